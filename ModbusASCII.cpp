@@ -82,11 +82,14 @@ idle:
                     if (ec > 0 && m_frame_address == ':')
                     {
                         // if so, go to the ascii rx address high state
+                        MODBUS_STATISTICS_INC(m_statistics.rx_bytes);
                         m_state = state_rx_addr_high;
                         m_last_ticks = m_timer->ticks();
                         m_stream->communicationStatus(true, false);
                         goto rx_addr;
                     }
+                    if (ec < 0)
+                        MODBUS_STATISTICS_INC(m_statistics.dumps);
                 }
                 return 0; // waiting for an event
             }
@@ -102,14 +105,28 @@ idle:
                 //
                 if (m_stream->read(NULL, (size_t)-1))
                 {
+                    MODBUS_STATISTICS_INC(m_statistics.collisions);
                     m_state = state_collision;
                     m_last_ticks = m_timer->ticks();
                     m_stream->communicationStatus(true, false);
                 }
-                return 0; // waiting for user
+
+                // the frame has not been acknowledged by the application yet
+                if (m_state == state_frame_ready)
+                    return 0; // waiting for user
             }
+            MODBUS_FALLTHROUGH; // let the handler complete a deferred response
         case state_collision: // bus collision
             {
+                if (m_handler)
+                {
+                    state_type state = m_state;
+                    m_handler->poll_queue(this);
+
+                    // evaluate the switch statement again if the application sent or released the buffer
+                    if (m_state != state)
+                        return poll();
+                }
                 return 0; // waiting for user
             }
         case state_rx_addr_high: // receiving the high or low byte of the slave address [ASCII]
@@ -121,6 +138,7 @@ rx_addr:
                 if (elapsed > m_T1s)
                 {
                     // timeout, go to the idle state
+                    MODBUS_STATISTICS_INC(m_statistics.t1p5_breaks);
                     m_state = state_idle;
                     m_stream->communicationStatus(false, false);
                     goto idle; // enter the 'idle' state
@@ -132,6 +150,7 @@ rx_addr:
                 if (result < 0)
                 {
                     // read error, go to the idle state
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
                     m_state = state_idle;
                     m_stream->communicationStatus(false, false);
                     goto idle; // enter the 'idle' state
@@ -140,6 +159,7 @@ rx_addr:
                 // check if anything was done
                 if (!result)
                     return m_T1s - elapsed; // wait for the timeout
+                MODBUS_STATISTICS_INC(m_statistics.rx_bytes);
 
                 // check if we got the start of frame character
                 if (ch == ':')
@@ -154,6 +174,7 @@ rx_addr:
                 if (!ISXDIGIT(ch))
                 {
                     // invalid character, go to the idle state
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
                     m_state = state_idle;
                     goto idle; // enter the 'idle' state
                 }
@@ -179,6 +200,7 @@ rx_addr:
                 if (m_station_address && m_frame_address && m_station_address != m_frame_address)
                 {
                     // no match, go back to the idle state
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
                     m_state = state_idle;
                     m_stream->communicationStatus(false, false);
                     goto idle;
@@ -203,6 +225,7 @@ rx_pdu:
                     if (elapsed > m_T1s)
                     {
                         // timeout, go to the idle state
+                        MODBUS_STATISTICS_INC(m_statistics.t1p5_breaks);
                         m_state = state_idle;
                         m_stream->communicationStatus(false, false);
                         goto idle; // enter the 'idle' state
@@ -214,6 +237,7 @@ rx_pdu:
                     if (result < 0)
                     {
                         // read error, go to the idle state
+                        MODBUS_STATISTICS_INC(m_statistics.dumps);
                         m_state = state_idle;
                         m_stream->communicationStatus(false, false);
                         goto idle; // enter the 'idle' state
@@ -222,6 +246,7 @@ rx_pdu:
                     // check if anything was done
                     if (!result)
                         return m_T1s - elapsed; // wait for the timeout
+                    MODBUS_STATISTICS_INC(m_statistics.rx_bytes);
 
                     // check if we got the start of frame character
                     if (ch == ':')
@@ -239,6 +264,7 @@ rx_pdu:
                         if (m_state != state_rx_pdu_high)
                         {
                             // if so, drop the packet and go back to the 'idle' state
+                            MODBUS_STATISTICS_INC(m_statistics.dumps);
                             m_state = state_idle;
                             goto idle;
                         }
@@ -253,6 +279,9 @@ rx_pdu:
                     if (!ISXDIGIT(ch) || m_buffer_len == m_buffer_max)
                     {
                         // invalid character or too many characters, go to the idle state
+                        if (m_buffer_len == m_buffer_max)
+                            MODBUS_STATISTICS_INC(m_statistics.overruns);
+                        MODBUS_STATISTICS_INC(m_statistics.dumps);
                         m_state = state_idle;
                         m_stream->communicationStatus(false, false);
                         goto idle; // enter the 'idle' state
@@ -292,6 +321,7 @@ rx_cr:
                 if (elapsed > m_T1s)
                 {
                     // timeout, go to the idle state
+                    MODBUS_STATISTICS_INC(m_statistics.t1p5_breaks);
                     m_state = state_idle;
                     m_stream->communicationStatus(false, false);
                     goto idle; // enter the 'idle' state
@@ -303,6 +333,7 @@ rx_cr:
                 if (result < 0)
                 {
                     // read error, go to the idle state
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
                     m_state = state_idle;
                     m_stream->communicationStatus(false, false);
                     goto idle; // enter the 'idle' state
@@ -311,6 +342,7 @@ rx_cr:
                 // check if anything was done
                 if (!result)
                     return m_T1s - elapsed; // wait for the timeout
+                MODBUS_STATISTICS_INC(m_statistics.rx_bytes);
 
                 // check if we got the start of frame character
                 if (ch == ':')
@@ -321,10 +353,21 @@ rx_cr:
                     goto rx_addr;
                 }
 
-                // make sure we got the line feed and that the checksum is correct
-                if (ch != '\n' && m_buffer_len >= min_pdu_length && m_checksum == 0)
+                // make sure we got the line feed
+                if (ch != '\n')
                 {
                     // if not, drop the packet and go back to the 'idle' state
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
+                    m_state = state_idle;
+                    m_stream->communicationStatus(false, false);
+                    goto idle; // enter the 'idle' state
+                }
+
+                // make sure the checksum is correct
+                if (m_buffer_len < min_pdu_length || m_checksum != 0)
+                {
+                    // if not, drop the packet and go back to the 'idle' state
+                    MODBUS_STATISTICS_INC(m_statistics.checksum_errors);
                     m_state = state_idle;
                     m_stream->communicationStatus(false, false);
                     goto idle; // enter the 'idle' state
@@ -332,6 +375,9 @@ rx_cr:
 
                 // LRC passed, remove the LRC byte
                 m_buffer_len -= LRC_LEN;
+                MODBUS_STATISTICS_INC(m_statistics.rx_frames);
+                if (m_buffer[0] & 0x80)
+                    MODBUS_STATISTICS_INC(m_statistics.exceptions);
 
                 // move to the 'Frame Ready' state
                 m_state = state_frame_ready;
@@ -570,7 +616,15 @@ tx_lf:
                         return 0; // fatal exception
                     }
 
-                    // done; move to the line feed character
+                    // done; count the frame and wait for the characters to drain
+                    //
+                    // Note: each byte of the address, PDU and LRC is sent as
+                    // two hex characters, framed by ':' and CR LF.
+                    //
+                    MODBUS_STATISTICS_INC(m_statistics.tx_frames);
+                    MODBUS_STATISTICS_ADD(m_statistics.tx_bytes, (m_buffer_len + 1 + LRC_LEN) * 2 + 3);
+                    if (m_buffer[0] & 0x80)
+                        MODBUS_STATISTICS_INC(m_statistics.exceptions);
                     m_state = state_tx_wait;
                     goto tx_wait;
                 }
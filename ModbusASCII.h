@@ -40,12 +40,20 @@ namespace ModbusPotato
         virtual void send();
         virtual void finished();
         virtual bool frame_ready() const { return m_state == state_frame_ready; }
+
+        /// <summary>
+        /// Returns true if the framer is waiting for the start of a frame.
+        /// </summary>
+        bool idle() const { return m_state == state_idle; }
         virtual uint8_t frame_address() const { return m_frame_address; }
         virtual void set_frame_address(uint8_t address) { m_frame_address = address; }
         virtual uint8_t* buffer() { return m_buffer; }
         virtual size_t buffer_len() const { return m_buffer_len; }
         virtual void set_buffer_len(size_t len) { m_buffer_len = len; }
         virtual size_t buffer_max() const { return m_buffer_max; }
+#if MODBUS_STATISTICS
+        virtual CModbusStatistics* statistics() { return &m_statistics; }
+#endif
     private:
         enum
         {
@@ -87,6 +95,9 @@ namespace ModbusPotato
         state_type m_state;
         system_tick_t m_last_ticks;
         system_tick_t m_T1s;
+#if MODBUS_STATISTICS
+        CModbusStatistics m_statistics;
+#endif
     };
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,113 @@
+#include "ModbusAutoDetect.h"
+#define ISXDIGIT(ch) (((ch) >= '0' && (ch) <= '9') || ((ch) >= 'A' && (ch) <= 'F') || ((ch) >= 'a' && (ch) <= 'f'))
+namespace ModbusPotato
+{
+    CModbusAutoDetect::CModbusAutoDetect(IStream* stream, ITimeProvider* timer, uint8_t* buffer, size_t buffer_max)
+        :   m_stream(stream)
+        ,   m_handler()
+        ,   m_mode(mode_rtu)
+        ,   m_held_pos()
+        ,   m_held_len()
+        ,   m_sniff_len()
+        ,   m_rtu_channel(this, mode_rtu)
+        ,   m_ascii_channel(this, mode_ascii)
+        ,   m_rtu(stream ? &m_rtu_channel : NULL, timer, buffer, buffer_max)
+        ,   m_ascii(stream ? &m_ascii_channel : NULL, timer, buffer, buffer_max)
+    {
+        m_rtu.set_handler(this);
+        m_ascii.set_handler(this);
+    }
+
+    unsigned long CModbusAutoDetect::poll()
+    {
+        // poll the framer which has the line, and poll again if it handed the line to the other one
+        //
+        // Note: the line only changes hands when a character is taken from
+        // the stream, so this can't loop forever.
+        //
+        for (;;)
+        {
+            mode_type mode = m_mode;
+            unsigned long timeout = framer()->poll();
+            if (m_mode == mode)
+            {
+                collect_statistics();
+                return timeout;
+            }
+        }
+    }
+
+    int CModbusAutoDetect::read(mode_type mode, uint8_t* buffer, size_t buffer_size)
+    {
+        // the other framer has the line
+        if (mode != m_mode || !buffer_size)
+            return 0;
+
+        // pass on the characters read while detecting the mode
+        if (m_held_pos < m_held_len)
+        {
+            size_t len = m_held_len - m_held_pos;
+            if (len > buffer_size)
+                len = buffer_size;
+            for (size_t i = 0; i < len; ++i, ++m_held_pos)
+            {
+                if (buffer)
+                    buffer[i] = m_held[m_held_pos];
+            }
+            return (int)len;
+        }
+
+        // the middle of a frame or dumped data goes straight to the framer
+        if (!buffer || !(mode == mode_ascii ? m_ascii.idle() : m_rtu.idle()))
+            return m_stream->read(buffer, buffer_size);
+
+        // read the first character of the frame
+        if (!m_sniff_len)
+        {
+            int ec = m_stream->read(m_held, 1);
+            if (ec <= 0)
+                return ec;
+            m_sniff_len = 1;
+        }
+
+        // a ':' is only the start of an ASCII frame if a hex digit follows it
+        mode_type detected = mode_rtu;
+        if (m_held[0] == ':')
+        {
+            int ec = m_stream->read(m_held + 1, 1);
+            if (!ec)
+                return 0; // waiting for the second character
+            if (ec < 0)
+            {
+                m_sniff_len = 0;
+                return ec; // let the framer handle the error
+            }
+            m_sniff_len = 2;
+            if (ISXDIGIT(m_held[1]))
+                detected = mode_ascii;
+        }
+
+        // hand the line and the characters to the framer for the frame
+        m_mode = detected;
+        m_held_pos = 0;
+        m_held_len = m_sniff_len;
+        m_sniff_len = 0;
+        if (m_mode != mode)
+            return 0; // the other framer reads them when poll() polls it
+        return read(mode, buffer, buffer_size);
+    }
+
+    void CModbusAutoDetect::frame_ready(IFramer*)
+    {
+        // the handler may read or clear the counters, e.g. for a diagnostics request
+        collect_statistics();
+        if (m_handler)
+            m_handler->frame_ready(this);
+    }
+
+    void CModbusAutoDetect::poll_queue(IFramer*)
+    {
+        if (m_handler)
+            m_handler->poll_queue(this);
+    }
+}
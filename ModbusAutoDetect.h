@@ -0,0 +1,127 @@
+#ifndef __ModbusPotato_ModbusAutoDetect_h__
+#define __ModbusPotato_ModbusAutoDetect_h__
+#include "ModbusRTU.h"
+#include "ModbusASCII.h"
+namespace ModbusPotato
+{
+    /// <summary>
+    /// This class accepts both RTU and ASCII frames on the same port, and replies in the mode of each request.
+    /// </summary>
+    /// <remarks>
+    /// See the IFramer interface for a complete description of the public
+    /// methods.
+    ///
+    /// A CModbusRTU and a CModbusASCII framer are kept inside, sharing the
+    /// one buffer given to the constructor, and each reads the stream
+    /// through a small filter.  Whenever the framer which has the line is
+    /// waiting for the start of a frame, the filter looks at the first
+    /// character: a ':' followed by a hex digit starts an ASCII frame, and
+    /// anything else starts an RTU frame.  The line is then handed to that
+    /// framer, which receives the frame, checks its CRC or LRC and keeps the
+    /// line until it has been answered.  Only a ':' needs the second
+    /// character before deciding, since it is also the RTU address 58, so
+    /// the RTU path costs one comparison per frame and nothing per
+    /// character.
+    ///
+    /// Frames which arrive while the application holds the buffer go to
+    /// the framer holding it, as collisions, just as with a single framer.
+    ///
+    /// rtu() and ascii() give access to the framers for their setup, i.e.
+    /// rtu()->setup(baud) must be called as with CModbusRTU.  The other
+    /// methods act on the framer which has the line.
+    ///
+    /// statistics() returns one set of counters for the port, which the
+    /// detector keeps across mode switches.  The counters of each framer are
+    /// moved into it after every poll and before each frame is handed to
+    /// the handler, so those returned by rtu()->statistics() and
+    /// ascii()->statistics() only hold the counts not yet moved.
+    /// </remarks>
+    class CModbusAutoDetect : public IFramer, private IFrameHandler
+    {
+    public:
+        enum mode_type
+        {
+            mode_rtu,
+            mode_ascii,
+        };
+
+        /// <summary>
+        /// Constructor for the auto-detecting framer.
+        /// </summary>
+        CModbusAutoDetect(IStream* stream, ITimeProvider* timer, uint8_t* buffer, size_t buffer_max);
+
+        /// <summary>
+        /// Returns the RTU framer, for its setup.
+        /// </summary>
+        CModbusRTU* rtu() { return &m_rtu; }
+
+        /// <summary>
+        /// Returns the ASCII framer, for its setup.
+        /// </summary>
+        CModbusASCII* ascii() { return &m_ascii; }
+
+        /// <summary>
+        /// Returns the mode of the last frame received, which is also the mode of the reply.
+        /// </summary>
+        mode_type mode() const { return m_mode; }
+
+        virtual void set_handler(IFrameHandler* handler) { m_handler = handler; }
+        virtual uint8_t station_address() const { return m_rtu.station_address(); }
+        virtual void set_station_address(uint8_t address) { m_rtu.set_station_address(address); m_ascii.set_station_address(address); }
+        virtual unsigned long poll();
+        virtual bool begin_send() { return framer()->begin_send(); }
+        virtual void send() { framer()->send(); }
+        virtual void finished() { framer()->finished(); }
+        virtual bool frame_ready() const { return framer()->frame_ready(); }
+        virtual uint8_t frame_address() const { return framer()->frame_address(); }
+        virtual void set_frame_address(uint8_t address) { framer()->set_frame_address(address); }
+        virtual uint8_t* buffer() { return framer()->buffer(); }
+        virtual size_t buffer_len() const { return framer()->buffer_len(); }
+        virtual void set_buffer_len(size_t len) { framer()->set_buffer_len(len); }
+        virtual size_t buffer_max() const { return framer()->buffer_max(); }
+#if MODBUS_STATISTICS
+        virtual CModbusStatistics* statistics() { return &m_statistics; }
+#endif
+        virtual bool deadline(system_tick_t& ticks) const { return framer()->deadline(ticks); }
+        virtual bool set_checksum(uint16_t checksum) { return framer()->set_checksum(checksum); }
+    private:
+        // filters the stream for one of the framers
+        class CChannel : public IStream
+        {
+        public:
+            CChannel(CModbusAutoDetect* owner, mode_type mode) : m_owner(owner), m_mode(mode) {}
+            virtual int read(uint8_t* buffer, size_t buffer_size) { return m_owner->read(m_mode, buffer, buffer_size); }
+            virtual int write(uint8_t* buffer, size_t len) { return m_owner->m_stream->write(buffer, len); }
+            virtual void txEnable(bool state) { m_owner->m_stream->txEnable(state); }
+            virtual bool writeComplete() { return m_owner->m_stream->writeComplete(); }
+            virtual void communicationStatus(bool rx, bool tx) { m_owner->m_stream->communicationStatus(rx, tx); }
+        private:
+            CModbusAutoDetect* m_owner;
+            mode_type m_mode;
+        };
+        virtual void frame_ready(IFramer* framer);
+        virtual void poll_queue(IFramer* framer);
+        IFramer* framer() { return m_mode == mode_ascii ? (IFramer*)&m_ascii : (IFramer*)&m_rtu; }
+        const IFramer* framer() const { return m_mode == mode_ascii ? (const IFramer*)&m_ascii : (const IFramer*)&m_rtu; }
+        int read(mode_type mode, uint8_t* buffer, size_t buffer_size);
+        void collect_statistics()
+        {
+#if MODBUS_STATISTICS
+            m_statistics.collect(*m_rtu.statistics());
+            m_statistics.collect(*m_ascii.statistics());
+#endif
+        }
+        IStream* m_stream;
+        IFrameHandler* m_handler;
+        mode_type m_mode;
+        uint8_t m_held[2]; // characters read while detecting the mode, not yet passed to the framer
+        uint8_t m_held_pos, m_held_len, m_sniff_len;
+        CChannel m_rtu_channel, m_ascii_channel;
+        CModbusRTU m_rtu;
+        CModbusASCII m_ascii;
+#if MODBUS_STATISTICS
+        CModbusStatistics m_statistics;
+#endif
+    };
+}
+#endif
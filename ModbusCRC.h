@@ -0,0 +1,41 @@
+// CRC-16 used by the RTU frame format.
+//
+#ifndef __ModbusPotato_CRC_h__
+#define __ModbusPotato_CRC_h__
+#include "ModbusTypes.h"
+namespace ModbusPotato
+{
+    enum
+    {
+        crc16_modbus_poly = 0xa001, // CRC-16 polynomial, bit reversed
+        crc16_modbus_init = 0xffff, // initial value of the CRC
+    };
+
+    /// <summary>
+    /// Accumulates the CRC-16 of some bytes, as defined in section 2.5.1.2 of the serial line spec.
+    /// </summary>
+    /// <remarks>
+    /// Start with crc16_modbus_init.  The CRC is sent low byte first, so
+    /// the CRC of a frame including its own CRC bytes is 0.
+    ///
+    /// This is inline and unrolled since the framers call it for every
+    /// chunk they receive or send.
+    /// </remarks>
+    inline uint16_t crc16_modbus(uint16_t crc, const uint8_t* buffer, size_t len)
+    {
+        for (; len; buffer++, len--)
+        {
+            crc ^= *buffer;
+            crc = (crc & 1) != 0 ? ((crc >> 1) ^ crc16_modbus_poly) : (crc >> 1);
+            crc = (crc & 1) != 0 ? ((crc >> 1) ^ crc16_modbus_poly) : (crc >> 1);
+            crc = (crc & 1) != 0 ? ((crc >> 1) ^ crc16_modbus_poly) : (crc >> 1);
+            crc = (crc & 1) != 0 ? ((crc >> 1) ^ crc16_modbus_poly) : (crc >> 1);
+            crc = (crc & 1) != 0 ? ((crc >> 1) ^ crc16_modbus_poly) : (crc >> 1);
+            crc = (crc & 1) != 0 ? ((crc >> 1) ^ crc16_modbus_poly) : (crc >> 1);
+            crc = (crc & 1) != 0 ? ((crc >> 1) ^ crc16_modbus_poly) : (crc >> 1);
+            crc = (crc & 1) != 0 ? ((crc >> 1) ^ crc16_modbus_poly) : (crc >> 1);
+        }
+        return crc;
+    }
+}
+#endif
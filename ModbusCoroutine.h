@@ -0,0 +1,538 @@
+#ifndef __ModbusPotato_Coroutine_h__
+#define __ModbusPotato_Coroutine_h__
+#include "ModbusMaster.h"
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#include <exception>
+#include <stddef.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <poll.h>
+#endif
+namespace ModbusPotato
+{
+    // forward declarations
+    class CModbusCoroutineMaster;
+
+    /// <summary>
+    /// Hands out fixed size blocks from application-owned memory for coroutine frames.
+    /// </summary>
+    /// <remarks>
+    /// The size of a coroutine frame is chosen by the compiler, so the
+    /// block size must be large enough for the largest coroutine that uses
+    /// the pool.  largest() returns the largest frame requested so far,
+    /// including any which did not fit, to help choosing it.
+    /// </remarks>
+    class CModbusFramePool
+    {
+    public:
+        enum
+        {
+            alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+        };
+
+        /// <summary>
+        /// Constructor for the frame pool, which carves the memory into blocks.
+        /// </summary>
+        CModbusFramePool(void* memory, size_t size, size_t block_size)
+            :   m_free()
+            ,   m_block_size((block_size + alignment - 1) / alignment * alignment)
+            ,   m_available()
+            ,   m_largest()
+        {
+            // align the first block and link all of the blocks into the free list
+            char* begin = (char*)(((size_t)memory + alignment - 1) / alignment * alignment);
+            char* end = (char*)memory + size;
+            for (char* block = begin; m_block_size && block + m_block_size <= end; block += m_block_size)
+                deallocate(block);
+        }
+
+        /// <summary>
+        /// Returns a block, or NULL if the size is larger than a block or none are left.
+        /// </summary>
+        void* allocate(size_t size) noexcept
+        {
+            if (size > m_largest)
+                m_largest = size;
+            if (size > m_block_size || !m_free)
+                return NULL;
+            block_type* block = m_free;
+            m_free = block->next;
+            m_available--;
+            return block;
+        }
+
+        /// <summary>
+        /// Returns a block to the pool.
+        /// </summary>
+        void deallocate(void* memory) noexcept
+        {
+            block_type* block = (block_type*)memory;
+            block->next = m_free;
+            m_free = block;
+            m_available++;
+        }
+
+        /// <summary>
+        /// Returns the size of each block.
+        /// </summary>
+        size_t block_size() const { return m_block_size; }
+
+        /// <summary>
+        /// Returns the number of free blocks.
+        /// </summary>
+        size_t available() const { return m_available; }
+
+        /// <summary>
+        /// Returns the largest size requested from the pool.
+        /// </summary>
+        size_t largest() const { return m_largest; }
+    private:
+        struct block_type
+        {
+            block_type* next;
+        };
+        block_type* m_free;
+        size_t m_block_size, m_available, m_largest;
+    };
+
+    /// <summary>
+    /// The return type of a coroutine which polls slaves through CModbusCoroutineMaster.
+    /// </summary>
+    /// <remarks>
+    /// The frame of the coroutine is taken from the CModbusFramePool passed
+    /// as its first parameter, or as its first parameter after the object
+    /// for a member function.  A coroutine without a pool parameter does
+    /// not compile, so nothing is ever taken from the heap.  If the pool
+    /// has no block left, the coroutine is not started and valid() returns
+    /// false.
+    ///
+    /// The coroutine starts running as soon as it is called, up to its first
+    /// co_await.  The task owns the frame, which is returned to the pool
+    /// when the task is destroyed, so a task must not be destroyed while
+    /// its coroutine is waiting in a co_await.  Exceptions are not used, so
+    /// an exception leaving the coroutine calls std::terminate().
+    /// </remarks>
+    class CModbusTask
+    {
+    public:
+        struct promise_type
+        {
+            template <class... Args>
+            static void* operator new(size_t size, CModbusFramePool& pool, Args&...) noexcept
+            {
+                return allocate(size, pool);
+            }
+            template <class This, class... Args>
+            static void* operator new(size_t size, This&, CModbusFramePool& pool, Args&...) noexcept
+            {
+                return allocate(size, pool);
+            }
+            static void* operator new(size_t size) = delete;
+            static void operator delete(void* frame) noexcept
+            {
+                // the pool is stored in front of the frame
+                char* block = (char*)frame - CModbusFramePool::alignment;
+                (*(CModbusFramePool**)block)->deallocate(block);
+            }
+            static CModbusTask get_return_object_on_allocation_failure() noexcept { return CModbusTask(); }
+            CModbusTask get_return_object() noexcept { return CModbusTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_never initial_suspend() const noexcept { return std::suspend_never(); }
+            std::suspend_always final_suspend() const noexcept { return std::suspend_always(); }
+            void return_void() const noexcept {}
+            void unhandled_exception() const noexcept { std::terminate(); }
+        private:
+            static void* allocate(size_t size, CModbusFramePool& pool) noexcept
+            {
+                char* block = (char*)pool.allocate(size + CModbusFramePool::alignment);
+                if (!block)
+                    return NULL;
+                *(CModbusFramePool**)block = &pool;
+                return block + CModbusFramePool::alignment;
+            }
+        };
+
+        CModbusTask() noexcept : m_handle() {}
+        CModbusTask(CModbusTask&& other) noexcept : m_handle(other.m_handle) { other.m_handle = nullptr; }
+        CModbusTask& operator=(CModbusTask&& other) noexcept
+        {
+            if (this != &other)
+            {
+                if (m_handle)
+                    m_handle.destroy();
+                m_handle = other.m_handle;
+                other.m_handle = nullptr;
+            }
+            return *this;
+        }
+        ~CModbusTask()
+        {
+            if (m_handle)
+                m_handle.destroy();
+        }
+
+        /// <summary>
+        /// Returns false if the pool had no room for the coroutine.
+        /// </summary>
+        bool valid() const { return (bool)m_handle; }
+
+        /// <summary>
+        /// Returns true if the coroutine has returned, or was never started.
+        /// </summary>
+        bool done() const { return !m_handle || m_handle.done(); }
+    private:
+        explicit CModbusTask(std::coroutine_handle<promise_type> handle) noexcept : m_handle(handle) {}
+        CModbusTask(const CModbusTask&) = delete;
+        CModbusTask& operator=(const CModbusTask&) = delete;
+        std::coroutine_handle<promise_type> m_handle;
+    };
+
+    /// <summary>
+    /// The result of a request awaited through CModbusCoroutineMaster.
+    /// </summary>
+    /// <remarks>
+    /// The status is one of modbus_transaction_status, or idle if the
+    /// request was invalid and was never sent.  The data holds the response
+    /// PDU when the status is ok or exception.
+    /// </remarks>
+    struct CModbusResult
+    {
+        uint8_t status; // see modbus_transaction_status
+        size_t len; // length of the response PDU
+        uint8_t data[MODBUS_DATA_BUFFER_SIZE];
+
+        /// <summary>
+        /// Returns true if a normal response was received.
+        /// </summary>
+        bool ok() const { return status == modbus_transaction_status::ok; }
+
+        /// <summary>
+        /// Returns the exception code of an exception response, or 0.
+        /// </summary>
+        uint8_t exception_code() const { return status == modbus_transaction_status::exception && len >= 2 ? data[1] : 0; }
+
+        /// <summary>
+        /// Returns the number of registers in a read holding or input registers response.
+        /// </summary>
+        size_t register_count() const { return ok() && len >= 2 && (size_t)data[1] + 2 <= len ? data[1] / 2 : 0; }
+
+        /// <summary>
+        /// Returns a register from a read holding or input registers response.
+        /// </summary>
+        uint16_t register_value(size_t index) const { return index < register_count() ? (uint16_t)(data[2 + index * 2] << 8 | data[3 + index * 2]) : 0; }
+
+        /// <summary>
+        /// Returns a bit from a read coils or discrete inputs response.
+        /// </summary>
+        bool bit(size_t index) const { return ok() && len >= 2 && index / 8 < data[1] && index / 8 + 2 < len && (data[2 + index / 8] >> (index % 8) & 1); }
+    };
+
+    /// <summary>
+    /// The base class of the objects which a coroutine waits on in a co_await.
+    /// </summary>
+    class CModbusAwaiter
+    {
+    protected:
+        CModbusAwaiter(CModbusCoroutineMaster* owner) : m_owner(owner), m_handle(), m_next() {}
+        CModbusAwaiter(const CModbusAwaiter&) = delete;
+        CModbusAwaiter& operator=(const CModbusAwaiter&) = delete;
+        void ready();
+        friend class CModbusCoroutineMaster;
+        CModbusCoroutineMaster* m_owner;
+        std::coroutine_handle<> m_handle;
+        CModbusAwaiter* m_next;
+    };
+
+    /// <summary>
+    /// Suspends a coroutine until the response to a request has arrived.
+    /// </summary>
+    /// <remarks>
+    /// This is created by the methods of CModbusCoroutineMaster and lives
+    /// in the frame of the awaiting coroutine, together with the
+    /// transaction and its buffer.
+    /// </remarks>
+    class CModbusRequest : public CModbusAwaiter, private IMasterHandler
+    {
+    public:
+        CModbusRequest(CModbusCoroutineMaster* owner, uint8_t unit, const uint8_t* pdu, size_t len)
+            :   CModbusAwaiter(owner)
+            ,   m_transaction(this, m_data, sizeof(m_data))
+        {
+            m_transaction.address = unit;
+            if (len > sizeof(m_data))
+                return; // invalid, so it is never sent
+            for (size_t i = 0; i < len; ++i)
+                m_data[i] = pdu[i];
+            m_transaction.len = len;
+        }
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        CModbusResult await_resume() const noexcept
+        {
+            CModbusResult result;
+            result.status = m_transaction.status;
+            result.len = 0;
+            if (result.status == modbus_transaction_status::ok || result.status == modbus_transaction_status::exception)
+            {
+                result.len = m_transaction.len;
+                for (size_t i = 0; i < result.len; ++i)
+                    result.data[i] = m_data[i];
+            }
+            return result;
+        }
+    private:
+        virtual void transaction_complete(CModbusMaster*, CModbusTransaction*) { ready(); }
+        CModbusTransaction m_transaction;
+        uint8_t m_data[MODBUS_DATA_BUFFER_SIZE];
+    };
+
+    /// <summary>
+    /// Suspends a coroutine for a time.
+    /// </summary>
+    class CModbusDelay : public CModbusAwaiter
+    {
+    public:
+        CModbusDelay(CModbusCoroutineMaster* owner, system_tick_t ticks) : CModbusAwaiter(owner), m_start(), m_ticks(ticks) {}
+        bool await_ready() const noexcept { return !m_ticks; }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() const noexcept {}
+    private:
+        friend class CModbusCoroutineMaster;
+        system_tick_t m_start, m_ticks;
+    };
+
+    /// <summary>
+    /// Runs coroutines which poll slaves through a CModbusMaster on a single-threaded event loop.
+    /// </summary>
+    /// <remarks>
+    /// Each request method returns an object to co_await from a coroutine
+    /// returning CModbusTask, i.e.:
+    ///
+    ///     CModbusTask scan(CModbusFramePool&amp; pool, CModbusCoroutineMaster&amp; master)
+    ///     {
+    ///         for (;;)
+    ///         {
+    ///             CModbusResult result = co_await master.read_holding(1, 0, 10);
+    ///             if (result.ok())
+    ///                 use(result.register_value(0));
+    ///             co_await master.delay(100000);
+    ///         }
+    ///     }
+    ///
+    /// The awaited request and its transaction live in the frame of the
+    /// coroutine, and the master queues the transactions of all of the
+    /// waiting coroutines, so any number of them can be waiting at once
+    /// while nothing is allocated.  This makes the frames large, though:
+    /// each CModbusRequest holds a MODBUS_DATA_BUFFER_SIZE buffer for the
+    /// request and its response, and each CModbusResult a copy of the
+    /// response, since the request is gone once the co_await returns.
+    /// With GCC 12 a coroutine making two requests and two delays takes a
+    /// 1400 byte frame, so a thousand of them need about 1.4MB of blocks;
+    /// CModbusFramePool::largest() gives the size for a given compiler.
+    /// The requests are sent one at a time
+    /// in the order they were made, subject to the retries and offline
+    /// slave handling configured on master().
+    ///
+    /// poll() polls the framer and the master, and then resumes each
+    /// coroutine whose request has completed or whose delay has elapsed.
+    /// Coroutines are only resumed from poll(), never from inside the
+    /// framer or the master.  run() is a complete event loop for POSIX
+    /// hosts which waits on the framer's file descriptor between polls.
+    ///
+    /// The master registers itself as the framer's handler.
+    /// </remarks>
+    class CModbusCoroutineMaster
+    {
+    public:
+        CModbusCoroutineMaster(IFramer* framer, ITimeProvider* timer)
+            :   m_framer(framer)
+            ,   m_timer(timer)
+            ,   m_master(framer, timer)
+            ,   m_ready_head()
+            ,   m_ready_tail()
+            ,   m_delays()
+            ,   m_waiting()
+        {
+        }
+
+        /// <summary>
+        /// Returns the master, to configure its timeouts, retries and health table.
+        /// </summary>
+        CModbusMaster& master() { return m_master; }
+
+        /// <summary>
+        /// Returns the number of coroutines waiting in a co_await.
+        /// </summary>
+        size_t waiting() const { return m_waiting; }
+
+        CModbusRequest read_coils(uint8_t unit, uint16_t address, uint16_t count) { return make_request(unit, 0x01, address, count); }
+        CModbusRequest read_discrete_inputs(uint8_t unit, uint16_t address, uint16_t count) { return make_request(unit, 0x02, address, count); }
+        CModbusRequest read_holding(uint8_t unit, uint16_t address, uint16_t count) { return make_request(unit, 0x03, address, count); }
+        CModbusRequest read_input(uint8_t unit, uint16_t address, uint16_t count) { return make_request(unit, 0x04, address, count); }
+        CModbusRequest write_coil(uint8_t unit, uint16_t address, bool value) { return make_request(unit, 0x05, address, value ? 0xff00 : 0x0000); }
+        CModbusRequest write_holding(uint8_t unit, uint16_t address, uint16_t value) { return make_request(unit, 0x06, address, value); }
+
+        /// <summary>
+        /// Writes one or more holding registers using function 0x10.
+        /// </summary>
+        CModbusRequest write_holding(uint8_t unit, uint16_t address, uint16_t count, const uint16_t* values)
+        {
+            uint8_t pdu[MODBUS_DATA_BUFFER_SIZE];
+            if (!count || count > 123)
+                return CModbusRequest(this, unit, pdu, (size_t)-1); // invalid
+            pdu[0] = 0x10;
+            pdu[1] = (uint8_t)(address >> 8);
+            pdu[2] = (uint8_t)address;
+            pdu[3] = (uint8_t)(count >> 8);
+            pdu[4] = (uint8_t)count;
+            pdu[5] = (uint8_t)(count * 2);
+            for (uint16_t i = 0; i < count; ++i)
+            {
+                pdu[6 + i * 2] = (uint8_t)(values[i] >> 8);
+                pdu[7 + i * 2] = (uint8_t)values[i];
+            }
+            return CModbusRequest(this, unit, pdu, 6 + count * 2);
+        }
+
+        /// <summary>
+        /// Sends any request PDU, starting with the function code, i.e. for user defined function codes.
+        /// </summary>
+        CModbusRequest request(uint8_t unit, const uint8_t* pdu, size_t len) { return CModbusRequest(this, unit, pdu, len); }
+
+        /// <summary>
+        /// Suspends the coroutine for the given number of microseconds.
+        /// </summary>
+        CModbusDelay delay(unsigned long us)
+        {
+            unsigned long per_tick = m_timer->microseconds_per_tick();
+            return CModbusDelay(this, (system_tick_t)(per_tick > 1 ? (us + per_tick - 1) / per_tick : us));
+        }
+
+        /// <summary>
+        /// Polls the framer and the master, and resumes the coroutines which are ready.
+        /// </summary>
+        /// <returns>
+        /// The next timeout, in system ticks, or 0 if none.
+        /// </returns>
+        /// <remarks>
+        /// This follows the same rules as IFramer::poll().
+        /// </remarks>
+        unsigned long poll()
+        {
+            for (;;)
+            {
+                unsigned long timeout = min_timeout(m_framer->poll(), m_master.poll());
+
+                // move the delays which have elapsed to the ready list
+                system_tick_t now = m_timer->ticks();
+                for (CModbusAwaiter** link = &m_delays; *link;)
+                {
+                    CModbusDelay* delay = static_cast<CModbusDelay*>(*link);
+                    system_tick_t elapsed = now - delay->m_start;
+                    if (elapsed >= delay->m_ticks)
+                    {
+                        *link = delay->m_next;
+                        delay->ready();
+                        continue;
+                    }
+                    timeout = min_timeout(timeout, delay->m_ticks - elapsed);
+                    link = &delay->m_next;
+                }
+                if (!m_ready_head)
+                    return timeout;
+
+                // resume the ready coroutines, which may make new requests, and poll again to send them
+                while (CModbusAwaiter* awaiter = m_ready_head)
+                {
+                    m_ready_head = awaiter->m_next;
+                    if (!m_ready_head)
+                        m_ready_tail = NULL;
+                    m_waiting--;
+                    awaiter->m_handle.resume(); // the awaiter is gone after this
+                }
+            }
+        }
+
+#if defined(__unix__) || defined(__APPLE__)
+        /// <summary>
+        /// Runs the event loop until no coroutine is waiting.
+        /// </summary>
+        /// <remarks>
+        /// Between polls, this waits until the file descriptor is readable
+        /// or the next timeout has elapsed.  Without a file descriptor, i.e.
+        /// for a framer on a stream that can't be waited on, it polls
+        /// continuously.
+        /// </remarks>
+        void run(int fd)
+        {
+            for (;;)
+            {
+                unsigned long timeout = poll();
+                if (!m_waiting)
+                    return;
+                int ms = -1;
+                if (timeout)
+                {
+                    unsigned long long us = (unsigned long long)timeout * m_timer->microseconds_per_tick();
+                    ms = (int)((us + 999) / 1000);
+                }
+                if (fd < 0)
+                    continue;
+                struct pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                ::poll(&pfd, 1, ms);
+            }
+        }
+#endif
+    private:
+        friend class CModbusAwaiter;
+        friend class CModbusRequest;
+        friend class CModbusDelay;
+        static unsigned long min_timeout(unsigned long a, unsigned long b) { return !a || (b && b < a) ? b : a; }
+        CModbusRequest make_request(uint8_t unit, uint8_t function, uint16_t address, uint16_t value)
+        {
+            uint8_t pdu[5] = { function, (uint8_t)(address >> 8), (uint8_t)address, (uint8_t)(value >> 8), (uint8_t)value };
+            return CModbusRequest(this, unit, pdu, sizeof(pdu));
+        }
+        IFramer* m_framer;
+        ITimeProvider* m_timer;
+        CModbusMaster m_master;
+        CModbusAwaiter* m_ready_head;
+        CModbusAwaiter* m_ready_tail;
+        CModbusAwaiter* m_delays;
+        size_t m_waiting;
+    };
+
+    inline void CModbusAwaiter::ready()
+    {
+        // queue the coroutine to be resumed by CModbusCoroutineMaster::poll()
+        m_next = NULL;
+        if (m_owner->m_ready_tail)
+            m_owner->m_ready_tail->m_next = this;
+        else
+            m_owner->m_ready_head = this;
+        m_owner->m_ready_tail = this;
+    }
+
+    inline bool CModbusRequest::await_suspend(std::coroutine_handle<> handle)
+    {
+        // an invalid request completes right away with the 'idle' status
+        m_handle = handle;
+        if (!m_owner->m_master.submit(&m_transaction))
+            return false;
+        m_owner->m_waiting++;
+        return true;
+    }
+
+    inline void CModbusDelay::await_suspend(std::coroutine_handle<> handle)
+    {
+        m_handle = handle;
+        m_start = m_owner->m_timer->ticks();
+        m_next = m_owner->m_delays;
+        m_owner->m_delays = this;
+        m_owner->m_waiting++;
+    }
+}
+#endif
+#endif
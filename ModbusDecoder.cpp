@@ -0,0 +1,224 @@
+#include "ModbusDecoder.h"
+namespace ModbusPotato
+{
+    using namespace modbus_point_type;
+    using namespace modbus_word_order;
+
+    enum
+    {
+        read_holding_registers = 0x03,
+        read_input_registers = 0x04,
+    };
+
+    // the raw and output types for each point type
+    template <int type> struct point_traits;
+    template <> struct point_traits<uint16>
+    {
+        typedef uint16_t raw_type;
+        typedef uint16_t value_type;
+        static value_type convert(raw_type raw) { return raw; }
+    };
+    template <> struct point_traits<int16>
+    {
+        typedef uint16_t raw_type;
+        typedef int16_t value_type;
+        static value_type convert(raw_type raw) { return (int16_t)raw; }
+    };
+    template <> struct point_traits<uint32>
+    {
+        typedef uint32_t raw_type;
+        typedef uint32_t value_type;
+        static value_type convert(raw_type raw) { return raw; }
+    };
+    template <> struct point_traits<int32>
+    {
+        typedef uint32_t raw_type;
+        typedef int32_t value_type;
+        static value_type convert(raw_type raw) { return (int32_t)raw; }
+    };
+    template <> struct point_traits<float32>
+    {
+        typedef uint32_t raw_type;
+        typedef float value_type;
+        static value_type convert(raw_type raw) { union { uint32_t u; float f; } bits; bits.u = raw; return bits.f; }
+    };
+    template <> struct point_traits<float64>
+    {
+        typedef uint64_t raw_type;
+        typedef double value_type;
+        static value_type convert(raw_type raw) { union { uint64_t u; double f; } bits; bits.u = raw; return bits.f; }
+    };
+
+    // assemble a value from its bytes in the given word order
+    //
+    // Note: the byte index is a constant expression for each iteration, so
+    // the compiler unrolls this into a fixed sequence of loads and shifts.
+    //
+    template <typename raw_type, int order>
+    static inline raw_type load(const uint8_t* src)
+    {
+        const int bytes = sizeof(raw_type);
+        raw_type value = 0;
+        for (int k = 0; k < bytes; ++k)
+        {
+            int i = order == abcd ? k
+                : order == cdab ? (bytes / 2 - 1 - k / 2) * 2 + k % 2
+                : order == badc ? k ^ 1
+                : bytes - 1 - k;
+            value = (raw_type)(value << 8) | src[i];
+        }
+        return value;
+    }
+
+    // decode a number of values of one type, word order and scaling
+    template <int type, int order, bool scaled>
+    static void kernel(const uint8_t* src, size_t src_stride, uint8_t* dst, size_t dst_stride, size_t count, double scale)
+    {
+        typedef point_traits<type> traits;
+        for (; count; --count, src += src_stride, dst += dst_stride)
+        {
+            typename traits::value_type value = traits::convert(load<typename traits::raw_type, order>(src));
+            if (scaled)
+                *(double*)dst = value * scale;
+            else
+                *(typename traits::value_type*)dst = value;
+        }
+    }
+
+    typedef void (*kernel_type)(const uint8_t* src, size_t src_stride, uint8_t* dst, size_t dst_stride, size_t count, double scale);
+    #define KERNEL_ORDER(type, order) { kernel<type, order, false>, kernel<type, order, true> }
+    #define KERNEL_TYPE(type) { KERNEL_ORDER(type, abcd), KERNEL_ORDER(type, cdab), KERNEL_ORDER(type, badc), KERNEL_ORDER(type, dcba) }
+    static const kernel_type kernels[float64 + 1][dcba + 1][2] =
+    {
+        KERNEL_TYPE(uint16),
+        KERNEL_TYPE(int16),
+        KERNEL_TYPE(uint32),
+        KERNEL_TYPE(int32),
+        KERNEL_TYPE(float32),
+        KERNEL_TYPE(float64),
+    };
+    #undef KERNEL_TYPE
+    #undef KERNEL_ORDER
+
+    // returns the number of registers used by a point
+    static size_t point_registers(uint8_t type)
+    {
+        switch (type)
+        {
+        case uint16:
+        case int16:
+            return 1;
+        case float64:
+            return 4;
+        default:
+            return 2;
+        }
+    }
+
+    // returns true if the point stores a scaled double
+    static bool point_scaled(const CModbusPoint& point)
+    {
+        return point.scale != 0 && point.scale != 1;
+    }
+
+    // returns the size of the output field for a point
+    static size_t point_size(const CModbusPoint& point)
+    {
+        return point_scaled(point) ? sizeof(double) : point_registers(point.type) * 2;
+    }
+
+    CModbusDecoder::CModbusDecoder(CModbusPoint* points, size_t count)
+        :   m_points(points)
+        ,   m_count(count)
+        ,   m_registers()
+        ,   m_compiled()
+    {
+    }
+
+    bool CModbusDecoder::compile()
+    {
+        // pick the decoding loop for each point and find the size of the block
+        m_compiled = false;
+        m_registers = 0;
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            CModbusPoint& point = m_points[i];
+            if (point.type > float64 || point.order > dcba)
+                return false;
+            point.kernel = kernels[point.type][point.order][point_scaled(point)];
+            size_t end = point.offset + point_registers(point.type);
+            if (end > m_registers)
+                m_registers = end;
+        }
+
+        // merge each point with the run which follows it, if it continues the same pattern
+        for (size_t i = m_count; i--; )
+        {
+            CModbusPoint& point = m_points[i];
+            point.run = 1;
+            if (i + 1 == m_count)
+                continue;
+            const CModbusPoint& next = m_points[i + 1];
+            if (next.kernel == point.kernel
+                && (next.scale == point.scale || !point_scaled(point))
+                && next.offset == point.offset + point_registers(point.type)
+                && next.output == point.output + point_size(point)
+                && next.run != 0xffff)
+            {
+                point.run = next.run + 1;
+            }
+        }
+        m_compiled = true;
+        return true;
+    }
+
+    size_t CModbusDecoder::column_size(size_t index) const
+    {
+        return point_size(m_points[index]);
+    }
+
+    bool CModbusDecoder::decode(const uint8_t* data, size_t len, void* output) const
+    {
+        if (!m_compiled || len < m_registers * 2)
+            return false;
+
+        // decode each run of points
+        uint8_t* dst = (uint8_t*)output;
+        for (size_t i = 0; i < m_count; i += m_points[i].run)
+        {
+            const CModbusPoint& point = m_points[i];
+            point.kernel(data + point.offset * 2, point_registers(point.type) * 2, dst + point.output, point_size(point), point.run, point.scale);
+        }
+        return true;
+    }
+
+    bool CModbusDecoder::decode_response(const CModbusTransaction* transaction, void* output) const
+    {
+        // make sure this is a complete read response
+        //
+        // data[0] = fc
+        // data[1] = byte count
+        // data[2+] = registers
+        //
+        const uint8_t* data = transaction->data;
+        if (transaction->status != modbus_transaction_status::ok || transaction->len < 2)
+            return false;
+        if ((data[0] != read_holding_registers && data[0] != read_input_registers) || data[1] != transaction->len - 2)
+            return false;
+        return decode(data + 2, data[1], output);
+    }
+
+    bool CModbusDecoder::decode_columns(const uint8_t* data, size_t stride, size_t rows, void* const* columns) const
+    {
+        if (!m_compiled || stride < m_registers * 2)
+            return false;
+
+        // decode each point for all of the rows at once
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            const CModbusPoint& point = m_points[i];
+            point.kernel(data + point.offset * 2, stride, (uint8_t*)columns[i], point_size(point), rows, point.scale);
+        }
+        return true;
+    }
+}
@@ -0,0 +1,154 @@
+#ifndef __ModbusPotato_Decoder_h__
+#define __ModbusPotato_Decoder_h__
+#include "ModbusMaster.h"
+namespace ModbusPotato
+{
+    namespace modbus_point_type
+    {
+        /// <summary>
+        /// The type of a value held in one or more registers.
+        /// </summary>
+        enum modbus_point_type
+        {
+            uint16 = 0, // one register
+            int16, // one register
+            uint32, // two registers
+            int32, // two registers
+            float32, // two registers, IEEE 754 single precision
+            float64, // four registers, IEEE 754 double precision
+        };
+    }
+
+    namespace modbus_word_order
+    {
+        /// <summary>
+        /// The order of the bytes of a value spread over several registers.
+        /// </summary>
+        /// <remarks>
+        /// The letters name the bytes of a 32-bit value from the most to the
+        /// least significant, in the order they appear in the registers.
+        /// Longer values follow the same pattern, and for 16-bit values only
+        /// the byte order within the register matters.
+        /// </remarks>
+        enum modbus_word_order
+        {
+            abcd = 0, // big-endian, as defined by the Modbus spec
+            cdab, // least significant register first
+            badc, // bytes swapped within each register
+            dcba, // little-endian
+        };
+    }
+
+    /// <summary>
+    /// Describes one value to be decoded from a block of registers.
+    /// </summary>
+    /// <remarks>
+    /// The points are owned by the application and given to the
+    /// CModbusDecoder as an array, usually a static table with one entry
+    /// per field of an output struct.  The output field has the natural C
+    /// type of the point (uint16_t, int16_t, uint32_t, int32_t, float or
+    /// double), unless a scale other than 0 or 1 is given, in which case the
+    /// scaled value is stored as a double.
+    /// </remarks>
+    struct CModbusPoint
+    {
+        uint16_t offset; // register offset within the block
+        uint8_t type; // see modbus_point_type
+        uint8_t order; // see modbus_word_order
+        double scale; // multiplier, or 0 to store the raw value
+        size_t output; // byte offset of the field in the output struct, i.e. offsetof()
+
+        // set by CModbusDecoder::compile()
+        void (*kernel)(const uint8_t* src, size_t src_stride, uint8_t* dst, size_t dst_stride, size_t count, double scale);
+        uint16_t run; // number of points decoded together, starting with this one
+    };
+
+    /// <summary>
+    /// Converts blocks of registers into typed values using a schema which is compiled once.
+    /// </summary>
+    /// <remarks>
+    /// compile() checks the points and picks a decoding loop specialized
+    /// for the type, word order and scaling of each one, so no per-value
+    /// interpretation of the schema is left for decode().  Points which
+    /// share the same loop and have adjacent registers and adjacent output
+    /// fields are merged into a single run.  A table of 32 consecutive
+    /// float32 values is therefore decoded by one tight loop.
+    ///
+    /// decode() fills one output struct from one block, and
+    /// decode_columns() fills one array per point from many blocks of the
+    /// same layout, such as the responses from a fleet of identical meters
+    /// or successive scans of one slave.
+    ///
+    /// The register data is in network byte order, exactly as it appears
+    /// in a read response after the function code and byte count.
+    /// </remarks>
+    class CModbusDecoder
+    {
+    public:
+        CModbusDecoder(CModbusPoint* points, size_t count);
+
+        /// <summary>
+        /// Prepares the points for decoding.
+        /// </summary>
+        /// <returns>
+        /// false if a point has an invalid type or word order.
+        /// </returns>
+        /// <remarks>
+        /// This must be called once before decoding, and again if the
+        /// points are changed.
+        /// </remarks>
+        bool compile();
+
+        /// <summary>
+        /// Returns the number of registers a block must contain for every point to be decoded.
+        /// </summary>
+        size_t registers() const { return m_registers; }
+
+        /// <summary>
+        /// Returns the number of points in the schema.
+        /// </summary>
+        size_t count() const { return m_count; }
+
+        /// <summary>
+        /// Returns the point at the given index.
+        /// </summary>
+        const CModbusPoint& point(size_t index) const { return m_points[index]; }
+
+        /// <summary>
+        /// Returns the size of the output field or array element for the point at the given index.
+        /// </summary>
+        size_t column_size(size_t index) const;
+
+        /// <summary>
+        /// Decodes one block of registers into the output struct.
+        /// </summary>
+        /// <returns>
+        /// false if the schema is not compiled or the block is too short.
+        /// </returns>
+        bool decode(const uint8_t* data, size_t len, void* output) const;
+
+        /// <summary>
+        /// Decodes the response to a read of holding or input registers held by a completed transaction.
+        /// </summary>
+        /// <remarks>
+        /// The first register of the request is offset 0 of the schema.
+        /// </remarks>
+        bool decode_response(const CModbusTransaction* transaction, void* output) const;
+
+        /// <summary>
+        /// Decodes a number of blocks, each 'stride' bytes apart, into one array per point.
+        /// </summary>
+        /// <remarks>
+        /// columns[i] is the array for points[i], of the same type as the
+        /// field it would be stored in by decode().  The output offset of
+        /// the points is not used.
+        /// </remarks>
+        bool decode_columns(const uint8_t* data, size_t stride, size_t rows, void* const* columns) const;
+    private:
+        CModbusPoint* m_points;
+        size_t m_count;
+        size_t m_registers;
+        bool m_compiled;
+    };
+}
+#endif
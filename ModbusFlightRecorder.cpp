@@ -0,0 +1,61 @@
+#include "ModbusFlightRecorder.h"
+#include <stdio.h>
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf
+#endif
+namespace ModbusPotato
+{
+    CModbusFlightRecorder::CModbusFlightRecorder(CModbusFlightRecord* records, size_t count)
+        :   m_records(records)
+        ,   m_mask()
+        ,   m_next()
+    {
+        // round the number of records down to a power of two
+        size_t size = 1;
+        while (size * 2 <= count && size * 2 != 0)
+            size *= 2;
+        m_mask = size - 1;
+
+        // use a single dummy record if no storage was given so that record() is always safe
+        if (!m_records || !count)
+        {
+            static CModbusFlightRecord dummy;
+            m_records = &dummy;
+            m_mask = 0;
+        }
+    }
+
+    void CModbusFlightRecorder::dump(line_writer writer, void* context, state_namer state_name) const
+    {
+        if (!writer)
+            return;
+        size_t n = count();
+        for (size_t i = 0; i < n; ++i)
+        {
+            // the time spent in the old state is the time since the previous transition
+            const CModbusFlightRecord& entry = at(i);
+            unsigned long delta = i ? (unsigned long)(system_tick_t)(entry.ticks - at(i - 1).ticks) : 0;
+
+            // format the state names or numbers
+            char old_buf[4], new_buf[4];
+            const char* old_name = state_name ? state_name(entry.old_state) : NULL;
+            const char* new_name = state_name ? state_name(entry.new_state) : NULL;
+            if (!old_name)
+            {
+                snprintf(old_buf, sizeof(old_buf), "%u", entry.old_state);
+                old_name = old_buf;
+            }
+            if (!new_name)
+            {
+                snprintf(new_buf, sizeof(new_buf), "%u", entry.new_state);
+                new_name = new_buf;
+            }
+
+            // write the line
+            char line[80];
+            snprintf(line, sizeof(line), "%10lu +%-8lu %s -> %s len=%u",
+                (unsigned long)entry.ticks, delta, old_name, new_name, (unsigned int)entry.length);
+            writer(context, line);
+        }
+    }
+}
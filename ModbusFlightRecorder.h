@@ -0,0 +1,107 @@
+// Ring buffer of framer state transitions, for diagnosing latency in the field.
+//
+#ifndef __ModbusPotato_FlightRecorder_h__
+#define __ModbusPotato_FlightRecorder_h__
+#include "ModbusTypes.h"
+
+// Set MODBUS_FLIGHT_RECORDER to 0 to compile the recorder hooks out of the
+// framers.  They are disabled by default on AVR.
+#ifndef MODBUS_FLIGHT_RECORDER
+#ifdef __AVR__
+#define MODBUS_FLIGHT_RECORDER 0
+#else
+#define MODBUS_FLIGHT_RECORDER 1
+#endif
+#endif
+
+namespace ModbusPotato
+{
+    /// <summary>
+    /// One state transition in the flight recorder.
+    /// </summary>
+    struct CModbusFlightRecord
+    {
+        system_tick_t ticks; // system tick count when the state was entered
+        uint8_t old_state, new_state;
+        uint16_t length; // buffer length at the time of the transition
+    };
+
+    /// <summary>
+    /// Records the most recent state transitions of a framer.
+    /// </summary>
+    /// <remarks>
+    /// The caller supplies the storage for the records.  The number of
+    /// records is rounded down to a power of two so that recording a
+    /// transition is an index mask and a few stores; once the ring is full
+    /// the oldest records are over-written.
+    ///
+    /// Within poll(), the framer does not read the clock to record a
+    /// transition; each record carries the last tick count the framer read
+    /// for its own timers.  Transitions made outside of poll(), by
+    /// begin_send(), send() and finished(), read the clock when a recorder
+    /// is attached, so the time a frame is held by the application is the
+    /// difference between its frame_ready and queue or idle records.
+    ///
+    /// The recorder is written from the thread calling the framer's poll()
+    /// method, so dump() should be called from the same thread or while the
+    /// framer is not being polled.
+    /// </remarks>
+    class CModbusFlightRecorder
+    {
+    public:
+        /// <summary>
+        /// Called by dump() with each decoded line of text, without a line terminator.
+        /// </summary>
+        typedef void (*line_writer)(void* context, const char* line);
+
+        /// <summary>
+        /// Returns the name of a state, given the raw state value.
+        /// </summary>
+        typedef const char* (*state_namer)(uint8_t state);
+
+        CModbusFlightRecorder(CModbusFlightRecord* records, size_t count);
+
+        /// <summary>
+        /// Adds a state transition to the ring.
+        /// </summary>
+        void record(system_tick_t ticks, uint8_t old_state, uint8_t new_state, size_t length)
+        {
+            CModbusFlightRecord& entry = m_records[m_next++ & m_mask];
+            entry.ticks = ticks;
+            entry.old_state = old_state;
+            entry.new_state = new_state;
+            entry.length = (uint16_t)length;
+        }
+
+        /// <summary>
+        /// Returns the number of records currently held in the ring.
+        /// </summary>
+        size_t count() const { return m_next > m_mask ? m_mask + 1 : m_next; }
+
+        /// <summary>
+        /// Returns a record, where 0 is the oldest.
+        /// </summary>
+        const CModbusFlightRecord& at(size_t index) const { return m_records[(m_next - count() + index) & m_mask]; }
+
+        /// <summary>
+        /// Discards all the records.
+        /// </summary>
+        void clear() { m_next = 0; }
+
+        /// <summary>
+        /// Decodes the records, oldest first, into one line of text each.
+        /// </summary>
+        /// <remarks>
+        /// Each line holds the tick count, the ticks elapsed since the
+        /// previous transition (the time spent in the old state), the old
+        /// and new state names and the buffer length.  If state_name is NULL
+        /// then the raw state values are written instead.
+        /// </remarks>
+        void dump(line_writer writer, void* context, state_namer state_name) const;
+    private:
+        CModbusFlightRecord* m_records;
+        size_t m_mask;
+        unsigned long m_next;
+    };
+}
+#endif
@@ -8,6 +8,7 @@
 #ifndef __ModbusPotato_Interface_h__
 #define __ModbusPotato_Interface_h__
 #include "ModbusTypes.h"
+#include "ModbusStatistics.h"
 namespace ModbusPotato
 {
 #ifdef ARDUINO
@@ -128,6 +129,17 @@ namespace ModbusPotato
         /// Called when a new frame has been received by the remote.
         /// </summary>
         virtual void frame_ready(IFramer* framer) = 0;
+
+        /// <summary>
+        /// Called by poll() while the application holds the buffer.
+        /// </summary>
+        /// <remarks>
+        /// This is called in the queue and collision states, after
+        /// begin_send() has been called but before send() or finished().  It
+        /// allows a handler which deferred its response to send it from the
+        /// same context as poll(), without blocking the caller.
+        /// </remarks>
+        virtual void poll_queue(IFramer*) {}
     };
 
     /// <summary>
@@ -298,6 +310,62 @@ namespace ModbusPotato
         /// Returns the maximum allowable length of the buffer.
         /// </summary>
         virtual size_t buffer_max() const = 0;
+
+#if MODBUS_STATISTICS
+        /// <summary>
+        /// Returns the diagnostic counters, or NULL if the framer does not keep any.
+        /// </summary>
+        /// <remarks>
+        /// This method does not exist when MODBUS_STATISTICS is 0, so that
+        /// the framers do not carry the counters or the virtual slot.  See
+        /// CModbusStatistics for the rules on reading the counters from
+        /// another thread.
+        /// </remarks>
+        virtual CModbusStatistics* statistics() { return NULL; }
+#endif
+
+        /// <summary>
+        /// Returns the absolute system tick at which poll() must next be called for a timer.
+        /// </summary>
+        /// <returns>
+        /// true if the framer is waiting on a timer, or false if it is only
+        /// waiting on the stream or the application.
+        /// </returns>
+        /// <remarks>
+        /// This is the same timer as the timeout returned by poll(), but it
+        /// is measured from when the framer latched the last event rather
+        /// than from when poll() returned, so it does not drift with the
+        /// time the caller spends before it goes to sleep.  A runtime can
+        /// sleep until the deadline with an absolute timer such as
+        /// clock_nanosleep(TIMER_ABSTIME) or a hardware compare interrupt,
+        /// so that a response goes out at the earliest legal instant.
+        ///
+        /// Only a timer which is still running is reported.  Once it has
+        /// expired the framer is waiting on the stream, as poll() would
+        /// return 0, so a caller must not spin on a deadline in the past.
+        ///
+        /// Framers which do not track a deadline return false, in which case
+        /// the timeout returned by poll() must be used.
+        /// </remarks>
+        virtual bool deadline(system_tick_t&) const { return false; }
+
+        /// <summary>
+        /// Supplies the checksum of the frame about to be sent, so that the framer does not calculate it.
+        /// </summary>
+        /// <returns>
+        /// true if the checksum will be used, or false if the framer does not support it.
+        /// </returns>
+        /// <remarks>
+        /// This is for an application which keeps frames that are sent
+        /// repeatedly, along with their checksums.  It must be called after
+        /// the frame address and buffer have their final values, and before
+        /// send().  The value applies to the next frame only.
+        ///
+        /// The checksum is the CRC-16 of the frame address and the PDU, as
+        /// defined in section 2.5.1.2 of the serial line spec.  Only the RTU
+        /// framer supports it.
+        /// </remarks>
+        virtual bool set_checksum(uint16_t) { return false; }
     };
 
     /// <summary>
@@ -322,6 +390,12 @@ namespace ModbusPotato
     /// If the address and count are valid, but an error occurs when handling
     /// the command, then the handler should return
     /// modbus_exception_code::server_device_failure.
+    ///
+    /// If the request cannot be completed right away (i.e. the value must be
+    /// fetched from a slow device), the handler may return
+    /// modbus_exception_code::pending.  The framer keeps the request in its
+    /// buffer and any 'result' pointer remains valid until the application
+    /// calls CModbusSlave::complete() with the final result.
     /// 
     /// </remarks>
     class ISlaveHandler
@@ -0,0 +1,388 @@
+#include "ModbusLineRuntime.h"
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <time.h>
+namespace ModbusPotato
+{
+    // returns the monotonic time in nanoseconds
+    static unsigned long long monotonic_ns()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (unsigned long long)now.tv_sec * 1000000000ull + now.tv_nsec;
+    }
+
+    // sleep for the given number of microseconds
+    static void sleep_us(unsigned long microseconds)
+    {
+        struct timespec delay;
+        delay.tv_sec = microseconds / 1000000;
+        delay.tv_nsec = (long)(microseconds % 1000000) * 1000;
+        nanosleep(&delay, NULL);
+    }
+
+    // sleep until the given monotonic time in nanoseconds
+    //
+    // Note: an absolute wake-up time is used so that the time spent between
+    // reading the clock and going to sleep does not delay the wake-up.
+    //
+    static void sleep_until_ns(unsigned long long deadline)
+    {
+        struct timespec wake;
+        wake.tv_sec = (time_t)(deadline / 1000000000ull);
+        wake.tv_nsec = (long)(deadline % 1000000000ull);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+            ;
+    }
+
+    // wait until one of the file descriptors is readable or the given monotonic time in nanoseconds
+    //
+    // Note: ppoll() only takes a relative timeout, so it is measured from
+    // just before the call to keep the error small.
+    //
+    static void wait_until_ns(struct pollfd* fds, size_t count, unsigned long long deadline)
+    {
+        if (!count)
+        {
+            sleep_until_ns(deadline);
+            return;
+        }
+        unsigned long long now = monotonic_ns();
+        if (deadline <= now)
+            return;
+        struct timespec timeout;
+        timeout.tv_sec = (time_t)((deadline - now) / 1000000000ull);
+        timeout.tv_nsec = (long)((deadline - now) % 1000000000ull);
+        ppoll(fds, count, &timeout, NULL);
+    }
+
+    CModbusLine::CModbusLine(IFramer* framer, IFrameHandler* handler, int fd)
+        :   m_framer(framer)
+        ,   m_handler(handler)
+        ,   m_fd(fd)
+        ,   m_frames()
+        ,   m_last_frames()
+        ,   m_frame_rate()
+        ,   m_owner()
+        ,   m_next_owner()
+    {
+        if (m_framer)
+            m_framer->set_handler(this);
+    }
+
+    void CModbusLine::frame_ready(IFramer* framer)
+    {
+        // only the owning worker writes the counter
+        __atomic_store_n(&m_frames, m_frames + 1, __ATOMIC_RELAXED);
+        if (m_handler)
+            m_handler->frame_ready(framer);
+    }
+
+    void CModbusLine::poll_queue(IFramer* framer)
+    {
+        if (m_handler)
+            m_handler->poll_queue(framer);
+    }
+
+    CModbusLineRuntime::CModbusLineRuntime(ITimeProvider* timer)
+        :   m_timer(timer)
+        ,   m_worker_count()
+        ,   m_line_count()
+        ,   m_idle_period(default_idle_period)
+        ,   m_rebalance_interval(default_rebalance_interval)
+        ,   m_saturation(default_saturation)
+        ,   m_supervisor()
+        ,   m_supervisor_started()
+        ,   m_running()
+    {
+        pthread_mutex_init(&m_lock, NULL);
+    }
+
+    CModbusLineRuntime::~CModbusLineRuntime()
+    {
+        stop();
+        pthread_mutex_destroy(&m_lock);
+    }
+
+    bool CModbusLineRuntime::add_worker(int cpu)
+    {
+        if (m_running || m_worker_count == max_workers)
+            return false;
+
+        worker_type& worker = m_workers[m_worker_count];
+        worker.runtime = this;
+        worker.thread = pthread_t();
+        worker.cpu = cpu;
+        worker.index = (int)m_worker_count;
+        worker.busy_ns = worker.last_busy_ns = 0;
+        worker.utilization = 0;
+        m_worker_count++;
+        return true;
+    }
+
+    bool CModbusLineRuntime::add_line(CModbusLine* line)
+    {
+        if (m_running || !line || !line->m_framer || m_line_count == max_lines)
+            return false;
+        m_lines[m_line_count++] = line;
+        return true;
+    }
+
+    void CModbusLineRuntime::set_rebalance(unsigned long interval_ms, unsigned int saturation_percent)
+    {
+        m_rebalance_interval = interval_ms;
+        m_saturation = saturation_percent;
+    }
+
+    bool CModbusLineRuntime::start()
+    {
+        if (m_running || !m_worker_count || !m_timer)
+            return false;
+
+        // assign the lines round-robin until we have measured the frame rates
+        for (size_t i = 0; i < m_line_count; ++i)
+        {
+            m_lines[i]->m_owner = m_lines[i]->m_next_owner = (int)(i % m_worker_count);
+            m_lines[i]->m_last_frames = m_lines[i]->frames();
+        }
+
+        // start the workers
+        __atomic_store_n(&m_running, 1, __ATOMIC_RELEASE);
+        for (size_t i = 0; i < m_worker_count; ++i)
+        {
+            if (pthread_create(&m_workers[i].thread, NULL, &worker_main, &m_workers[i]) != 0)
+            {
+                // join the workers that did start
+                __atomic_store_n(&m_running, 0, __ATOMIC_RELEASE);
+                while (i--)
+                    pthread_join(m_workers[i].thread, NULL);
+                return false;
+            }
+        }
+
+        // start the supervisor if automatic rebalancing is enabled
+        if (m_rebalance_interval)
+            m_supervisor_started = pthread_create(&m_supervisor, NULL, &supervisor_main, this) == 0;
+
+        return true;
+    }
+
+    void CModbusLineRuntime::stop()
+    {
+        if (!m_running)
+            return;
+
+        // signal the threads to exit and wait for them
+        __atomic_store_n(&m_running, 0, __ATOMIC_RELEASE);
+        if (m_supervisor_started)
+        {
+            pthread_join(m_supervisor, NULL);
+            m_supervisor_started = false;
+        }
+        for (size_t i = 0; i < m_worker_count; ++i)
+            pthread_join(m_workers[i].thread, NULL);
+    }
+
+    void* CModbusLineRuntime::worker_main(void* arg)
+    {
+        worker_type* worker = (worker_type*)arg;
+        worker->runtime->run_worker(worker);
+        return NULL;
+    }
+
+    void CModbusLineRuntime::run_worker(worker_type* worker)
+    {
+        // pin the thread to the requested core
+        if (worker->cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(worker->cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+
+        // wake up at the requested time rather than within the default 50us slack
+        prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+
+        unsigned long long ns_per_tick = (unsigned long long)m_timer->microseconds_per_tick() * 1000;
+        struct pollfd fds[max_lines];
+        while (__atomic_load_n(&m_running, __ATOMIC_ACQUIRE))
+        {
+            size_t fd_count = 0;
+            // latch the tick count against the monotonic clock so that the
+            // framer deadlines can be converted to absolute wake-up times
+            system_tick_t start_ticks = m_timer->ticks();
+            unsigned long long start = monotonic_ns();
+            unsigned long long wake = start + (unsigned long long)m_idle_period * 1000;
+            for (size_t i = 0; i < m_line_count; ++i)
+            {
+                // skip any lines owned by other workers
+                CModbusLine* line = m_lines[i];
+                if (__atomic_load_n(&line->m_owner, __ATOMIC_ACQUIRE) != worker->index)
+                    continue;
+
+                // hand the line over if it was moved to another worker
+                //
+                // Note: this is the only place the owner changes, so a line
+                // is never polled by two workers at once.
+                //
+                int next = __atomic_load_n(&line->m_next_owner, __ATOMIC_RELAXED);
+                if (next != worker->index)
+                {
+                    __atomic_store_n(&line->m_owner, next, __ATOMIC_RELEASE);
+                    continue;
+                }
+
+                // wake up when the line has data
+                if (line->m_fd >= 0)
+                {
+                    fds[fd_count].fd = line->m_fd;
+                    fds[fd_count].events = POLLIN;
+                    fds[fd_count].revents = 0;
+                    fd_count++;
+                }
+
+                // run the state machine and keep track of the earliest wake-up time
+                //
+                // Note: the framer's absolute deadline is preferred as it is
+                // measured from the event that started the timer.  A deadline
+                // that has already passed wakes the worker right away.  The
+                // relative timeout from poll() is measured from the start of
+                // this pass, which can only wake the worker early.
+                //
+                unsigned long ticks = line->m_framer->poll();
+                system_tick_t deadline;
+                unsigned long long when;
+                if (line->m_framer->deadline(deadline))
+                {
+                    system_tick_t remaining = deadline - start_ticks;
+                    when = remaining > (~(system_tick_t)0 >> 1) ? start : start + remaining * ns_per_tick;
+                }
+                else if (ticks)
+                    when = start + ticks * ns_per_tick;
+                else
+                    continue;
+                if (when < wake)
+                    wake = when;
+            }
+
+            // account for the time spent polling
+            unsigned long long now = monotonic_ns();
+            __atomic_store_n(&worker->busy_ns, worker->busy_ns + (now - start), __ATOMIC_RELAXED);
+
+            // wait for input or the earliest deadline
+            if (wake > now)
+                wait_until_ns(fds, fd_count, wake);
+        }
+    }
+
+    void* CModbusLineRuntime::supervisor_main(void* arg)
+    {
+        CModbusLineRuntime* runtime = (CModbusLineRuntime*)arg;
+        unsigned long long last = monotonic_ns();
+        while (__atomic_load_n(&runtime->m_running, __ATOMIC_ACQUIRE))
+        {
+            // wait for the next interval in short steps so that stop() is not delayed
+            for (unsigned long elapsed = 0; elapsed < runtime->m_rebalance_interval && __atomic_load_n(&runtime->m_running, __ATOMIC_ACQUIRE); elapsed += 10)
+                sleep_us(10000);
+
+            // measure the frame rates and worker utilization
+            pthread_mutex_lock(&runtime->m_lock);
+            unsigned long long now = monotonic_ns();
+            runtime->measure(now - last);
+            last = now;
+
+            // rebalance if any worker is saturated
+            for (size_t i = 0; i < runtime->m_worker_count; ++i)
+            {
+                if (runtime->m_workers[i].utilization >= runtime->m_saturation)
+                {
+                    runtime->assign();
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&runtime->m_lock);
+        }
+        return NULL;
+    }
+
+    void CModbusLineRuntime::measure(unsigned long long elapsed_ns)
+    {
+        if (!elapsed_ns)
+            return;
+
+        // update the frame rate of each line
+        //
+        // Note: the rate is smoothed by averaging with the previous value
+        // so that a single burst does not move the lines around.
+        //
+        for (size_t i = 0; i < m_line_count; ++i)
+        {
+            CModbusLine* line = m_lines[i];
+            unsigned long frames = line->frames();
+            unsigned long rate = (unsigned long)((unsigned long long)(frames - line->m_last_frames) * 1000000000ull / elapsed_ns);
+            __atomic_store_n(&line->m_frame_rate, (line->m_frame_rate + rate + 1) / 2, __ATOMIC_RELAXED);
+            line->m_last_frames = frames;
+        }
+
+        // update the utilization of each worker
+        for (size_t i = 0; i < m_worker_count; ++i)
+        {
+            worker_type& worker = m_workers[i];
+            unsigned long long busy = __atomic_load_n(&worker.busy_ns, __ATOMIC_RELAXED);
+            unsigned long long utilization = (busy - worker.last_busy_ns) * 100 / elapsed_ns;
+            __atomic_store_n(&worker.utilization, (unsigned int)(utilization > 100 ? 100 : utilization), __ATOMIC_RELAXED);
+            worker.last_busy_ns = busy;
+        }
+    }
+
+    void CModbusLineRuntime::rebalance()
+    {
+        pthread_mutex_lock(&m_lock);
+        assign();
+        pthread_mutex_unlock(&m_lock);
+    }
+
+    void CModbusLineRuntime::assign()
+    {
+        // called with m_lock held
+        if (!m_worker_count)
+            return;
+
+        // sort the lines by descending frame rate
+        //
+        // Note: insertion sort is plenty for the number of lines allowed.
+        //
+        size_t order[max_lines];
+        for (size_t i = 0; i < m_line_count; ++i)
+        {
+            size_t j = i;
+            for (; j && m_lines[order[j - 1]]->m_frame_rate < m_lines[i]->m_frame_rate; --j)
+                order[j] = order[j - 1];
+            order[j] = i;
+        }
+
+        // assign each line to the least loaded worker
+        //
+        // Note: every line costs at least one unit so that idle lines are
+        // still spread evenly across the workers.
+        //
+        unsigned long long load[max_workers] = {};
+        for (size_t i = 0; i < m_line_count; ++i)
+        {
+            size_t best = 0;
+            for (size_t w = 1; w < m_worker_count; ++w)
+            {
+                if (load[w] < load[best])
+                    best = w;
+            }
+            CModbusLine* line = m_lines[order[i]];
+            load[best] += line->m_frame_rate + 1;
+            __atomic_store_n(&line->m_next_owner, (int)best, __ATOMIC_RELAXED);
+        }
+    }
+}
+#endif
@@ -0,0 +1,194 @@
+#ifndef __ModbusLineRuntime_h__
+#define __ModbusLineRuntime_h__
+#include "ModbusInterface.h"
+#ifdef __linux__
+#include <pthread.h>
+namespace ModbusPotato
+{
+    /// <summary>
+    /// Represents one serial line served by the CModbusLineRuntime class.
+    /// </summary>
+    /// <remarks>
+    /// This object is installed as the framer's handler and forwards all
+    /// events to the application handler, counting the frames so that the
+    /// runtime can balance the lines across the worker threads.
+    ///
+    /// The application handler is called from the worker thread that
+    /// currently owns the line.  A line is only ever polled by one worker at
+    /// a time, but it may move to another worker when the lines are
+    /// rebalanced.
+    ///
+    /// The file descriptor of the framer's stream, if there is one, lets
+    /// the owning worker wake up as soon as data arrives instead of at the
+    /// end of its idle period.
+    /// </remarks>
+    class CModbusLine : public IFrameHandler
+    {
+    public:
+        CModbusLine(IFramer* framer, IFrameHandler* handler, int fd = -1);
+        virtual void frame_ready(IFramer* framer);
+        virtual void poll_queue(IFramer* framer);
+
+        /// <summary>
+        /// Returns the framer for this line.
+        /// </summary>
+        IFramer* framer() const { return m_framer; }
+
+        /// <summary>
+        /// Returns the file descriptor the worker waits on for input, or -1 if none.
+        /// </summary>
+        int fd() const { return m_fd; }
+
+        /// <summary>
+        /// Returns the total number of frames received on this line.
+        /// </summary>
+        unsigned long frames() const { return __atomic_load_n(&m_frames, __ATOMIC_RELAXED); }
+
+        /// <summary>
+        /// Returns the frame rate measured at the last rebalance check, in frames per second.
+        /// </summary>
+        unsigned long frame_rate() const { return __atomic_load_n(&m_frame_rate, __ATOMIC_RELAXED); }
+
+        /// <summary>
+        /// Returns the index of the worker that currently owns this line.
+        /// </summary>
+        int worker() const { return __atomic_load_n(&m_owner, __ATOMIC_ACQUIRE); }
+    private:
+        friend class CModbusLineRuntime;
+        IFramer* m_framer;
+        IFrameHandler* m_handler;
+        int m_fd;
+        unsigned long m_frames, m_last_frames;
+        unsigned long m_frame_rate;
+        int m_owner, m_next_owner;
+    };
+
+    /// <summary>
+    /// Runs many serial lines on a set of worker threads pinned to CPU cores.
+    /// </summary>
+    /// <remarks>
+    /// Each worker runs its own event loop which calls poll() on the lines it
+    /// owns and then waits with ppoll() on the file descriptors of those
+    /// lines until one of them is readable, the earliest deadline of the
+    /// framers, or the end of the idle period if none of them are waiting
+    /// on a timer.  The deadline is taken from IFramer::deadline() where
+    /// the framer supports it, so that a slave's response is sent at the
+    /// end of the T3.5 delay rather than whenever the loop happens to come
+    /// around.  The idle period still bounds the wait, since a framer
+    /// waiting for room in its write buffer, or a line without a file
+    /// descriptor, must be polled again.
+    ///
+    /// The lines are initially assigned round-robin.  A supervisor thread
+    /// measures the frame rate of each line and the utilization of each
+    /// worker, and when a worker saturates the lines are reassigned so that
+    /// the total frame rate of each worker is balanced.  Lines are handed
+    /// over between polls, so no locks are taken in the event loop.  The
+    /// measurements and the assignment are guarded by a mutex, so
+    /// rebalance() may also be called by the application while the
+    /// supervisor is running.
+    ///
+    /// All workers and lines must be added before calling start(), and no
+    /// memory is allocated.
+    /// </remarks>
+    class CModbusLineRuntime
+    {
+    public:
+        enum
+        {
+            max_workers = 64,
+            max_lines = 256,
+            default_idle_period = 500, // default sleep time when no timers are pending, in microseconds
+            default_rebalance_interval = 1000, // default rebalance check interval, in milliseconds
+            default_saturation = 80, // default worker utilization that triggers rebalancing, in percent
+        };
+
+        /// <summary>
+        /// Constructor for the runtime.
+        /// </summary>
+        /// <remarks>
+        /// The timer must be the same time provider used by the framers, and
+        /// is used to convert the timeouts returned by poll().
+        /// </remarks>
+        CModbusLineRuntime(ITimeProvider* timer);
+        ~CModbusLineRuntime();
+
+        /// <summary>
+        /// Adds a worker thread pinned to the given CPU core, or -1 to let the scheduler choose.
+        /// </summary>
+        bool add_worker(int cpu);
+
+        /// <summary>
+        /// Adds a line to be served by the workers.
+        /// </summary>
+        bool add_line(CModbusLine* line);
+
+        /// <summary>
+        /// Sets the time a worker sleeps when none of its framers are waiting on a timer, in microseconds.
+        /// </summary>
+        void set_idle_period(unsigned long microseconds) { m_idle_period = microseconds; }
+
+        /// <summary>
+        /// Sets how often the frame rates are measured and the utilization that triggers rebalancing.
+        /// </summary>
+        /// <remarks>
+        /// An interval of 0 disables automatic rebalancing; rebalance() may
+        /// still be called by the application.
+        /// </remarks>
+        void set_rebalance(unsigned long interval_ms, unsigned int saturation_percent);
+
+        /// <summary>
+        /// Starts the worker threads.
+        /// </summary>
+        bool start();
+
+        /// <summary>
+        /// Stops and joins the worker threads.
+        /// </summary>
+        void stop();
+
+        /// <summary>
+        /// Reassigns the lines so that the measured frame rates are balanced across the workers.
+        /// </summary>
+        /// <remarks>
+        /// This may be called from any thread.
+        /// </remarks>
+        void rebalance();
+
+        /// <summary>
+        /// Returns the number of workers.
+        /// </summary>
+        size_t worker_count() const { return m_worker_count; }
+
+        /// <summary>
+        /// Returns the utilization of the given worker at the last rebalance check, in percent.
+        /// </summary>
+        unsigned int worker_utilization(size_t worker) const { return worker < m_worker_count ? __atomic_load_n(&m_workers[worker].utilization, __ATOMIC_RELAXED) : 0; }
+    private:
+        struct worker_type
+        {
+            CModbusLineRuntime* runtime;
+            pthread_t thread;
+            int cpu, index;
+            unsigned long long busy_ns, last_busy_ns;
+            unsigned int utilization;
+        };
+        static void* worker_main(void* arg);
+        static void* supervisor_main(void* arg);
+        void run_worker(worker_type* worker);
+        void measure(unsigned long long elapsed_ns);
+        void assign();
+        ITimeProvider* m_timer;
+        worker_type m_workers[max_workers];
+        size_t m_worker_count;
+        CModbusLine* m_lines[max_lines];
+        size_t m_line_count;
+        unsigned long m_idle_period, m_rebalance_interval;
+        unsigned int m_saturation;
+        pthread_mutex_t m_lock; // guards the measurements and the assignment of the lines
+        pthread_t m_supervisor;
+        bool m_supervisor_started;
+        int m_running;
+    };
+}
+#endif
+#endif
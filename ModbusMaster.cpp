@@ -0,0 +1,376 @@
+#include "ModbusMaster.h"
+namespace ModbusPotato
+{
+    // calculate the amount of time elapsed
+    //
+    // Note: see ModbusRTU.cpp for the explanation of the roll-over behavior.
+    //
+    #define ELAPSED(start, end) ((system_tick_t)(end) - (system_tick_t)(start))
+
+    enum
+    {
+        default_timeout_us = 1000000, // response timeout
+        default_retries = 2,
+        default_backoff_us = 10000, // delay before the first retry
+        default_max_backoff_us = 200000, // upper bound of the retry delay
+        default_turnaround_us = 100000, // delay after a broadcast, see section 2.1 of the serial line spec
+        default_offline_threshold = 3, // consecutive failed transactions before a slave is offline
+        default_probe_interval_us = 10000000, // how often an offline slave is probed
+    };
+
+    CModbusMaster::CModbusMaster(IFramer* framer, ITimeProvider* timer)
+        :   m_framer(framer)
+        ,   m_timer(timer)
+        ,   m_queue_head()
+        ,   m_queue_tail()
+        ,   m_active()
+        ,   m_health()
+        ,   m_health_count()
+        ,   m_state(state_idle)
+        ,   m_last_ticks()
+        ,   m_timeout(to_ticks(default_timeout_us))
+        ,   m_backoff(to_ticks(default_backoff_us))
+        ,   m_max_backoff(to_ticks(default_max_backoff_us))
+        ,   m_turnaround(to_ticks(default_turnaround_us))
+        ,   m_probe_interval(to_ticks(default_probe_interval_us))
+        ,   m_min_rto()
+        ,   m_max_rto()
+        ,   m_attempt_timeout()
+        ,   m_retries(default_retries)
+        ,   m_offline_threshold(default_offline_threshold)
+        ,   m_function()
+        ,   m_probe()
+    {
+        m_framer->set_handler(this);
+    }
+
+    system_tick_t CModbusMaster::to_ticks(unsigned long us) const
+    {
+        // round up so that a short delay is never 0 ticks
+        unsigned long us_per_tick = m_timer->microseconds_per_tick();
+        return (system_tick_t)((us + us_per_tick - 1) / us_per_tick);
+    }
+
+    void CModbusMaster::set_backoff(unsigned long backoff_us, unsigned long max_backoff_us)
+    {
+        m_backoff = to_ticks(backoff_us);
+        m_max_backoff = to_ticks(max_backoff_us);
+        if (m_max_backoff < m_backoff)
+            m_max_backoff = m_backoff;
+    }
+
+    void CModbusMaster::set_adaptive_timeout(unsigned long floor_us, unsigned long ceiling_us)
+    {
+        m_min_rto = to_ticks(floor_us);
+        m_max_rto = to_ticks(ceiling_us);
+        if (m_max_rto && m_max_rto < m_min_rto)
+            m_max_rto = m_min_rto;
+    }
+
+    void CModbusMaster::set_health_table(CModbusSlaveHealth* table, size_t count)
+    {
+        m_health = table;
+        m_health_count = table ? count : 0;
+        for (size_t i = 0; i < m_health_count; ++i)
+            m_health[i].clear();
+    }
+
+    void CModbusMaster::reset_health(uint8_t address)
+    {
+        if (CModbusSlaveHealth* health = slave_health(address))
+            health->clear();
+    }
+
+    bool CModbusMaster::submit(CModbusTransaction* transaction)
+    {
+        // make sure the transaction isn't already in use and the request will fit in the framer
+        if (!transaction || transaction->status == modbus_transaction_status::queued || transaction->status == modbus_transaction_status::active)
+            return false;
+        if (!transaction->data || !transaction->len || transaction->len > transaction->max || transaction->len > m_framer->buffer_max())
+            return false;
+
+        // add it to the end of the queue
+        transaction->status = modbus_transaction_status::queued;
+        transaction->attempts = 0;
+        transaction->next = NULL;
+        if (m_queue_tail)
+            m_queue_tail->next = transaction;
+        else
+            m_queue_head = transaction;
+        m_queue_tail = transaction;
+        return true;
+    }
+
+    system_tick_t CModbusMaster::backoff_delay() const
+    {
+        // double the delay for each attempt, up to the maximum
+        system_tick_t delay = m_backoff;
+        for (uint8_t i = 1; i < m_active->attempts && delay < m_max_backoff; ++i)
+            delay <<= 1;
+        return delay < m_max_backoff ? delay : m_max_backoff;
+    }
+
+    system_tick_t CModbusMaster::response_timeout() const
+    {
+        // use the fixed timeout until the slave has answered
+        CModbusSlaveHealth* health = slave_health(m_active->address);
+        if (!m_max_rto || !health || !health->rto)
+            return m_timeout;
+        if (health->rto < m_min_rto)
+            return m_min_rto;
+        return health->rto < m_max_rto ? health->rto : m_max_rto;
+    }
+
+    void CModbusMaster::update_rtt(CModbusSlaveHealth* health, system_tick_t rtt)
+    {
+        // see RFC 6298 section 2, with alpha = 1/8 and beta = 1/4 applied to the scaled values
+        if (!health->rto)
+        {
+            health->srtt = rtt << 3;
+            health->rttvar = rtt << 1;
+        }
+        else
+        {
+            system_tick_t srtt = health->srtt >> 3;
+            system_tick_t delta = rtt > srtt ? rtt - srtt : srtt - rtt;
+            health->srtt = health->srtt - srtt + rtt;
+            health->rttvar = health->rttvar - (health->rttvar >> 2) + delta;
+        }
+
+        // RTO = SRTT + max(G, 4 * RTTVAR), where the clock granularity G is one tick
+        health->rto = (health->srtt >> 3) + (health->rttvar ? health->rttvar : 1);
+    }
+
+    bool CModbusMaster::skip(CModbusTransaction* transaction)
+    {
+        // slaves which are online or not tracked are never skipped
+        m_probe = false;
+        CModbusSlaveHealth* health = slave_health(transaction->address);
+        if (!health || health->state == CModbusSlaveHealth::online)
+            return false;
+
+        // skip the request until the probe interval has elapsed
+        system_tick_t ticks = m_timer->ticks();
+        if (ELAPSED(health->offline_ticks, ticks) < m_probe_interval)
+        {
+            health->skipped++;
+            return true;
+        }
+
+        // let this request through once, without retries
+        health->offline_ticks = ticks;
+        m_probe = true;
+        return false;
+    }
+
+    void CModbusMaster::failed()
+    {
+        // count the consecutive failures and mark the slave offline when it reaches the threshold
+        CModbusSlaveHealth* health = slave_health(m_active->address);
+        if (!health)
+            return;
+        if (health->failures != 0xff)
+            health->failures++;
+        if (health->state == CModbusSlaveHealth::online && m_offline_threshold && health->failures >= m_offline_threshold)
+        {
+            health->state = CModbusSlaveHealth::offline;
+            health->offline_ticks = m_timer->ticks();
+        }
+    }
+
+    void CModbusMaster::complete(uint8_t status)
+    {
+        // release the transaction before calling the handler so that it can be submitted again
+        CModbusTransaction* transaction = m_active;
+        m_active = NULL;
+        m_state = state_idle;
+        transaction->status = status;
+        if (transaction->handler)
+            transaction->handler->transaction_complete(this, transaction);
+    }
+
+    void CModbusMaster::frame_ready(IFramer* framer)
+    {
+        // ignore anything which is not a response to the active request
+        //
+        // Note: a late response to the previous attempt is accepted while
+        // waiting to retry, since it answers the same request.
+        //
+        if (!m_active || (m_state != state_wait && m_state != state_backoff) || framer->frame_address() != m_active->address)
+        {
+            framer->finished();
+            return;
+        }
+
+        // copy the response into the transaction
+        size_t len = framer->buffer_len();
+        const uint8_t* buffer = framer->buffer();
+        uint8_t status;
+        if (!len || (buffer[0] & 0x7f) != m_function || len > m_active->max)
+        {
+            status = modbus_transaction_status::invalid_response;
+        }
+        else
+        {
+            for (size_t i = 0; i < len; ++i)
+                m_active->data[i] = buffer[i];
+            m_active->len = len;
+            status = (buffer[0] & 0x80) ? modbus_transaction_status::exception : modbus_transaction_status::ok;
+        }
+        framer->finished();
+
+        // the slave answered, so it is online
+        if (CModbusSlaveHealth* health = slave_health(m_active->address))
+        {
+            // only sample the round trip time if the request was not sent again (Karn's algorithm)
+            if (m_max_rto && m_state == state_wait && m_active->attempts == 1)
+                update_rtt(health, ELAPSED(m_last_ticks, m_timer->ticks()));
+            health->responses++;
+            if (status == modbus_transaction_status::exception)
+                health->exceptions++;
+            health->failures = 0;
+            health->state = CModbusSlaveHealth::online;
+        }
+        complete(status);
+    }
+
+    unsigned long CModbusMaster::poll()
+    {
+        // state machine for sending requests
+        //
+        // Reason for goto statements: re-evaluate switch case labels when
+        // changing states.
+        //
+        switch (m_state)
+        {
+        case state_idle: // waiting for a request
+idle:
+            {
+                // take the next transaction from the queue, skipping those for offline slaves
+                //
+                // Note: only the transactions queued before this point are
+                // skipped, so that a handler which submits again from the
+                // callback can't keep this loop running when every slave
+                // is offline.
+                //
+                CModbusTransaction* last = m_queue_tail;
+                while (!m_active && m_queue_head)
+                {
+                    m_active = m_queue_head;
+                    m_queue_head = m_active->next;
+                    if (!m_queue_head)
+                        m_queue_tail = NULL;
+                    m_active->next = NULL;
+                    if (!skip(m_active))
+                        break;
+                    bool was_last = m_active == last;
+                    complete(modbus_transaction_status::skipped);
+                    if (was_last)
+                        return m_queue_head ? 1 : 0; // check the rest of the queue on the next tick
+                }
+                if (!m_active)
+                    return 0; // waiting for a request
+
+                // start the transaction
+                if (CModbusSlaveHealth* health = slave_health(m_active->address))
+                    health->transactions++;
+                m_active->status = modbus_transaction_status::active;
+                m_function = m_active->data[0];
+                m_state = state_send;
+            }
+            MODBUS_FALLTHROUGH; // send the request
+        case state_send: // waiting for the framer to accept the request
+send:
+            {
+                // try to lock the framer's buffer
+                //
+                // If the framer is busy receiving, wait for its own timer to
+                // end the frame.  Without one it is waiting on the stream,
+                // and its poll() covers the wait.
+                //
+                if (!m_framer->begin_send())
+                {
+                    system_tick_t deadline;
+                    if (!m_framer->deadline(deadline))
+                        return 0; // waiting for the framer
+                    system_tick_t remaining = ELAPSED(m_timer->ticks(), deadline);
+                    if (!remaining || remaining > (system_tick_t)-1 / 2)
+                        return 1; // the framer's timer has just expired, try again on the next tick
+                    return remaining; // waiting for the framer's timer
+                }
+
+                // copy the request into the framer and send it
+                uint8_t* buffer = m_framer->buffer();
+                for (size_t i = 0; i < m_active->len; ++i)
+                    buffer[i] = m_active->data[i];
+                m_framer->set_frame_address(m_active->address);
+                m_framer->set_buffer_len(m_active->len);
+                m_framer->send();
+                m_active->attempts++;
+                m_last_ticks = m_timer->ticks();
+
+                // broadcasts are not answered, so only wait for the turnaround delay
+                if (!m_active->address)
+                {
+                    m_state = state_turnaround;
+                    goto turnaround;
+                }
+                m_attempt_timeout = response_timeout();
+                m_state = state_wait;
+                return m_attempt_timeout; // waiting for the response
+            }
+        case state_wait: // waiting for the response
+            {
+                // check if the response timeout has elapsed
+                system_tick_t elapsed = ELAPSED(m_last_ticks, m_timer->ticks());
+                if (elapsed < m_attempt_timeout)
+                    return m_attempt_timeout - elapsed; // waiting for the response
+
+                // count the timeout and back off the adaptive timeout
+                if (CModbusSlaveHealth* health = slave_health(m_active->address))
+                {
+                    health->timeouts++;
+                    if (m_max_rto && health->rto)
+                        health->rto = health->rto < m_max_rto / 2 ? health->rto * 2 : m_max_rto;
+                }
+
+                // retry unless this was the last attempt or a probe of an offline slave
+                if (!m_probe && m_active->attempts <= m_retries)
+                {
+                    m_last_ticks = m_timer->ticks();
+                    m_state = state_backoff;
+                    goto backoff;
+                }
+
+                // give up on this transaction
+                failed();
+                complete(modbus_transaction_status::timeout);
+                goto idle;
+            }
+        case state_backoff: // waiting before sending the request again
+backoff:
+            {
+                system_tick_t delay = backoff_delay();
+                system_tick_t elapsed = ELAPSED(m_last_ticks, m_timer->ticks());
+                if (elapsed < delay)
+                    return delay - elapsed; // waiting for the backoff delay
+
+                // send the request again
+                if (CModbusSlaveHealth* health = slave_health(m_active->address))
+                    health->retries++;
+                m_state = state_send;
+                goto send;
+            }
+        case state_turnaround: // waiting after a broadcast
+turnaround:
+            {
+                system_tick_t elapsed = ELAPSED(m_last_ticks, m_timer->ticks());
+                if (elapsed < m_turnaround)
+                    return m_turnaround - elapsed; // waiting for the slaves to process the request
+                complete(modbus_transaction_status::ok);
+                goto idle;
+            }
+        }
+        return 0;
+    }
+}
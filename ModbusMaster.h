@@ -0,0 +1,290 @@
+#ifndef __ModbusPotato_Master_h__
+#define __ModbusPotato_Master_h__
+#include "ModbusInterface.h"
+namespace ModbusPotato
+{
+    // forward declarations
+    class CModbusMaster;
+    struct CModbusTransaction;
+
+    namespace modbus_transaction_status
+    {
+        /// <summary>
+        /// The state or final result of a CModbusTransaction.
+        /// </summary>
+        enum modbus_transaction_status
+        {
+            idle = 0, // not submitted
+            queued, // waiting to be sent
+            active, // sent, or waiting for a retry
+            ok, // a normal response was received, or a broadcast was sent
+            exception, // an exception response was received
+            timeout, // no response after all of the retries
+            skipped, // not sent because the slave is offline
+            invalid_response, // the response did not match the request or did not fit in the buffer
+            rejected, // not sent because the master did not accept the request
+        };
+    }
+
+    /// <summary>
+    /// Receives notifications when a transaction submitted to the master has finished.
+    /// </summary>
+    class IMasterHandler
+    {
+    public:
+        virtual ~IMasterHandler() {}
+
+        /// <summary>
+        /// Called when a transaction has finished with the given status.
+        /// </summary>
+        /// <remarks>
+        /// This is called from CModbusMaster::poll() or from the framer's
+        /// poll() when the response arrives.  The transaction is no longer
+        /// owned by the master, so it may be changed and submitted again
+        /// from within this method.
+        /// </remarks>
+        virtual void transaction_complete(CModbusMaster* master, CModbusTransaction* transaction) = 0;
+    };
+
+    /// <summary>
+    /// Describes a request to a slave and receives its response.
+    /// </summary>
+    /// <remarks>
+    /// The transaction object and its data buffer are owned by the
+    /// application and linked into the master's queue using
+    /// CModbusMaster::submit(), so no memory is allocated.  They must remain
+    /// valid until the handler is called.
+    ///
+    /// The data buffer holds the request PDU, starting with the function
+    /// code, when the transaction is submitted.  The response PDU is copied
+    /// over it when a response is received, so a transaction which is sent
+    /// repeatedly must rebuild its request each time.
+    /// </remarks>
+    struct CModbusTransaction
+    {
+        CModbusTransaction(IMasterHandler* handler, uint8_t* data, size_t max)
+            :   handler(handler)
+            ,   address()
+            ,   data(data)
+            ,   len()
+            ,   max(max)
+            ,   status(modbus_transaction_status::idle)
+            ,   attempts()
+            ,   next()
+        {
+        }
+        IMasterHandler* handler;
+        uint8_t address; // slave address, or 0 for broadcast
+        uint8_t* data; // request PDU, replaced by the response PDU
+        size_t len; // length of the PDU in the data buffer
+        size_t max; // size of the data buffer
+        uint8_t status; // see modbus_transaction_status
+        uint8_t attempts; // number of times the request was sent
+        CModbusTransaction* next;
+    };
+
+    /// <summary>
+    /// Tracks the health of one slave polled by the master.
+    /// </summary>
+    /// <remarks>
+    /// A slave is marked offline after a number of consecutive transactions
+    /// have timed out.  Requests to an offline slave are skipped, except for
+    /// one probe per probe interval which is sent without retries.  The
+    /// slave is back online as soon as it answers.
+    ///
+    /// When adaptive timeouts are enabled, the round trip time of each
+    /// request which was answered on the first attempt is used to update
+    /// the smoothed round trip time and its variance, in the same way as
+    /// the TCP retransmission timer (RFC 6298).  The response timeout for
+    /// the slave is the smoothed round trip time plus four times the
+    /// variance, and is doubled after each timeout.
+    ///
+    /// The counters roll over at their maximum value.
+    /// </remarks>
+    struct CModbusSlaveHealth
+    {
+        enum
+        {
+            online,
+            offline,
+        };
+        uint8_t state; // online or offline
+        uint8_t failures; // consecutive transactions which timed out
+        system_tick_t offline_ticks; // when the slave went offline or was last probed
+        uint32_t transactions; // transactions sent to this slave
+        uint32_t responses; // responses received, including exceptions
+        uint32_t exceptions; // exception responses received
+        uint32_t timeouts; // requests which were not answered, including retries
+        uint32_t retries; // requests sent again after a timeout
+        uint32_t skipped; // transactions which were not sent because the slave was offline
+        system_tick_t srtt; // smoothed round trip time, in ticks scaled by 8
+        system_tick_t rttvar; // round trip time variance, in ticks scaled by 4
+        system_tick_t rto; // adaptive response timeout in ticks, or 0 until the first response
+
+        CModbusSlaveHealth() { clear(); }
+
+        /// <summary>
+        /// Returns the slave online and resets the counters.
+        /// </summary>
+        void clear()
+        {
+            state = online;
+            failures = 0;
+            offline_ticks = 0;
+            transactions = responses = exceptions = timeouts = retries = skipped = 0;
+            srtt = rttvar = rto = 0;
+        }
+    };
+
+    /// <summary>
+    /// This class implements a non-blocking Modbus master.
+    /// </summary>
+    /// <remarks>
+    /// Transactions are submitted to a queue and sent one at a time through
+    /// the framer, which must have its station address set to 0.  The
+    /// master registers itself as the framer's handler.  Both the framer's
+    /// poll() and the master's poll() must be called from the main loop,
+    /// and the next timeout is the smaller of the two results.
+    ///
+    /// A request which is not answered within the response timeout is sent
+    /// again up to the configured number of retries.  The delay before each
+    /// retry starts at the backoff time and doubles on each attempt, up to
+    /// the maximum backoff.  Broadcast requests are never retried, and
+    /// complete after the turnaround delay.
+    ///
+    /// If a health table is given using set_health_table(), slaves which
+    /// stop answering are marked offline so that most of the bus time goes
+    /// to the slaves which respond.  See CModbusSlaveHealth.
+    /// </remarks>
+    class CModbusMaster : public IFrameHandler
+    {
+    public:
+        CModbusMaster(IFramer* framer, ITimeProvider* timer);
+        virtual void frame_ready(IFramer* framer);
+
+        /// <summary>
+        /// Sends queued requests and handles the response timeouts.
+        /// </summary>
+        /// <returns>
+        /// The next timeout, in system ticks, or 0 if none.
+        /// </returns>
+        /// <remarks>
+        /// This follows the same rules as IFramer::poll(), and must also be
+        /// called after submit().
+        /// </remarks>
+        unsigned long poll();
+
+        /// <summary>
+        /// Adds a transaction to the end of the queue.
+        /// </summary>
+        /// <returns>
+        /// false if the transaction is already queued or active, or the request is empty.
+        /// </returns>
+        bool submit(CModbusTransaction* transaction);
+
+        /// <summary>
+        /// Returns true if a transaction is active or queued.
+        /// </summary>
+        bool busy() const { return m_active || m_queue_head; }
+
+        /// <summary>
+        /// Sets the time to wait for a response, in microseconds.
+        /// </summary>
+        void set_timeout(unsigned long timeout_us) { m_timeout = to_ticks(timeout_us); }
+
+        /// <summary>
+        /// Enables adaptive response timeouts for the slaves in the health table, in microseconds.
+        /// </summary>
+        /// <remarks>
+        /// The timeout for each slave is estimated from the measured round
+        /// trip times and kept between the floor and the ceiling.  The round
+        /// trip time is measured from when the request is handed to the
+        /// framer, so it includes the inter-frame delay and the time to send
+        /// the request and the response.  The fixed timeout set using
+        /// set_timeout() is used until a slave has answered, and for slaves
+        /// which are not tracked.  A ceiling of 0 disables adaptive
+        /// timeouts.
+        /// </remarks>
+        void set_adaptive_timeout(unsigned long floor_us, unsigned long ceiling_us);
+
+        /// <summary>
+        /// Sets the number of times an unanswered request is sent again.
+        /// </summary>
+        void set_retries(uint8_t retries) { m_retries = retries; }
+
+        /// <summary>
+        /// Sets the delay before the first retry and the upper bound it doubles up to, in microseconds.
+        /// </summary>
+        void set_backoff(unsigned long backoff_us, unsigned long max_backoff_us);
+
+        /// <summary>
+        /// Sets the delay after a broadcast request before the next request is sent, in microseconds.
+        /// </summary>
+        void set_turnaround_delay(unsigned long delay_us) { m_turnaround = to_ticks(delay_us); }
+
+        /// <summary>
+        /// Sets the number of consecutive timed out transactions before a slave is marked offline.
+        /// </summary>
+        /// <remarks>
+        /// A value of 0 never marks a slave offline.
+        /// </remarks>
+        void set_offline_threshold(uint8_t failures) { m_offline_threshold = failures; }
+
+        /// <summary>
+        /// Sets how often a request is let through to an offline slave, in microseconds.
+        /// </summary>
+        void set_probe_interval(unsigned long interval_us) { m_probe_interval = to_ticks(interval_us); }
+
+        /// <summary>
+        /// Sets the table used to track the health of each slave, or NULL to disable tracking.
+        /// </summary>
+        /// <remarks>
+        /// The table is indexed by the slave address, so it must have 248
+        /// entries to track every slave.  Slaves with an address beyond the
+        /// end of the table are always treated as online.
+        /// </remarks>
+        void set_health_table(CModbusSlaveHealth* table, size_t count);
+
+        /// <summary>
+        /// Returns the health of the given slave, or NULL if it is not tracked.
+        /// </summary>
+        const CModbusSlaveHealth* health(uint8_t address) const { return slave_health(address); }
+
+        /// <summary>
+        /// Marks the given slave online and resets its counters.
+        /// </summary>
+        void reset_health(uint8_t address);
+    private:
+        enum state_type
+        {
+            state_idle,
+            state_send,
+            state_wait,
+            state_backoff,
+            state_turnaround,
+        };
+        system_tick_t to_ticks(unsigned long us) const;
+        CModbusSlaveHealth* slave_health(uint8_t address) const { return m_health && address && address < m_health_count ? m_health + address : NULL; }
+        system_tick_t backoff_delay() const;
+        system_tick_t response_timeout() const;
+        void update_rtt(CModbusSlaveHealth* health, system_tick_t rtt);
+        bool skip(CModbusTransaction* transaction);
+        void failed();
+        void complete(uint8_t status);
+        IFramer* m_framer;
+        ITimeProvider* m_timer;
+        CModbusTransaction* m_queue_head;
+        CModbusTransaction* m_queue_tail;
+        CModbusTransaction* m_active;
+        CModbusSlaveHealth* m_health;
+        size_t m_health_count;
+        state_type m_state;
+        system_tick_t m_last_ticks;
+        system_tick_t m_timeout, m_backoff, m_max_backoff, m_turnaround, m_probe_interval;
+        system_tick_t m_min_rto, m_max_rto, m_attempt_timeout;
+        uint8_t m_retries, m_offline_threshold;
+        uint8_t m_function;
+        bool m_probe;
+    };
+}
+#endif
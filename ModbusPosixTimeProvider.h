@@ -0,0 +1,31 @@
+#ifndef __ModbusPosixTimeProvider_h__
+#define __ModbusPosixTimeProvider_h__
+#include "ModbusInterface.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <time.h>
+namespace ModbusPotato
+{
+    /// <summary>
+    /// This class provides a microsecond level clock for POSIX hosts.
+    /// </summary>
+    /// <remarks>
+    /// The monotonic clock is truncated to system_tick_t, so it rolls over
+    /// to 0 at the maximum value as required by ITimeProvider.
+    /// </remarks>
+    class CModbusPosixTimeProvider : public ITimeProvider
+    {
+    public:
+        virtual ModbusPotato::system_tick_t ticks() const
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            return (system_tick_t)((uint64_t)now.tv_sec * 1000000u + now.tv_nsec / 1000);
+        }
+        virtual unsigned long microseconds_per_tick() const
+        {
+            return 1;
+        }
+    };
+}
+#endif
+#endif
@@ -1,4 +1,5 @@
 #include "ModbusRTU.h"
+#include "ModbusCRC.h"
 #ifdef _MSC_VER
 #undef max
 #endif
@@ -28,25 +29,6 @@ namespace ModbusPotato
     static_assert(ELAPSED(~(system_tick_t)0, 0) == 1, "elapsed time roll-over check failed");
     #endif
 
-    // accumulate the next byte of the CRC
-    enum { POLY = 0xa001 };
-    static inline uint16_t crc16_modbus(uint16_t crc, const uint8_t* buffer, size_t len)
-    {
-        for (; len; buffer++, len--)
-        {
-            crc ^= *buffer;
-            crc = (crc & 1) != 0 ? ((crc >> 1) ^ POLY) : (crc >> 1);
-            crc = (crc & 1) != 0 ? ((crc >> 1) ^ POLY) : (crc >> 1);
-            crc = (crc & 1) != 0 ? ((crc >> 1) ^ POLY) : (crc >> 1);
-            crc = (crc & 1) != 0 ? ((crc >> 1) ^ POLY) : (crc >> 1);
-            crc = (crc & 1) != 0 ? ((crc >> 1) ^ POLY) : (crc >> 1);
-            crc = (crc & 1) != 0 ? ((crc >> 1) ^ POLY) : (crc >> 1);
-            crc = (crc & 1) != 0 ? ((crc >> 1) ^ POLY) : (crc >> 1);
-            crc = (crc & 1) != 0 ? ((crc >> 1) ^ POLY) : (crc >> 1);
-        }
-        return crc;
-    }
-
     CModbusRTU::CModbusRTU(IStream* stream, ITimeProvider* timer, uint8_t* buffer, size_t buffer_max)
         :   m_stream(stream)
         ,   m_timer(timer)
@@ -55,6 +37,9 @@ namespace ModbusPotato
         ,   m_buffer_len()
         ,   m_handler()
         ,   m_checksum()
+        ,   m_tx_checksum()
+        ,   m_tx_checksum_valid()
+        ,   m_predict_length()
         ,   m_station_address()
         ,   m_frame_address()
         ,   m_buffer_tx_pos()
@@ -62,10 +47,26 @@ namespace ModbusPotato
         ,   m_last_ticks()
         ,   m_T3p5()
         ,   m_T1p5()
+        ,   m_pool()
+        ,   m_pool_base(buffer)
+        ,   m_pool_count()
+        ,   m_buffer_index()
+        ,   m_rx_state(rx_idle)
+        ,   m_rx_index()
+        ,   m_rx_address()
+        ,   m_rx_checksum()
+        ,   m_rx_len()
+        ,   m_queue_head()
+        ,   m_queue_count()
+        ,   m_queue_mask()
+#if MODBUS_FLIGHT_RECORDER
+        ,   m_recorder()
+        ,   m_ticks()
+#endif
     {
         if (!m_stream || !m_timer || !m_buffer || m_buffer_max < 3)
         {
-            m_state = state_exception;
+            enter_state(state_exception);
             return;
         }
 
@@ -73,20 +74,24 @@ namespace ModbusPotato
         setup(default_baud_rate);
 
         // update the system tick count
-        m_last_ticks = m_timer->ticks();
+        m_last_ticks = ticks();
     }
 
-    void CModbusRTU::setup(unsigned long baud)
+    void CModbusRTU::setup(unsigned long baud, bool fast_timing)
     {
         // calculate the intercharacter delays in microseconds
-        unsigned int t3p5 = default_3t5_period;
-        unsigned int t1p5 = default_1t5_period;
-        if (baud && baud <= 19200)
+        unsigned long t3p5 = default_3t5_period;
+        unsigned long t1p5 = default_1t5_period;
+        if (baud && (baud <= 19200 || fast_timing))
         {
-            t3p5 = CALC_INTER_CHAR_DELAY(3500000, baud);
-            t1p5 = CALC_INTER_CHAR_DELAY(1500000, baud);
+            t3p5 = CALC_INTER_CHAR_DELAY(3500000ul, baud);
+            t1p5 = CALC_INTER_CHAR_DELAY(1500000ul, baud);
         }
+        set_delays(t3p5, t1p5);
+    }
 
+    void CModbusRTU::set_delays(unsigned long t3p5, unsigned long t1p5)
+    {
         // convert the intercharacter delays from microseconds to system ticks
         //
         // Note: on systems that have poor resolution timers, we must round
@@ -112,6 +117,300 @@ namespace ModbusPotato
         m_T1p5 = m_T1p5 < minimum_tick_count ? minimum_tick_count : m_T1p5;
     }
 
+    void CModbusRTU::set_receive_pool(uint8_t* buffers, size_t count)
+    {
+        // the pool is only used if there is at least one extra buffer
+        if (!buffers || !count)
+            return;
+        m_pool = buffers;
+        m_pool_count = (uint8_t)(count < max_pool_buffers - 1 ? count + 1 : (size_t)max_pool_buffers);
+    }
+
+    bool CModbusRTU::predicted_end(const uint8_t* pdu, size_t len, uint16_t checksum) const
+    {
+        // the CRC is accumulated as the bytes arrive, so it is checked first
+        if (!m_predict_length || checksum != 0 || len < min_pdu_length)
+            return false;
+
+        // a slave only expects requests, while a master may see either
+        size_t predicted = frame_length(pdu, len - CRC_LEN, false);
+        if (predicted && predicted + CRC_LEN == len)
+            return true;
+        if (m_station_address)
+            return false;
+        predicted = frame_length(pdu, len - CRC_LEN, true);
+        return predicted && predicted + CRC_LEN == len;
+    }
+
+    unsigned long CModbusRTU::receive_background()
+    {
+        // receive frames into a free pool buffer while the application holds m_buffer
+        //
+        // This follows the same rules as the dump, idle and receive states
+        // of the main state machine, but leaves m_state alone.  Completed
+        // frames are queued for the idle state to hand to the application.
+        //
+        system_tick_t elapsed = ELAPSED(m_last_ticks, ticks());
+        switch (m_rx_state)
+        {
+        case rx_idle: // waiting for the start of a frame
+            {
+                int ec = m_stream->read(&m_rx_address, 1);
+                if (!ec)
+                    return 0; // waiting for an event
+
+                // find a free buffer
+                uint8_t busy = (uint8_t)(m_queue_mask | (1 << m_buffer_index));
+                for (m_rx_index = 0; m_rx_index < m_pool_count && (busy & (1 << m_rx_index)); ++m_rx_index)
+                    ;
+
+                // dump the frame if the character is invalid, not for us or there is nowhere to put it
+                if (ec < 0 || (m_rx_address && m_station_address && m_rx_address != m_station_address) || m_rx_index == m_pool_count)
+                {
+                    if (ec > 0 && m_rx_index == m_pool_count)
+                        MODBUS_STATISTICS_INC(m_statistics.overruns);
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
+                    m_rx_state = rx_dump;
+                    m_last_ticks = ticks();
+                    return m_T3p5; // waiting for T3.5 timer
+                }
+
+                // start receiving the frame
+                m_rx_checksum = crc16_modbus(crc16_modbus_init, &m_rx_address, 1);
+                MODBUS_STATISTICS_INC(m_statistics.rx_bytes);
+                m_rx_len = 0;
+                m_rx_state = rx_receive;
+                m_last_ticks = ticks();
+                elapsed = 0;
+            }
+            MODBUS_FALLTHROUGH; // receive the rest of the frame
+        case rx_receive: // actively receiving a frame
+            {
+                uint8_t* buffer = pool_buffer(m_rx_index);
+                if (int ec = m_stream->read(buffer + m_rx_len, m_buffer_max - m_rx_len))
+                {
+                    // check for comm errors or if the inter-character delay has been exceeded
+                    if (ec < 0 || elapsed >= (m_T1p5 + quantization_rounding_count))
+                    {
+                        if (ec > 0)
+                            MODBUS_STATISTICS_INC(m_statistics.t1p5_breaks);
+                        MODBUS_STATISTICS_INC(m_statistics.dumps);
+                        m_rx_state = rx_dump;
+                        m_last_ticks = ticks();
+                        return m_T3p5; // waiting for T3.5 timer
+                    }
+
+                    // update the CRC and advance the buffer pointer
+                    m_rx_checksum = crc16_modbus(m_rx_checksum, buffer + m_rx_len, ec);
+                    m_rx_len += ec;
+                    MODBUS_STATISTICS_ADD(m_statistics.rx_bytes, ec);
+                    m_last_ticks = ticks();
+                    elapsed = 0;
+                }
+
+                // check if there is still input even after we have filled the buffer
+                if (m_buffer_max == m_rx_len && m_stream->read(NULL, (size_t)-1))
+                {
+                    MODBUS_STATISTICS_INC(m_statistics.overruns);
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
+                    m_rx_state = rx_dump;
+                    m_last_ticks = ticks();
+                    return m_T3p5; // waiting for T3.5 timer
+                }
+
+                // check if the T3.5 timer has elapsed, unless the frame already has its predicted length
+                if (elapsed < m_T3p5 && !predicted_end(buffer, m_rx_len, m_rx_checksum))
+                    return m_T3p5 - elapsed; // wait for the timer to elapse
+
+                // drop the frame if the CRC failed
+                m_rx_state = rx_idle;
+                if (m_rx_len < min_pdu_length || m_rx_checksum != 0)
+                {
+                    MODBUS_STATISTICS_INC(m_statistics.checksum_errors);
+                    return 0; // waiting for an event
+                }
+
+                // crc passed, queue the frame without the CRC
+                uint8_t tail = (uint8_t)((m_queue_head + m_queue_count) % max_pool_buffers);
+                m_queue_index[tail] = m_rx_index;
+                m_queue_address[tail] = m_rx_address;
+                m_queue_len[tail] = m_rx_len - CRC_LEN;
+                m_queue_count++;
+                m_queue_mask |= (uint8_t)(1 << m_rx_index);
+                MODBUS_STATISTICS_INC(m_statistics.rx_frames);
+                if (buffer[0] & 0x80)
+                    MODBUS_STATISTICS_INC(m_statistics.exceptions);
+                return 0; // waiting for an event
+            }
+        case rx_dump: // dump any unwanted incoming data
+            {
+                if (m_stream->read(NULL, (size_t)-1))
+                {
+                    m_last_ticks = ticks();
+                    return m_T3p5; // waiting for T3.5 timer
+                }
+                if (elapsed >= m_T3p5)
+                {
+                    m_rx_state = rx_idle;
+                    return 0; // waiting for an event
+                }
+                return m_T3p5 - elapsed;
+            }
+        }
+        return 0;
+    }
+
+    unsigned long CModbusRTU::poll_handler_queue(unsigned long timeout)
+    {
+        // give the handler a chance to send a deferred response
+        //
+        // The timeout is that of the background receiver, which has
+        // already been polled in this pass.
+        //
+        if (m_handler)
+        {
+            state_type state = m_state;
+            m_handler->poll_queue(this);
+
+            // evaluate the switch statement again if the application sent or released the buffer
+            if (m_state != state)
+                return poll();
+        }
+        return timeout; // waiting for user
+    }
+
+    bool CModbusRTU::deadline(system_tick_t& ticks) const
+    {
+        // these are the same timers that poll() waits on, measured from the last latched event
+        switch (m_state)
+        {
+        case state_dump: // end of the unwanted data
+        case state_receive: // end of the frame
+        case state_tx_wait: // end of the inter-frame delay after our own frame
+            {
+                ticks = m_last_ticks + m_T3p5;
+                return true;
+            }
+        case state_tx_addr: // earliest legal instant to start transmitting
+            {
+                // a frame arriving in the background is finished first
+                if (m_pool_count && m_rx_state != rx_idle)
+                    break;
+
+                // once the delay has passed, poll() is waiting for room in the write buffer
+                if (ELAPSED(m_last_ticks, m_timer->ticks()) >= m_T3p5 + quantization_rounding_count)
+                    return false; // waiting on the stream
+                ticks = m_last_ticks + m_T3p5 + quantization_rounding_count;
+                return true;
+            }
+        }
+
+        // the background receiver is waiting for the end of a frame or of the unwanted data
+        if (m_pool_count && m_rx_state != rx_idle)
+        {
+            ticks = m_last_ticks + m_T3p5;
+            return true;
+        }
+        return false; // waiting on the stream or the application
+    }
+
+    const char* CModbusRTU::state_name(uint8_t state)
+    {
+        switch (state)
+        {
+        case state_exception: return "exception";
+        case state_dump: return "dump";
+        case state_idle: return "idle";
+        case state_frame_ready: return "frame_ready";
+        case state_queue: return "queue";
+        case state_collision: return "collision";
+        case state_receive: return "receive";
+        case state_tx_addr: return "tx_addr";
+        case state_tx_pdu: return "tx_pdu";
+        case state_tx_crc: return "tx_crc";
+        case state_tx_drain: return "tx_drain";
+        case state_tx_wait: return "tx_wait";
+        }
+        return NULL;
+    }
+
+    size_t CModbusRTU::frame_length(const uint8_t* pdu, size_t len, bool response)
+    {
+        // the function code decides the layout
+        if (!len)
+            return 1;
+        uint8_t function = pdu[0];
+        if (function == 0x08)
+        {
+            // diagnostics has a sub-function and one data word, except for return query data which echoes any number of bytes
+            if (len < 3)
+                return 3;
+            return pdu[1] || pdu[2] ? 5 : 0;
+        }
+        if (response)
+        {
+            // exception responses only have the exception code
+            if (function & 0x80)
+                return 2;
+            switch (function)
+            {
+            case 0x01: // read coils
+            case 0x02: // read discrete inputs
+            case 0x03: // read holding registers
+            case 0x04: // read input registers
+            case 0x0c: // get comm event log
+            case 0x11: // report server id
+            case 0x14: // read file record
+            case 0x15: // write file record
+            case 0x17: // read/write multiple registers
+                return len < 2 ? 2 : 2 + pdu[1]; // byte count
+            case 0x05: // write single coil
+            case 0x06: // write single register
+            case 0x0b: // get comm event counter
+            case 0x0f: // write multiple coils
+            case 0x10: // write multiple registers
+                return 5;
+            case 0x07: // read exception status
+                return 2;
+            case 0x16: // mask write register
+                return 7;
+            case 0x18: // read fifo queue
+                return len < 3 ? 3 : 3 + ((size_t)pdu[1] << 8 | pdu[2]); // 16-bit byte count
+            }
+        }
+        else
+        {
+            switch (function)
+            {
+            case 0x01: // read coils
+            case 0x02: // read discrete inputs
+            case 0x03: // read holding registers
+            case 0x04: // read input registers
+            case 0x05: // write single coil
+            case 0x06: // write single register
+                return 5;
+            case 0x07: // read exception status
+            case 0x0b: // get comm event counter
+            case 0x0c: // get comm event log
+            case 0x11: // report server id
+                return 1;
+            case 0x0f: // write multiple coils
+            case 0x10: // write multiple registers
+                return len < 6 ? 6 : 6 + pdu[5]; // byte count after the address and quantity
+            case 0x14: // read file record
+            case 0x15: // write file record
+                return len < 2 ? 2 : 2 + pdu[1]; // byte count
+            case 0x16: // mask write register
+                return 7;
+            case 0x17: // read/write multiple registers
+                return len < 10 ? 10 : 10 + pdu[9]; // byte count after the read and write ranges
+            case 0x18: // read fifo queue
+                return 3;
+            }
+        }
+        return 0; // unknown or user defined function code
+    }
+
     unsigned long CModbusRTU::poll()
     {
         // state machine for handling incoming data
@@ -169,12 +468,12 @@ namespace ModbusPotato
 dump:
             {
                 // if not, check how much time has elapsed
-                system_tick_t elapsed = ELAPSED(m_last_ticks, m_timer->ticks());
+                system_tick_t elapsed = ELAPSED(m_last_ticks, ticks());
 
                 // if the timer is done, then go to the idle state
                 if (elapsed >= m_T3p5)
                 {
-                    m_state = state_idle;
+                    enter_state(state_idle);
                     m_stream->communicationStatus(false, false);
                     goto idle; // waiting for an event
                 }
@@ -183,7 +482,7 @@ dump:
                 if (m_stream->read(NULL, (size_t)-1))
                 {
                     // reset the T3.5 timer
-                    m_last_ticks = m_timer->ticks();
+                    m_last_ticks = ticks();
                     return m_T3p5; // waiting for T3.5 timer
                 }
 
@@ -193,25 +492,51 @@ dump:
         case state_idle: // waiting for something to happen
 idle:       
             {
+                // with a buffer pool, all frames are received in the background
+                if (m_pool_count)
+                {
+                    unsigned long timeout = receive_background();
+                    if (!m_queue_count)
+                        return timeout; // waiting for an event
+
+                    // hand the oldest queued frame to the application by switching buffers
+                    uint8_t index = m_queue_index[m_queue_head];
+                    m_buffer_index = index;
+                    m_buffer = pool_buffer(index);
+                    m_buffer_len = m_queue_len[m_queue_head];
+                    m_frame_address = m_queue_address[m_queue_head];
+                    m_queue_head = (uint8_t)((m_queue_head + 1) % max_pool_buffers);
+                    m_queue_count--;
+                    m_queue_mask &= (uint8_t)~(1 << index);
+
+                    // move to the 'Frame Ready' state and execute the callback
+                    enter_state(state_frame_ready);
+                    if (m_handler)
+                        m_handler->frame_ready(this);
+                    return poll(); // jump to the start of the function to re-evalutate entire switch statement
+                }
+
                 if (int ec = m_stream->read(&m_frame_address, 1))
                 {
                     // make sure the character is valid
                     if (ec < 0 || (m_frame_address && m_station_address && m_frame_address != m_station_address))
                     {
                         // invalid character received - reset the timer and enter the 'dump' state.
-                        m_last_ticks = m_timer->ticks();
-                        m_state = state_dump;
+                        MODBUS_STATISTICS_INC(m_statistics.dumps);
+                        m_last_ticks = ticks();
+                        enter_state(state_dump);
                         m_stream->communicationStatus(true, false);
                         goto dump; // enter the dump state
                     }
 
                     // initialize the CRC and accumulate the frame address
-                    m_checksum = crc16_modbus(0xffff, &m_frame_address, 1);
+                    m_checksum = crc16_modbus(crc16_modbus_init, &m_frame_address, 1);
+                    MODBUS_STATISTICS_INC(m_statistics.rx_bytes);
 
                     // broadcast or station address match, enter the receiving state
-                    m_state = state_receive;
+                    m_last_ticks = ticks();
+                    enter_state(state_receive);
                     m_buffer_len = 0;
-                    m_last_ticks = m_timer->ticks();
                     m_stream->communicationStatus(true, false);
                     goto receive; // enter the receive state
                 }
@@ -227,23 +552,40 @@ idle:
                 // re-transmitting, or there are multiple masters or slaves
                 // with the same address.
                 //
-                if (m_stream->read(NULL, (size_t)-1))
+                // With a buffer pool the new data is received in the
+                // background instead, while the application holds the buffer.
+                //
+                unsigned long timeout = 0;
+                if (m_pool_count)
+                {
+                    timeout = receive_background();
+                    if (m_state == state_frame_ready)
+                        return timeout; // waiting for user
+                }
+                else if (m_stream->read(NULL, (size_t)-1))
                 {
-                    m_state = state_collision;
-                    m_last_ticks = m_timer->ticks();
+                    MODBUS_STATISTICS_INC(m_statistics.collisions);
+                    m_last_ticks = ticks();
+                    enter_state(state_collision);
                     m_stream->communicationStatus(true, false);
                 }
-                return 0; // waiting for user
+
+                // the frame has not been acknowledged by the application yet
+                if (m_state == state_frame_ready)
+                    return 0; // waiting for user
+
+                // let the handler complete a deferred response
+                return poll_handler_queue(timeout);
             }
         case state_collision: // bus collision
             {
-                return 0; // waiting for user
+                return poll_handler_queue(m_pool_count ? receive_background() : 0);
             }
         case state_receive: // actively receiving new data
 receive:
             {
                 // check how much time has elapsed
-                system_tick_t elapsed = ELAPSED(m_last_ticks, m_timer->ticks());
+                system_tick_t elapsed = ELAPSED(m_last_ticks, ticks());
 
                 // check if there are any waiting characters
                 if (int ec = m_stream->read(m_buffer + m_buffer_len, m_buffer_max - m_buffer_len))
@@ -256,17 +598,21 @@ receive:
                     if (ec < 0 || elapsed >= (m_T1p5 + quantization_rounding_count))
                     {
                         // if so, reset the timer and enter the 'dump' state.
-                        m_last_ticks = m_timer->ticks();
-                        m_state = state_dump;
+                        if (ec > 0)
+                            MODBUS_STATISTICS_INC(m_statistics.t1p5_breaks);
+                        MODBUS_STATISTICS_INC(m_statistics.dumps);
+                        m_last_ticks = ticks();
+                        enter_state(state_dump);
                         goto dump; // enter the dump state
                     }
 
                     // update the CRC and advance the buffer pointer
                     m_checksum = crc16_modbus(m_checksum, m_buffer + m_buffer_len, ec);
                     m_buffer_len += ec;
+                    MODBUS_STATISTICS_ADD(m_statistics.rx_bytes, ec);
 
                     // reset the timer
-                    m_last_ticks = m_timer->ticks();
+                    m_last_ticks = ticks();
                     elapsed = 0;
                 }
 
@@ -274,13 +620,16 @@ receive:
                 if (m_buffer_max == m_buffer_len && m_stream->read(NULL, (size_t)-1))
                 {
                     // if so, reset the timer and enter the 'dump' state.
-                    m_last_ticks = m_timer->ticks();
-                    m_state = state_dump;
+                    MODBUS_STATISTICS_INC(m_statistics.overruns);
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
+                    m_last_ticks = ticks();
+                    enter_state(state_dump);
                     goto dump; // enter the dump state
                 }
 
-                // check if the T3.5 timer has elapsed
-                if (elapsed < m_T3p5)
+                // check if the T3.5 timer has elapsed, unless the frame already has its predicted length
+                bool predicted = elapsed < m_T3p5 && predicted_end(m_buffer, m_buffer_len, m_checksum);
+                if (elapsed < m_T3p5 && !predicted)
                     return m_T3p5 - elapsed; // wait for the timer to elapse
 
                 // check the CRC
@@ -295,18 +644,28 @@ receive:
                 if (m_buffer_len < min_pdu_length || m_checksum != 0)
                 {
                     // if the CRC failed, then dump the frame and go back to idle
-                    m_last_ticks = m_timer->ticks();
-                    m_state = state_idle;
+                    MODBUS_STATISTICS_INC(m_statistics.checksum_errors);
+                    m_last_ticks = ticks();
+                    enter_state(state_idle);
                     m_stream->communicationStatus(false, false);
                     goto idle; // enter the idle state
                 }
 
                 // crc passed, remove the two CRC bytes
                 m_buffer_len -= CRC_LEN;
+                MODBUS_STATISTICS_INC(m_statistics.rx_frames);
+                if (m_buffer[0] & 0x80)
+                    MODBUS_STATISTICS_INC(m_statistics.exceptions);
 
                 // move to the 'Frame Ready' state
-                m_state = state_frame_ready;
-                m_last_ticks = m_timer->ticks();
+                //
+                // Note: a predicted frame keeps the time of its last
+                // character, so that the T3.5 gap before the response is
+                // measured from there.
+                //
+                if (!predicted)
+                    m_last_ticks = ticks();
+                enter_state(state_frame_ready);
                 m_stream->communicationStatus(false, false);
 
                 // execute the callback
@@ -318,6 +677,14 @@ receive:
             }
         case state_tx_addr: // transmitting remote station address [RTU]
             {
+                // let a frame which started arriving in the background finish first
+                if (m_pool_count)
+                {
+                    unsigned long timeout = receive_background();
+                    if (m_rx_state != rx_idle)
+                        return timeout; // wait for the end of the frame
+                }
+
                 // dump any incoming data
                 //
                 // This should not happen and if it does then it's probably
@@ -328,8 +695,10 @@ receive:
                 if (m_stream->read(NULL, (size_t)-1))
                 {
                     // reset the timer and go to the dump state
-                    m_last_ticks = m_timer->ticks();
-                    m_state = state_dump;
+                    MODBUS_STATISTICS_INC(m_statistics.collisions);
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
+                    m_last_ticks = ticks();
+                    enter_state(state_dump);
                     m_stream->communicationStatus(true, false);
                     goto dump; // dump any remaining data
                 }
@@ -345,7 +714,7 @@ receive:
                 // does, the worse case will be an additional T3.5 + 2 count
                 // delay.
                 //
-                system_tick_t elapsed = ELAPSED(m_last_ticks, m_timer->ticks());
+                system_tick_t elapsed = ELAPSED(m_last_ticks, ticks());
                 if (elapsed < (m_T3p5 + quantization_rounding_count))
                     return m_T3p5 + quantization_rounding_count - elapsed; // waiting to send
 
@@ -355,14 +724,14 @@ receive:
                     // check if something bad happened
                     if (ec < 0)
                     {
-                        m_state = state_exception;
+                        enter_state(state_exception);
                         m_stream->communicationStatus(false, false);
                         return 0; // fatal exception
                     }
 
                     // address sent; update the CRC while we send the frame address and move to the 'TX PDU' state
-                    m_checksum = crc16_modbus(0xffff, &m_frame_address, 1);
-                    m_state = state_tx_pdu;
+                    m_checksum = m_tx_checksum_valid ? m_tx_checksum : crc16_modbus(crc16_modbus_init, &m_frame_address, 1);
+                    enter_state(state_tx_pdu);
                     m_buffer_tx_pos = 0;
                     goto tx_pdu;
                 }
@@ -378,13 +747,14 @@ tx_pdu:
                     // check if something bad happened
                     if (ec < 0)
                     {
-                        m_state = state_exception;
+                        enter_state(state_exception);
                         m_stream->communicationStatus(false, false);
                         return 0; // fatal exception
                     }
 
-                    // update the CRC while we send the bytes and advance the buffer tx position
-                    m_checksum = crc16_modbus(m_checksum, m_buffer + m_buffer_tx_pos, ec);
+                    // update the CRC while we send the bytes, unless it was given, and advance the buffer tx position
+                    if (!m_tx_checksum_valid)
+                        m_checksum = crc16_modbus(m_checksum, m_buffer + m_buffer_tx_pos, ec);
                     m_buffer_tx_pos += ec;
                 }
 
@@ -395,7 +765,8 @@ tx_pdu:
                 if (m_buffer_tx_pos == m_buffer_len)
                 {
                     // if so, enter the 'TX CRC' state
-                    m_state = state_tx_crc;
+                    m_tx_checksum_valid = false;
+                    enter_state(state_tx_crc);
                     m_buffer_tx_pos = 0;
                     goto tx_crc; // enter the 'TX CRC' state
                 }
@@ -417,7 +788,7 @@ tx_crc:
                     // check if something bad happened
                     if (ec < 0)
                     {
-                        m_state = state_exception;
+                        enter_state(state_exception);
                         m_stream->communicationStatus(false, false);
                         return 0; // fatal exception
                     }
@@ -433,7 +804,11 @@ tx_crc:
                 // check if we should enter the 'TX Drain' state
                 if (m_buffer_tx_pos == CRC_LEN)
                 {
-                    m_state = state_tx_drain;
+                    MODBUS_STATISTICS_INC(m_statistics.tx_frames);
+                    MODBUS_STATISTICS_ADD(m_statistics.tx_bytes, m_buffer_len + 1 + CRC_LEN);
+                    if (m_buffer[0] & 0x80)
+                        MODBUS_STATISTICS_INC(m_statistics.exceptions);
+                    enter_state(state_tx_drain);
                     goto tx_drain; // enter the 'TX Drain' state
                 }
 
@@ -452,8 +827,8 @@ tx_drain:
                     m_stream->txEnable(false);
 
                     // go to the tx wait state so we can wait for the T3.5 delay
-                    m_last_ticks = m_timer->ticks();
-                    m_state = state_tx_wait;
+                    m_last_ticks = ticks();
+                    enter_state(state_tx_wait);
                     m_stream->communicationStatus(false, false);
                     goto tx_wait;
                 }
@@ -467,23 +842,24 @@ tx_wait:
                 m_stream->read(NULL, (size_t)-1);
 
                 // check if the T3.5 timer has elapsed
-                system_tick_t elapsed = ELAPSED(m_last_ticks, m_timer->ticks());
+                system_tick_t elapsed = ELAPSED(m_last_ticks, ticks());
                 if (elapsed < m_T3p5)
                     return m_T3p5 - elapsed; // wait for the timer to elapse
 
                 // TX done! go to the idle state
-                m_state = state_idle;
+                enter_state(state_idle);
                 goto idle;
             }
         }
 
         // if we get here, then something terrible has happened such as memory corruption
-        m_state = state_exception;
+        enter_state(state_exception);
         return 0;
     }
 
     bool CModbusRTU::begin_send()
     {
+        record_ticks();
         switch (m_state)
         {
         case state_collision:
@@ -497,20 +873,32 @@ tx_wait:
         case state_idle:
         case state_frame_ready:
             {
-                m_state = state_queue; // set the state machine to the 'queue' state we the user can access the buffer
+                enter_state(state_queue); // set the state machine to the 'queue' state we the user can access the buffer
+                m_tx_checksum_valid = false;
                 return true;
             }
         }
         return false; // not ready to send
     }
 
+    bool CModbusRTU::set_checksum(uint16_t checksum)
+    {
+        // the checksum can only be given while the application holds the buffer
+        if (m_state != state_queue)
+            return false;
+        m_tx_checksum = checksum;
+        m_tx_checksum_valid = true;
+        return true;
+    }
+
     void CModbusRTU::send()
     {
+        record_ticks();
         // sanity check
         if (m_buffer_len >= buffer_max())
         {
             // buffer overflow - enter the 'exception' state
-            m_state = state_exception;
+            enter_state(state_exception);
             return;
         }
 
@@ -519,7 +907,7 @@ tx_wait:
         case state_queue: // buffer is ready
             {
                 // enter the transmit station address state
-                m_state = state_tx_addr;
+                enter_state(state_tx_addr);
                 m_stream->communicationStatus(false, true);
 
                 // enable the transmitter
@@ -533,13 +921,13 @@ tx_wait:
                 // Note: The timer should be set already when entering the
                 // collision state.
                 //
-                m_state = state_dump;
+                enter_state(state_dump);
                 return; // collision, abort transmission and dump any further incoming data
             }
         default:
             {
                 // invalid state, user probably didn't call begin_send()
-                m_state = state_exception;
+                enter_state(state_exception);
                 return; // invalid state - enter the 'exception' state
             }
         }
@@ -547,25 +935,26 @@ tx_wait:
 
     void CModbusRTU::finished()
     {
+        record_ticks();
         switch (m_state)
         {
         case state_frame_ready: // received
         case state_queue: // aborting begin_send()
             {
                 // acknowledge or abort the user lock on the buffer
-                m_state = state_idle;
+                enter_state(state_idle);
                 return; // ok
             }
         case state_collision: // bus collision
             {
                 // more data started when we were not expecting it
-                m_state = state_dump;
+                enter_state(state_dump);
                 return; // collision, dump any further incoming data
             }
         default:
             {
                 // invalid state
-                m_state = state_exception;
+                enter_state(state_exception);
                 return; // invalid state - enter the 'exception' state
             }
         }
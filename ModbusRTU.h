@@ -1,6 +1,7 @@
 #ifndef __ModbusPotato_ModbusRTU_h__
 #define __ModbusPotato_ModbusRTU_h__
 #include "ModbusInterface.h"
+#include "ModbusFlightRecorder.h"
 namespace ModbusPotato
 {
     /// <summary>
@@ -29,8 +30,72 @@ namespace ModbusPotato
         /// Notice that this method does NOT setup the serial link (i.e.
         /// Serial.begin(...)).  The baud rate is only needed to calculate
         /// the inter-character delays.
+        ///
+        /// Above 19200 baud the spec recommends fixed delays of 750us for
+        /// T1.5 and 1750us for T3.5, which are used unless fast_timing is
+        /// set.  With fast_timing the delays are calculated from the baud
+        /// rate at every speed, which is much shorter at high baud rates but
+        /// only works if every device on the link does the same, so it is
+        /// meant for private or point-to-point links.
         /// </remarks>
-        void setup(unsigned long baud);
+        void setup(unsigned long baud, bool fast_timing = false);
+
+        /// <summary>
+        /// Sets the T3.5 and T1.5 delays explicitly, in microseconds.
+        /// </summary>
+        /// <remarks>
+        /// This replaces the delays calculated by setup().  The delays are
+        /// rounded down to the timer resolution, with a minimum of two
+        /// ticks each.
+        /// </remarks>
+        void set_delays(unsigned long t3p5, unsigned long t1p5);
+
+        /// <summary>
+        /// Adds a pool of receive buffers so that new frames can arrive while the application holds one.
+        /// </summary>
+        /// <remarks>
+        /// The storage must hold 'count' buffers of buffer_max() bytes each,
+        /// and together with the buffer given to the constructor up to
+        /// max_pool_buffers buffers are used.  This must be called before
+        /// the first call to poll().
+        ///
+        /// With a pool, frames which arrive while the application holds the
+        /// buffer (in the frame ready or queue states) are received into a
+        /// free buffer and queued instead of being treated as a collision.
+        /// Each time the application releases its buffer, the oldest queued
+        /// frame is handed over by switching buffer() to it, without copying.
+        /// The application must therefore call buffer() again for each frame
+        /// rather than keeping the pointer.  If every buffer is in use, the
+        /// incoming frame is dropped and counted as an overrun.
+        ///
+        /// A frame that starts arriving before send() is called delays the
+        /// transmission until T3.5 after it ends, rather than aborting it.
+        /// </remarks>
+        void set_receive_pool(uint8_t* buffers, size_t count);
+
+        /// <summary>
+        /// Enables ending frames as soon as their predicted length has arrived with a valid CRC.
+        /// </summary>
+        /// <remarks>
+        /// Normally a frame is only complete after T3.5 of silence, which at
+        /// 9600 baud adds about 4ms before frame_ready() on the slave, and
+        /// again on the master for the response.  With this enabled, the
+        /// length of the frame is predicted from its function code and byte
+        /// count using frame_length(), and the frame is handed over as soon
+        /// as that many bytes have arrived and the CRC checks out.  Frames
+        /// with unknown or user defined function codes still end after T3.5.
+        ///
+        /// With a station address only requests are expected, and with a
+        /// station address of 0 (i.e. a master) either layout is accepted.
+        /// The T3.5 gap before the next transmission is still kept, but it
+        /// is measured from the last character of the frame, so a response
+        /// can start T3.5 after the request instead of twice that.
+        ///
+        /// This relies on every device on the link respecting the T3.5 gap
+        /// between frames, as the spec requires, since characters arriving
+        /// right after a predicted end start a new frame.
+        /// </remarks>
+        void set_predict_length(bool enable) { m_predict_length = enable; }
 
         virtual void set_handler(IFrameHandler* handler) { m_handler = handler; }
         virtual uint8_t station_address() const { return m_station_address; }
@@ -40,12 +105,58 @@ namespace ModbusPotato
         virtual void send();
         virtual void finished();
         virtual bool frame_ready() const { return m_state == state_frame_ready; }
+
+        /// <summary>
+        /// Returns true if the framer is waiting for the first character of a frame.
+        /// </summary>
+        bool idle() const { return m_state == state_idle && m_rx_state == rx_idle; }
         virtual uint8_t frame_address() const { return m_frame_address; }
         virtual void set_frame_address(uint8_t address) { m_frame_address = address; }
         virtual uint8_t* buffer() { return m_buffer; }
         virtual size_t buffer_len() const { return m_buffer_len; }
         virtual void set_buffer_len(size_t len) { m_buffer_len = len; }
         virtual size_t buffer_max() const { return m_buffer_max; }
+        virtual bool deadline(system_tick_t& ticks) const;
+        virtual bool set_checksum(uint16_t checksum);
+#if MODBUS_STATISTICS
+        virtual CModbusStatistics* statistics() { return &m_statistics; }
+#endif
+#if MODBUS_FLIGHT_RECORDER
+
+        /// <summary>
+        /// Sets the recorder for the state transitions, or NULL to stop recording.
+        /// </summary>
+        void set_flight_recorder(CModbusFlightRecorder* recorder) { m_recorder = recorder; }
+#endif
+
+        /// <summary>
+        /// Returns the name of a raw state value, for decoding the flight recorder.
+        /// </summary>
+        static const char* state_name(uint8_t state);
+
+        /// <summary>
+        /// Predicts the length of a PDU from its function code and byte count fields.
+        /// </summary>
+        /// <returns>
+        /// 0 if the function code is not known, or the length is not given by
+        /// the PDU, as for the diagnostics return query data sub-function,
+        /// which echoes any number of bytes.  Otherwise, if the value is
+        /// no more than 'len' it is the length of the PDU, and if it is more
+        /// than 'len' then at least that many bytes are needed before the
+        /// length can be told, and this must be called again once they have
+        /// arrived.
+        /// </returns>
+        /// <remarks>
+        /// The PDU starts with the function code, and excludes the station
+        /// address and the CRC.  Requests and responses have different
+        /// layouts for most function codes, so 'response' selects which one
+        /// is expected.
+        /// </remarks>
+        static size_t frame_length(const uint8_t* pdu, size_t len, bool response);
+        enum
+        {
+            max_pool_buffers = 8, // maximum number of receive buffers, including the one given to the constructor
+        };
     private:
         enum
         {
@@ -62,7 +173,9 @@ namespace ModbusPotato
         IFrameHandler* m_handler;
         uint8_t* m_buffer;
         size_t m_buffer_len, m_buffer_max;
-        uint16_t m_checksum;
+        uint16_t m_checksum, m_tx_checksum;
+        bool m_tx_checksum_valid;
+        bool m_predict_length;
         uint8_t m_station_address, m_frame_address;
         uint8_t m_buffer_tx_pos;
         enum state_type
@@ -80,9 +193,71 @@ namespace ModbusPotato
             state_tx_drain,
             state_tx_wait,
         };
+        // reads the system tick count, keeping it to time stamp the state transitions
+        system_tick_t ticks()
+        {
+#if MODBUS_FLIGHT_RECORDER
+            return m_ticks = m_timer->ticks();
+#else
+            return m_timer->ticks();
+#endif
+        }
+
+        // reads the clock for a transition made outside of poll(), but only if it will be recorded
+        void record_ticks()
+        {
+#if MODBUS_FLIGHT_RECORDER
+            if (m_recorder)
+                m_ticks = m_timer->ticks();
+#endif
+        }
+
+        // changes state, recording the transition with the last tick count read by the framer
+        void enter_state(state_type state)
+        {
+#if MODBUS_FLIGHT_RECORDER
+            if (m_recorder)
+                m_recorder->record(m_ticks, (uint8_t)m_state, (uint8_t)state, m_buffer_len);
+#endif
+            m_state = state;
+        }
         state_type m_state;
         system_tick_t m_last_ticks;
         system_tick_t m_T3p5, m_T1p5;
+
+        // receive buffer pool
+        //
+        // Note: buffer 0 is the one given to the constructor.  The
+        // background receiver runs whenever the pool is in use and the state
+        // machine is not transmitting.
+        //
+        enum rx_state_type
+        {
+            rx_idle,
+            rx_receive,
+            rx_dump,
+        };
+        uint8_t* pool_buffer(uint8_t index) const { return index ? m_pool + (index - 1) * m_buffer_max : m_pool_base; }
+        unsigned long receive_background();
+        unsigned long poll_handler_queue(unsigned long timeout);
+        bool predicted_end(const uint8_t* pdu, size_t len, uint16_t checksum) const;
+        uint8_t* m_pool;
+        uint8_t* m_pool_base;
+        uint8_t m_pool_count, m_buffer_index;
+        rx_state_type m_rx_state;
+        uint8_t m_rx_index, m_rx_address;
+        uint16_t m_rx_checksum;
+        size_t m_rx_len;
+        uint8_t m_queue_head, m_queue_count, m_queue_mask;
+        uint8_t m_queue_index[max_pool_buffers], m_queue_address[max_pool_buffers];
+        size_t m_queue_len[max_pool_buffers];
+#if MODBUS_STATISTICS
+        CModbusStatistics m_statistics;
+#endif
+#if MODBUS_FLIGHT_RECORDER
+        CModbusFlightRecorder* m_recorder;
+        system_tick_t m_ticks;
+#endif
     };
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,357 @@
+#include "ModbusRTUOverTCP.h"
+#include "ModbusRTU.h"
+#include "ModbusCRC.h"
+namespace ModbusPotato
+{
+    // macro to calculate the elapsed time in ticks, taking into account roll-overs
+    #define ELAPSED(start, end) ((system_tick_t)(end) - (system_tick_t)(start))
+
+    CModbusRTUOverTCP::CModbusRTUOverTCP(IStream* stream, ITimeProvider* timer, uint8_t* buffer, size_t buffer_max)
+        :   m_stream(stream)
+        ,   m_timer(timer)
+        ,   m_handler()
+        ,   m_buffer(buffer)
+        ,   m_buffer_len()
+        ,   m_buffer_max(buffer_max)
+        ,   m_checksum()
+        ,   m_station_address()
+        ,   m_frame_address()
+        ,   m_layouts()
+        ,   m_buffer_tx_pos()
+        ,   m_state(state_idle)
+        ,   m_last_ticks()
+        ,   m_timeout()
+    {
+        if (!m_stream || !m_timer || !m_buffer || m_buffer_max < 3)
+        {
+            m_state = state_exception;
+            return;
+        }
+
+        // set the default timeout
+        set_timeout(default_timeout);
+    }
+
+    void CModbusRTUOverTCP::set_timeout(unsigned int milliseconds)
+    {
+        m_timeout = milliseconds * 1000 / m_timer->microseconds_per_tick();
+    }
+
+    unsigned long CModbusRTUOverTCP::poll()
+    {
+        // state machine for handling incoming data
+        //
+        // This is the RTU state machine without the silent intervals: the
+        // end of a frame is found from its predicted length and CRC, and
+        // there is no dump or collision state since the next frame may
+        // already be waiting in the stream.  The only timer drops a partial
+        // frame once no more of it has arrived for the timeout.
+        //
+        // Reason for goto statements: re-evaluate switch case labels when
+        // changing states.
+        //
+        switch (m_state)
+        {
+        case state_exception: // fatal error - framer shut down
+            {
+                // do nothing
+                return 0;
+            }
+        case state_idle: // waiting for something to happen
+idle:
+            {
+                int ec = m_stream->read(&m_frame_address, 1);
+                if (!ec)
+                    return 0; // waiting for an event
+                if (ec < 0)
+                {
+                    // communication error - there's no way to find the next frame in what is left
+                    MODBUS_STATISTICS_INC(m_statistics.dumps);
+                    m_stream->read(NULL, (size_t)-1);
+                    return 0; // waiting for an event
+                }
+
+                // initialize the CRC and accumulate the frame address
+                //
+                // Note: a slave only expects requests, while a master or
+                // a slave answering every address may see either.
+                //
+                m_checksum = crc16_modbus(crc16_modbus_init, &m_frame_address, 1);
+                m_layouts = m_station_address ? layout_request : layout_request | layout_response;
+                m_buffer_len = 0;
+                MODBUS_STATISTICS_INC(m_statistics.rx_bytes);
+                m_state = state_receive;
+                m_last_ticks = m_timer->ticks();
+                m_stream->communicationStatus(true, false);
+            }
+            MODBUS_FALLTHROUGH; // receive the rest of the frame
+        case state_receive: // receiving the rest of the frame
+            {
+                for (;;)
+                {
+                    // find how many bytes the shortest of the possible layouts needs
+                    size_t want = 0;
+                    for (uint8_t layout = layout_request; layout <= layout_response; layout <<= 1)
+                    {
+                        if (!(m_layouts & layout))
+                            continue;
+                        size_t len = CModbusRTU::frame_length(m_buffer, m_buffer_len, layout == layout_response);
+                        if (!len)
+                        {
+                            // unknown or variable length function code; look for the end of the frame with the CRC instead
+                            m_layouts = (uint8_t)((m_layouts & ~layout) | layout_scan);
+                            continue;
+                        }
+                        if (len <= m_buffer_len)
+                        {
+                            // the length is known; the frame is complete once the CRC has arrived
+                            len += CRC_LEN;
+                            if (len <= m_buffer_len)
+                            {
+                                if (len == m_buffer_len && m_checksum == 0)
+                                    goto frame_complete;
+
+                                // bad CRC, or passed by a longer layout
+                                m_layouts &= (uint8_t)~layout;
+                                continue;
+                            }
+                        }
+                        if (!want || len < want)
+                            want = len;
+                    }
+
+                    // without a known length, the frame ends at the first byte which leaves the CRC at zero
+                    //
+                    // Note: the bytes are read one at a time so that a
+                    // following frame is left in the stream.  A frame whose
+                    // CRC never matches is dropped by the timeout, or by
+                    // the overrun check once it fills the buffer.
+                    //
+                    if (m_layouts & layout_scan)
+                    {
+                        if (m_checksum == 0 && m_buffer_len >= min_pdu_length + CRC_LEN)
+                            goto frame_complete;
+                        want = m_buffer_len + 1;
+                    }
+
+                    // check if the frame can't be received
+                    if (!want || want > m_buffer_max)
+                    {
+                        // dump whatever is waiting and go back to idle
+                        if (want)
+                            MODBUS_STATISTICS_INC(m_statistics.overruns);
+                        else
+                            MODBUS_STATISTICS_INC(m_statistics.checksum_errors);
+                        MODBUS_STATISTICS_INC(m_statistics.dumps);
+                        m_stream->read(NULL, (size_t)-1);
+                        m_state = state_idle;
+                        m_stream->communicationStatus(false, false);
+                        return 0; // waiting for an event
+                    }
+
+                    // read up to the end of the shortest layout, leaving any following frame in the stream
+                    int ec = m_stream->read(m_buffer + m_buffer_len, want - m_buffer_len);
+                    if (!ec)
+                    {
+                        // drop the partial frame if the rest of it hasn't arrived in time
+                        system_tick_t elapsed = ELAPSED(m_last_ticks, m_timer->ticks());
+                        if (elapsed < m_timeout)
+                            return m_timeout - elapsed; // waiting for the rest of the frame
+                        MODBUS_STATISTICS_INC(m_statistics.t1p5_breaks);
+                        m_state = state_idle;
+                        m_stream->communicationStatus(false, false);
+                        goto idle; // enter the 'idle' state
+                    }
+                    if (ec < 0)
+                    {
+                        MODBUS_STATISTICS_INC(m_statistics.dumps);
+                        m_stream->read(NULL, (size_t)-1);
+                        m_state = state_idle;
+                        m_stream->communicationStatus(false, false);
+                        return 0; // waiting for an event
+                    }
+                    m_checksum = crc16_modbus(m_checksum, m_buffer + m_buffer_len, ec);
+                    m_buffer_len += ec;
+                    m_last_ticks = m_timer->ticks();
+                    MODBUS_STATISTICS_ADD(m_statistics.rx_bytes, ec);
+                }
+
+frame_complete:
+                // crc passed, remove the two CRC bytes
+                m_buffer_len -= CRC_LEN;
+                m_stream->communicationStatus(false, false);
+
+                // discard frames for other stations
+                if (m_frame_address && m_station_address && m_frame_address != m_station_address)
+                {
+                    m_state = state_idle;
+                    goto idle;
+                }
+                MODBUS_STATISTICS_INC(m_statistics.rx_frames);
+                if (m_buffer[0] & 0x80)
+                    MODBUS_STATISTICS_INC(m_statistics.exceptions);
+
+                // move to the 'Frame Ready' state and execute the callback
+                m_state = state_frame_ready;
+                if (m_handler)
+                    m_handler->frame_ready(this);
+
+                // evaluate the switch statement again in case something has changed
+                return poll(); // jump to the start of the function to re-evalutate entire switch statement
+            }
+        case state_frame_ready: // waiting for the application layer to process the frame
+            {
+                // any following frames wait in the stream until the buffer is released
+                return 0; // waiting for user
+            }
+        case state_queue: // waiting for the application layer to create frame for transmission
+            {
+                if (m_handler)
+                {
+                    m_handler->poll_queue(this);
+
+                    // evaluate the switch statement again if the application sent or released the buffer
+                    if (m_state != state_queue)
+                        return poll();
+                }
+                return 0; // waiting for user
+            }
+        case state_tx_addr: // transmitting remote station address
+            {
+                if (int ec = m_stream->write(&m_frame_address, 1))
+                {
+                    // check if something bad happened
+                    if (ec < 0)
+                    {
+                        m_state = state_exception;
+                        m_stream->communicationStatus(false, false);
+                        return 0; // fatal exception
+                    }
+
+                    // address sent; update the CRC while we send the frame address and move to the 'TX PDU' state
+                    m_checksum = crc16_modbus(crc16_modbus_init, &m_frame_address, 1);
+                    m_state = state_tx_pdu;
+                    m_buffer_tx_pos = 0;
+                    goto tx_pdu;
+                }
+                return 0; // waiting for room in the write buffer
+            }
+        case state_tx_pdu: // transmitting frame PDU
+tx_pdu:
+            {
+                // send the next chunk
+                if (m_buffer_tx_pos != m_buffer_len)
+                {
+                    int ec = m_stream->write(m_buffer + m_buffer_tx_pos, m_buffer_len - m_buffer_tx_pos);
+                    if (ec < 0)
+                    {
+                        m_state = state_exception;
+                        m_stream->communicationStatus(false, false);
+                        return 0; // fatal exception
+                    }
+
+                    // update the CRC while we send the bytes and advance the buffer tx position
+                    m_checksum = crc16_modbus(m_checksum, m_buffer + m_buffer_tx_pos, ec);
+                    m_buffer_tx_pos += ec;
+                }
+
+                // check if we should start sending the CRC
+                if (m_buffer_tx_pos == m_buffer_len)
+                {
+                    m_state = state_tx_crc;
+                    m_buffer_tx_pos = 0;
+                    goto tx_crc; // enter the 'TX CRC' state
+                }
+                return 0; // waiting for room in the write buffer
+            }
+        case state_tx_crc: // transmitting the frame CRC
+tx_crc:
+            {
+                while (m_buffer_tx_pos != CRC_LEN)
+                {
+                    // write the next byte in the CRC
+                    uint8_t ch = (uint8_t)m_checksum;
+                    int ec = m_stream->write(&ch, 1);
+                    if (!ec)
+                        return 0; // waiting for room in the write buffer
+                    if (ec < 0)
+                    {
+                        m_state = state_exception;
+                        m_stream->communicationStatus(false, false);
+                        return 0; // fatal exception
+                    }
+
+                    // advance the high byte of the CRC to the low byte and start again
+                    m_checksum >>= 8;
+                    m_buffer_tx_pos++;
+                }
+
+                // done; there is no inter-frame delay, so the next frame may be received right away
+                MODBUS_STATISTICS_INC(m_statistics.tx_frames);
+                MODBUS_STATISTICS_ADD(m_statistics.tx_bytes, m_buffer_len + 1 + CRC_LEN);
+                if (m_buffer[0] & 0x80)
+                    MODBUS_STATISTICS_INC(m_statistics.exceptions);
+                m_state = state_idle;
+                m_stream->communicationStatus(false, false);
+                goto idle;
+            }
+        }
+
+        // if we get here, then something terrible has happened such as memory corruption
+        m_state = state_exception;
+        return 0;
+    }
+
+    bool CModbusRTUOverTCP::begin_send()
+    {
+        switch (m_state)
+        {
+        case state_queue:
+            {
+                return true; // already in the queue state
+            }
+        case state_idle:
+        case state_frame_ready:
+            {
+                m_state = state_queue; // set the state machine to the 'queue' state so the user can access the buffer
+                return true;
+            }
+        }
+        return false; // not ready to send
+    }
+
+    void CModbusRTUOverTCP::send()
+    {
+        // sanity check
+        if (m_buffer_len >= buffer_max() || m_state != state_queue)
+        {
+            // buffer overflow, or the user didn't call begin_send() - enter the 'exception' state
+            m_state = state_exception;
+            return;
+        }
+
+        // enter the transmit station address state
+        m_state = state_tx_addr;
+        m_stream->communicationStatus(false, true);
+    }
+
+    void CModbusRTUOverTCP::finished()
+    {
+        switch (m_state)
+        {
+        case state_frame_ready: // received
+        case state_queue: // aborting begin_send()
+            {
+                // acknowledge or abort the user lock on the buffer
+                m_state = state_idle;
+                return; // ok
+            }
+        default:
+            {
+                // invalid state
+                m_state = state_exception;
+                return; // invalid state - enter the 'exception' state
+            }
+        }
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef __ModbusPotato_ModbusRTUOverTCP_h__
+#define __ModbusPotato_ModbusRTUOverTCP_h__
+#include "ModbusInterface.h"
+namespace ModbusPotato
+{
+    /// <summary>
+    /// This class handles RTU frames carried over a TCP connection, i.e. through a serial to TCP bridge.
+    /// </summary>
+    /// <remarks>
+    /// See the IFramer interface for a complete description of the public
+    /// methods.
+    ///
+    /// This is the framing used by 'modpoll -m enc' and by terminal
+    /// servers: the same address, PDU and CRC as CModbusRTU, but without
+    /// the T1.5 and T3.5 gaps, which do not survive the trip through TCP.
+    /// Instead, the length of each frame is predicted from its function
+    /// code and byte count fields using CModbusRTU::frame_length(), and
+    /// the frame is complete as soon as that many bytes have arrived with a
+    /// valid CRC.  The only timer is the receive timeout: a partial frame
+    /// is dropped once none of the rest of it has arrived for that long,
+    /// so a truncated frame can't swallow the start of the next one.
+    /// Otherwise the framer only needs to be polled when the stream has
+    /// data or room.
+    ///
+    /// Only the bytes of the current frame are read from the stream, so
+    /// several frames arriving in one segment are handed to the
+    /// application one at a time, and a master may send its next request
+    /// before the response to the previous one.  The stream should buffer
+    /// its input, since a frame is read in a few small pieces.
+    ///
+    /// With a station address, only requests are expected.  With a station
+    /// address of 0, as on a master, each frame may be either a request or
+    /// a response, and the layout whose CRC matches is used.  Frames for
+    /// other stations are received in full and then discarded.
+    ///
+    /// A frame whose length can't be predicted, i.e. with a user defined
+    /// function code or a diagnostics echo, ends at the first byte which
+    /// leaves its CRC at zero, once it holds at least a function code and
+    /// one more byte.  A frame with a known length but a bad CRC can't be
+    /// skipped, so any data waiting in the stream is dumped to find the
+    /// start of the next frame.
+    /// </remarks>
+    class CModbusRTUOverTCP : public IFramer
+    {
+    public:
+        /// <summary>
+        /// Constructor for the RTU over TCP framer.
+        /// </summary>
+        CModbusRTUOverTCP(IStream* stream, ITimeProvider* timer, uint8_t* buffer, size_t buffer_max);
+
+        /// <summary>
+        /// Sets the receive timeout, in milliseconds
+        /// </summary>
+        /// <remarks>
+        /// The poll() method must be called and the timer adjusted according
+        /// to the semantics described in IFramer::poll() for the new timeout
+        /// to take effect.
+        /// </remarks>
+        void set_timeout(unsigned int milliseconds);
+
+        virtual void set_handler(IFrameHandler* handler) { m_handler = handler; }
+        virtual uint8_t station_address() const { return m_station_address; }
+        virtual void set_station_address(uint8_t address) { m_station_address = address; }
+        virtual unsigned long poll();
+        virtual bool begin_send();
+        virtual void send();
+        virtual void finished();
+        virtual bool frame_ready() const { return m_state == state_frame_ready; }
+        virtual uint8_t frame_address() const { return m_frame_address; }
+        virtual void set_frame_address(uint8_t address) { m_frame_address = address; }
+        virtual uint8_t* buffer() { return m_buffer; }
+        virtual size_t buffer_len() const { return m_buffer_len; }
+        virtual void set_buffer_len(size_t len) { m_buffer_len = len; }
+        virtual size_t buffer_max() const { return m_buffer_max; }
+#if MODBUS_STATISTICS
+        virtual CModbusStatistics* statistics() { return &m_statistics; }
+#endif
+    private:
+        enum
+        {
+            CRC_LEN = 2,
+            min_pdu_length = 2, // minimum PDU length for a frame found by its CRC, i.e. a function code and an exception code
+            default_timeout = 1000, // default receive timeout, in milliseconds
+            layout_request = 0x01, // the frame may be a request
+            layout_response = 0x02, // the frame may be a response
+            layout_scan = 0x04, // the frame may have an unknown length, and ends where the CRC matches
+        };
+        IStream* m_stream;
+        ITimeProvider* m_timer;
+        IFrameHandler* m_handler;
+        uint8_t* m_buffer;
+        size_t m_buffer_len, m_buffer_max;
+        uint16_t m_checksum;
+        uint8_t m_station_address, m_frame_address;
+        uint8_t m_layouts;
+        size_t m_buffer_tx_pos;
+        enum state_type
+        {
+            state_exception,
+            state_idle,
+            state_frame_ready,
+            state_queue,
+            state_receive,
+            state_tx_addr,
+            state_tx_pdu,
+            state_tx_crc,
+        };
+        state_type m_state;
+        system_tick_t m_last_ticks;
+        system_tick_t m_timeout;
+#if MODBUS_STATISTICS
+        CModbusStatistics m_statistics;
+#endif
+    };
+}
+#endif
@@ -0,0 +1,206 @@
+#include "ModbusRegisterFile.h"
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+namespace ModbusPotato
+{
+    // returns the monotonic time in nanoseconds
+    static unsigned long long monotonic_ns()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (unsigned long long)now.tv_sec * 1000000000ull + now.tv_nsec;
+    }
+
+    CModbusRegisterFile::CModbusRegisterFile()
+        :   m_handler()
+        ,   m_subscription(this, 0, 0)
+        ,   m_map()
+        ,   m_map_size()
+        ,   m_registers()
+        ,   m_count()
+        ,   m_created()
+        ,   m_dirty_begin()
+        ,   m_dirty_end()
+        ,   m_sync_interval(default_sync_interval)
+        ,   m_last_sync_ns()
+    {
+    }
+
+    CModbusRegisterFile::~CModbusRegisterFile()
+    {
+        close();
+    }
+
+    uint32_t CModbusRegisterFile::header_checksum(const header_type* header)
+    {
+        // FNV-1a over the fields before the checksum
+        const uint8_t* p = (const uint8_t*)header;
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < offsetof(header_type, checksum); ++i)
+            hash = (hash ^ p[i]) * 16777619u;
+        return hash;
+    }
+
+    int CModbusRegisterFile::create(const char* path, size_t size, size_t count)
+    {
+        // write the new file under a temporary name
+        char tmp[max_path];
+        if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+            return -1;
+        int fd = ::open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return -1;
+        header_type header = {};
+        header.magic = magic_value;
+        header.version = current_version;
+        header.header_size = header_size;
+        header.count = (uint32_t)count;
+        header.checksum = header_checksum(&header);
+        if (ftruncate(fd, size) != 0 || pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fsync(fd) != 0)
+        {
+            ::close(fd);
+            unlink(tmp);
+            return -1;
+        }
+
+        // move it into place, and flush the directory so that the rename is durable
+        if (rename(tmp, path) != 0)
+        {
+            ::close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        char dir[max_path];
+        strcpy(dir, path);
+        char* slash = strrchr(dir, '/');
+        if (slash)
+            *(slash == dir ? slash + 1 : slash) = 0;
+        int dir_fd = ::open(slash ? dir : ".", O_RDONLY | O_DIRECTORY);
+        if (dir_fd >= 0)
+        {
+            fsync(dir_fd);
+            ::close(dir_fd);
+        }
+        m_created = true;
+        return fd;
+    }
+
+    bool CModbusRegisterFile::open(const char* path, size_t count)
+    {
+        // open the existing file, or create a new one
+        close();
+        m_created = false;
+        if (!count || count > 0xffff)
+            return false;
+        size_t size = header_size + count * sizeof(uint16_t);
+        int fd = ::open(path, O_RDWR);
+        if (fd < 0 && errno == ENOENT)
+            fd = create(path, size, count);
+        if (fd < 0)
+            return false;
+
+        // map the whole file
+        //
+        // Note: the mapping holds its own reference to the file, so the
+        // descriptor isn't needed afterwards.
+        //
+        struct stat st;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size == size)
+            map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+            return false;
+
+        // make sure the header is intact and matches the requested size
+        const header_type* header = (const header_type*)map;
+        if (header->magic != magic_value || header->version != current_version || header->header_size != header_size
+            || header->count != count || header->checksum != header_checksum(header))
+        {
+            munmap(map, size);
+            return false;
+        }
+        m_map = (uint8_t*)map;
+        m_map_size = size;
+        m_registers = (uint16_t*)(m_map + header_size);
+        m_count = count;
+        m_dirty_begin = m_dirty_end = 0;
+        m_last_sync_ns = monotonic_ns();
+        m_subscription.count = (uint16_t)count;
+        return true;
+    }
+
+    void CModbusRegisterFile::close()
+    {
+        if (m_handler)
+        {
+            m_handler->unsubscribe(&m_subscription);
+            m_handler = NULL;
+        }
+        if (!m_map)
+            return;
+        sync();
+        munmap(m_map, m_map_size);
+        m_map = NULL;
+        m_map_size = 0;
+        m_registers = NULL;
+        m_count = 0;
+    }
+
+    void CModbusRegisterFile::attach(CModbusSlaveHandlerHolding* handler)
+    {
+        if (m_handler)
+            m_handler->unsubscribe(&m_subscription);
+        m_handler = handler;
+        if (m_handler)
+            m_handler->subscribe(&m_subscription);
+    }
+
+    void CModbusRegisterFile::registers_changed(uint16_t address, uint16_t count)
+    {
+        // extend the range which needs flushing
+        size_t begin = address, end = (size_t)address + count;
+        if (m_dirty_begin >= m_dirty_end)
+        {
+            m_dirty_begin = begin;
+            m_dirty_end = end;
+            return;
+        }
+        if (begin < m_dirty_begin)
+            m_dirty_begin = begin;
+        if (end > m_dirty_end)
+            m_dirty_end = end;
+    }
+
+    void CModbusRegisterFile::poll()
+    {
+        if (!m_map || m_dirty_begin >= m_dirty_end || !m_sync_interval)
+            return;
+        if (monotonic_ns() - m_last_sync_ns >= (unsigned long long)m_sync_interval * 1000000ull)
+            sync();
+    }
+
+    bool CModbusRegisterFile::sync()
+    {
+        if (!m_map)
+            return false;
+        m_last_sync_ns = monotonic_ns();
+        if (m_dirty_begin >= m_dirty_end)
+            return true;
+
+        // flush the pages which hold the written registers
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t begin = (header_size + m_dirty_begin * sizeof(uint16_t)) / page * page;
+        size_t end = header_size + m_dirty_end * sizeof(uint16_t);
+        m_dirty_begin = m_dirty_end = 0;
+        return msync(m_map + begin, end - begin, MS_SYNC) == 0;
+    }
+}
+#endif
@@ -0,0 +1,133 @@
+#ifndef __ModbusPotato_RegisterFile_h__
+#define __ModbusPotato_RegisterFile_h__
+#include "ModbusSlaveHandlerHolding.h"
+#ifdef __linux__
+namespace ModbusPotato
+{
+    /// <summary>
+    /// Keeps an array of holding registers in a memory-mapped file so that it survives a restart.
+    /// </summary>
+    /// <remarks>
+    /// The registers are mapped straight from the file, and the array given
+    /// by registers() is passed to CModbusSlaveHandlerHolding, so a write
+    /// from the master is still a plain memory store.  The kernel writes the
+    /// pages back to the file, so nothing is lost if the process crashes or
+    /// is restarted, and open() maps the previous values without reading or
+    /// parsing anything.
+    ///
+    /// To also survive a power failure, the written registers must be
+    /// flushed to the disk.  attach() subscribes to the handler to track the
+    /// range written since the last flush, and poll() calls msync() on that
+    /// range once the sync interval has elapsed, so that a burst of writes
+    /// costs one flush.  sync() flushes immediately.
+    ///
+    /// A new file is written to a temporary file, flushed and then renamed
+    /// into place, and its header is never changed afterwards.  A crash
+    /// while creating it therefore leaves either no file or a complete
+    /// one, and the header is checked on every open.  The registers are
+    /// stored in host byte order.
+    ///
+    /// No memory is allocated.
+    /// </remarks>
+    class CModbusRegisterFile : public IRegisterChangeHandler
+    {
+    public:
+        enum
+        {
+            max_path = 256,
+            default_sync_interval = 1000, // default time between flushes, in milliseconds
+        };
+        CModbusRegisterFile();
+        ~CModbusRegisterFile();
+
+        /// <summary>
+        /// Maps the file with the given number of registers, creating it filled with zeros if it doesn't exist.
+        /// </summary>
+        /// <returns>
+        /// false if the file can't be created or mapped, or holds a different number of registers.
+        /// </returns>
+        bool open(const char* path, size_t count);
+
+        /// <summary>
+        /// Flushes any written registers and unmaps the file.
+        /// </summary>
+        void close();
+
+        /// <summary>
+        /// Returns true if the file was created by the last call to open(), so that the application can load its defaults.
+        /// </summary>
+        bool created() const { return m_created; }
+
+        /// <summary>
+        /// Returns the mapped registers, or NULL if the file is not open.
+        /// </summary>
+        uint16_t* registers() const { return m_registers; }
+
+        /// <summary>
+        /// Returns the number of registers.
+        /// </summary>
+        size_t count() const { return m_count; }
+
+        /// <summary>
+        /// Subscribes to all of the registers of the handler to track the writes which need flushing.
+        /// </summary>
+        /// <remarks>
+        /// close() unsubscribes again, so it must be called before the
+        /// handler is destroyed.
+        /// </remarks>
+        void attach(CModbusSlaveHandlerHolding* handler);
+
+        /// <summary>
+        /// Sets the minimum time between flushes, in milliseconds, or 0 to only flush from sync().
+        /// </summary>
+        void set_sync_interval(unsigned long interval_ms) { m_sync_interval = interval_ms; }
+
+        /// <summary>
+        /// Flushes the written registers if the sync interval has elapsed since the last flush.
+        /// </summary>
+        /// <remarks>
+        /// This must be called from the same thread as the slave, and may
+        /// block while the pages are written.
+        /// </remarks>
+        void poll();
+
+        /// <summary>
+        /// Flushes the written registers to the disk now.
+        /// </summary>
+        bool sync();
+
+        /// <summary>
+        /// Records a write from the master; called by the handler after attach().
+        /// </summary>
+        virtual void registers_changed(uint16_t address, uint16_t count);
+    private:
+        struct header_type
+        {
+            uint32_t magic;
+            uint16_t version;
+            uint16_t header_size;
+            uint32_t count;
+            uint32_t checksum;
+        };
+        enum
+        {
+            magic_value = 0x46525050, // "PPRF"
+            current_version = 1,
+            header_size = 64, // offset of the registers in the file
+        };
+        static uint32_t header_checksum(const header_type* header);
+        int create(const char* path, size_t size, size_t count);
+        CModbusSlaveHandlerHolding* m_handler;
+        CModbusRegisterSubscription m_subscription;
+        uint8_t* m_map;
+        size_t m_map_size;
+        uint16_t* m_registers;
+        size_t m_count;
+        bool m_created;
+        size_t m_dirty_begin, m_dirty_end;
+        unsigned long m_sync_interval;
+        unsigned long long m_last_sync_ns;
+    };
+}
+#endif
+#endif
@@ -0,0 +1,126 @@
+#include "ModbusResponseCache.h"
+#include "ModbusCRC.h"
+namespace ModbusPotato
+{
+    enum
+    {
+        read_holding_registers = 0x03,
+        x0 = 0x8000, // the polynomial 1, since the CRC is bit reversed
+        x1 = 0x4000, // the polynomial x
+    };
+
+    // multiply two polynomials modulo the CRC polynomial
+    //
+    // Note: this is the same method as multmodp() in zlib's crc32.c, applied
+    // to 16 bits.  'a' must not be 0.
+    //
+    static uint16_t multmodp(uint16_t a, uint16_t b)
+    {
+        uint16_t m = x0, p = 0;
+        for (;;)
+        {
+            if (a & m)
+            {
+                p ^= b;
+                if (!(a & (m - 1)))
+                    break;
+            }
+            m >>= 1;
+            b = (b & 1) != 0 ? ((b >> 1) ^ crc16_modbus_poly) : (b >> 1);
+        }
+        return p;
+    }
+
+    // return x^(8n) modulo the CRC polynomial, which advances a CRC over n zero bytes
+    static uint16_t x8nmodp(size_t n)
+    {
+        uint16_t result = x0, power = x1;
+        for (size_t e = n * 8; e; e >>= 1)
+        {
+            if (e & 1)
+                result = multmodp(power, result);
+            power = multmodp(power, power);
+        }
+        return result;
+    }
+
+    CModbusResponseCache::CModbusResponseCache()
+        :   hits()
+        ,   misses()
+        ,   m_entries()
+    {
+    }
+
+    void CModbusResponseCache::add(CModbusCachedResponse* entry)
+    {
+        entry->valid = false;
+        entry->next = m_entries;
+        m_entries = entry;
+    }
+
+    CModbusCachedResponse* CModbusResponseCache::find(uint16_t address, uint16_t count) const
+    {
+        for (CModbusCachedResponse* entry = m_entries; entry; entry = entry->next)
+        {
+            if (entry->address == address && entry->count == count)
+                return entry;
+        }
+        return NULL;
+    }
+
+    void CModbusResponseCache::store(CModbusCachedResponse* entry, uint8_t station, const uint8_t* pdu)
+    {
+        // copy the response
+        size_t len = entry->count * 2 + 2;
+        for (size_t i = 0; i < len; ++i)
+            entry->pdu[i] = pdu[i];
+
+        // calculate the checksum over the station address and the PDU
+        entry->station = station;
+        entry->checksum = crc16_modbus(crc16_modbus(crc16_modbus_init, &station, 1), entry->pdu, len);
+        entry->valid = true;
+    }
+
+    void CModbusResponseCache::update(uint16_t address, uint16_t count, const uint16_t* values)
+    {
+        for (CModbusCachedResponse* entry = m_entries; entry; entry = entry->next)
+        {
+            // find the registers in this entry which are in the range
+            uint32_t begin = address > entry->address ? address : entry->address;
+            uint32_t end = (uint32_t)address + count;
+            if ((uint32_t)entry->address + entry->count < end)
+                end = (uint32_t)entry->address + entry->count;
+            if (!entry->valid || begin >= end)
+                continue;
+
+            // replace the values and accumulate the CRC of the difference
+            //
+            // Note: the CRC of the old frame XOR'ed with the CRC of the new
+            // frame is the CRC, with no initial value, of the XOR of the two
+            // frames.  That is zero up to the first changed register, so only
+            // the changed registers need to be fed in before advancing it
+            // over the registers which follow.
+            //
+            uint8_t* data = entry->pdu + 2 + (begin - entry->address) * 2;
+            uint16_t delta = 0;
+            uint8_t changed = 0;
+            for (uint32_t i = begin; i < end; ++i, data += 2)
+            {
+                uint16_t value = values[i - address];
+                uint8_t diff[2] = { (uint8_t)(data[0] ^ (value >> 8)), (uint8_t)(data[1] ^ value) };
+                data[0] = (uint8_t)(value >> 8);
+                data[1] = (uint8_t)value;
+                changed |= diff[0] | diff[1];
+                delta = crc16_modbus(delta, diff, 2);
+            }
+            if (changed)
+                entry->checksum ^= multmodp(x8nmodp(((uint32_t)entry->address + entry->count - end) * 2), delta);
+        }
+    }
+
+    void CModbusResponseCache::invalidate()
+    {
+        for (CModbusCachedResponse* entry = m_entries; entry; entry = entry->next)
+            entry->valid = false;
+    }
+}
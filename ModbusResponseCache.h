@@ -0,0 +1,96 @@
+#ifndef __ModbusPotato_ResponseCache_h__
+#define __ModbusPotato_ResponseCache_h__
+#include "ModbusTypes.h"
+namespace ModbusPotato
+{
+    /// <summary>
+    /// Holds the serialized response to a read of one range of holding registers.
+    /// </summary>
+    /// <remarks>
+    /// The entry and its storage are owned by the application and linked
+    /// into the cache using CModbusResponseCache::add(), so no memory is
+    /// allocated.  The storage must hold count * 2 + 2 bytes.  The entry
+    /// only matches a function 0x03 request for exactly the same range.
+    /// </remarks>
+    struct CModbusCachedResponse
+    {
+        CModbusCachedResponse(uint16_t address, uint16_t count, uint8_t* storage)
+            :   address(address)
+            ,   count(count)
+            ,   pdu(storage)
+            ,   checksum()
+            ,   station()
+            ,   valid()
+            ,   next()
+        {
+        }
+        uint16_t address; // raw address of the first holding register, i.e. 0 for 40001
+        uint16_t count; // number of registers
+        uint8_t* pdu; // function code, byte count and register values in network byte order
+        uint16_t checksum; // CRC-16 of the station address and the PDU
+        uint8_t station; // station address the checksum was calculated for
+        bool valid; // true once the response has been stored
+        CModbusCachedResponse* next;
+    };
+
+    /// <summary>
+    /// Caches the responses to repeated reads of hot ranges of holding registers.
+    /// </summary>
+    /// <remarks>
+    /// CModbusSlave fills an entry from the handler's result the first time
+    /// its range is read, and answers later reads by copying the stored
+    /// response into the framer without calling the handler.  The stored
+    /// CRC is given to the framer using IFramer::set_checksum(), so on the
+    /// RTU framer the response is sent without calculating it again.
+    ///
+    /// Writes made through the slave are applied to the cached values by
+    /// the slave itself.  If the registers change in any other way, the
+    /// application must call update() with the new values, or invalidate().
+    /// update() patches the stored CRC rather than recalculating it: since
+    /// the CRC is linear, the CRC of the changed bytes XOR'ed with the old
+    /// bytes, advanced over the bytes which follow them, is XOR'ed into the
+    /// old CRC.  The cost is proportional to the number of registers which
+    /// changed, and not to the size of the range.
+    ///
+    /// The cache must only be used from the same context as the framer's
+    /// poll().
+    /// </remarks>
+    class CModbusResponseCache
+    {
+    public:
+        CModbusResponseCache();
+
+        /// <summary>
+        /// Adds an entry for a range of holding registers.
+        /// </summary>
+        void add(CModbusCachedResponse* entry);
+
+        /// <summary>
+        /// Returns the entry for the given range, or NULL if it is not cached.
+        /// </summary>
+        CModbusCachedResponse* find(uint16_t address, uint16_t count) const;
+
+        /// <summary>
+        /// Stores the response PDU for an entry and calculates its checksum.
+        /// </summary>
+        void store(CModbusCachedResponse* entry, uint8_t station, const uint8_t* pdu);
+
+        /// <summary>
+        /// Applies new values, in host byte order, to the cached responses which overlap the given range.
+        /// </summary>
+        void update(uint16_t address, uint16_t count, const uint16_t* values);
+
+        /// <summary>
+        /// Discards all of the cached responses; they are stored again on the next read.
+        /// </summary>
+        void invalidate();
+
+        /// <summary>
+        /// The number of reads answered from the cache, and the number which had to call the handler.
+        /// </summary>
+        uint32_t hits, misses;
+    private:
+        CModbusCachedResponse* m_entries;
+    };
+}
+#endif
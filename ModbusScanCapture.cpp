@@ -0,0 +1,258 @@
+#include "ModbusScanCapture.h"
+#ifdef __linux__
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+namespace ModbusPotato
+{
+    enum
+    {
+        read_holding_registers = 0x03,
+        read_input_registers = 0x04,
+    };
+
+    // round up to a multiple of 8 bytes
+    static size_t align8(size_t size)
+    {
+        return (size + 7) & ~(size_t)7;
+    }
+
+    CModbusScanCapture::CModbusScanCapture(const CModbusDecoder* decoder)
+        :   m_decoder(decoder)
+        ,   m_capacity()
+        ,   m_segment()
+        ,   m_fd(-1)
+        ,   m_map()
+        ,   m_map_size()
+        ,   m_header()
+        ,   m_times()
+    {
+        m_prefix[0] = 0;
+    }
+
+    CModbusScanCapture::~CModbusScanCapture()
+    {
+        close();
+    }
+
+    bool CModbusScanCapture::open(const char* prefix, uint32_t rows_per_segment)
+    {
+        // make sure the prefix leaves room for the segment number
+        close();
+        if (!rows_per_segment || m_decoder->count() > max_columns || strlen(prefix) >= sizeof(m_prefix))
+            return false;
+        strcpy(m_prefix, prefix);
+        m_capacity = rows_per_segment;
+
+        // continue after the last existing segment
+        char path[max_path];
+        struct stat st;
+        for (m_segment = 0; ; ++m_segment)
+        {
+            if (!segment_path(path, m_segment))
+                return false;
+            if (stat(path, &st) != 0)
+                break;
+        }
+        return create();
+    }
+
+    bool CModbusScanCapture::segment_path(char* path, uint32_t segment) const
+    {
+        // the prefix is short enough for any segment number, but check anyway
+        int len = snprintf(path, max_path, "%s.%06u", m_prefix, (unsigned int)segment);
+        return len > 0 && len < max_path;
+    }
+
+    bool CModbusScanCapture::create()
+    {
+        // determine the size of the file
+        size_t columns = m_decoder->count();
+        size_t time_offset = align8(sizeof(CModbusCaptureHeader) + columns * sizeof(CModbusCaptureColumn));
+        size_t size = align8(time_offset + (size_t)m_capacity * sizeof(uint32_t));
+        for (size_t i = 0; i < columns; ++i)
+        {
+            m_sizes[i] = (uint8_t)m_decoder->column_size(i);
+            size = align8(size + (size_t)m_capacity * m_sizes[i]);
+        }
+        if (size > 0xffffffffu)
+            return false; // the offsets in the header are 32 bits
+
+        // create and map the file
+        //
+        // Note: the new file is filled with zeros by ftruncate(), so only
+        // the non-zero fields of the header need to be stored.
+        //
+        char path[max_path];
+        if (!segment_path(path, m_segment))
+            return false;
+        m_fd = ::open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (m_fd < 0)
+            return false;
+        void* map = MAP_FAILED;
+        if (ftruncate(m_fd, size) == 0)
+            map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (map == MAP_FAILED)
+        {
+            unmap();
+            return false;
+        }
+        m_map = (uint8_t*)map;
+        m_map_size = size;
+
+        // fill in the header and the column table
+        m_header = (CModbusCaptureHeader*)m_map;
+        m_header->version = CModbusCaptureHeader::current_version;
+        m_header->columns = (uint16_t)columns;
+        m_header->capacity = m_capacity;
+        m_header->segment = m_segment;
+        m_header->time_offset = (uint32_t)time_offset;
+        m_times = (uint32_t*)(m_map + time_offset);
+        CModbusCaptureColumn* table = (CModbusCaptureColumn*)(m_header + 1);
+        size_t offset = align8(time_offset + (size_t)m_capacity * sizeof(uint32_t));
+        for (size_t i = 0; i < columns; ++i)
+        {
+            // scaled values are stored as doubles
+            table[i].offset = (uint32_t)offset;
+            table[i].type = m_sizes[i] == sizeof(double) ? (uint8_t)modbus_point_type::float64 : m_decoder->point(i).type;
+            table[i].size = m_sizes[i];
+            m_columns[i] = m_map + offset;
+            offset = align8(offset + (size_t)m_capacity * m_sizes[i]);
+        }
+
+        // the segment is valid for readers once the magic number is set
+        __atomic_store_n(&m_header->magic, (uint32_t)CModbusCaptureHeader::magic_value, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    void CModbusScanCapture::unmap()
+    {
+        if (m_map)
+            munmap(m_map, m_map_size);
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+        m_map = NULL;
+        m_map_size = 0;
+        m_header = NULL;
+        m_times = NULL;
+    }
+
+    void CModbusScanCapture::close()
+    {
+        if (m_header)
+            __atomic_or_fetch(&m_header->flags, (uint32_t)CModbusCaptureHeader::flag_closed, __ATOMIC_RELEASE);
+        unmap();
+    }
+
+    bool CModbusScanCapture::append(const uint8_t* data, size_t len, uint64_t time_us)
+    {
+        if (!m_header || len < m_decoder->registers() * 2)
+            return false;
+
+        // start a new segment if this one is full or the time offset won't fit
+        uint32_t row = m_header->rows;
+        if (row && (row == m_capacity || time_us < m_header->base_time || time_us - m_header->base_time > 0xffffffffu))
+        {
+            close();
+            m_segment++;
+            if (!create())
+                return false;
+            row = 0;
+        }
+        if (!row)
+            m_header->base_time = time_us;
+
+        // decode the values straight into the next row of each column
+        size_t columns = m_decoder->count();
+        void* dst[max_columns];
+        for (size_t i = 0; i < columns; ++i)
+            dst[i] = m_columns[i] + (size_t)row * m_sizes[i];
+        m_decoder->decode_columns(data, len, 1, dst);
+        m_times[row] = (uint32_t)(time_us - m_header->base_time);
+
+        // publish the row
+        __atomic_store_n(&m_header->rows, row + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    bool CModbusScanCapture::append(const CModbusTransaction* transaction, uint64_t time_us)
+    {
+        // make sure this is a complete read response
+        //
+        // data[0] = fc
+        // data[1] = byte count
+        // data[2+] = registers
+        //
+        const uint8_t* data = transaction->data;
+        if (transaction->status != modbus_transaction_status::ok || transaction->len < 2)
+            return false;
+        if ((data[0] != read_holding_registers && data[0] != read_input_registers) || data[1] != transaction->len - 2)
+            return false;
+        return append(data + 2, data[1], time_us);
+    }
+
+    CModbusCaptureReader::CModbusCaptureReader()
+        :   m_map()
+        ,   m_map_size()
+        ,   m_header()
+        ,   m_columns()
+        ,   m_times()
+    {
+    }
+
+    CModbusCaptureReader::~CModbusCaptureReader()
+    {
+        close();
+    }
+
+    bool CModbusCaptureReader::open(const char* path)
+    {
+        // map the whole file
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CModbusCaptureHeader))
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+            return false;
+        m_map = (const uint8_t*)map;
+        m_map_size = st.st_size;
+        m_header = (const CModbusCaptureHeader*)m_map;
+        m_columns = (const CModbusCaptureColumn*)(m_header + 1);
+
+        // make sure the writer has finished creating it and that everything is inside the file
+        bool valid = __atomic_load_n(&m_header->magic, __ATOMIC_ACQUIRE) == CModbusCaptureHeader::magic_value
+            && m_header->version == CModbusCaptureHeader::current_version
+            && sizeof(CModbusCaptureHeader) + m_header->columns * sizeof(CModbusCaptureColumn) <= m_map_size
+            && m_header->time_offset + (size_t)m_header->capacity * sizeof(uint32_t) <= m_map_size;
+        for (size_t i = 0; valid && i < m_header->columns; ++i)
+            valid = m_columns[i].offset + (size_t)m_header->capacity * m_columns[i].size <= m_map_size;
+        if (!valid)
+        {
+            close();
+            return false;
+        }
+        m_times = (const uint32_t*)(m_map + m_header->time_offset);
+        return true;
+    }
+
+    void CModbusCaptureReader::close()
+    {
+        if (m_map)
+            munmap((void*)m_map, m_map_size);
+        m_map = NULL;
+        m_map_size = 0;
+        m_header = NULL;
+        m_columns = NULL;
+        m_times = NULL;
+    }
+}
+#endif
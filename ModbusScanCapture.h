@@ -0,0 +1,205 @@
+#ifndef __ModbusPotato_ScanCapture_h__
+#define __ModbusPotato_ScanCapture_h__
+#include "ModbusDecoder.h"
+#ifdef __linux__
+namespace ModbusPotato
+{
+    /// <summary>
+    /// Describes one column of a capture segment.
+    /// </summary>
+    struct CModbusCaptureColumn
+    {
+        uint32_t offset; // byte offset of the column from the start of the file
+        uint8_t type; // C type of the values, see modbus_point_type
+        uint8_t size; // size of each value in bytes
+        uint16_t reserved;
+    };
+
+    /// <summary>
+    /// The header at the start of each capture segment file.
+    /// </summary>
+    /// <remarks>
+    /// The header is followed by one CModbusCaptureColumn for each point,
+    /// and then by the time column and the value columns, each aligned to
+    /// 8 bytes and sized for 'capacity' rows.
+    ///
+    /// The time column holds the time of each row as a 32-bit offset in
+    /// microseconds from base_time, so a row costs 4 bytes of time instead
+    /// of 8.  The value columns hold the decoded values in their natural
+    /// width, rather than widening all of them to double.
+    ///
+    /// The writer stores the magic number last when creating a segment, and
+    /// increments 'rows' only after all of the values of a row are stored,
+    /// so a reader never sees a partly written row.
+    /// </remarks>
+    struct CModbusCaptureHeader
+    {
+        enum
+        {
+            magic_value = 0x5343504d, // "MPCS"
+            current_version = 1,
+            flag_closed = 0x01, // no more rows will be added; the next segment follows
+        };
+        uint32_t magic;
+        uint16_t version;
+        uint16_t columns; // number of value columns
+        uint32_t capacity; // number of rows the segment can hold
+        uint32_t rows; // number of complete rows
+        uint32_t flags;
+        uint32_t segment; // segment number
+        uint64_t base_time; // time of the first row, in microseconds
+        uint32_t time_offset; // byte offset of the time column from the start of the file
+        uint32_t reserved;
+    };
+
+    /// <summary>
+    /// Appends decoded scans to memory-mapped columnar segment files.
+    /// </summary>
+    /// <remarks>
+    /// Each call to append() decodes one block of registers using the
+    /// CModbusDecoder straight into the next row of the mapped columns, so
+    /// storing a scan is one store per point plus the time, with no system
+    /// call.  The application usually calls it from its
+    /// IMasterHandler::transaction_complete().
+    ///
+    /// The files are named with the prefix followed by a six digit segment
+    /// number, i.e. "meters.000042".  A new segment is started when the
+    /// current one is full, or when the time offset from its first row no
+    /// longer fits in 32 bits (about 71 minutes).  open() continues after
+    /// the last existing segment.
+    ///
+    /// Other processes may map the same files at the same time using
+    /// CModbusCaptureReader.  The data is written back to the files by the
+    /// kernel, so a crash of the process loses nothing that was appended,
+    /// but the files are not synchronized to the disk.
+    ///
+    /// No memory is allocated, and the decoder must have been compiled and
+    /// must not change while the capture is open.
+    /// </remarks>
+    class CModbusScanCapture
+    {
+    public:
+        enum
+        {
+            max_columns = 256,
+            max_path = 256, // including the segment number and the terminator
+            max_suffix = 11, // a dot and a segment number of up to 10 digits
+        };
+        CModbusScanCapture(const CModbusDecoder* decoder);
+        ~CModbusScanCapture();
+
+        /// <summary>
+        /// Opens a new segment after the last existing one with the given prefix.
+        /// </summary>
+        /// <returns>
+        /// false if the decoder has too many points, the prefix is longer
+        /// than max_path - max_suffix - 1 characters, or the file can't be
+        /// created.
+        /// </returns>
+        bool open(const char* prefix, uint32_t rows_per_segment);
+
+        /// <summary>
+        /// Marks the current segment closed and unmaps it.
+        /// </summary>
+        void close();
+
+        /// <summary>
+        /// Decodes one block of registers and appends it with the given time, in microseconds.
+        /// </summary>
+        /// <returns>
+        /// false if the capture is not open, the block is too short, or a new segment can't be created.
+        /// </returns>
+        bool append(const uint8_t* data, size_t len, uint64_t time_us);
+
+        /// <summary>
+        /// Appends the response to a read of holding or input registers held by a completed transaction.
+        /// </summary>
+        bool append(const CModbusTransaction* transaction, uint64_t time_us);
+
+        /// <summary>
+        /// Returns the current segment number.
+        /// </summary>
+        uint32_t segment() const { return m_segment; }
+
+        /// <summary>
+        /// Returns the number of rows in the current segment.
+        /// </summary>
+        uint32_t rows() const { return m_header ? m_header->rows : 0; }
+    private:
+        bool create();
+        void unmap();
+        bool segment_path(char* path, uint32_t segment) const;
+        const CModbusDecoder* m_decoder;
+        char m_prefix[max_path - max_suffix];
+        uint32_t m_capacity, m_segment;
+        int m_fd;
+        uint8_t* m_map;
+        size_t m_map_size;
+        CModbusCaptureHeader* m_header;
+        uint32_t* m_times;
+        uint8_t* m_columns[max_columns];
+        uint8_t m_sizes[max_columns];
+    };
+
+    /// <summary>
+    /// Maps a capture segment written by CModbusScanCapture for reading.
+    /// </summary>
+    /// <remarks>
+    /// The segment may still be written to while it is mapped.  rows() is
+    /// read with acquire ordering, so the values of every row below the
+    /// count it returns are complete.
+    /// </remarks>
+    class CModbusCaptureReader
+    {
+    public:
+        CModbusCaptureReader();
+        ~CModbusCaptureReader();
+
+        /// <summary>
+        /// Maps the given segment file.
+        /// </summary>
+        /// <returns>
+        /// false if the file can't be mapped or is not a complete segment.
+        /// </returns>
+        bool open(const char* path);
+
+        /// <summary>
+        /// Unmaps the segment.
+        /// </summary>
+        void close();
+
+        /// <summary>
+        /// Returns the number of complete rows.
+        /// </summary>
+        uint32_t rows() const { return __atomic_load_n(&m_header->rows, __ATOMIC_ACQUIRE); }
+
+        /// <summary>
+        /// Returns true once the writer has moved on to the next segment.
+        /// </summary>
+        bool closed() const { return (__atomic_load_n(&m_header->flags, __ATOMIC_ACQUIRE) & CModbusCaptureHeader::flag_closed) != 0; }
+
+        /// <summary>
+        /// Returns the segment header.
+        /// </summary>
+        const CModbusCaptureHeader* header() const { return m_header; }
+
+        /// <summary>
+        /// Returns the time of a row, in microseconds.
+        /// </summary>
+        uint64_t time(uint32_t row) const { return m_header->base_time + m_times[row]; }
+
+        /// <summary>
+        /// Returns the array of values for a column, whose C type is given by column_type().
+        /// </summary>
+        const void* column(size_t index) const { return m_map + m_columns[index].offset; }
+        uint8_t column_type(size_t index) const { return m_columns[index].type; }
+    private:
+        const uint8_t* m_map;
+        size_t m_map_size;
+        const CModbusCaptureHeader* m_header;
+        const CModbusCaptureColumn* m_columns;
+        const uint32_t* m_times;
+    };
+}
+#endif
+#endif
@@ -0,0 +1,311 @@
+#include "ModbusSharedTables.h"
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+namespace ModbusPotato
+{
+    // round up to a multiple of 64 bytes, so that each table starts on its own cache line
+    static size_t align64(size_t size)
+    {
+        return (size + 63) & ~(size_t)63;
+    }
+
+    // returns true if the table holds registers rather than bits
+    static bool register_table(CModbusSharedTables::table_type table)
+    {
+        return table == CModbusSharedTables::holding_registers || table == CModbusSharedTables::input_registers;
+    }
+
+    CModbusSharedTables::CModbusSharedTables()
+        :   m_map()
+        ,   m_map_size()
+        ,   m_header()
+    {
+    }
+
+    CModbusSharedTables::~CModbusSharedTables()
+    {
+        close();
+    }
+
+    bool CModbusSharedTables::create(const char* name, size_t coil_count, size_t discrete_count, size_t holding_count, size_t input_count, uint16_t block_size)
+    {
+        // lay out the tables and their sequence counters
+        close();
+        const size_t counts[table_count] = { coil_count, discrete_count, holding_count, input_count };
+        CModbusSharedHeader layout = {};
+        layout.version = CModbusSharedHeader::current_version;
+        layout.block_size = block_size;
+        size_t size = align64(sizeof(CModbusSharedHeader));
+        for (int i = 0; i < table_count; ++i)
+        {
+            if (counts[i] > 0x10000 || !block_size)
+                return false;
+            layout.count[i] = (uint32_t)counts[i];
+            layout.data_offset[i] = (uint32_t)size;
+            size = align64(size + counts[i] * (register_table((table_type)i) ? sizeof(uint16_t) : sizeof(uint8_t)));
+            layout.seq_offset[i] = (uint32_t)size;
+            size = align64(size + (counts[i] + block_size - 1) / block_size * sizeof(uint32_t));
+        }
+        layout.size = (uint32_t)size;
+
+        // create the segment, or map the existing one and make sure it matches
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+        if (fd < 0)
+        {
+            if (errno != EEXIST || !open(name))
+                return false;
+            bool match = m_header->block_size == layout.block_size;
+            for (int i = 0; i < table_count; ++i)
+                match = match && m_header->count[i] == layout.count[i];
+            if (!match)
+                close();
+            return match;
+        }
+        if (ftruncate(fd, size) != 0 || !map(fd))
+        {
+            ::close(fd);
+            shm_unlink(name);
+            return false;
+        }
+        ::close(fd);
+
+        // fill in the header; the segment is filled with zeros by ftruncate()
+        //
+        // Note: the magic number is stored last, so that another process
+        // calling open() never sees a partly initialized header.
+        //
+        *m_header = layout;
+        __atomic_store_n(&m_header->magic, (uint32_t)CModbusSharedHeader::magic_value, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    bool CModbusSharedTables::open(const char* name)
+    {
+        close();
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0)
+            return false;
+        bool result = map(fd);
+        ::close(fd);
+        if (!result)
+            return false;
+
+        // make sure the creator has finished and the layout is one we understand
+        if (__atomic_load_n(&m_header->magic, __ATOMIC_ACQUIRE) != CModbusSharedHeader::magic_value
+            || m_header->version != CModbusSharedHeader::current_version
+            || m_header->size > m_map_size
+            || !m_header->block_size)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool CModbusSharedTables::map(int fd)
+    {
+        // map the whole segment
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CModbusSharedHeader))
+            return false;
+        void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            return false;
+        m_map = (uint8_t*)map;
+        m_map_size = st.st_size;
+        m_header = (CModbusSharedHeader*)m_map;
+        return true;
+    }
+
+    void CModbusSharedTables::close()
+    {
+        if (m_map)
+            munmap(m_map, m_map_size);
+        m_map = NULL;
+        m_map_size = 0;
+        m_header = NULL;
+    }
+
+    bool CModbusSharedTables::remove(const char* name)
+    {
+        return shm_unlink(name) == 0;
+    }
+
+    bool CModbusSharedTables::check_range(table_type table, uint16_t address, uint16_t count) const
+    {
+        return m_header && table < table_count && count && (size_t)address + count <= m_header->count[table];
+    }
+
+    uint64_t CModbusSharedTables::read_begin(table_type table, size_t first, size_t last) const
+    {
+        // wait until none of the blocks are being written, and sum their counters
+        //
+        // Note: the counters only ever increase, so the sum is the same
+        // after copying only if none of the blocks were written meanwhile.
+        //
+        const uint32_t* seq = sequence(table);
+        for (;;)
+        {
+            uint64_t sum = 0;
+            size_t i = first;
+            for (; i <= last; ++i)
+            {
+                uint32_t value = __atomic_load_n(&seq[i], __ATOMIC_ACQUIRE);
+                if (value & 1)
+                    break;
+                sum += value;
+            }
+            if (i > last)
+                return sum;
+            sched_yield(); // a writer holds the block
+        }
+    }
+
+    bool CModbusSharedTables::read_retry(table_type table, size_t first, size_t last, uint64_t sum) const
+    {
+        // make sure the copy is complete before checking the counters again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        const uint32_t* seq = sequence(table);
+        uint64_t now = 0;
+        for (size_t i = first; i <= last; ++i)
+            now += __atomic_load_n(&seq[i], __ATOMIC_RELAXED);
+        return now != sum;
+    }
+
+    void CModbusSharedTables::write_lock(table_type table, size_t first, size_t last)
+    {
+        // take each block in ascending order by making its counter odd
+        uint32_t* seq = sequence(table);
+        for (size_t i = first; i <= last; ++i)
+        {
+            for (;;)
+            {
+                uint32_t value = __atomic_load_n(&seq[i], __ATOMIC_RELAXED);
+                if (!(value & 1) && __atomic_compare_exchange_n(&seq[i], &value, value + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                    break;
+                sched_yield(); // another writer holds the block
+            }
+        }
+
+        // make sure the odd counters are visible before any of the values change
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    void CModbusSharedTables::write_unlock(table_type table, size_t first, size_t last)
+    {
+        uint32_t* seq = sequence(table);
+        for (size_t i = first; i <= last; ++i)
+            __atomic_store_n(&seq[i], seq[i] + 1, __ATOMIC_RELEASE);
+    }
+
+    bool CModbusSharedTables::read_registers(table_type table, uint16_t address, uint16_t count, uint16_t* values) const
+    {
+        if (!register_table(table) || !check_range(table, address, count))
+            return false;
+        const uint16_t* data = (const uint16_t*)(m_map + m_header->data_offset[table]) + address;
+        size_t first = address / m_header->block_size, last = ((size_t)address + count - 1) / m_header->block_size;
+        uint64_t sum;
+        do
+        {
+            // copy the values
+            //
+            // Note: a writer may be changing them at the same time, so they
+            // are copied with relaxed atomic loads, which are as cheap as
+            // plain ones but well defined when they race; the fences in
+            // read_retry() and write_lock() order them against the counters.
+            //
+            sum = read_begin(table, first, last);
+            for (uint16_t i = 0; i < count; ++i)
+                values[i] = __atomic_load_n(&data[i], __ATOMIC_RELAXED);
+        } while (read_retry(table, first, last, sum));
+        return true;
+    }
+
+    bool CModbusSharedTables::write_registers(table_type table, uint16_t address, uint16_t count, const uint16_t* values)
+    {
+        if (!register_table(table) || !check_range(table, address, count))
+            return false;
+        uint16_t* data = (uint16_t*)(m_map + m_header->data_offset[table]) + address;
+        size_t first = address / m_header->block_size, last = ((size_t)address + count - 1) / m_header->block_size;
+        write_lock(table, first, last);
+        for (uint16_t i = 0; i < count; ++i)
+            __atomic_store_n(&data[i], values[i], __ATOMIC_RELAXED);
+        write_unlock(table, first, last);
+        return true;
+    }
+
+    bool CModbusSharedTables::read_bits(table_type table, uint16_t address, uint16_t count, uint8_t* values) const
+    {
+        if (register_table(table) || !check_range(table, address, count))
+            return false;
+        const uint8_t* data = m_map + m_header->data_offset[table] + address;
+        size_t first = address / m_header->block_size, last = ((size_t)address + count - 1) / m_header->block_size;
+        uint64_t sum;
+        do
+        {
+            // pack the bits, starting with the least significant bit of the first byte
+            sum = read_begin(table, first, last);
+            for (uint16_t i = 0; i < count; ++i)
+            {
+                if (!(i & 7))
+                    values[i >> 3] = 0;
+                values[i >> 3] |= (uint8_t)((__atomic_load_n(&data[i], __ATOMIC_RELAXED) & 1) << (i & 7));
+            }
+        } while (read_retry(table, first, last, sum));
+        return true;
+    }
+
+    bool CModbusSharedTables::write_bits(table_type table, uint16_t address, uint16_t count, const uint8_t* values)
+    {
+        if (register_table(table) || !check_range(table, address, count))
+            return false;
+        uint8_t* data = m_map + m_header->data_offset[table] + address;
+        size_t first = address / m_header->block_size, last = ((size_t)address + count - 1) / m_header->block_size;
+        write_lock(table, first, last);
+        for (uint16_t i = 0; i < count; ++i)
+            __atomic_store_n(&data[i], (uint8_t)((values[i >> 3] >> (i & 7)) & 1), __ATOMIC_RELAXED);
+        write_unlock(table, first, last);
+        return true;
+    }
+
+    CModbusSlaveHandlerShared::CModbusSlaveHandlerShared(CModbusSharedTables* tables)
+        :   m_tables(tables)
+    {
+    }
+
+    modbus_exception_code::modbus_exception_code CModbusSlaveHandlerShared::read_coils(uint16_t address, uint16_t count, uint8_t* result)
+    {
+        return m_tables->read_bits(CModbusSharedTables::coils, address, count, result) ? modbus_exception_code::ok : modbus_exception_code::illegal_data_address;
+    }
+
+    modbus_exception_code::modbus_exception_code CModbusSlaveHandlerShared::read_discrete_inputs(uint16_t address, uint16_t count, uint8_t* result)
+    {
+        return m_tables->read_bits(CModbusSharedTables::discrete_inputs, address, count, result) ? modbus_exception_code::ok : modbus_exception_code::illegal_data_address;
+    }
+
+    modbus_exception_code::modbus_exception_code CModbusSlaveHandlerShared::read_holding_registers(uint16_t address, uint16_t count, uint16_t* result)
+    {
+        return m_tables->read_registers(CModbusSharedTables::holding_registers, address, count, result) ? modbus_exception_code::ok : modbus_exception_code::illegal_data_address;
+    }
+
+    modbus_exception_code::modbus_exception_code CModbusSlaveHandlerShared::read_input_registers(uint16_t address, uint16_t count, uint16_t* result)
+    {
+        return m_tables->read_registers(CModbusSharedTables::input_registers, address, count, result) ? modbus_exception_code::ok : modbus_exception_code::illegal_data_address;
+    }
+
+    modbus_exception_code::modbus_exception_code CModbusSlaveHandlerShared::write_multiple_registers(uint16_t address, uint16_t count, const uint16_t* values)
+    {
+        return m_tables->write_registers(CModbusSharedTables::holding_registers, address, count, values) ? modbus_exception_code::ok : modbus_exception_code::illegal_data_address;
+    }
+
+    modbus_exception_code::modbus_exception_code CModbusSlaveHandlerShared::write_multiple_coils(uint16_t address, uint16_t count, const uint8_t* values)
+    {
+        return m_tables->write_bits(CModbusSharedTables::coils, address, count, values) ? modbus_exception_code::ok : modbus_exception_code::illegal_data_address;
+    }
+}
+#endif
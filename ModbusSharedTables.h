@@ -0,0 +1,167 @@
+#ifndef __ModbusPotato_SharedTables_h__
+#define __ModbusPotato_SharedTables_h__
+#include "ModbusSlaveHandlerBase.h"
+#ifdef __linux__
+namespace ModbusPotato
+{
+    /// <summary>
+    /// The header at the start of a shared register segment.
+    /// </summary>
+    /// <remarks>
+    /// The header is followed by the four tables and their sequence
+    /// counters, at the offsets given here.  The coils and discrete inputs
+    /// are stored one byte per bit, and the registers in host byte order.
+    /// Each table is divided into blocks of block_size items, and each block
+    /// has its own sequence counter.
+    /// </remarks>
+    struct CModbusSharedHeader
+    {
+        enum
+        {
+            magic_value = 0x54535050, // "PPST"
+            current_version = 1,
+        };
+        uint32_t magic; // set last by the creator
+        uint16_t version; // layout version
+        uint16_t block_size; // number of bits or registers per sequence counter
+        uint32_t count[4]; // number of items in each table, see CModbusSharedTables::table_type
+        uint32_t data_offset[4]; // byte offset of each table from the start of the segment
+        uint32_t seq_offset[4]; // byte offset of the sequence counters of each table
+        uint32_t size; // total size of the segment
+    };
+
+    /// <summary>
+    /// Maps the four Modbus tables from a POSIX shared memory segment so that several processes can use them.
+    /// </summary>
+    /// <remarks>
+    /// The process running the slave usually calls create(), and the other
+    /// processes call open().  All of them read and write the values
+    /// directly in the shared pages, with no round trip through another
+    /// process.
+    ///
+    /// Each block of the tables is protected by a sequence lock.  A writer
+    /// makes the counter odd while it changes the block and even again when
+    /// it is done, and writers exclude each other by taking the odd value
+    /// with a compare and swap.  A reader copies the values without taking
+    /// any lock, and copies them again if a counter was odd or changed while
+    /// it was copying, so readers never block the slave or each other.  A
+    /// read or write of a range is consistent across all of the blocks it
+    /// touches.
+    ///
+    /// A process which dies while writing leaves its blocks locked, so the
+    /// writers should be the slave and well behaved control processes.
+    /// </remarks>
+    class CModbusSharedTables
+    {
+    public:
+        enum table_type
+        {
+            coils = 0,
+            discrete_inputs,
+            holding_registers,
+            input_registers,
+            table_count,
+        };
+        enum
+        {
+            default_block_size = 64,
+        };
+        CModbusSharedTables();
+        ~CModbusSharedTables();
+
+        /// <summary>
+        /// Creates the segment with the given number of items in each table, or maps it if it already exists with the same layout.
+        /// </summary>
+        /// <returns>
+        /// false if the segment can't be created, or already exists with different counts or a different block size.
+        /// </returns>
+        /// <remarks>
+        /// The name follows the rules of shm_open(), i.e. "/plant-io".  The
+        /// values in an existing segment are kept, so the slave process can
+        /// be restarted without disturbing the other processes.
+        /// </remarks>
+        bool create(const char* name, size_t coil_count, size_t discrete_count, size_t holding_count, size_t input_count, uint16_t block_size = default_block_size);
+
+        /// <summary>
+        /// Maps an existing segment, with whatever layout it has.
+        /// </summary>
+        /// <returns>
+        /// false if the segment doesn't exist, is still being created, or has a different layout version.
+        /// </returns>
+        bool open(const char* name);
+
+        /// <summary>
+        /// Unmaps the segment.  The segment itself remains until remove() is called.
+        /// </summary>
+        void close();
+
+        /// <summary>
+        /// Removes the segment with the given name; processes which have it mapped may keep using it.
+        /// </summary>
+        static bool remove(const char* name);
+
+        /// <summary>
+        /// Returns the number of items in a table, or 0 if the segment is not mapped.
+        /// </summary>
+        size_t count(table_type table) const { return m_header ? m_header->count[table] : 0; }
+
+        /// <summary>
+        /// Copies a range of holding or input registers.
+        /// </summary>
+        /// <returns>
+        /// false if the table does not hold registers or the range is outside of it.
+        /// </returns>
+        bool read_registers(table_type table, uint16_t address, uint16_t count, uint16_t* values) const;
+
+        /// <summary>
+        /// Stores a range of holding or input registers.
+        /// </summary>
+        bool write_registers(table_type table, uint16_t address, uint16_t count, const uint16_t* values);
+
+        /// <summary>
+        /// Copies a range of coils or discrete inputs, packed eight to a byte starting with the least significant bit.
+        /// </summary>
+        bool read_bits(table_type table, uint16_t address, uint16_t count, uint8_t* values) const;
+
+        /// <summary>
+        /// Stores a range of coils or discrete inputs, packed eight to a byte starting with the least significant bit.
+        /// </summary>
+        bool write_bits(table_type table, uint16_t address, uint16_t count, const uint8_t* values);
+    private:
+        bool map(int fd);
+        bool check_range(table_type table, uint16_t address, uint16_t count) const;
+        uint32_t* sequence(table_type table) const { return (uint32_t*)(m_map + m_header->seq_offset[table]); }
+        uint64_t read_begin(table_type table, size_t first, size_t last) const;
+        bool read_retry(table_type table, size_t first, size_t last, uint64_t sum) const;
+        void write_lock(table_type table, size_t first, size_t last);
+        void write_unlock(table_type table, size_t first, size_t last);
+        uint8_t* m_map;
+        size_t m_map_size;
+        CModbusSharedHeader* m_header;
+    };
+
+    /// <summary>
+    /// This class serves all four Modbus tables from a CModbusSharedTables segment.
+    /// </summary>
+    /// <remarks>
+    /// Writes from the master are immediately visible to the other
+    /// processes mapping the segment, and values they write are returned
+    /// to the master on the next read.  An address outside of a table
+    /// returns an illegal data address exception.
+    /// </remarks>
+    class CModbusSlaveHandlerShared : public CModbusSlaveHandlerBase
+    {
+    public:
+        CModbusSlaveHandlerShared(CModbusSharedTables* tables);
+        virtual modbus_exception_code::modbus_exception_code read_coils(uint16_t address, uint16_t count, uint8_t* result);
+        virtual modbus_exception_code::modbus_exception_code read_discrete_inputs(uint16_t address, uint16_t count, uint8_t* result);
+        virtual modbus_exception_code::modbus_exception_code read_holding_registers(uint16_t address, uint16_t count, uint16_t* result);
+        virtual modbus_exception_code::modbus_exception_code read_input_registers(uint16_t address, uint16_t count, uint16_t* result);
+        virtual modbus_exception_code::modbus_exception_code write_multiple_registers(uint16_t address, uint16_t count, const uint16_t* values);
+        virtual modbus_exception_code::modbus_exception_code write_multiple_coils(uint16_t address, uint16_t count, const uint8_t* values);
+    private:
+        CModbusSharedTables* m_tables;
+    };
+}
+#endif
+#endif
@@ -1,9 +1,105 @@
 #include "ModbusSlave.h"
 namespace ModbusPotato
 {
+    // the standard functions, which are installed in the dispatch table of each slave
+    //
+    // Note: the codes are kept in a separate constant array so that a
+    // slave constructed before this file's static objects is still
+    // installed with the right entries.  Both arrays are in the order of
+    // builtin_index.
+    //
+    const uint8_t CModbusSlave::s_builtin_codes[builtin_count] =
+    {
+        read_coil_status,
+        read_discrete_input_status,
+        read_holding_registers,
+        read_input_registers,
+        write_single_coil,
+        write_single_register,
+        diagnostics,
+        get_comm_event_counter,
+        write_multiple_coils,
+        write_multiple_registers,
+    };
+    CModbusSlave::builtin_function CModbusSlave::s_builtins[builtin_count] =
+    {
+        builtin_function(&CModbusSlave::read_coils_rsp),
+        builtin_function(&CModbusSlave::read_discrete_inputs_rsp),
+        builtin_function(&CModbusSlave::read_holding_registers_rsp),
+        builtin_function(&CModbusSlave::read_input_registers_rsp),
+        builtin_function(&CModbusSlave::write_single_coil_rsp),
+        builtin_function(&CModbusSlave::write_single_register_rsp),
+        builtin_function(&CModbusSlave::diagnostics_rsp),
+        builtin_function(&CModbusSlave::comm_event_counter_rsp),
+        builtin_function(&CModbusSlave::write_multiple_coils_rsp),
+        builtin_function(&CModbusSlave::write_multiple_registers_rsp),
+    };
+
     CModbusSlave::CModbusSlave(ISlaveHandler* handler)
         :   m_handler(handler)
+        ,   m_pending_framer()
+        ,   m_pending_function()
+        ,   m_count()
+        ,   m_cache()
+        ,   m_cache_entry()
+        ,   m_cache_bypass()
+        ,   m_pending(pending_none)
+        ,   m_pending_result()
+        ,   m_message_count()
+        ,   m_no_response_count()
+        ,   m_busy_count()
+        ,   m_event_count()
+    {
+        for (size_t i = 0; i < max_function; ++i)
+            m_functions[i] = NULL;
+        for (size_t i = 0; i < builtin_count; ++i)
+            m_functions[s_builtin_codes[i]] = &s_builtins[i];
+    }
+
+    bool CModbusSlave::set_function(uint8_t function, IModbusFunction* handler)
+    {
+        if (!function || function >= max_function)
+            return false;
+        m_functions[function] = handler;
+
+        // the cache relies on the standard functions to read the holding registers and to see every write
+        switch (function)
+        {
+        case read_holding_registers:
+        case write_single_coil:
+        case write_single_register:
+        case write_multiple_coils:
+        case write_multiple_registers:
+            {
+                m_cache_bypass =
+                        m_functions[read_holding_registers] != &s_builtins[builtin_read_holding_registers]
+                    ||  m_functions[write_single_coil] != &s_builtins[builtin_write_single_coil]
+                    ||  m_functions[write_single_register] != &s_builtins[builtin_write_single_register]
+                    ||  m_functions[write_multiple_coils] != &s_builtins[builtin_write_multiple_coils]
+                    ||  m_functions[write_multiple_registers] != &s_builtins[builtin_write_multiple_registers];
+
+                // the registers may have been written without the cache seeing it
+                m_cache_entry = NULL;
+                if (m_cache)
+                    m_cache->invalidate();
+                break;
+            }
+        }
+        return true;
+    }
+
+    modbus_exception_code::modbus_exception_code CModbusSlave::builtin_function::execute(CModbusSlave* slave, IFramer* framer)
     {
+        // the data model functions need the handler
+        if (!slave->m_handler && m_execute != &CModbusSlave::comm_event_counter_rsp)
+            return modbus_exception_code::illegal_function;
+        return (modbus_exception_code::modbus_exception_code)(slave->*m_execute)(framer);
+    }
+
+    void CModbusSlave::builtin_function::finish(CModbusSlave* slave, IFramer* framer)
+    {
+        slave->finish_rsp(framer);
+        slave->update_cache(framer);
     }
 
     void CModbusSlave::frame_ready(IFramer* framer)
@@ -19,46 +115,127 @@ namespace ModbusPotato
         // lock the buffer
         if (!framer->begin_send())
             return; // collision
+        m_message_count++;
+
+        // find the handler for the function code
+        IModbusFunction* handler = function(framer->buffer()[0]);
+
+        // only one request can be deferred at a time, but the standard event counter can be read while one is
+        if (m_pending != pending_none && (!handler || handler != &s_builtins[builtin_get_comm_event_counter]))
+        {
+            m_busy_count++;
+            send_response(framer, modbus_exception_code::server_device_busy);
+            return;
+        }
+        if (!handler)
+        {
+            send_response(framer, modbus_exception_code::illegal_function);
+            return;
+        }
+
+        // answer reads of the cached ranges without calling the handler
+        if (cached_rsp(framer))
+        {
+            send_response(framer, modbus_exception_code::ok);
+            return;
+        }
+
+        // hold on to the buffer in case the handler defers the response
+        //
+        // Note: this is done before calling the handler, since complete()
+        // may be called from another context before the handler returns.
+        // The standard event counter never defers, and reports whether
+        // another request is deferred, so it is left out.
+        //
+        bool deferrable = m_pending == pending_none && handler != &s_builtins[builtin_get_comm_event_counter];
+        if (deferrable)
+        {
+            m_pending_framer = framer;
+            m_pending_function = handler;
+            store_release(m_pending, (uint8_t)pending_waiting);
+        }
 
         // handle the function code
         //
         // See http://www.modbus.org/docs/Modbus_Application_Protocol_V1_1b3.pdf
         //
-        uint8_t result = modbus_exception_code::illegal_function;
-        if (m_handler)
+        uint8_t result = handler->execute(this, framer);
+
+        // check if the handler deferred the response
+        if (result == modbus_exception_code::pending)
         {
-            switch (framer->buffer()[0])
-            {
-            case read_coil_status:
-                result = read_bit_input_rsp(framer, false);
-                break;
-            case read_discrete_input_status:
-                result = read_bit_input_rsp(framer, true);
-                break;
-            case read_holding_registers:
-                result = read_registers_rsp(framer, true);
-                break;
-            case read_input_registers:
-                result = read_registers_rsp(framer, false);
-                break;
-            case write_single_coil:
-                result = write_single_coil_rsp(framer);
-                break;
-            case write_single_register:
-                result = write_single_register_rsp(framer);
-                break;
-            case write_multiple_coils:
-                result = write_multiple_coils_rsp(framer);
-                break;
-            case write_multiple_registers:
-                result = write_multiple_registers_rsp(framer);
-                break;
-            }
+            if (deferrable)
+                return; // the response will be sent from poll_queue()
+            result = modbus_exception_code::server_device_failure;
         }
+        else if (deferrable)
+        {
+            // answered right away; release the buffer
+            m_pending_framer = NULL;
+            m_pending_function = NULL;
+            m_pending = pending_none;
+        }
+
+        // build the response
+        if (result == modbus_exception_code::ok)
+            handler->finish(this, framer);
+
+        // send the result back
+        send_response(framer, result);
+    }
+
+    void CModbusSlave::poll_queue(IFramer* framer)
+    {
+        // check if the deferred request for this framer has been completed
+        //
+        // Note: the acquire load orders the reads of the result and of the
+        // buffer after it, pairing with the release store in complete().
+        //
+        if (framer != m_pending_framer || load_acquire(m_pending) != pending_completed)
+            return; // still waiting
+
+        // release the pending request
+        uint8_t result = m_pending_result;
+        IModbusFunction* handler = m_pending_function;
+        m_pending_framer = NULL;
+        m_pending_function = NULL;
+        m_pending = pending_none;
+
+        // build and send the response
+        if (result == modbus_exception_code::ok)
+            handler->finish(this, framer);
+        send_response(framer, result);
+    }
+
+    void CModbusSlave::complete(modbus_exception_code::modbus_exception_code result)
+    {
+        // make sure there is something to complete
+        if (m_pending != pending_waiting)
+            return;
+
+        // the handler must not defer the same request twice
+        if (result == modbus_exception_code::pending)
+            result = modbus_exception_code::server_device_failure;
+
+        // record the result; the response is sent by the framer's poll()
+        //
+        // Note: the release store publishes the result, and anything the
+        // handler wrote to the buffer before calling this, to poll_queue().
+        //
+        m_pending_result = result;
+        store_release(m_pending, (uint8_t)pending_completed);
+    }
+
+    void CModbusSlave::send_response(IFramer* framer, uint8_t result)
+    {
+        // count the successfully completed requests for the event counter
+        if (result == modbus_exception_code::ok && framer->buffer()[0] != get_comm_event_counter)
+            m_event_count++;
 
         // exit if this is a broadcast packet (no response needed)
         if (framer->station_address() && !framer->frame_address())
         {
+            m_no_response_count++;
             framer->finished();
             return;
         }
@@ -77,6 +254,128 @@ namespace ModbusPotato
         framer->send();
     }
 
+    void CModbusSlave::finish_rsp(IFramer* framer)
+    {
+        // build the response once the handler has succeeded
+        //
+        // Note: m_count is the number of bits or registers in the request,
+        // which may have been over-written in the buffer by the result.
+        //
+        uint8_t* buffer = framer->buffer();
+        switch (buffer[0])
+        {
+        case read_coil_status:
+        case read_discrete_input_status:
+            {
+                // update the byte count and packet length
+                //
+                // buffer[0] = fc
+                // buffer[1] = byte count
+                // buffer[2+] = data
+                //
+                size_t bytes = (m_count + 7) / 8;
+                buffer[1] = (uint8_t)bytes;
+                framer->set_buffer_len(bytes + 2);
+                break;
+            }
+        case read_holding_registers:
+        case read_input_registers:
+            {
+                // set the resulting byte count and buffer length
+                buffer[1] = (uint8_t)(m_count * 2);
+                framer->set_buffer_len(m_count * 2 + 2);
+
+                // fixup the byte order of the resulting registers
+                uint16_t* regs = (uint16_t*)(buffer + 2);
+                for (uint16_t i = 0; i < m_count; ++i)
+                    regs[i] = htons(regs[i]);
+                break;
+            }
+        case write_multiple_coils:
+        case write_multiple_registers:
+            {
+                // the response echoes the address and count, which are still in the buffer
+                framer->set_buffer_len(5);
+                break;
+            }
+        }
+    }
+
+    bool CModbusSlave::cached_rsp(IFramer* framer)
+    {
+        // only plain reads of holding registers by the standard function are cached
+        m_cache_entry = NULL;
+        uint8_t* buffer = framer->buffer();
+        if (!m_cache || m_cache_bypass || buffer[0] != read_holding_registers || framer->buffer_len() != 5)
+            return false;
+
+        // find the entry for the range
+        uint16_t address = ((uint16_t)buffer[1] << 8) | buffer[2];
+        uint16_t count = ((uint16_t)buffer[3] << 8) | buffer[4];
+        CModbusCachedResponse* entry = m_cache->find(address, count);
+        size_t len = count * 2 + 2;
+        if (!entry || len > framer->buffer_max())
+            return false;
+
+        // remember the entry so that the handler's result can be stored by update_cache()
+        if (!entry->valid)
+        {
+            m_cache_entry = entry;
+            m_cache->misses++;
+            return false;
+        }
+
+        // copy the stored response into the framer
+        //
+        // Note: the checksum only applies if the response is sent with the
+        // same station address it was calculated for.
+        //
+        for (size_t i = 0; i < len; ++i)
+            buffer[i] = entry->pdu[i];
+        framer->set_buffer_len(len);
+        if (entry->station == framer->frame_address())
+            framer->set_checksum(entry->checksum);
+        m_cache->hits++;
+        return true;
+    }
+
+    void CModbusSlave::update_cache(IFramer* framer)
+    {
+        // keep the cache in step with a request which succeeded
+        //
+        // Note: this is called after finish_rsp(), when the registers
+        // written by function 0x10 are still in the buffer after the echoed
+        // address and count, in host byte order.
+        //
+        CModbusCachedResponse* entry = m_cache_entry;
+        m_cache_entry = NULL;
+        if (!m_cache)
+            return;
+        uint8_t* buffer = framer->buffer();
+        uint16_t address = ((uint16_t)buffer[1] << 8) | buffer[2];
+        switch (buffer[0])
+        {
+        case read_holding_registers:
+            {
+                // store the response to a read of a cached range
+                if (entry)
+                    m_cache->store(entry, framer->frame_address(), buffer);
+                break;
+            }
+        case write_single_register:
+            {
+                uint16_t value = ((uint16_t)buffer[3] << 8) | buffer[4];
+                m_cache->update(address, 1, &value);
+                break;
+            }
+        case write_multiple_registers:
+            {
+                m_cache->update(address, m_count, (const uint16_t*)(buffer + 6));
+                break;
+            }
+        }
+    }
+
     uint8_t CModbusSlave::read_bit_input_rsp(IFramer* framer, bool discrete)
     {
         if (framer->buffer_len() != 5)
@@ -101,21 +400,11 @@ namespace ModbusPotato
             return modbus_exception_code::illegal_data_value; // count not valid
 
         // execute the handler
-        uint8_t result = modbus_exception_code::illegal_function;
+        m_count = count;
         if (discrete)
-            result = m_handler->read_discrete_inputs(address, count, buffer + 2);
+            return m_handler->read_discrete_inputs(address, count, buffer + 2);
         else
-            result = m_handler->read_coils(address, count, buffer + 2);
-
-        // check if something went wrong
-        if (result != modbus_exception_code::ok)
-            return result; // error
-
-        // update the byte count and packet length
-        buffer[1] = bytes;
-        framer->set_buffer_len(buffer_len);
-
-        return modbus_exception_code::ok;
+            return m_handler->read_coils(address, count, buffer + 2);
     }
 
     uint8_t CModbusSlave::read_registers_rsp(IFramer* framer, bool holding)
@@ -145,25 +434,11 @@ namespace ModbusPotato
         uint16_t* regs = (uint16_t*)(buffer + 2);
 
         // execute the handler
-        uint8_t result = modbus_exception_code::illegal_function;
+        m_count = count;
         if (holding)
-            result = m_handler->read_holding_registers(address, count, regs);
+            return m_handler->read_holding_registers(address, count, regs);
         else
-            result = m_handler->read_input_registers(address, count, regs);
-
-        // check if something went wrong
-        if (result != modbus_exception_code::ok)
-            return result; // error
-
-        // set the resulting byte count and buffer length
-        buffer[1] = count * 2;
-        framer->set_buffer_len(buffer_len);
-
-        // fixup the byte order of the resulting registers
-        for (uint16_t i = 0; i < count; ++i)
-            regs[i] = htons(regs[i]);
-
-        return modbus_exception_code::ok;
+            return m_handler->read_input_registers(address, count, regs);
     }
 
     uint8_t CModbusSlave::write_single_coil_rsp(IFramer* framer)
@@ -214,17 +489,8 @@ namespace ModbusPotato
             return modbus_exception_code::illegal_data_value;
 
         // execute the handler
-        if (uint8_t result = m_handler->write_multiple_coils(address, count, buffer + 6))
-            return result; // error
-
-        // set the result buffer
-        buffer[1] = (uint8_t)(address >> 8);
-        buffer[2] = (uint8_t)address;
-        buffer[3] = (uint8_t)(count >> 8);
-        buffer[4] = (uint8_t)count;
-        framer->set_buffer_len(5);
-
-        return modbus_exception_code::ok;
+        m_count = count;
+        return m_handler->write_multiple_coils(address, count, buffer + 6);
     }
 
     uint8_t CModbusSlave::write_multiple_registers_rsp(IFramer* framer)
@@ -251,16 +517,125 @@ namespace ModbusPotato
             regs[i] = htons(regs[i]);
 
         // execute the handler
-        if (uint8_t result = m_handler->write_multiple_registers(address, count, regs))
-            return result; // error
-
-        // set the result buffer
-        buffer[1] = (uint8_t)(address >> 8);
-        buffer[2] = (uint8_t)address;
-        buffer[3] = (uint8_t)(count >> 8);
-        buffer[4] = (uint8_t)count;
-        framer->set_buffer_len(5);
+        m_count = count;
+        return m_handler->write_multiple_registers(address, count, regs);
+    }
+
+    uint8_t CModbusSlave::diagnostics_rsp(IFramer* framer)
+    {
+        // see section 6.8 of http://www.modbus.org/docs/Modbus_Application_Protocol_V1_1b3.pdf
+        if (framer->buffer_len() < 3)
+            return modbus_exception_code::illegal_function;
+
+        // determine the sub-function
+        //
+        // buffer[0] = fc
+        // buffer[1] = sub-function H
+        // buffer[2] = sub-function L
+        // buffer[3+] = data
+        //
+        uint8_t* buffer = framer->buffer();
+        uint16_t sub_function = ((uint16_t)buffer[1] << 8) | buffer[2];
+
+        // the response to 'return query data' is an echo of the request
+        if (sub_function == diag_return_query_data)
+            return modbus_exception_code::ok;
+
+        // the remaining sub-functions have a single data word
+        if (framer->buffer_len() != 5)
+            return modbus_exception_code::illegal_function;
+
+        // find the counter to return in the data word
+        //
+        // Note: the framer discards frames for other stations before
+        // checking them, so the bus message count only includes the frames
+        // for this station and broadcasts.
+        //
+#if MODBUS_STATISTICS
+        CModbusStatistics* stats = framer->statistics();
+#else
+        CModbusStatistics* stats = NULL;
+#endif
+        uint16_t value;
+        switch (sub_function)
+        {
+        case diag_clear_counters:
+            {
+                // clear the counters and echo the request
+                if (stats)
+                    stats->clear();
+                m_message_count = m_no_response_count = m_busy_count = m_event_count = 0;
+                return modbus_exception_code::ok;
+            }
+        case diag_bus_message_count:
+            {
+                if (!stats)
+                    return modbus_exception_code::illegal_function;
+                value = (uint16_t)stats->rx_frames;
+                break;
+            }
+        case diag_bus_communication_error_count:
+            {
+                if (!stats)
+                    return modbus_exception_code::illegal_function;
+                value = (uint16_t)stats->checksum_errors;
+                break;
+            }
+        case diag_bus_exception_error_count:
+            {
+                if (!stats)
+                    return modbus_exception_code::illegal_function;
+                value = (uint16_t)stats->exceptions;
+                break;
+            }
+        case diag_bus_character_overrun_count:
+            {
+                if (!stats)
+                    return modbus_exception_code::illegal_function;
+                value = (uint16_t)stats->overruns;
+                break;
+            }
+        case diag_slave_message_count:
+            value = m_message_count;
+            break;
+        case diag_slave_no_response_count:
+            value = m_no_response_count;
+            break;
+        case diag_slave_nak_count:
+            value = 0; // negative acknowledgements are never sent
+            break;
+        case diag_slave_busy_count:
+            value = m_busy_count;
+            break;
+        default:
+            return modbus_exception_code::illegal_function;
+        }
 
+        // the response echoes the sub-function with the counter in place of the data
+        buffer[3] = (uint8_t)(value >> 8);
+        buffer[4] = (uint8_t)value;
+        return modbus_exception_code::ok;
+    }
+
+    uint8_t CModbusSlave::comm_event_counter_rsp(IFramer* framer)
+    {
+        // see section 6.9 of http://www.modbus.org/docs/Modbus_Application_Protocol_V1_1b3.pdf
+        if (framer->buffer_len() != 1)
+            return modbus_exception_code::illegal_function;
+
+        // build the response
+        //
+        // buffer[0] = fc
+        // buffer[1..2] = status word, 0xFFFF if a request is still being processed
+        // buffer[3..4] = event count
+        //
+        uint8_t* buffer = framer->buffer();
+        uint16_t status = m_pending != pending_none ? 0xffff : 0;
+        buffer[1] = (uint8_t)(status >> 8);
+        buffer[2] = (uint8_t)status;
+        buffer[3] = (uint8_t)(m_event_count >> 8);
+        buffer[4] = (uint8_t)m_event_count;
+        framer->set_buffer_len(5);
         return modbus_exception_code::ok;
     }
 }
@@ -1,22 +1,185 @@
 #include "ModbusInterface.h"
+#include "ModbusResponseCache.h"
 namespace ModbusPotato
 {
+    // forward declarations
+    class CModbusSlave;
+
+    /// <summary>
+    /// Handles one function code in the dispatch table of CModbusSlave.
+    /// </summary>
+    /// <remarks>
+    /// The request PDU, starting with the function code, is in the framer's
+    /// buffer, and the response is built in place using buffer() and
+    /// set_buffer_len().  execute() returns modbus_exception_code::ok to send
+    /// the response, an exception code to send an exception response
+    /// instead, or modbus_exception_code::pending to defer the request
+    /// until CModbusSlave::complete() is called.  finish() is called once
+    /// the request has succeeded, including after a deferred request is
+    /// completed, and may be used to build the parts of the response which
+    /// depend on the result.
+    /// </remarks>
+    class IModbusFunction
+    {
+    public:
+        virtual ~IModbusFunction() {}
+        virtual modbus_exception_code::modbus_exception_code execute(CModbusSlave* slave, IFramer* framer) = 0;
+        virtual void finish(CModbusSlave*, IFramer*) {}
+    };
+
     /// <summary>
     /// This class implements a basic Modbus slave interface.
     /// </summary>
+    /// <remarks>
+    /// If the ISlaveHandler returns modbus_exception_code::pending, the
+    /// request is held in the framer buffer until complete() is called, and
+    /// the response is then sent from the next call to the framer's poll().
+    /// Only one request can be pending at a time.
+    ///
+    /// Function 0x08 (Diagnostics) and 0x0B (Get Comm Event Counter) are
+    /// answered by the slave itself.  The bus counters are taken from the
+    /// framer's CModbusStatistics, and the sub-functions which need them
+    /// return an illegal function exception if the framer does not keep
+    /// statistics.
+    ///
+    /// If a response cache is set, reads of the cached ranges of holding
+    /// registers are answered from it, and writes through the slave are
+    /// applied to it.  See CModbusResponseCache.  The cache is bypassed
+    /// while the read holding registers function or any of the write
+    /// functions (0x05, 0x06, 0x0F and 0x10) is replaced using
+    /// set_function(), since the replacement does not keep it up to date,
+    /// and it is invalidated whenever one of them is replaced or restored.
+    ///
+    /// Requests are dispatched through a table indexed by the function
+    /// code.  The standard functions above are entries in the table, which
+    /// call the ISlaveHandler, and set_function() installs an
+    /// IModbusFunction for any other code, such as the user defined codes
+    /// 65 to 72 and 100 to 110, or replaces a standard one.  Function codes
+    /// of 0x80 and above are exception responses, so the table only has
+    /// entries for the codes below.
+    /// </remarks>
     class CModbusSlave : public IFrameHandler
     {
     public:
         CModbusSlave(ISlaveHandler* handler);
         virtual void frame_ready(IFramer* framer);
+        virtual void poll_queue(IFramer* framer);
+
+        /// <summary>
+        /// Completes a request that was deferred by the handler.
+        /// </summary>
+        /// <remarks>
+        /// The result is either modbus_exception_code::ok if the handler has
+        /// filled in the result buffer it was given, or an exception code to
+        /// send back to the master.
+        ///
+        /// This only records the result, so it may be called from another
+        /// context such as an interrupt handler or another thread.  The
+        /// framer's poll() method must be called afterwards to send the
+        /// response.
+        ///
+        /// The result is published with a release store and read by poll()
+        /// with an acquire load (see store_release() and load_acquire()), so
+        /// everything the handler wrote to the result buffer before calling
+        /// this is seen by the slave.  On targets without threads, these
+        /// reduce to a compiler barrier, which is what an interrupt handler
+        /// relies on.
+        /// </remarks>
+        void complete(modbus_exception_code::modbus_exception_code result);
+
+        /// <summary>
+        /// Returns true if a deferred request is waiting for complete() or to be sent.
+        /// </summary>
+        bool pending() const { return m_pending != pending_none; }
+
+        /// <summary>
+        /// Sets the cache used to answer repeated reads of holding registers, or NULL to disable it.
+        /// </summary>
+        void set_response_cache(CModbusResponseCache* cache) { m_cache = cache; m_cache_entry = NULL; }
+
+        /// <summary>
+        /// Installs the handler for a function code, or NULL to answer it with an illegal function exception.
+        /// </summary>
+        /// <returns>
+        /// false if the function code is 0 or an exception code.
+        /// </returns>
+        /// <remarks>
+        /// The previous handler, which may be one of the standard functions,
+        /// can be saved with function() to restore it later or to pass on
+        /// the requests it should still handle.
+        /// </remarks>
+        bool set_function(uint8_t function, IModbusFunction* handler);
+
+        /// <summary>
+        /// Returns the handler for a function code, or NULL if there is none.
+        /// </summary>
+        IModbusFunction* function(uint8_t function) const { return function && function < max_function ? m_functions[function] : NULL; }
     private:
+        enum
+        {
+            max_function = 0x80, // codes from here on are exception responses
+        };
+
+        // an entry in the dispatch table for one of the standard functions
+        class builtin_function : public IModbusFunction
+        {
+        public:
+            typedef uint8_t (CModbusSlave::*execute_type)(IFramer* framer);
+            builtin_function(execute_type execute) : m_execute(execute) {}
+            virtual modbus_exception_code::modbus_exception_code execute(CModbusSlave* slave, IFramer* framer);
+            virtual void finish(CModbusSlave* slave, IFramer* framer);
+            execute_type m_execute;
+        };
+        enum builtin_index // index of each standard function in s_builtin_codes and s_builtins
+        {
+            builtin_read_coils,
+            builtin_read_discrete_inputs,
+            builtin_read_holding_registers,
+            builtin_read_input_registers,
+            builtin_write_single_coil,
+            builtin_write_single_register,
+            builtin_diagnostics,
+            builtin_get_comm_event_counter,
+            builtin_write_multiple_coils,
+            builtin_write_multiple_registers,
+            builtin_count,
+        };
+        static const uint8_t s_builtin_codes[builtin_count];
+        static builtin_function s_builtins[builtin_count];
+        uint8_t read_coils_rsp(IFramer* framer) { return read_bit_input_rsp(framer, false); }
+        uint8_t read_discrete_inputs_rsp(IFramer* framer) { return read_bit_input_rsp(framer, true); }
+        uint8_t read_holding_registers_rsp(IFramer* framer) { return read_registers_rsp(framer, true); }
+        uint8_t read_input_registers_rsp(IFramer* framer) { return read_registers_rsp(framer, false); }
+        void send_response(IFramer* framer, uint8_t result);
+        void finish_rsp(IFramer* framer);
+        bool cached_rsp(IFramer* framer);
+        void update_cache(IFramer* framer);
         uint8_t read_bit_input_rsp(IFramer* framer, bool discrete);
         uint8_t read_registers_rsp(IFramer* framer, bool holding);
         uint8_t write_single_coil_rsp(IFramer* framer);
         uint8_t write_single_register_rsp(IFramer* framer);
         uint8_t write_multiple_coils_rsp(IFramer* framer);
         uint8_t write_multiple_registers_rsp(IFramer* framer);
+        uint8_t diagnostics_rsp(IFramer* framer);
+        uint8_t comm_event_counter_rsp(IFramer* framer);
         ISlaveHandler* m_handler;
+        IModbusFunction* m_functions[max_function];
+        IFramer* m_pending_framer;
+        IModbusFunction* m_pending_function;
+        uint16_t m_count;
+        CModbusResponseCache* m_cache;
+        CModbusCachedResponse* m_cache_entry;
+        bool m_cache_bypass; // true if a standard function which reads or writes holding registers was replaced
+        enum pending_type
+        {
+            pending_none,
+            pending_waiting,
+            pending_completed,
+        };
+        volatile uint8_t m_pending, m_pending_result;
+
+        // diagnostic counters which are not kept by the framer
+        uint16_t m_message_count, m_no_response_count, m_busy_count, m_event_count;
         enum
         {
             read_coil_status = 0x01,
@@ -25,8 +188,23 @@ namespace ModbusPotato
             read_input_registers = 0x04,
             write_single_coil = 0x05,
             write_single_register = 0x06,
+            diagnostics = 0x08,
+            get_comm_event_counter = 0x0b,
             write_multiple_coils = 0x0f,
             write_multiple_registers = 0x10,
         };
+        enum diagnostic_type
+        {
+            diag_return_query_data = 0x00,
+            diag_clear_counters = 0x0a,
+            diag_bus_message_count = 0x0b,
+            diag_bus_communication_error_count = 0x0c,
+            diag_bus_exception_error_count = 0x0d,
+            diag_slave_message_count = 0x0e,
+            diag_slave_no_response_count = 0x0f,
+            diag_slave_nak_count = 0x10,
+            diag_slave_busy_count = 0x11,
+            diag_bus_character_overrun_count = 0x12,
+        };
     };
 }
@@ -4,6 +4,10 @@ namespace ModbusPotato
     CModbusSlaveHandlerHolding::CModbusSlaveHandlerHolding(uint16_t* array, size_t len)
         :  m_array(array)
         ,  m_len(len)
+        ,  m_dirty()
+        ,  m_dirty_begin()
+        ,  m_dirty_end()
+        ,  m_subscriptions()
     {
     }
 
@@ -33,9 +37,146 @@ namespace ModbusPotato
             return modbus_exception_code::illegal_data_address;
 
         // copy the values
-        for (; count; ++address, --count)
-            m_array[address] = *values++;
+        for (uint16_t i = 0; i < count; ++i)
+            m_array[address + i] = *values++;
+
+        // record the change and notify any subscribers
+        mark_dirty(address, count);
+        notify(address, count);
 
         return modbus_exception_code::ok;
     }
+
+    void CModbusSlaveHandlerHolding::set_dirty_bitmap(uint8_t* bitmap)
+    {
+        m_dirty = bitmap;
+        m_dirty_begin = m_dirty_end = 0;
+        if (!m_dirty)
+            return;
+
+        // start with no changes
+        for (size_t i = 0; i < (m_len + 7) / 8; ++i)
+            m_dirty[i] = 0;
+    }
+
+    void CModbusSlaveHandlerHolding::mark_dirty(uint16_t address, uint16_t count)
+    {
+        if (!m_dirty || !count)
+            return;
+
+        // set the bits for each register in the range
+        //
+        // Note: whole bytes in the middle of the range are set directly
+        // instead of bit by bit.
+        //
+        size_t begin = address, end = (size_t)address + count;
+        size_t i = begin;
+        for (; i < end && (i & 7); ++i)
+            m_dirty[i >> 3] |= (uint8_t)(1 << (i & 7));
+        for (; i + 8 <= end; i += 8)
+            m_dirty[i >> 3] = 0xff;
+        for (; i < end; ++i)
+            m_dirty[i >> 3] |= (uint8_t)(1 << (i & 7));
+
+        // extend the range that must be scanned by next_change()
+        if (m_dirty_begin >= m_dirty_end)
+        {
+            m_dirty_begin = begin;
+            m_dirty_end = end;
+            return;
+        }
+        if (begin < m_dirty_begin)
+            m_dirty_begin = begin;
+        if (end > m_dirty_end)
+            m_dirty_end = end;
+    }
+
+    bool CModbusSlaveHandlerHolding::next_change(uint16_t& address, uint16_t& count)
+    {
+        if (!m_dirty)
+            return false;
+
+        // find the first set bit, skipping over clear bytes
+        //
+        // Note: only the range between the lowest and highest register
+        // written since the last drain is scanned.
+        //
+        size_t i = m_dirty_begin;
+        while (i < m_dirty_end)
+        {
+            if (!(i & 7) && !m_dirty[i >> 3])
+            {
+                i += 8;
+                continue;
+            }
+            if (m_dirty[i >> 3] & (1 << (i & 7)))
+                break;
+            ++i;
+        }
+
+        // check if there are no more changes
+        if (i >= m_dirty_end)
+        {
+            m_dirty_begin = m_dirty_end = 0;
+            return false;
+        }
+
+        // find the end of the run, clearing the bits as we go
+        size_t start = i;
+        while (i < m_dirty_end && (m_dirty[i >> 3] & (1 << (i & 7))))
+        {
+            m_dirty[i >> 3] &= (uint8_t)~(1 << (i & 7));
+            ++i;
+        }
+
+        // return the range and advance past it
+        address = (uint16_t)start;
+        count = (uint16_t)(i - start);
+        m_dirty_begin = i;
+        return true;
+    }
+
+    void CModbusSlaveHandlerHolding::clear_changes()
+    {
+        uint16_t address, count;
+        while (next_change(address, count))
+        {
+        }
+    }
+
+    void CModbusSlaveHandlerHolding::subscribe(CModbusRegisterSubscription* subscription)
+    {
+        subscription->next = m_subscriptions;
+        m_subscriptions = subscription;
+    }
+
+    void CModbusSlaveHandlerHolding::unsubscribe(CModbusRegisterSubscription* subscription)
+    {
+        for (CModbusRegisterSubscription** p = &m_subscriptions; *p; p = &(*p)->next)
+        {
+            if (*p == subscription)
+            {
+                *p = subscription->next;
+                subscription->next = NULL;
+                return;
+            }
+        }
+    }
+
+    void CModbusSlaveHandlerHolding::notify(uint16_t address, uint16_t count)
+    {
+        size_t end = (size_t)address + count;
+        for (CModbusRegisterSubscription* p = m_subscriptions; p; p = p->next)
+        {
+            // clip the written range to the subscribed range
+            size_t sub_begin = p->address, sub_end = (size_t)p->address + p->count;
+            size_t begin = address > sub_begin ? address : sub_begin;
+            size_t last = end < sub_end ? end : sub_end;
+            if (begin >= last || !p->handler)
+                continue;
+
+            // notify the subscriber
+            p->handler->registers_changed((uint16_t)begin, (uint16_t)(last - begin));
+        }
+    }
 }
@@ -3,18 +3,115 @@
 #include "ModbusSlaveHandlerBase.h"
 namespace ModbusPotato
 {
+    /// <summary>
+    /// Receives notifications when the master writes to a range of holding registers.
+    /// </summary>
+    class IRegisterChangeHandler
+    {
+    public:
+        virtual ~IRegisterChangeHandler() {}
+
+        /// <summary>
+        /// Called after the master has written the given range of registers.
+        /// </summary>
+        /// <remarks>
+        /// The range is clipped to the subscribed range, so only the
+        /// registers the subscriber asked for are reported.
+        /// </remarks>
+        virtual void registers_changed(uint16_t address, uint16_t count) = 0;
+    };
+
+    /// <summary>
+    /// Describes a subscription to changes in a range of holding registers.
+    /// </summary>
+    /// <remarks>
+    /// The subscription object is owned by the application and linked into
+    /// the handler using CModbusSlaveHandlerHolding::subscribe(), so no memory
+    /// is allocated.  It must remain valid until it is unsubscribed.
+    /// </remarks>
+    struct CModbusRegisterSubscription
+    {
+        CModbusRegisterSubscription(IRegisterChangeHandler* handler, uint16_t address, uint16_t count)
+            :   handler(handler)
+            ,   address(address)
+            ,   count(count)
+            ,   next()
+        {
+        }
+        IRegisterChangeHandler* handler;
+        uint16_t address, count;
+        CModbusRegisterSubscription* next;
+    };
+
     /// <summary>
     /// This class is an example of a slave handler for reading and writing holding registers to an array.
     /// </summary>
+    /// <remarks>
+    /// Registers written by the master can optionally be tracked in a dirty
+    /// bitmap supplied by the application using set_dirty_bitmap(), and then
+    /// drained once per cycle with next_change().  Alternatively, the
+    /// application can subscribe to ranges of registers to be notified as
+    /// soon as they are written.  Either way the cost of reacting to a write
+    /// is proportional to the number of registers written and not to the size
+    /// of the register array.
+    /// </remarks>
     class CModbusSlaveHandlerHolding : public CModbusSlaveHandlerBase
     {
     public:
         CModbusSlaveHandlerHolding(uint16_t* array, size_t len);
         virtual modbus_exception_code::modbus_exception_code read_holding_registers(uint16_t address, uint16_t count, uint16_t* result);
         virtual modbus_exception_code::modbus_exception_code write_multiple_registers(uint16_t address, uint16_t count, const uint16_t* values);
+
+        /// <summary>
+        /// Sets the bitmap used to track the registers written by the master, or NULL to disable tracking.
+        /// </summary>
+        /// <remarks>
+        /// The bitmap must be at least (len + 7) / 8 bytes long, where len is
+        /// the number of registers passed to the constructor.  Bit 0 of the
+        /// first byte corresponds to the first holding register (40001).  The
+        /// bitmap is cleared when it is set.
+        /// </remarks>
+        void set_dirty_bitmap(uint8_t* bitmap);
+
+        /// <summary>
+        /// Returns true if any registers have been written since the last call to next_change().
+        /// </summary>
+        bool dirty() const { return m_dirty_begin < m_dirty_end; }
+
+        /// <summary>
+        /// Removes the next contiguous range of written registers from the dirty bitmap.
+        /// </summary>
+        /// <returns>
+        /// true if a range was returned, or false if there are no more changes.
+        /// </returns>
+        /// <remarks>
+        /// This is meant to be called in a loop once per cycle until it
+        /// returns false.  The ranges are returned in ascending address order.
+        /// </remarks>
+        bool next_change(uint16_t& address, uint16_t& count);
+
+        /// <summary>
+        /// Clears all pending changes from the dirty bitmap.
+        /// </summary>
+        void clear_changes();
+
+        /// <summary>
+        /// Adds a subscription for changes to a range of registers.
+        /// </summary>
+        void subscribe(CModbusRegisterSubscription* subscription);
+
+        /// <summary>
+        /// Removes a subscription previously added with subscribe().
+        /// </summary>
+        void unsubscribe(CModbusRegisterSubscription* subscription);
     private:
+        void mark_dirty(uint16_t address, uint16_t count);
+        void notify(uint16_t address, uint16_t count);
         uint16_t* m_array;
         size_t m_len;
+        uint8_t* m_dirty;
+        size_t m_dirty_begin, m_dirty_end;
+        CModbusRegisterSubscription* m_subscriptions;
     };
 }
 #endif
@@ -0,0 +1,120 @@
+// Diagnostic counters maintained by the framers.
+//
+#ifndef __ModbusPotato_Statistics_h__
+#define __ModbusPotato_Statistics_h__
+#include "ModbusTypes.h"
+
+// Set MODBUS_STATISTICS to 0 to compile the counters out of the framers.
+//
+// They are disabled by default on AVR, where the RAM and the cycles spent
+// updating them are better used elsewhere.
+//
+#ifndef MODBUS_STATISTICS
+#ifdef __AVR__
+#define MODBUS_STATISTICS 0
+#else
+#define MODBUS_STATISTICS 1
+#endif
+#endif
+
+// add to or increment one of the counters
+//
+// Note: the counters are only written by the thread calling poll(), so a
+// read-modify-write is safe.  The store is atomic so that another thread
+// can read the counters without a lock.
+//
+#if MODBUS_STATISTICS
+#ifdef __GNUC__
+#define MODBUS_STATISTICS_ADD(counter, n) __atomic_store_n(&(counter), (uint32_t)((counter) + (n)), __ATOMIC_RELAXED)
+#else
+#define MODBUS_STATISTICS_ADD(counter, n) ((counter) += (uint32_t)(n))
+#endif
+#else
+#define MODBUS_STATISTICS_ADD(counter, n) ((void)0)
+#endif
+#define MODBUS_STATISTICS_INC(counter) MODBUS_STATISTICS_ADD(counter, 1)
+
+// read one of the counters from any thread
+#ifdef __GNUC__
+#define MODBUS_STATISTICS_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define MODBUS_STATISTICS_LOAD(counter) (*(const volatile uint32_t*)&(counter))
+#endif
+
+namespace ModbusPotato
+{
+    /// <summary>
+    /// Counts the frames and errors seen by a framer.
+    /// </summary>
+    /// <remarks>
+    /// The counters roll over at their maximum value.  They are updated
+    /// from poll() and may be read from another thread using snapshot()
+    /// without stopping the framer; each counter is read atomically, but
+    /// the set as a whole is not.  clear() must only be called from the
+    /// thread calling poll().
+    /// </remarks>
+    struct CModbusStatistics
+    {
+        uint32_t rx_frames; // valid frames received for this station or broadcast
+        uint32_t tx_frames; // frames sent
+        uint32_t rx_bytes; // characters received as part of a frame, including the address and checksum
+        uint32_t tx_bytes; // characters sent, including the address and checksum
+        uint32_t checksum_errors; // frames discarded due to a CRC or LRC error, or because they were too short
+        uint32_t t1p5_breaks; // frames discarded due to a character gap greater than T1.5 [RTU], or a timeout [ASCII, RTU over TCP]
+        uint32_t overruns; // frames discarded because they did not fit in the buffer
+        uint32_t collisions; // characters received while holding the buffer or before sending
+        uint32_t dumps; // times incoming data was discarded, including communication errors
+        uint32_t exceptions; // exception responses sent or received
+
+        CModbusStatistics() { clear(); }
+
+        /// <summary>
+        /// Resets all the counters to zero.
+        /// </summary>
+        void clear()
+        {
+            rx_frames = tx_frames = rx_bytes = tx_bytes = 0;
+            checksum_errors = t1p5_breaks = overruns = collisions = dumps = exceptions = 0;
+        }
+
+        /// <summary>
+        /// Copies the counters without a lock.
+        /// </summary>
+        void snapshot(CModbusStatistics& copy) const
+        {
+            copy.rx_frames = MODBUS_STATISTICS_LOAD(rx_frames);
+            copy.tx_frames = MODBUS_STATISTICS_LOAD(tx_frames);
+            copy.rx_bytes = MODBUS_STATISTICS_LOAD(rx_bytes);
+            copy.tx_bytes = MODBUS_STATISTICS_LOAD(tx_bytes);
+            copy.checksum_errors = MODBUS_STATISTICS_LOAD(checksum_errors);
+            copy.t1p5_breaks = MODBUS_STATISTICS_LOAD(t1p5_breaks);
+            copy.overruns = MODBUS_STATISTICS_LOAD(overruns);
+            copy.collisions = MODBUS_STATISTICS_LOAD(collisions);
+            copy.dumps = MODBUS_STATISTICS_LOAD(dumps);
+            copy.exceptions = MODBUS_STATISTICS_LOAD(exceptions);
+        }
+
+        /// <summary>
+        /// Adds the counters of another set to this one, and clears the other set.
+        /// </summary>
+        /// <remarks>
+        /// This is used to keep one set of counters for several framers.  It
+        /// must only be called from the thread calling poll().
+        /// </remarks>
+        void collect(CModbusStatistics& other)
+        {
+            MODBUS_STATISTICS_ADD(rx_frames, other.rx_frames);
+            MODBUS_STATISTICS_ADD(tx_frames, other.tx_frames);
+            MODBUS_STATISTICS_ADD(rx_bytes, other.rx_bytes);
+            MODBUS_STATISTICS_ADD(tx_bytes, other.tx_bytes);
+            MODBUS_STATISTICS_ADD(checksum_errors, other.checksum_errors);
+            MODBUS_STATISTICS_ADD(t1p5_breaks, other.t1p5_breaks);
+            MODBUS_STATISTICS_ADD(overruns, other.overruns);
+            MODBUS_STATISTICS_ADD(collisions, other.collisions);
+            MODBUS_STATISTICS_ADD(dumps, other.dumps);
+            MODBUS_STATISTICS_ADD(exceptions, other.exceptions);
+            other.clear();
+        }
+    };
+}
+#endif
@@ -7,8 +7,20 @@
 #include <Arduino.h>
 #elif _MSC_VER
 #include <Windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <stddef.h>
+#include <arpa/inet.h>
 #endif
 #define MODBUS_DATA_BUFFER_SIZE (255)
+
+// marks an intentional fall through to the next case label
+#if __cplusplus >= 201703L
+#define MODBUS_FALLTHROUGH [[fallthrough]]
+#elif defined(__GNUC__) && __GNUC__ >= 7
+#define MODBUS_FALLTHROUGH __attribute__((fallthrough))
+#else
+#define MODBUS_FALLTHROUGH ((void)0)
+#endif
 namespace ModbusPotato
 {
 #ifdef ARDUINO
@@ -17,6 +29,9 @@ namespace ModbusPotato
 #elif _MSC_VER
     // system tick type
     typedef DWORD system_tick_t;
+#elif defined(__unix__) || defined(__APPLE__)
+    // system tick type
+    typedef uint32_t system_tick_t;
 #endif
 
     namespace modbus_exception_code
@@ -40,8 +55,49 @@ namespace ModbusPotato
             server_device_busy = 0x06,
             memory_parity_error = 0x08,
             gateway_path_unavailable = 0x0A,
-            gateway_target_failed_to_respond = 0x0B
+            gateway_target_failed_to_respond = 0x0B,
+
+            // not a protocol exception code; returned by an ISlaveHandler to
+            // defer the response until CModbusSlave::complete() is called.
+            pending = 0xFF
         };
     }
+
+    /// <summary>
+    /// Stores a flag shared with an interrupt handler or another thread, after all of the writes before it.
+    /// </summary>
+    /// <remarks>
+    /// A context which reads the new value with load_acquire() also sees
+    /// everything written before the store.  On GCC targets without
+    /// threads, such as AVR, this is a plain store with a compiler barrier,
+    /// which is all that is needed to hand data to or from an interrupt.
+    /// </remarks>
+    template <class T> inline void store_release(volatile T& flag, T value)
+    {
+#ifdef __GNUC__
+        __atomic_store_n(&flag, value, __ATOMIC_RELEASE);
+#elif _MSC_VER
+        MemoryBarrier();
+        flag = value;
+#else
+        flag = value;
+#endif
+    }
+
+    /// <summary>
+    /// Loads a flag shared with an interrupt handler or another thread, before all of the reads after it.
+    /// </summary>
+    template <class T> inline T load_acquire(const volatile T& flag)
+    {
+#ifdef __GNUC__
+        return __atomic_load_n(&flag, __ATOMIC_ACQUIRE);
+#elif _MSC_VER
+        T value = flag;
+        MemoryBarrier();
+        return value;
+#else
+        return flag;
+#endif
+    }
 }
 #endif
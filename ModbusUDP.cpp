@@ -0,0 +1,390 @@
+#include "ModbusUDP.h"
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+namespace ModbusPotato
+{
+    // fills in a socket address from a numeric IPv4 or IPv6 address, or the IPv4 wildcard if NULL
+    static bool make_address(const char* address, uint16_t port, struct sockaddr_storage* result, socklen_t* len)
+    {
+        memset(result, 0, sizeof(*result));
+        struct sockaddr_in* v4 = (struct sockaddr_in*)result;
+        if (!address || inet_pton(AF_INET, address, &v4->sin_addr) == 1)
+        {
+            v4->sin_family = AF_INET;
+            v4->sin_port = htons(port);
+            *len = sizeof(*v4);
+            return true;
+        }
+        struct sockaddr_in6* v6 = (struct sockaddr_in6*)result;
+        if (inet_pton(AF_INET6, address, &v6->sin6_addr) == 1)
+        {
+            v6->sin6_family = AF_INET6;
+            v6->sin6_port = htons(port);
+            *len = sizeof(*v6);
+            return true;
+        }
+        return false;
+    }
+
+    CModbusUDP::CModbusUDP()
+        :   m_handler()
+        ,   m_slots()
+        ,   m_slot_count()
+        ,   m_fd(-1)
+        ,   m_state(state_exception)
+        ,   m_station_address()
+        ,   m_frame_address()
+        ,   m_buffer_len()
+        ,   m_slot()
+        ,   m_rx_next()
+        ,   m_rx_count()
+        ,   m_tx_count()
+        ,   m_request()
+        ,   m_outstanding()
+        ,   m_transaction_id()
+        ,   m_routes()
+    {
+    }
+
+    CModbusUDP::~CModbusUDP()
+    {
+        close();
+    }
+
+    void CModbusUDP::set_slots(CModbusUDPDatagram* slots, size_t count)
+    {
+        if (m_fd >= 0)
+            return;
+        m_slots = slots;
+        m_slot_count = slots ? (count < max_slots ? count : (size_t)max_slots) : 0;
+    }
+
+    bool CModbusUDP::open(const char* address, uint16_t port)
+    {
+        // create and bind the socket
+        close();
+        struct sockaddr_storage local;
+        socklen_t local_len;
+        if (!m_slot_count || !make_address(address, port, &local, &local_len))
+            return false;
+        m_fd = socket(local.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0)
+            return false;
+        if (bind(m_fd, (struct sockaddr*)&local, local_len) != 0)
+        {
+            close();
+            return false;
+        }
+
+        // start with no frames held
+        m_slot = m_rx_next = m_rx_count = m_tx_count = 0;
+        m_request = m_outstanding = false;
+        m_state = state_idle;
+        return true;
+    }
+
+    void CModbusUDP::close()
+    {
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+        m_state = state_exception;
+    }
+
+    uint16_t CModbusUDP::port() const
+    {
+        struct sockaddr_storage local;
+        socklen_t len = sizeof(local);
+        if (m_fd < 0 || getsockname(m_fd, (struct sockaddr*)&local, &len) != 0)
+            return 0;
+        if (local.ss_family == AF_INET6)
+            return ntohs(((struct sockaddr_in6*)&local)->sin6_port);
+        return ntohs(((struct sockaddr_in*)&local)->sin_port);
+    }
+
+    bool CModbusUDP::add_route(CModbusUDPRoute* route, uint8_t unit, const char* address, uint16_t port)
+    {
+        if (!address || !make_address(address, port, &route->peer, &route->peer_len))
+            return false;
+        route->unit = unit;
+        route->next = m_routes;
+        m_routes = route;
+        return true;
+    }
+
+    bool CModbusUDP::next_frame()
+    {
+        // take the next datagram of the batch
+        m_slot = m_rx_next++;
+        CModbusUDPDatagram* datagram = m_slots + m_slot;
+        const uint8_t* header = datagram->data + 1;
+
+        // check the MBAP header: protocol 0, and a length which covers the unit id and the PDU
+        if (datagram->len <= CModbusUDPDatagram::header_length || header[2] || header[3]
+            || (size_t)(header[4] << 8 | header[5]) != datagram->len - (CModbusUDPDatagram::header_length - 1))
+        {
+            MODBUS_STATISTICS_INC(m_statistics.dumps);
+            return false;
+        }
+
+        // while polling, only accept responses to the recent requests
+        uint16_t id = (uint16_t)(header[0] << 8 | header[1]);
+        if (m_outstanding && (uint16_t)(m_transaction_id - id) >= response_window)
+        {
+            MODBUS_STATISTICS_INC(m_statistics.dumps);
+            return false;
+        }
+
+        // drop frames for other stations
+        m_frame_address = header[6];
+        if (m_frame_address && m_station_address && m_frame_address != m_station_address)
+            return false;
+        m_buffer_len = datagram->len - CModbusUDPDatagram::header_length;
+        m_request = false;
+        MODBUS_STATISTICS_INC(m_statistics.rx_frames);
+        MODBUS_STATISTICS_ADD(m_statistics.rx_bytes, datagram->len);
+        if (datagram->data[CModbusUDPDatagram::pdu_offset] & 0x80)
+            MODBUS_STATISTICS_INC(m_statistics.exceptions);
+        return true;
+    }
+
+    bool CModbusUDP::flush()
+    {
+        // send all of the queued datagrams with as few calls as possible
+        struct mmsghdr msgs[max_slots];
+        struct iovec iov[max_slots];
+        memset(msgs, 0, sizeof(msgs[0]) * m_tx_count);
+        for (size_t i = 0; i < m_tx_count; ++i)
+        {
+            CModbusUDPDatagram* datagram = m_slots + m_tx_slots[i];
+            iov[i].iov_base = datagram->data + 1;
+            iov[i].iov_len = datagram->len;
+            msgs[i].msg_hdr.msg_name = &datagram->peer;
+            msgs[i].msg_hdr.msg_namelen = datagram->peer_len;
+            msgs[i].msg_hdr.msg_iov = iov + i;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        size_t sent = 0;
+        while (sent < m_tx_count)
+        {
+            int ec = sendmmsg(m_fd, msgs + sent, (unsigned int)(m_tx_count - sent), MSG_DONTWAIT);
+            if (ec < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR)
+                {
+                    // keep the rest for the next call
+                    for (size_t i = sent; i < m_tx_count; ++i)
+                        m_tx_slots[i - sent] = m_tx_slots[i];
+                    m_tx_count -= sent;
+                    return false;
+                }
+
+                // drop the datagram which failed, i.e. an unreachable peer
+                MODBUS_STATISTICS_INC(m_statistics.dumps);
+                sent++;
+                continue;
+            }
+            for (int i = 0; i < ec; ++i)
+            {
+                const uint8_t* pdu = m_slots[m_tx_slots[sent + i]].data + CModbusUDPDatagram::pdu_offset;
+                MODBUS_STATISTICS_INC(m_statistics.tx_frames);
+                MODBUS_STATISTICS_ADD(m_statistics.tx_bytes, m_slots[m_tx_slots[sent + i]].len);
+                if (pdu[0] & 0x80)
+                    MODBUS_STATISTICS_INC(m_statistics.exceptions);
+            }
+            sent += ec;
+        }
+        m_tx_count = 0;
+        return true;
+    }
+
+    unsigned long CModbusUDP::poll()
+    {
+        switch (m_state)
+        {
+        case state_exception: // not open, or a fatal error
+            {
+                return 0;
+            }
+        case state_frame_ready: // waiting for the application layer to process the frame
+            {
+                // the rest of the batch waits in the slots until the frame is released
+                return 0; // waiting for user
+            }
+        case state_queue: // waiting for the application layer to create frame for transmission
+            {
+                if (m_handler)
+                {
+                    m_handler->poll_queue(this);
+
+                    // evaluate the switch statement again if the application sent or released the buffer
+                    if (m_state != state_queue)
+                        return poll();
+                }
+                return 0; // waiting for user
+            }
+        case state_idle: // handing over the received datagrams
+            {
+                for (;;)
+                {
+                    // hand over the next frame of the batch
+                    if (m_rx_next < m_rx_count)
+                    {
+                        if (!next_frame())
+                            continue;
+                        m_state = state_frame_ready;
+                        if (m_handler)
+                            m_handler->frame_ready(this);
+
+                        // evaluate the switch statement again if the application still holds the frame
+                        if (m_state != state_idle)
+                            return poll();
+                        continue;
+                    }
+
+                    // the batch is done, so send the responses to it
+                    if (!flush())
+                        return 1; // the socket is full, try again on the next tick
+
+                    // receive the next batch into all of the slots
+                    struct mmsghdr msgs[max_slots];
+                    struct iovec iov[max_slots];
+                    memset(msgs, 0, sizeof(msgs[0]) * m_slot_count);
+                    for (size_t i = 0; i < m_slot_count; ++i)
+                    {
+                        iov[i].iov_base = m_slots[i].data + 1;
+                        iov[i].iov_len = sizeof(m_slots[i].data) - 1;
+                        msgs[i].msg_hdr.msg_name = &m_slots[i].peer;
+                        msgs[i].msg_hdr.msg_namelen = sizeof(m_slots[i].peer);
+                        msgs[i].msg_hdr.msg_iov = iov + i;
+                        msgs[i].msg_hdr.msg_iovlen = 1;
+                    }
+                    int ec = recvmmsg(m_fd, msgs, (unsigned int)m_slot_count, MSG_DONTWAIT, NULL);
+                    if (ec <= 0)
+                    {
+                        if (ec < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                            MODBUS_STATISTICS_INC(m_statistics.dumps);
+                        return 0; // waiting for the socket
+                    }
+                    for (int i = 0; i < ec; ++i)
+                    {
+                        // datagrams which did not fit are dropped by next_frame()
+                        m_slots[i].len = msgs[i].msg_len;
+                        m_slots[i].peer_len = msgs[i].msg_hdr.msg_namelen;
+                        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                        {
+                            MODBUS_STATISTICS_INC(m_statistics.overruns);
+                            m_slots[i].len = 0;
+                        }
+                    }
+                    m_rx_next = 0;
+                    m_rx_count = ec;
+                }
+            }
+        }
+
+        // if we get here, then something terrible has happened such as memory corruption
+        m_state = state_exception;
+        return 0;
+    }
+
+    bool CModbusUDP::begin_send()
+    {
+        switch (m_state)
+        {
+        case state_queue:
+            {
+                return true; // already in the queue state
+            }
+        case state_frame_ready:
+            {
+                // the response is built in the slot of the request
+                m_state = state_queue;
+                return true;
+            }
+        case state_idle:
+            {
+                // a new request needs a free slot, so the batch must have been handled and sent
+                if (m_rx_next < m_rx_count || !flush())
+                    return false; // busy receiving or sending
+                m_slot = m_rx_next = m_rx_count = 0;
+                m_request = true;
+                m_state = state_queue;
+                return true;
+            }
+        }
+        return false; // not ready to send
+    }
+
+    void CModbusUDP::send()
+    {
+        // sanity check
+        if (m_state != state_queue || !m_buffer_len || m_buffer_len > CModbusUDPDatagram::max_pdu)
+        {
+            // buffer overflow, or the user didn't call begin_send() - enter the 'exception' state
+            m_state = state_exception;
+            return;
+        }
+
+        CModbusUDPDatagram* datagram = m_slots + m_slot;
+        uint8_t* header = datagram->data + 1;
+        if (m_request)
+        {
+            // send a new request to the route for the unit, with the next transaction id
+            CModbusUDPRoute* route = m_routes;
+            while (route && route->unit != m_frame_address)
+                route = route->next;
+            if (!route)
+            {
+                MODBUS_STATISTICS_INC(m_statistics.dumps);
+                m_state = state_idle;
+                return;
+            }
+            memcpy(&datagram->peer, &route->peer, route->peer_len);
+            datagram->peer_len = route->peer_len;
+            m_transaction_id++;
+            header[0] = (uint8_t)(m_transaction_id >> 8);
+            header[1] = (uint8_t)m_transaction_id;
+            m_outstanding = true;
+        }
+
+        // fill in the rest of the MBAP header; a response keeps the transaction id and peer of its request
+        size_t len = m_buffer_len + 1;
+        header[2] = header[3] = 0;
+        header[4] = (uint8_t)(len >> 8);
+        header[5] = (uint8_t)len;
+        header[6] = m_frame_address;
+        datagram->len = CModbusUDPDatagram::header_length + m_buffer_len;
+        m_tx_slots[m_tx_count++] = (uint8_t)m_slot;
+        m_state = state_idle;
+
+        // requests go out right away, while responses wait for the rest of their batch
+        if (m_request)
+            flush();
+    }
+
+    void CModbusUDP::finished()
+    {
+        switch (m_state)
+        {
+        case state_frame_ready: // received
+        case state_queue: // aborting begin_send()
+            {
+                // acknowledge or abort the user lock on the buffer
+                m_state = state_idle;
+                return; // ok
+            }
+        default:
+            {
+                // invalid state
+                m_state = state_exception;
+                return; // invalid state - enter the 'exception' state
+            }
+        }
+    }
+}
+#endif
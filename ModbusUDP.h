@@ -0,0 +1,184 @@
+#ifndef __ModbusPotato_ModbusUDP_h__
+#define __ModbusPotato_ModbusUDP_h__
+#include "ModbusInterface.h"
+#ifdef __linux__
+#include <sys/socket.h>
+namespace ModbusPotato
+{
+    /// <summary>
+    /// Holds one datagram and the address of its peer for CModbusUDP.
+    /// </summary>
+    /// <remarks>
+    /// The MBAP header starts at data + 1, so that the PDU which follows
+    /// it is aligned for the register arrays built by the slave.
+    /// </remarks>
+    struct CModbusUDPDatagram
+    {
+        enum
+        {
+            header_length = 7, // MBAP header: transaction id, protocol id, length and unit id
+            pdu_offset = 1 + header_length, // offset of the PDU in 'data'
+            max_pdu = 253, // largest PDU allowed by the spec
+        };
+        uint8_t data[pdu_offset + max_pdu];
+        size_t len; // length of the datagram, starting at data + 1
+        struct sockaddr_storage peer;
+        socklen_t peer_len;
+    };
+
+    /// <summary>
+    /// Maps a unit address to the peer which requests for it are sent to.
+    /// </summary>
+    /// <remarks>
+    /// Routes are owned by the application and linked into the framer
+    /// using CModbusUDP::add_route(), so no memory is allocated.
+    /// </remarks>
+    struct CModbusUDPRoute
+    {
+        CModbusUDPRoute() : unit(), peer_len(), next() {}
+        uint8_t unit;
+        struct sockaddr_storage peer;
+        socklen_t peer_len;
+        CModbusUDPRoute* next;
+    };
+
+    /// <summary>
+    /// This class handles Modbus frames with an MBAP header carried in UDP datagrams.
+    /// </summary>
+    /// <remarks>
+    /// See the IFramer interface for a complete description of the public
+    /// methods.  Like the other framers it is used by CModbusSlave to
+    /// serve requests, or by CModbusMaster to poll devices.
+    ///
+    /// One socket serves any number of peers.  Datagrams are received in
+    /// batches with recvmmsg() into the slots given to set_slots(), and
+    /// handed to the application one at a time by pointing buffer() at the
+    /// PDU in each slot, so the application must call buffer() again for
+    /// each frame.  A response is built in place in the slot of its
+    /// request and sent back to the peer which sent it, with the same
+    /// transaction id.  The responses to a batch are sent together with
+    /// sendmmsg() once every request of the batch has been handled.
+    ///
+    /// Batching saves system calls, but not the work done in the kernel
+    /// for each datagram.  Over the loopback interface udp-benchmark shows
+    /// no consistent difference between one slot and 64, so the number of
+    /// slots is best chosen by memory rather than by speed.
+    ///
+    /// A request started with begin_send() while no frame is held, as the
+    /// master does, is sent to the route for its frame address, with a new
+    /// transaction id.  While a request is outstanding, only responses with
+    /// the id of one of the last few requests are accepted, so a late
+    /// response to a retry is still matched but stale datagrams are not.
+    ///
+    /// With a station address, frames for other units are dropped and
+    /// unit 0 is treated as a broadcast.  Many Modbus/TCP style clients
+    /// send unit 0 or 255 to any device, so a slave which should answer
+    /// them must use a station address of 0.
+    ///
+    /// No timers are used, so poll() returns 0 and must be called again
+    /// when fd() is readable, except when the socket was too full to send
+    /// the responses of a batch: it then returns 1, and must be called on
+    /// the next tick to send them.  The socket is non-blocking, and no
+    /// memory is allocated.
+    /// </remarks>
+    class CModbusUDP : public IFramer
+    {
+    public:
+        enum
+        {
+            max_slots = 64, // largest batch used by recvmmsg() and sendmmsg()
+            response_window = 8, // number of recent request ids whose responses are accepted
+        };
+        CModbusUDP();
+        ~CModbusUDP();
+
+        /// <summary>
+        /// Sets the datagram slots, which also sets the batch size.
+        /// </summary>
+        /// <remarks>
+        /// At least one slot is required, and up to max_slots are used.
+        /// This must be called before open().
+        /// </remarks>
+        void set_slots(CModbusUDPDatagram* slots, size_t count);
+
+        /// <summary>
+        /// Creates a non-blocking socket bound to the given numeric address and port.
+        /// </summary>
+        /// <remarks>
+        /// A NULL address binds to all IPv4 interfaces, and a port of 0
+        /// lets the system choose one, i.e. for a master.
+        /// </remarks>
+        bool open(const char* address, uint16_t port);
+
+        /// <summary>
+        /// Closes the socket.
+        /// </summary>
+        void close();
+
+        /// <summary>
+        /// Returns the socket, for waiting until it is readable, or -1 if it is not open.
+        /// </summary>
+        int fd() const { return m_fd; }
+
+        /// <summary>
+        /// Returns the local port of the socket.
+        /// </summary>
+        uint16_t port() const;
+
+        /// <summary>
+        /// Fills in a route for a unit address and links it into the framer.
+        /// </summary>
+        /// <returns>
+        /// false if the address is not a valid numeric IPv4 or IPv6 address.
+        /// </returns>
+        bool add_route(CModbusUDPRoute* route, uint8_t unit, const char* address, uint16_t port);
+
+        virtual void set_handler(IFrameHandler* handler) { m_handler = handler; }
+        virtual uint8_t station_address() const { return m_station_address; }
+        virtual void set_station_address(uint8_t address) { m_station_address = address; }
+        virtual unsigned long poll();
+        virtual bool begin_send();
+        virtual void send();
+        virtual void finished();
+        virtual bool frame_ready() const { return m_state == state_frame_ready; }
+        virtual uint8_t frame_address() const { return m_frame_address; }
+        virtual void set_frame_address(uint8_t address) { m_frame_address = address; }
+        virtual uint8_t* buffer() { return m_slots[m_slot].data + CModbusUDPDatagram::pdu_offset; }
+        virtual size_t buffer_len() const { return m_buffer_len; }
+        virtual void set_buffer_len(size_t len) { m_buffer_len = len; }
+        virtual size_t buffer_max() const { return CModbusUDPDatagram::max_pdu; }
+#if MODBUS_STATISTICS
+        virtual CModbusStatistics* statistics() { return &m_statistics; }
+#endif
+    private:
+        enum state_type
+        {
+            state_exception,
+            state_idle,
+            state_frame_ready,
+            state_queue,
+        };
+        bool flush();
+        bool next_frame();
+        IFrameHandler* m_handler;
+        CModbusUDPDatagram* m_slots;
+        size_t m_slot_count;
+        int m_fd;
+        state_type m_state;
+        uint8_t m_station_address, m_frame_address;
+        size_t m_buffer_len;
+        size_t m_slot; // slot holding the current frame
+        size_t m_rx_next, m_rx_count; // next slot to hand to the application, and number received in the batch
+        size_t m_tx_count; // number of queued responses in m_tx_slots
+        uint8_t m_tx_slots[max_slots];
+        bool m_request; // the current frame is a request started by begin_send()
+        bool m_outstanding; // a request has been sent and responses are being matched
+        uint16_t m_transaction_id; // id of the last request sent
+        CModbusUDPRoute* m_routes;
+#if MODBUS_STATISTICS
+        CModbusStatistics m_statistics;
+#endif
+    };
+}
+#endif
+#endif
@@ -0,0 +1,230 @@
+#include "ModbusWriteBatch.h"
+namespace ModbusPotato
+{
+    enum
+    {
+        write_single_register = 0x06,
+        write_multiple_registers = 0x10,
+        max_write_registers = 123, // see section 6.12 of the application protocol spec
+    };
+
+    CModbusWriteBatch::CModbusWriteBatch(CModbusMaster* master)
+        :   m_master(master)
+        ,   m_fleet()
+        ,   m_fleet_count()
+        ,   m_head()
+        ,   m_tail()
+        ,   m_busy()
+        ,   m_done()
+        ,   m_broadcast_frames()
+        ,   m_unicast_frames()
+        ,   m_transaction(this, m_data, sizeof(m_data))
+    {
+    }
+
+    void CModbusWriteBatch::set_fleet(const uint8_t* addresses, size_t count)
+    {
+        m_fleet = addresses;
+        m_fleet_count = addresses ? count : 0;
+    }
+
+    bool CModbusWriteBatch::add(CModbusSetpoint* setpoint)
+    {
+        // validate the setpoint
+        if (m_busy || !setpoint || !setpoint->address || !setpoint->count || setpoint->count > max_write_registers || !setpoint->values)
+            return false;
+        if (setpoint->status == modbus_transaction_status::queued || setpoint->status == modbus_transaction_status::active)
+            return false;
+
+        // the first setpoint after a batch has been sent starts a new batch
+        if (m_done)
+        {
+            m_head = m_tail = NULL;
+            m_done = false;
+        }
+        if (!m_head)
+            m_broadcast_frames = m_unicast_frames = 0;
+
+        // add it to the end of the list
+        setpoint->status = modbus_transaction_status::queued;
+        setpoint->broadcast = false;
+        setpoint->overwritten = false;
+        setpoint->next = NULL;
+        if (m_tail)
+            m_tail->next = setpoint;
+        else
+            m_head = setpoint;
+        m_tail = setpoint;
+        return true;
+    }
+
+    bool CModbusWriteBatch::start()
+    {
+        if (m_busy || m_done || !m_head)
+            return false;
+        m_busy = true;
+        send_next();
+        return true;
+    }
+
+    bool CModbusWriteBatch::same_values(const CModbusSetpoint* a, const CModbusSetpoint* b) const
+    {
+        if (a->reg != b->reg || a->count != b->count)
+            return false;
+        for (uint16_t i = 0; i < a->count; ++i)
+        {
+            if (a->values[i] != b->values[i])
+                return false;
+        }
+        return true;
+    }
+
+    bool CModbusWriteBatch::covers_fleet(const CModbusSetpoint* first) const
+    {
+        // check that every slave in the fleet has an unsent setpoint for the same range
+        if (!m_fleet_count)
+            return false;
+        for (size_t i = 0; i < m_fleet_count; ++i)
+        {
+            const CModbusSetpoint* setpoint = first;
+            for (; setpoint; setpoint = setpoint->next)
+            {
+                if (setpoint->status == modbus_transaction_status::queued && setpoint->address == m_fleet[i] && setpoint->reg == first->reg && setpoint->count == first->count)
+                    break;
+            }
+            if (!setpoint)
+                return false;
+        }
+        return true;
+    }
+
+    const CModbusSetpoint* CModbusWriteBatch::most_common(const CModbusSetpoint* first, unsigned int& count) const
+    {
+        // count the unsent setpoints with the same values as each one in the group
+        const CModbusSetpoint* result = NULL;
+        count = 0;
+        for (const CModbusSetpoint* candidate = first; candidate; candidate = candidate->next)
+        {
+            if (candidate->status != modbus_transaction_status::queued || candidate->reg != first->reg || candidate->count != first->count)
+                continue;
+            unsigned int matches = 0;
+            for (const CModbusSetpoint* setpoint = candidate; setpoint; setpoint = setpoint->next)
+            {
+                if (setpoint->status == modbus_transaction_status::queued && same_values(setpoint, candidate))
+                    matches++;
+            }
+            if (matches > count)
+            {
+                result = candidate;
+                count = matches;
+            }
+        }
+        return result;
+    }
+
+    void CModbusWriteBatch::build(uint8_t address, const CModbusSetpoint* setpoint)
+    {
+        // build a write single register request for one register, or write multiple registers for more
+        m_transaction.address = address;
+        m_data[1] = (uint8_t)(setpoint->reg >> 8);
+        m_data[2] = (uint8_t)setpoint->reg;
+        if (setpoint->count == 1)
+        {
+            m_data[0] = write_single_register;
+            m_data[3] = (uint8_t)(setpoint->values[0] >> 8);
+            m_data[4] = (uint8_t)setpoint->values[0];
+            m_transaction.len = 5;
+            return;
+        }
+        m_data[0] = write_multiple_registers;
+        m_data[3] = (uint8_t)(setpoint->count >> 8);
+        m_data[4] = (uint8_t)setpoint->count;
+        m_data[5] = (uint8_t)(setpoint->count * 2);
+        for (uint16_t i = 0; i < setpoint->count; ++i)
+        {
+            m_data[6 + i * 2] = (uint8_t)(setpoint->values[i] >> 8);
+            m_data[7 + i * 2] = (uint8_t)setpoint->values[i];
+        }
+        m_transaction.len = 6 + setpoint->count * 2;
+    }
+
+    void CModbusWriteBatch::send_next()
+    {
+        for (;;)
+        {
+            // find the first setpoint which has not been sent
+            CModbusSetpoint* first = m_head;
+            while (first && first->status != modbus_transaction_status::queued)
+                first = first->next;
+            if (!first)
+            {
+                m_busy = false;
+                m_done = true;
+                return;
+            }
+
+            // broadcast the most common values if every slave in the fleet is written, and more than one slave shares them
+            unsigned int count = 0;
+            const CModbusSetpoint* common = covers_fleet(first) ? most_common(first, count) : NULL;
+            if (common && count > 1)
+            {
+                for (CModbusSetpoint* setpoint = first; setpoint; setpoint = setpoint->next)
+                {
+                    if (setpoint->status == modbus_transaction_status::queued && same_values(setpoint, common))
+                    {
+                        setpoint->status = modbus_transaction_status::active;
+                        setpoint->broadcast = true;
+                    }
+                }
+                build(0, common);
+                if (m_master->submit(&m_transaction))
+                {
+                    // the slaves whose values differ act on the broadcast too, until their own values are sent afterwards
+                    for (CModbusSetpoint* setpoint = first; setpoint; setpoint = setpoint->next)
+                    {
+                        if (setpoint->status == modbus_transaction_status::queued && setpoint->reg == common->reg && setpoint->count == common->count)
+                            setpoint->overwritten = true;
+                    }
+                    m_broadcast_frames++;
+                    return;
+                }
+            }
+            else
+            {
+                first->status = modbus_transaction_status::active;
+                build(first->address, first);
+                if (m_master->submit(&m_transaction))
+                {
+                    m_unicast_frames++;
+                    return;
+                }
+            }
+
+            // the master did not accept the frame, so fail its setpoints and try the next one
+            complete(modbus_transaction_status::rejected);
+        }
+    }
+
+    void CModbusWriteBatch::complete(uint8_t status)
+    {
+        // record the result in the setpoints which were sent in this frame
+        for (CModbusSetpoint* setpoint = m_head; setpoint; setpoint = setpoint->next)
+        {
+            if (setpoint->status != modbus_transaction_status::active)
+                continue;
+            setpoint->status = status;
+            if (status == modbus_transaction_status::ok)
+                setpoint->overwritten = false;
+            else if (status == modbus_transaction_status::rejected)
+                setpoint->broadcast = false;
+        }
+    }
+
+    void CModbusWriteBatch::transaction_complete(CModbusMaster*, CModbusTransaction* transaction)
+    {
+        complete(transaction->status);
+
+        // send the next frame
+        send_next();
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef __ModbusPotato_WriteBatch_h__
+#define __ModbusPotato_WriteBatch_h__
+#include "ModbusMaster.h"
+namespace ModbusPotato
+{
+    /// <summary>
+    /// Describes a write of one or more holding registers to one slave.
+    /// </summary>
+    /// <remarks>
+    /// The setpoint object and its values are owned by the application and
+    /// linked into the batch using CModbusWriteBatch::add(), so no memory is
+    /// allocated.  They must remain valid until the batch is no longer busy.
+    /// </remarks>
+    struct CModbusSetpoint
+    {
+        CModbusSetpoint(uint8_t address, uint16_t reg, uint16_t count, const uint16_t* values)
+            :   address(address)
+            ,   reg(reg)
+            ,   count(count)
+            ,   values(values)
+            ,   status(modbus_transaction_status::idle)
+            ,   broadcast()
+            ,   overwritten()
+            ,   next()
+        {
+        }
+        uint8_t address; // slave address
+        uint16_t reg; // raw address of the first holding register, i.e. 0 for 40001
+        uint16_t count; // number of registers to write
+        const uint16_t* values;
+        uint8_t status; // see modbus_transaction_status
+        bool broadcast; // true if the values were sent in a broadcast frame
+        bool overwritten; // true if the slave was sent a broadcast of other values, and its own write did not succeed
+        CModbusSetpoint* next;
+    };
+
+    /// <summary>
+    /// Sends a batch of holding register writes to a fleet of slaves, using broadcasts where possible.
+    /// </summary>
+    /// <remarks>
+    /// The fleet is the list of slaves which share the same register layout.
+    /// Since every slave on the line acts on a broadcast, the fleet must
+    /// include every slave on the line.
+    ///
+    /// The setpoints are grouped by their register range.  If every slave
+    /// in the fleet has a setpoint for a range, the most common values are
+    /// sent once as a broadcast write (function 0x06 for one register or
+    /// 0x10 for several), followed by unicast writes to the slaves whose
+    /// values differ.  Otherwise every setpoint in the group is sent as a
+    /// unicast write.  The master inserts its turnaround delay after each
+    /// broadcast.
+    ///
+    /// Pushing the same setpoint to 200 meters therefore takes one frame
+    /// and the turnaround delay, instead of 200 round trips.  The slaves do
+    /// not acknowledge a broadcast, so the status of a setpoint sent that
+    /// way is ok as soon as the turnaround delay has elapsed.
+    ///
+    /// A broadcast cannot be addressed to some slaves only, so the slaves
+    /// whose values differ also act on it and hold the common values until
+    /// their own write arrives.  If that write fails, the setpoint is
+    /// marked as overwritten as well as failed, since the slave is now
+    /// holding the wrong values rather than its previous ones.
+    ///
+    /// A frame which the master does not accept, such as one too long for
+    /// the framer's buffer, fails its setpoints with the rejected status
+    /// and the batch carries on with the next one.
+    ///
+    /// The master's poll() sends the frames.  Setpoints for the same slave
+    /// and register range must not be added twice in one batch.
+    /// </remarks>
+    class CModbusWriteBatch : public IMasterHandler
+    {
+    public:
+        CModbusWriteBatch(CModbusMaster* master);
+        virtual void transaction_complete(CModbusMaster* master, CModbusTransaction* transaction);
+
+        /// <summary>
+        /// Sets the addresses of the slaves which share the register layout, or NULL to never broadcast.
+        /// </summary>
+        void set_fleet(const uint8_t* addresses, size_t count);
+
+        /// <summary>
+        /// Adds a setpoint to the batch.
+        /// </summary>
+        /// <returns>
+        /// false if the batch is busy, or the setpoint is invalid or already in a batch.
+        /// </returns>
+        bool add(CModbusSetpoint* setpoint);
+
+        /// <summary>
+        /// Starts sending the setpoints added since the last batch.
+        /// </summary>
+        /// <returns>
+        /// false if the batch is busy or empty.
+        /// </returns>
+        bool start();
+
+        /// <summary>
+        /// Returns true while the batch is being sent.
+        /// </summary>
+        bool busy() const { return m_busy; }
+
+        /// <summary>
+        /// Returns the number of broadcast and unicast frames sent for the last batch.
+        /// </summary>
+        unsigned int broadcast_frames() const { return m_broadcast_frames; }
+        unsigned int unicast_frames() const { return m_unicast_frames; }
+    private:
+        bool same_values(const CModbusSetpoint* a, const CModbusSetpoint* b) const;
+        bool covers_fleet(const CModbusSetpoint* first) const;
+        const CModbusSetpoint* most_common(const CModbusSetpoint* first, unsigned int& count) const;
+        void send_next();
+        void complete(uint8_t status);
+        void build(uint8_t address, const CModbusSetpoint* setpoint);
+        CModbusMaster* m_master;
+        const uint8_t* m_fleet;
+        size_t m_fleet_count;
+        CModbusSetpoint* m_head;
+        CModbusSetpoint* m_tail;
+        bool m_busy, m_done;
+        unsigned int m_broadcast_frames, m_unicast_frames;
+        uint8_t m_data[MODBUS_DATA_BUFFER_SIZE];
+        CModbusTransaction m_transaction;
+    };
+}
+#endif
@@ -0,0 +1,269 @@
+// Capacity planning for a Modbus RTU line using the simulated bus.
+//
+// A master repeatedly polls a scan list of FC03 reads from simulated slaves
+// on a CBusSimulator, and the achievable poll rate, cycle time and bus
+// utilization are reported.  The simulation runs faster than real time.
+//
+// Usage: bus-capacity [-b baud] [-p parity] [-s slaves] [-o offline slaves]
+//                     [-r registers] [-t timeout ms] [-a turnaround us]
+//                     [-d simulated seconds] [-f] [-R retries]
+//                     [-k offline threshold] [-P probe interval ms]
+//                     [-A adaptive timeout floor ms] [-n noise interval]
+//
+// The -f switch uses the fast T1.5/T3.5 timing calculated from the baud
+// rate instead of the fixed delays recommended above 19200 baud.
+//
+// By default requests are not retried and every slave is polled on every
+// cycle.  The -k switch marks a slave offline after the given number of
+// consecutive timeouts, after which it is only probed once per probe
+// interval.
+//
+// The -A switch estimates each slave's response timeout from the measured
+// round trip times, between the given floor and the -t timeout.  The -n
+// switch corrupts one in every N characters on average, so that the cost
+// of lost frames can be compared.
+//
+#include "BusSimulator.h"
+#include "../../ModbusMaster.h"
+#include "../../ModbusRTU.h"
+#include "../../ModbusSlave.h"
+#include "../../ModbusSlaveHandlerHolding.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+using namespace ModbusPotato;
+
+namespace
+{
+    enum
+    {
+        max_slaves = 247,
+        register_count = 125,
+    };
+
+    // one simulated slave device on the bus
+    struct CSimulatedSlave
+    {
+        CSimulatedSlave(CBusSimulator* bus, uint8_t address)
+            :   endpoint(bus)
+            ,   rtu(&endpoint, bus, buffer, MODBUS_DATA_BUFFER_SIZE)
+            ,   handler(registers, register_count)
+            ,   slave(&handler)
+        {
+            for (size_t i = 0; i < register_count; ++i)
+                registers[i] = (uint16_t)i;
+            rtu.set_station_address(address);
+            rtu.set_handler(&slave);
+        }
+        uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+        uint16_t registers[register_count];
+        CBusEndpoint endpoint;
+        CModbusRTU rtu;
+        CModbusSlaveHandlerHolding handler;
+        CModbusSlave slave;
+    };
+
+    // polls each slave in the scan list in turn through the master
+    class CScanMaster : public IMasterHandler
+    {
+    public:
+        CScanMaster(CModbusMaster* master, unsigned int slaves, uint16_t registers)
+            :   responses()
+            ,   timeouts()
+            ,   errors()
+            ,   skipped()
+            ,   cycles()
+            ,   submitted()
+            ,   m_master(master)
+            ,   m_transaction(this, m_data, sizeof(m_data))
+            ,   m_slaves(slaves)
+            ,   m_registers(registers)
+            ,   m_next()
+        {
+        }
+
+        // queues the request for the next slave in the scan list
+        void submit()
+        {
+            m_data[0] = 0x03;
+            m_data[1] = 0;
+            m_data[2] = 0;
+            m_data[3] = (uint8_t)(m_registers >> 8);
+            m_data[4] = (uint8_t)m_registers;
+            m_transaction.address = (uint8_t)(m_next + 1);
+            m_transaction.len = 5;
+            m_master->submit(&m_transaction);
+            submitted = true;
+        }
+
+        virtual void transaction_complete(CModbusMaster*, CModbusTransaction* transaction)
+        {
+            switch (transaction->status)
+            {
+            case modbus_transaction_status::ok:
+                if (transaction->len == (size_t)m_registers * 2 + 2)
+                    responses++;
+                else
+                    errors++;
+                break;
+            case modbus_transaction_status::timeout:
+                timeouts++;
+                break;
+            case modbus_transaction_status::skipped:
+                skipped++;
+                break;
+            default:
+                errors++;
+                break;
+            }
+
+            // move on to the next slave
+            if (++m_next == m_slaves)
+            {
+                m_next = 0;
+                cycles++;
+            }
+            submit();
+        }
+
+        unsigned long responses, timeouts, errors, skipped, cycles;
+        bool submitted;
+    private:
+        CModbusMaster* m_master;
+        uint8_t m_data[MODBUS_DATA_BUFFER_SIZE];
+        CModbusTransaction m_transaction;
+        unsigned int m_slaves;
+        uint16_t m_registers;
+        unsigned int m_next;
+    };
+
+    // returns the monotonic time in seconds
+    double now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned long baud = 19200, timeout_ms = 100, turnaround_us = 0;
+    unsigned int slaves = 8, offline = 0, registers = 10;
+    char parity = 'E';
+    bool fast_timing = false;
+    unsigned int retries = 0, offline_threshold = 0;
+    unsigned long probe_ms = 10000, adaptive_floor_ms = 0, noise = 0;
+    double duration = 60;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:s:o:r:t:a:d:fR:k:P:A:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b': baud = strtoul(optarg, NULL, 0); break;
+        case 'p': parity = optarg[0]; break;
+        case 's': slaves = (unsigned int)strtoul(optarg, NULL, 0); break;
+        case 'o': offline = (unsigned int)strtoul(optarg, NULL, 0); break;
+        case 'r': registers = (unsigned int)strtoul(optarg, NULL, 0); break;
+        case 't': timeout_ms = strtoul(optarg, NULL, 0); break;
+        case 'a': turnaround_us = strtoul(optarg, NULL, 0); break;
+        case 'd': duration = atof(optarg); break;
+        case 'f': fast_timing = true; break;
+        case 'R': retries = (unsigned int)strtoul(optarg, NULL, 0); break;
+        case 'k': offline_threshold = (unsigned int)strtoul(optarg, NULL, 0); break;
+        case 'P': probe_ms = strtoul(optarg, NULL, 0); break;
+        case 'A': adaptive_floor_ms = strtoul(optarg, NULL, 0); break;
+        case 'n': noise = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-b baud] [-p parity] [-s slaves] [-o offline slaves] [-r registers] [-t timeout ms] [-a turnaround us] [-d simulated seconds] [-f] [-R retries] [-k offline threshold] [-P probe interval ms] [-A adaptive timeout floor ms] [-n noise interval]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!baud || !slaves || slaves > max_slaves || offline > slaves || !registers || registers > register_count || retries > 255 || offline_threshold > 255)
+    {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    // create the bus and the devices on it
+    //
+    // Note: the offline slaves are the last addresses in the scan list and
+    // are polled but never answer.
+    //
+    CBusSimulator bus(baud, 8, parity, parity == 'N' || parity == 'n' ? 2 : 1);
+    bus.set_turnaround(turnaround_us);
+    bus.set_noise(noise);
+    CSimulatedSlave* devices[max_slaves];
+    for (unsigned int i = 0; i < slaves - offline; ++i)
+    {
+        devices[i] = new CSimulatedSlave(&bus, (uint8_t)(i + 1));
+        devices[i]->rtu.setup(baud, fast_timing);
+    }
+    CBusEndpoint master_endpoint(&bus);
+    uint8_t master_buffer[MODBUS_DATA_BUFFER_SIZE];
+    CModbusRTU master_rtu(&master_endpoint, &bus, master_buffer, MODBUS_DATA_BUFFER_SIZE);
+    master_rtu.setup(baud, fast_timing);
+    CModbusMaster master(&master_rtu, &bus);
+    master.set_timeout(timeout_ms * 1000);
+    master.set_retries((uint8_t)retries);
+    master.set_offline_threshold((uint8_t)offline_threshold);
+    master.set_probe_interval(probe_ms * 1000);
+    CModbusSlaveHealth health[max_slaves + 1];
+    if (adaptive_floor_ms)
+        master.set_adaptive_timeout(adaptive_floor_ms * 1000, timeout_ms * 1000);
+    if (offline_threshold || adaptive_floor_ms)
+        master.set_health_table(health, max_slaves + 1);
+    CScanMaster scan(&master, slaves, (uint16_t)registers);
+    scan.submit();
+
+    // run the simulation
+    double start = now();
+    unsigned long long end_ns = (unsigned long long)(duration * 1e9);
+    while (bus.now_ns() < end_ns)
+    {
+        // let the master send the next request or time out
+        unsigned long wait = master.poll();
+        scan.submitted = false;
+
+        // poll the framers and find the earliest timeout
+        if (unsigned long timeout = master_rtu.poll())
+            wait = !wait || timeout < wait ? timeout : wait;
+        for (unsigned int i = 0; i < slaves - offline; ++i)
+        {
+            if (unsigned long timeout = devices[i]->rtu.poll())
+                wait = !wait || timeout < wait ? timeout : wait;
+        }
+        if (scan.submitted)
+            continue; // a response completed the transaction, send the next one right away
+        if (unsigned long event = bus.next_event())
+            wait = !wait || event < wait ? event : wait;
+
+        // advance the clock to the next event
+        bus.advance(wait ? wait : 1);
+    }
+    double elapsed = now() - start;
+
+    // report the results
+    double seconds = bus.now_ns() * 1e-9;
+    unsigned long polls = scan.responses + scan.timeouts + scan.errors;
+    printf("line:        %lu baud, 8%c%d, %.1f us per character, %s timing\n", baud, parity, parity == 'N' || parity == 'n' ? 2 : 1, bus.character_time_ns() / 1000.0, fast_timing ? "fast" : "standard");
+    printf("scan list:   %u slaves (%u offline), %u registers per poll, %lu ms timeout, %u retries\n", slaves, offline, registers, timeout_ms, retries);
+    printf("simulated:   %.1f s in %.2f s (%.0fx real time)\n", seconds, elapsed, elapsed > 0 ? seconds / elapsed : 0);
+    printf("polls:       %lu ok, %lu timeouts, %lu errors, %lu skipped, %.1f polls/s\n", scan.responses, scan.timeouts, scan.errors, scan.skipped, polls / seconds);
+    printf("cycle time:  %.1f ms\n", scan.cycles ? seconds * 1000 / scan.cycles : 0);
+    printf("bus:         %.1f%% utilization, %lu characters lost to collisions, %lu to noise\n", bus.busy_ns() * 100.0 / bus.now_ns(), bus.collisions(), bus.noise_errors());
+    if (adaptive_floor_ms)
+    {
+        for (unsigned int i = 1; i <= slaves; ++i)
+        {
+            const CModbusSlaveHealth* status = master.health((uint8_t)i);
+            printf("slave %3u:   %s, srtt %.2f ms, rttvar %.2f ms, timeout %.2f ms\n", i, status->state == CModbusSlaveHealth::online ? "online" : "offline", (status->srtt >> 3) / 1000.0, (status->rttvar >> 2) / 1000.0, status->rto / 1000.0);
+        }
+    }
+
+    for (unsigned int i = 0; i < slaves - offline; ++i)
+        delete devices[i];
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,235 @@
+#include "BusSimulator.h"
+namespace ModbusPotato
+{
+    CBusSimulator::CBusSimulator(unsigned long baud, unsigned int data_bits, char parity, unsigned int stop_bits)
+        :   m_endpoint_count()
+        ,   m_now_ns()
+        ,   m_char_ns()
+        ,   m_turnaround_ns()
+        ,   m_busy_ns()
+        ,   m_busy_until_ns()
+        ,   m_collisions()
+        ,   m_characters()
+        ,   m_noise()
+        ,   m_noise_errors()
+        ,   m_random(2463534242u)
+        ,   m_echo()
+    {
+        // one start bit, the data bits, the optional parity bit and the stop bits
+        unsigned int bits = 1 + data_bits + (parity == 'N' || parity == 'n' ? 0 : 1) + stop_bits;
+        m_char_ns = baud ? (unsigned long long)bits * 1000000000ull / baud : 0;
+    }
+
+    bool CBusSimulator::attach(CBusEndpoint* endpoint)
+    {
+        if (m_endpoint_count == max_endpoints)
+            return false;
+        m_endpoints[m_endpoint_count++] = endpoint;
+        return true;
+    }
+
+    unsigned long CBusSimulator::next_event() const
+    {
+        // find the next character to complete
+        unsigned long long next = 0;
+        for (size_t i = 0; i < m_endpoint_count; ++i)
+        {
+            const CBusEndpoint* endpoint = m_endpoints[i];
+            if (endpoint->m_sending && (!next || endpoint->m_end_ns < next))
+                next = endpoint->m_end_ns;
+        }
+        if (!next)
+            return 0; // idle
+
+        // round up so that advancing by the result always completes the character
+        unsigned long long wait = next > m_now_ns ? next - m_now_ns : 0;
+        return (unsigned long)((wait + 999) / 1000) + (wait ? 0 : 1);
+    }
+
+    void CBusSimulator::advance(unsigned long microseconds)
+    {
+        unsigned long long target = m_now_ns + (unsigned long long)microseconds * 1000;
+        for (;;)
+        {
+            // find the next character to complete before the target time
+            CBusEndpoint* next = NULL;
+            for (size_t i = 0; i < m_endpoint_count; ++i)
+            {
+                CBusEndpoint* endpoint = m_endpoints[i];
+                if (endpoint->m_sending && endpoint->m_end_ns <= target && (!next || endpoint->m_end_ns < next->m_end_ns))
+                    next = endpoint;
+            }
+            if (!next)
+                break;
+
+            // deliver the character
+            m_now_ns = next->m_end_ns;
+            complete_character(next);
+        }
+        m_now_ns = target;
+    }
+
+    void CBusSimulator::start_character(CBusEndpoint* endpoint, unsigned long long start_ns)
+    {
+        // take the next character from the transmit queue
+        endpoint->m_ch = endpoint->m_tx[endpoint->m_tx_head];
+        endpoint->m_tx_head = (endpoint->m_tx_head + 1) % CBusEndpoint::buffer_size;
+        endpoint->m_tx_len--;
+        endpoint->m_sending = true;
+        endpoint->m_collided = false;
+        endpoint->m_start_ns = start_ns;
+        endpoint->m_end_ns = start_ns + m_char_ns;
+
+        // check if any other endpoint is driving the bus at the same time
+        for (size_t i = 0; i < m_endpoint_count; ++i)
+        {
+            CBusEndpoint* other = m_endpoints[i];
+            if (other == endpoint || !other->m_sending)
+                continue;
+            if (other->m_start_ns < endpoint->m_end_ns && endpoint->m_start_ns < other->m_end_ns)
+            {
+                other->m_collided = true;
+                endpoint->m_collided = true;
+            }
+        }
+
+        // account for the time the medium is busy
+        unsigned long long from = start_ns > m_busy_until_ns ? start_ns : m_busy_until_ns;
+        if (endpoint->m_end_ns > from)
+            m_busy_ns += endpoint->m_end_ns - from;
+        if (endpoint->m_end_ns > m_busy_until_ns)
+            m_busy_until_ns = endpoint->m_end_ns;
+    }
+
+    bool CBusSimulator::noise()
+    {
+        if (!m_noise)
+            return false;
+
+        // xorshift32, see Marsaglia, "Xorshift RNGs"
+        m_random ^= m_random << 13;
+        m_random ^= m_random >> 17;
+        m_random ^= m_random << 5;
+        return m_random % m_noise == 0;
+    }
+
+    void CBusSimulator::complete_character(CBusEndpoint* endpoint)
+    {
+        // deliver the character to the receivers
+        endpoint->m_sending = false;
+        bool error = endpoint->m_collided;
+        if (error)
+            m_collisions++;
+        else if ((error = noise()))
+            m_noise_errors++;
+        else
+            m_characters++;
+        for (size_t i = 0; i < m_endpoint_count; ++i)
+        {
+            if (m_endpoints[i] != endpoint || m_echo)
+                m_endpoints[i]->receive(endpoint->m_ch, error);
+        }
+
+        // send the next character back to back
+        if (endpoint->m_tx_len)
+            start_character(endpoint, endpoint->m_end_ns);
+    }
+
+    CBusEndpoint::CBusEndpoint(CBusSimulator* bus)
+        :   m_bus(bus)
+        ,   m_rx_head()
+        ,   m_rx_len()
+        ,   m_tx_head()
+        ,   m_tx_len()
+        ,   m_rx_error()
+        ,   m_tx_enabled()
+        ,   m_turnaround()
+        ,   m_enable_ns()
+        ,   m_sending()
+        ,   m_collided()
+        ,   m_ch()
+        ,   m_start_ns()
+        ,   m_end_ns()
+    {
+        m_bus->attach(this);
+    }
+
+    void CBusEndpoint::receive(uint8_t ch, bool error)
+    {
+        // flag an error if the character was corrupted or there is no room
+        if (error || m_rx_len == buffer_size)
+        {
+            m_rx_error = true;
+            return;
+        }
+        m_rx[(m_rx_head + m_rx_len) % buffer_size] = ch;
+        m_rx_len++;
+    }
+
+    int CBusEndpoint::read(uint8_t* buffer, size_t buffer_size)
+    {
+        if (!buffer_size)
+            return 0;
+
+        // report any errors by dumping the input
+        if (m_rx_error)
+        {
+            m_rx_error = false;
+            m_rx_head = m_rx_len = 0;
+            return -1;
+        }
+
+        // copy or dump the characters
+        size_t len = buffer_size < m_rx_len ? buffer_size : m_rx_len;
+        for (size_t i = 0; i < len; ++i)
+        {
+            if (buffer)
+                buffer[i] = m_rx[m_rx_head];
+            m_rx_head = (m_rx_head + 1) % CBusEndpoint::buffer_size;
+        }
+        m_rx_len -= len;
+        return (int)len;
+    }
+
+    int CBusEndpoint::write(uint8_t* buffer, size_t len)
+    {
+        // queue as much as will fit
+        size_t room = buffer_size - m_tx_len;
+        if (len > room)
+            len = room;
+        for (size_t i = 0; i < len; ++i)
+            m_tx[(m_tx_head + m_tx_len + i) % buffer_size] = buffer[i];
+        m_tx_len += len;
+
+        // start sending if the line is not already busy with our own characters
+        if (len && !m_sending)
+        {
+            unsigned long long start = m_bus->m_now_ns;
+            if (m_turnaround)
+            {
+                // the first character waits for the driver to turn around
+                unsigned long long ready = m_enable_ns + m_bus->m_turnaround_ns;
+                if (ready > start)
+                    start = ready;
+                m_turnaround = false;
+            }
+            m_bus->start_character(this, start);
+        }
+        return (int)len;
+    }
+
+    void CBusEndpoint::txEnable(bool state)
+    {
+        if (state && !m_tx_enabled)
+        {
+            m_enable_ns = m_bus->m_now_ns;
+            m_turnaround = true;
+        }
+        m_tx_enabled = state;
+    }
+
+    bool CBusEndpoint::writeComplete()
+    {
+        return !m_sending && !m_tx_len;
+    }
+}
\ No newline at end of file
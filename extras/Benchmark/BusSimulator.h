@@ -0,0 +1,157 @@
+// Simulated multi-drop RS-485 bus for capacity planning.
+//
+#ifndef __ModbusPotato_BusSimulator_h__
+#define __ModbusPotato_BusSimulator_h__
+#include "../../ModbusInterface.h"
+namespace ModbusPotato
+{
+    class CBusEndpoint;
+
+    /// <summary>
+    /// A shared half-duplex medium which delivers characters at the rate implied by the line settings.
+    /// </summary>
+    /// <remarks>
+    /// The simulator is also the time provider for every framer on the bus.
+    /// Time only moves when advance() is called, so a simulation runs as fast
+    /// as the framers can be polled rather than in real time.
+    ///
+    /// Each character occupies the medium for one character time (start bit,
+    /// data bits, parity bit and stop bits) and is delivered to every other
+    /// endpoint when its stop bit completes.  If two endpoints drive the bus
+    /// at the same time, all the overlapping characters are received with a
+    /// framing error.  The first character after an endpoint enables its
+    /// transmitter is delayed by the driver turnaround time.
+    /// </remarks>
+    class CBusSimulator : public ITimeProvider
+    {
+    public:
+        enum
+        {
+            max_endpoints = 256,
+        };
+
+        /// <summary>
+        /// Constructor for the bus.
+        /// </summary>
+        /// <remarks>
+        /// The parity is 'N', 'E' or 'O'.
+        /// </remarks>
+        CBusSimulator(unsigned long baud, unsigned int data_bits = 8, char parity = 'E', unsigned int stop_bits = 1);
+
+        virtual system_tick_t ticks() const { return (system_tick_t)(m_now_ns / 1000); }
+        virtual unsigned long microseconds_per_tick() const { return 1; }
+
+        /// <summary>
+        /// Sets the delay between enabling a transmitter and the first character, in microseconds.
+        /// </summary>
+        void set_turnaround(unsigned long microseconds) { m_turnaround_ns = (unsigned long long)microseconds * 1000; }
+
+        /// <summary>
+        /// Sets whether the transmitting endpoint receives its own characters.
+        /// </summary>
+        void set_echo(bool echo) { m_echo = echo; }
+
+        /// <summary>
+        /// Corrupts on average one in every 'interval' characters, or none if 0.
+        /// </summary>
+        /// <remarks>
+        /// A corrupted character is received by every endpoint with a
+        /// framing error, as if it had been hit by noise on the line.  The
+        /// characters are picked by a fixed pseudo-random sequence, so a
+        /// simulation is repeatable.
+        /// </remarks>
+        void set_noise(unsigned long interval) { m_noise = interval; }
+
+        /// <summary>
+        /// Returns the time it takes to send one character, in nanoseconds.
+        /// </summary>
+        unsigned long long character_time_ns() const { return m_char_ns; }
+
+        /// <summary>
+        /// Returns the number of microseconds until the next character completes, or 0 if the bus is idle.
+        /// </summary>
+        unsigned long next_event() const;
+
+        /// <summary>
+        /// Advances the clock by the given number of microseconds, delivering every character that completes.
+        /// </summary>
+        void advance(unsigned long microseconds);
+
+        /// <summary>
+        /// Returns the elapsed simulated time, in nanoseconds.
+        /// </summary>
+        unsigned long long now_ns() const { return m_now_ns; }
+
+        /// <summary>
+        /// Returns the time the medium has been driven by at least one endpoint, in nanoseconds.
+        /// </summary>
+        unsigned long long busy_ns() const { return m_busy_ns; }
+
+        /// <summary>
+        /// Returns the number of characters corrupted by collisions.
+        /// </summary>
+        unsigned long collisions() const { return m_collisions; }
+
+        /// <summary>
+        /// Returns the number of characters corrupted by noise.
+        /// </summary>
+        unsigned long noise_errors() const { return m_noise_errors; }
+
+        /// <summary>
+        /// Returns the number of characters delivered without errors.
+        /// </summary>
+        unsigned long characters() const { return m_characters; }
+    private:
+        friend class CBusEndpoint;
+        bool attach(CBusEndpoint* endpoint);
+        void start_character(CBusEndpoint* endpoint, unsigned long long start_ns);
+        void complete_character(CBusEndpoint* endpoint);
+        bool noise();
+        CBusEndpoint* m_endpoints[max_endpoints];
+        size_t m_endpoint_count;
+        unsigned long long m_now_ns, m_char_ns, m_turnaround_ns;
+        unsigned long long m_busy_ns, m_busy_until_ns;
+        unsigned long m_collisions, m_characters;
+        unsigned long m_noise, m_noise_errors;
+        uint32_t m_random;
+        bool m_echo;
+    };
+
+    /// <summary>
+    /// One station on the simulated bus.
+    /// </summary>
+    /// <remarks>
+    /// Received characters with a framing error are reported as described
+    /// in IStream::read(), by dumping the input and returning -1.  If the
+    /// receive buffer overflows, the next read also returns -1.
+    /// </remarks>
+    class CBusEndpoint : public IStream
+    {
+    public:
+        enum
+        {
+            buffer_size = 512,
+        };
+        CBusEndpoint(CBusSimulator* bus);
+
+        virtual int read(uint8_t* buffer, size_t buffer_size);
+        virtual int write(uint8_t* buffer, size_t len);
+        virtual void txEnable(bool state);
+        virtual bool writeComplete();
+        virtual void communicationStatus(bool, bool) {}
+    private:
+        friend class CBusSimulator;
+        void receive(uint8_t ch, bool error);
+        CBusSimulator* m_bus;
+        uint8_t m_rx[buffer_size], m_tx[buffer_size];
+        size_t m_rx_head, m_rx_len, m_tx_head, m_tx_len;
+        bool m_rx_error, m_tx_enabled, m_turnaround;
+        unsigned long long m_enable_ns;
+
+        // the character currently on the wire
+        bool m_sending, m_collided;
+        uint8_t m_ch;
+        unsigned long long m_start_ns, m_end_ns;
+    };
+}
+#endif
\ No newline at end of file
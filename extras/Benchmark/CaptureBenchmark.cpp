@@ -0,0 +1,128 @@
+// Benchmark for appending decoded scans to a capture.
+//
+// Each scan is a block of float32 registers, decoded by CModbusDecoder
+// and appended to memory-mapped segment files by CModbusScanCapture,
+// which are created in a temporary directory and removed afterwards.
+// The rate is reported for a few scan sizes, as scans and points per
+// second; the time spent creating new segments is included.
+//
+// Usage: capture-benchmark [seconds per case] [directory]
+//
+#include "../../ModbusScanCapture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+using namespace ModbusPotato;
+
+namespace
+{
+    enum
+    {
+        max_points = 64,
+        rows_per_segment = 1 << 20,
+        check_interval = 1024, // scans between reads of the clock
+    };
+
+    double now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    // appends scans of the given number of float32 points, and returns the scans per second
+    double run(const char* directory, size_t count, double seconds, unsigned int& segments)
+    {
+        // a run of float32 points, as read from a meter
+        CModbusPoint points[max_points];
+        for (size_t i = 0; i < count; ++i)
+        {
+            CModbusPoint& point = points[i];
+            point.offset = (uint16_t)(i * 2);
+            point.type = modbus_point_type::float32;
+            point.order = modbus_word_order::abcd;
+            point.scale = 0;
+            point.output = i * sizeof(float);
+            point.kernel = NULL;
+            point.run = 0;
+        }
+        CModbusDecoder decoder(points, count);
+        if (!decoder.compile())
+        {
+            fprintf(stderr, "compile failed\n");
+            exit(1);
+        }
+        uint8_t data[max_points * 4];
+        for (size_t i = 0; i < sizeof(data); ++i)
+            data[i] = (uint8_t)(i * 7);
+
+        char prefix[CModbusScanCapture::max_path - CModbusScanCapture::max_suffix];
+        snprintf(prefix, sizeof(prefix), "%s/points%u", directory, (unsigned int)count);
+        CModbusScanCapture capture(&decoder);
+        if (!capture.open(prefix, rows_per_segment))
+        {
+            perror("open");
+            exit(1);
+        }
+
+        unsigned long scans = 0;
+        uint64_t time_us = 0;
+        double start = now(), elapsed;
+        do
+        {
+            for (unsigned int i = 0; i < check_interval; ++i)
+            {
+                if (!capture.append(data, count * 4, time_us++))
+                {
+                    perror("append");
+                    exit(1);
+                }
+            }
+            scans += check_interval;
+            elapsed = now() - start;
+        } while (elapsed < seconds);
+        segments = capture.segment() + 1;
+        capture.close();
+
+        // remove the segments
+        for (unsigned int i = 0; i < segments; ++i)
+        {
+            char path[CModbusScanCapture::max_path];
+            snprintf(path, sizeof(path), "%s.%06u", prefix, i);
+            unlink(path);
+        }
+        return scans / elapsed;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    if (seconds <= 0)
+    {
+        fprintf(stderr, "usage: %s [seconds per case] [directory]\n", argv[0]);
+        return 1;
+    }
+
+    // use a fresh directory, on tmpfs by default so the disk does not set the pace
+    char directory[CModbusScanCapture::max_path / 2];
+    snprintf(directory, sizeof(directory), "%s/capture-benchmark-XXXXXX", argc > 2 ? argv[2] : "/dev/shm");
+    if (!mkdtemp(directory))
+    {
+        perror(directory);
+        return 1;
+    }
+
+    static const size_t counts[] = { 1, 8, 32, 64 };
+    printf("%-12s %14s %16s %10s\n", "points/scan", "scans/s", "points/s", "segments");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+    {
+        unsigned int segments = 0;
+        double rate = run(directory, counts[i], seconds, segments);
+        printf("%-12u %14.0f %16.0f %10u\n", (unsigned int)counts[i], rate, rate * counts[i], segments);
+    }
+    rmdir(directory);
+    return 0;
+}
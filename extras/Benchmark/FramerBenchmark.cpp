@@ -0,0 +1,246 @@
+// Micro-benchmarks for the RTU and ASCII framers and the slave.
+//
+// Each case loads a pre-encoded request into an in-memory stream and runs
+// the framer state machine with a virtual clock until it is idle again, so
+// only the time spent in the library is measured.  The results are
+// reported in request frames per second, nanoseconds per request frame and
+// bytes per second (received plus transmitted).
+//
+// Usage: framer-benchmark [seconds per case]
+//
+#include "LoopbackStream.h"
+#include "../../ModbusRTU.h"
+#include "../../ModbusASCII.h"
+#include "../../ModbusSlave.h"
+#include "../../ModbusSlaveHandlerHolding.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+using namespace ModbusPotato;
+
+namespace
+{
+    enum
+    {
+        slave_address = 1,
+        register_count = 256,
+        coil_count = 2048,
+        batch_size = 1000,
+        max_frame = MODBUS_DATA_BUFFER_SIZE * 2 + 8, // enough for an ASCII encoded frame
+    };
+
+    enum framer_type
+    {
+        framer_rtu,
+        framer_ascii,
+    };
+
+    // serves the holding registers and coils from arrays
+    class CBenchmarkHandler : public CModbusSlaveHandlerHolding
+    {
+    public:
+        CBenchmarkHandler()
+            :   CModbusSlaveHandlerHolding(m_registers, register_count)
+        {
+            for (size_t i = 0; i < register_count; ++i)
+                m_registers[i] = (uint16_t)(i * 0x0101);
+            for (size_t i = 0; i < coil_count / 8; ++i)
+                m_coils[i] = (uint8_t)i;
+        }
+        virtual modbus_exception_code::modbus_exception_code read_coils(uint16_t address, uint16_t count, uint8_t* result)
+        {
+            if ((size_t)address + count > coil_count)
+                return modbus_exception_code::illegal_data_address;
+            for (uint16_t i = 0; i < (count + 7) / 8; ++i)
+                result[i] = m_coils[(address / 8 + i) % (coil_count / 8)];
+            return modbus_exception_code::ok;
+        }
+        virtual modbus_exception_code::modbus_exception_code write_multiple_coils(uint16_t address, uint16_t count, const uint8_t* values)
+        {
+            if ((size_t)address + count > coil_count)
+                return modbus_exception_code::illegal_data_address;
+            for (uint16_t i = 0; i < (count + 7) / 8; ++i)
+                m_coils[(address / 8 + i) % (coil_count / 8)] = values[i];
+            return modbus_exception_code::ok;
+        }
+    private:
+        uint16_t m_registers[register_count];
+        uint8_t m_coils[coil_count / 8];
+    };
+
+    // releases each frame without responding, to measure the framer alone
+    class CReleaseHandler : public IFrameHandler
+    {
+    public:
+        virtual void frame_ready(IFramer* framer) { framer->finished(); }
+    };
+
+    // holds one framer of each type on the same stream and clock
+    struct CFramers
+    {
+        CFramers(CLoopbackStream* stream, CVirtualClock* clock)
+            :   rtu(stream, clock, buffer, MODBUS_DATA_BUFFER_SIZE)
+            ,   ascii(stream, clock, buffer, MODBUS_DATA_BUFFER_SIZE)
+        {
+        }
+        IFramer* get(framer_type type) { return type == framer_rtu ? (IFramer*)&rtu : (IFramer*)&ascii; }
+        uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+        CModbusRTU rtu;
+        CModbusASCII ascii;
+    };
+
+    // runs the framer until it has nothing left to do, advancing the virtual clock to each timeout
+    void run(IFramer* framer, CVirtualClock& clock)
+    {
+        while (unsigned long timeout = framer->poll())
+            clock.advance(timeout);
+    }
+
+    // encodes a request frame using the framer itself
+    size_t encode(framer_type type, const uint8_t* pdu, size_t pdu_len, uint8_t* frame)
+    {
+        CLoopbackStream stream;
+        CVirtualClock clock;
+        CFramers framers(&stream, &clock);
+        IFramer* framer = framers.get(type);
+        run(framer, clock);
+
+        // send the request to the capture buffer
+        stream.set_capture(frame, max_frame);
+        if (!framer->begin_send())
+            return 0;
+        framer->set_frame_address(slave_address);
+        for (size_t i = 0; i < pdu_len; ++i)
+            framer->buffer()[i] = pdu[i];
+        framer->set_buffer_len(pdu_len);
+        framer->send();
+        run(framer, clock);
+        return stream.capture_len();
+    }
+
+    // returns the monotonic time in seconds
+    double now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    void bench(framer_type type, bool slave, const char* name, unsigned int size, const uint8_t* pdu, size_t pdu_len, double seconds)
+    {
+        // encode the request
+        uint8_t frame[max_frame];
+        size_t frame_len = encode(type, pdu, pdu_len, frame);
+
+        // create the framer under test
+        CLoopbackStream stream;
+        CVirtualClock clock;
+        CFramers framers(&stream, &clock);
+        CBenchmarkHandler handler;
+        CModbusSlave slave_handler(&handler);
+        CReleaseHandler release_handler;
+        IFramer* framer = framers.get(type);
+        framer->set_station_address(slave_address);
+        framer->set_handler(slave ? (IFrameHandler*)&slave_handler : (IFrameHandler*)&release_handler);
+        run(framer, clock);
+
+        // make sure the request is actually handled
+        stream.load(frame, frame_len);
+        run(framer, clock);
+        if (slave && !stream.tx_bytes)
+        {
+            printf("%-6s %-6s %-24s %5u  no response\n", type == framer_rtu ? "rtu" : "ascii", slave ? "slave" : "framer", name, size);
+            return;
+        }
+
+        // run the request through the framer in batches until the time is up
+        stream.rx_bytes = stream.tx_bytes = 0;
+        unsigned long long frames = 0;
+        double start = now(), elapsed;
+        do
+        {
+            for (int i = 0; i < batch_size; ++i)
+            {
+                stream.load(frame, frame_len);
+                run(framer, clock);
+            }
+            frames += batch_size;
+            elapsed = now() - start;
+        } while (elapsed < seconds);
+
+        printf("%-6s %-6s %-24s %5u %12.0f %10.1f %14.0f\n",
+            type == framer_rtu ? "rtu" : "ascii",
+            slave ? "slave" : "framer",
+            name,
+            size,
+            frames / elapsed,
+            elapsed * 1e9 / frames,
+            (stream.rx_bytes + stream.tx_bytes) / elapsed);
+    }
+
+    // builds a read or write request PDU
+    size_t build(uint8_t* pdu, uint8_t function, uint16_t address, uint16_t count)
+    {
+        pdu[0] = function;
+        pdu[1] = (uint8_t)(address >> 8);
+        pdu[2] = (uint8_t)address;
+        pdu[3] = (uint8_t)(count >> 8);
+        pdu[4] = (uint8_t)count;
+        switch (function)
+        {
+        case 0x0f:
+            pdu[5] = (uint8_t)((count + 7) / 8);
+            for (uint8_t i = 0; i < pdu[5]; ++i)
+                pdu[6 + i] = (uint8_t)(0x55 + i);
+            return 6 + pdu[5];
+        case 0x10:
+            pdu[5] = (uint8_t)(count * 2);
+            for (uint8_t i = 0; i < pdu[5]; ++i)
+                pdu[6 + i] = i;
+            return 6 + pdu[5];
+        }
+        return 5;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.2;
+
+    struct
+    {
+        const char* name;
+        uint8_t function;
+        uint16_t count; // register or bit count, or the value for single writes
+    } cases[] =
+    {
+        { "fc01 read coils", 0x01, 16 },
+        { "fc01 read coils", 0x01, 2000 },
+        { "fc03 read holding", 0x03, 1 },
+        { "fc03 read holding", 0x03, 16 },
+        { "fc03 read holding", 0x03, 125 },
+        { "fc05 write coil", 0x05, 0xff00 },
+        { "fc06 write register", 0x06, 0x1234 },
+        { "fc0f write coils", 0x0f, 16 },
+        { "fc0f write coils", 0x0f, 1968 },
+        { "fc10 write registers", 0x10, 1 },
+        { "fc10 write registers", 0x10, 16 },
+        { "fc10 write registers", 0x10, 123 },
+    };
+
+    printf("%-6s %-6s %-24s %5s %12s %10s %14s\n", "framer", "mode", "function", "size", "frames/s", "ns/frame", "bytes/s");
+    for (int type = framer_rtu; type <= framer_ascii; ++type)
+    {
+        for (int slave = 0; slave <= 1; ++slave)
+        {
+            for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+            {
+                uint8_t pdu[MODBUS_DATA_BUFFER_SIZE];
+                size_t pdu_len = build(pdu, cases[i].function, 0, cases[i].count);
+                unsigned int size = cases[i].function == 0x05 || cases[i].function == 0x06 ? 1 : cases[i].count;
+                bench((framer_type)type, slave != 0, cases[i].name, size, pdu, pdu_len, seconds);
+            }
+        }
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,115 @@
+// In-memory stream and virtual clock used to drive the framers without hardware.
+//
+#ifndef __ModbusPotato_LoopbackStream_h__
+#define __ModbusPotato_LoopbackStream_h__
+#include "../../ModbusInterface.h"
+#include <string.h>
+namespace ModbusPotato
+{
+    /// <summary>
+    /// A stream which reads from a caller supplied buffer and counts or captures the written data.
+    /// </summary>
+    /// <remarks>
+    /// The receive data is not copied when loaded; the framer reads directly
+    /// from the caller's buffer, which must remain valid until it has been
+    /// consumed.  Written characters are only counted unless a capture
+    /// buffer is set.
+    /// </remarks>
+    class CLoopbackStream : public IStream
+    {
+    public:
+        CLoopbackStream()
+            :   rx_bytes()
+            ,   tx_bytes()
+            ,   m_rx()
+            ,   m_rx_len()
+            ,   m_capture()
+            ,   m_capture_len()
+            ,   m_capture_max()
+        {
+        }
+
+        /// <summary>
+        /// Sets the next characters to be received.
+        /// </summary>
+        void load(const uint8_t* data, size_t len)
+        {
+            m_rx = data;
+            m_rx_len = len;
+        }
+
+        /// <summary>
+        /// Sets the buffer to capture the written characters, or NULL to only count them.
+        /// </summary>
+        void set_capture(uint8_t* buffer, size_t buffer_max)
+        {
+            m_capture = buffer;
+            m_capture_max = buffer_max;
+            m_capture_len = 0;
+        }
+
+        /// <summary>
+        /// Returns the number of characters captured.
+        /// </summary>
+        size_t capture_len() const { return m_capture_len; }
+
+        virtual int read(uint8_t* buffer, size_t buffer_size)
+        {
+            size_t len = buffer_size < m_rx_len ? buffer_size : m_rx_len;
+            if (!len)
+                return 0;
+            if (buffer)
+                memcpy(buffer, m_rx, len);
+            m_rx += len;
+            m_rx_len -= len;
+            rx_bytes += len;
+            return (int)len;
+        }
+        virtual int write(uint8_t* buffer, size_t len)
+        {
+            if (m_capture)
+            {
+                size_t room = m_capture_max - m_capture_len;
+                size_t n = len < room ? len : room;
+                memcpy(m_capture + m_capture_len, buffer, n);
+                m_capture_len += n;
+            }
+            tx_bytes += len;
+            return (int)len;
+        }
+        virtual void txEnable(bool) {}
+        virtual bool writeComplete() { return true; }
+        virtual void communicationStatus(bool, bool) {}
+
+        unsigned long long rx_bytes, tx_bytes;
+    private:
+        const uint8_t* m_rx;
+        size_t m_rx_len;
+        uint8_t* m_capture;
+        size_t m_capture_len, m_capture_max;
+    };
+
+    /// <summary>
+    /// A clock which only moves when it is advanced by the caller.
+    /// </summary>
+    class CVirtualClock : public ITimeProvider
+    {
+    public:
+        CVirtualClock(unsigned long microseconds_per_tick = 1)
+            :   m_ticks()
+            ,   m_microseconds_per_tick(microseconds_per_tick)
+        {
+        }
+        virtual system_tick_t ticks() const { return m_ticks; }
+        virtual unsigned long microseconds_per_tick() const { return m_microseconds_per_tick; }
+
+        /// <summary>
+        /// Advances the clock by the given number of ticks.
+        /// </summary>
+        void advance(system_tick_t ticks) { m_ticks += ticks; }
+    private:
+        system_tick_t m_ticks;
+        unsigned long m_microseconds_per_tick;
+    };
+}
+#endif
\ No newline at end of file
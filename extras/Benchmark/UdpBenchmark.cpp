@@ -0,0 +1,251 @@
+// Loopback benchmark for the UDP framer.
+//
+// A slave is served by CModbusUDP on 127.0.0.1, and is driven in the same
+// thread by a raw client socket which keeps a window of read holding
+// registers requests in flight, sending and receiving them in batches.
+// Each case is run with a slave batch size of 1, which costs two system
+// calls per request as with a plain recvfrom()/sendto() loop, and with
+// larger batches.  A last case polls the slave one request at a time
+// through CModbusMaster on a second CModbusUDP.
+//
+// Usage: udp-benchmark [seconds per case]
+//
+#include "../../ModbusUDP.h"
+#include "../../ModbusMaster.h"
+#include "../../ModbusSlave.h"
+#include "../../ModbusSlaveHandlerHolding.h"
+#include "../../ModbusPosixTimeProvider.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+using namespace ModbusPotato;
+
+namespace
+{
+    enum
+    {
+        slave_address = 1,
+        register_count = 256,
+        read_count = 16,
+        request_length = 12, // MBAP header and a read holding registers request
+        max_window = 64,
+    };
+
+    double now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    // serves the holding registers from an array
+    class CBenchmarkHandler : public CModbusSlaveHandlerHolding
+    {
+    public:
+        CBenchmarkHandler()
+            :   CModbusSlaveHandlerHolding(m_registers, register_count)
+        {
+            for (size_t i = 0; i < register_count; ++i)
+                m_registers[i] = (uint16_t)(i * 0x0101);
+        }
+    private:
+        uint16_t m_registers[register_count];
+    };
+
+    // completes each transaction by counting it
+    class CCountingHandler : public IMasterHandler
+    {
+    public:
+        CCountingHandler() : completed(), failed() {}
+        virtual void transaction_complete(CModbusMaster*, CModbusTransaction* transaction)
+        {
+            if (transaction->status == modbus_transaction_status::ok)
+                completed++;
+            else
+                failed++;
+        }
+        unsigned long completed, failed;
+    };
+
+    CModbusUDPDatagram slave_slots[CModbusUDP::max_slots];
+    CModbusUDPDatagram master_slots[1];
+
+    // drives the slave with a window of requests from a raw socket, and returns the requests per second
+    double run_window(CModbusUDP& framer, size_t slots, size_t window, double seconds, unsigned long& errors)
+    {
+        framer.set_slots(slave_slots, slots);
+        if (!framer.open("127.0.0.1", 0))
+        {
+            perror("open");
+            exit(1);
+        }
+        int client = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in server;
+        memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(framer.port());
+        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (client < 0 || connect(client, (struct sockaddr*)&server, sizeof(server)) != 0)
+        {
+            perror("client");
+            exit(1);
+        }
+
+        uint8_t requests[max_window][request_length];
+        uint8_t responses[max_window][260];
+        struct mmsghdr tx[max_window], rx[max_window];
+        struct iovec tx_iov[max_window], rx_iov[max_window];
+        memset(tx, 0, sizeof(tx));
+        memset(rx, 0, sizeof(rx));
+        for (size_t i = 0; i < window; ++i)
+        {
+            tx_iov[i].iov_base = requests[i];
+            tx_iov[i].iov_len = request_length;
+            tx[i].msg_hdr.msg_iov = tx_iov + i;
+            tx[i].msg_hdr.msg_iovlen = 1;
+            rx_iov[i].iov_base = responses[i];
+            rx_iov[i].iov_len = sizeof(responses[i]);
+            rx[i].msg_hdr.msg_iov = rx_iov + i;
+            rx[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        uint16_t id = 0;
+        unsigned long count = 0;
+        double start = now(), elapsed;
+        do
+        {
+            // send a window of requests
+            for (size_t i = 0; i < window; ++i)
+            {
+                static const uint8_t request[request_length] = { 0, 0, 0, 0, 0, 6, slave_address, 0x03, 0x00, 0x10, 0x00, read_count };
+                memcpy(requests[i], request, request_length);
+                requests[i][0] = (uint8_t)(++id >> 8);
+                requests[i][1] = (uint8_t)id;
+            }
+            if (sendmmsg(client, tx, (unsigned int)window, 0) != (int)window)
+            {
+                perror("sendmmsg");
+                exit(1);
+            }
+
+            // serve them and collect the responses
+            size_t received = 0;
+            while (received < window)
+            {
+                framer.poll();
+                int ec = recvmmsg(client, rx, (unsigned int)(window - received), MSG_DONTWAIT, NULL);
+                if (ec < 0 && errno != EAGAIN)
+                {
+                    perror("recvmmsg");
+                    exit(1);
+                }
+                for (int i = 0; i < ec; ++i)
+                {
+                    if (rx[i].msg_len != 9 + read_count * 2 || responses[i][7] != 0x03)
+                        errors++;
+                }
+                if (ec > 0)
+                    received += ec;
+            }
+            count += window;
+            elapsed = now() - start;
+        } while (elapsed < seconds);
+
+        close(client);
+        framer.close();
+        return count / elapsed;
+    }
+
+    // polls the slave one request at a time through the master, and returns the transactions per second
+    double run_master(CModbusUDP& slave_framer, double seconds, unsigned long& errors)
+    {
+        slave_framer.set_slots(slave_slots, CModbusUDP::max_slots);
+        if (!slave_framer.open("127.0.0.1", 0))
+        {
+            perror("open");
+            exit(1);
+        }
+
+        CModbusPosixTimeProvider timer;
+        CModbusUDP framer;
+        CModbusUDPRoute route;
+        framer.set_slots(master_slots, 1);
+        if (!framer.open("127.0.0.1", 0) || !framer.add_route(&route, slave_address, "127.0.0.1", slave_framer.port()))
+        {
+            perror("master");
+            exit(1);
+        }
+        CModbusMaster master(&framer, &timer);
+        master.set_timeout(100000);
+
+        CCountingHandler handler;
+        uint8_t data[MODBUS_DATA_BUFFER_SIZE];
+        CModbusTransaction transaction(&handler, data, sizeof(data));
+        transaction.address = slave_address;
+
+        double start = now(), elapsed;
+        do
+        {
+            static const uint8_t request[] = { 0x03, 0x00, 0x10, 0x00, read_count };
+            memcpy(data, request, sizeof(request));
+            transaction.len = sizeof(request);
+            master.submit(&transaction);
+            while (master.busy())
+            {
+                master.poll();
+                slave_framer.poll();
+                framer.poll();
+            }
+            elapsed = now() - start;
+        } while (elapsed < seconds);
+
+        errors += handler.failed;
+        slave_framer.close();
+        return handler.completed / elapsed;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    if (seconds <= 0)
+    {
+        fprintf(stderr, "usage: %s [seconds per case]\n", argv[0]);
+        return 1;
+    }
+
+    CBenchmarkHandler handler;
+    CModbusSlave slave(&handler);
+    CModbusUDP framer;
+    framer.set_handler(&slave);
+    framer.set_station_address(slave_address);
+
+    static const size_t windows[] = { 1, 8, 32 };
+    static const size_t batches[] = { 1, 8, 64 };
+    unsigned long errors = 0;
+    printf("%-24s %14s %12s\n", "case", "requests/s", "ns/request");
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); ++w)
+    {
+        for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); ++b)
+        {
+            double rate = run_window(framer, batches[b], windows[w], seconds, errors);
+            char name[64];
+            snprintf(name, sizeof(name), "window %u, batch %u", (unsigned)windows[w], (unsigned)batches[b]);
+            printf("%-24s %14.0f %12.0f\n", name, rate, 1e9 / rate);
+        }
+    }
+    double rate = run_master(framer, seconds, errors);
+    printf("%-24s %14.0f %12.0f\n", "master, one at a time", rate, 1e9 / rate);
+
+    if (errors)
+    {
+        fprintf(stderr, "%lu bad responses\n", errors);
+        return 1;
+    }
+    return 0;
+}
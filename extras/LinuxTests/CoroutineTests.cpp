@@ -0,0 +1,182 @@
+// Runs coroutines through CModbusCoroutineMaster against a CModbusSlave
+// over the UDP loopback interface.
+//
+// Note: this file needs C++20, so it is built into its own test program
+// by the Makefile.
+//
+#include "UnitTest.h"
+#include "../../ModbusCoroutine.h"
+#include "../../ModbusUDP.h"
+#include "../../ModbusSlave.h"
+#include "../../ModbusSlaveHandlerHolding.h"
+#include "../../ModbusPosixTimeProvider.h"
+#include <poll.h>
+#include <time.h>
+using namespace UnitTests;
+using namespace ModbusPotato;
+
+namespace
+{
+    enum
+    {
+        slave_address = 1,
+        register_count = 32,
+        block_size = 4096,
+    };
+
+    // a slave serving an array of holding registers on the loopback interface, and a master routed to it
+    class CLoopback
+    {
+    public:
+        CLoopback()
+            :   m_handler(m_registers, register_count)
+            ,   m_slave(&m_handler)
+            ,   m_master(&m_master_framer, &m_timer)
+        {
+            for (size_t i = 0; i < register_count; ++i)
+                m_registers[i] = (uint16_t)(i * 0x0101);
+            m_slave_framer.set_slots(m_slave_slots, 4);
+            m_slave_framer.set_handler(&m_slave);
+            m_slave_framer.set_station_address(slave_address);
+            m_master_framer.set_slots(m_master_slots, 1);
+            m_master.master().set_timeout(100000);
+        }
+
+        bool open()
+        {
+            return m_slave_framer.open("127.0.0.1", 0)
+                && m_master_framer.open("127.0.0.1", 0)
+                && m_master_framer.add_route(&m_route, slave_address, "127.0.0.1", m_slave_framer.port());
+        }
+
+        // polls both ends until no coroutine is waiting, or returns false after a second
+        bool run()
+        {
+            struct timespec start, now;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (;;)
+            {
+                m_master.poll();
+                m_slave_framer.poll();
+                if (!m_master.waiting())
+                    return true;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if (now.tv_sec - start.tv_sec > 1)
+                    return false;
+                struct pollfd pfd[2] = { { m_master_framer.fd(), POLLIN, 0 }, { m_slave_framer.fd(), POLLIN, 0 } };
+                ::poll(pfd, 2, 1);
+            }
+        }
+
+        CModbusCoroutineMaster& master() { return m_master; }
+        uint16_t reg(size_t address) const { return m_registers[address]; }
+    private:
+        // the framers are constructed first, since the master registers itself as the handler of its framer
+        CModbusPosixTimeProvider m_timer;
+        CModbusUDPDatagram m_slave_slots[4], m_master_slots[1];
+        CModbusUDP m_slave_framer, m_master_framer;
+        CModbusUDPRoute m_route;
+        uint16_t m_registers[register_count];
+        CModbusSlaveHandlerHolding m_handler;
+        CModbusSlave m_slave;
+        CModbusCoroutineMaster m_master;
+    };
+
+    // what a coroutine saw
+    struct CSteps
+    {
+        CSteps() : written(), first(), last(), count(), finished() {}
+        bool written;
+        uint16_t first, last;
+        size_t count;
+        bool finished;
+    };
+
+    // writes three registers, waits, and reads them back
+    CModbusTask write_and_read(CModbusFramePool&, CModbusCoroutineMaster& master, uint16_t address, uint16_t value, CSteps& steps)
+    {
+        uint16_t values[3] = { value, (uint16_t)(value + 1), (uint16_t)(value + 2) };
+        CModbusResult result = co_await master.write_holding(slave_address, address, 3, values);
+        steps.written = result.ok();
+        co_await master.delay(2000);
+        result = co_await master.read_holding(slave_address, address, 3);
+        steps.count = result.register_count();
+        steps.first = result.register_value(0);
+        steps.last = result.register_value(2);
+        co_await master.delay(1000);
+        steps.finished = true;
+    }
+
+    // makes a request for no registers, which is never sent
+    CModbusTask invalid_request(CModbusFramePool&, CModbusCoroutineMaster& master, uint8_t& status)
+    {
+        uint16_t values[1] = {};
+        CModbusResult result = co_await master.write_holding(slave_address, 0, 0, values);
+        status = result.status;
+    }
+}
+
+TEST_METHOD(CoroutineTests, TestLoopback)
+{
+    CLoopback loopback;
+    Assert::AreEqual(true, loopback.open());
+    static char memory[2 * block_size + (size_t)CModbusFramePool::alignment];
+    CModbusFramePool pool(memory, sizeof(memory), block_size);
+    Assert::AreEqual((size_t)2, pool.available());
+
+    // two coroutines run at once, each up to its first request
+    CSteps first, second;
+    CModbusTask task1 = write_and_read(pool, loopback.master(), 4, 0x1000, first);
+    CModbusTask task2 = write_and_read(pool, loopback.master(), 20, 0x2000, second);
+    Assert::AreEqual(true, task1.valid());
+    Assert::AreEqual(true, task2.valid());
+    Assert::AreEqual((size_t)2, loopback.master().waiting());
+
+    // the pool is exhausted, so a third is not started
+    CSteps third;
+    CModbusTask task3 = write_and_read(pool, loopback.master(), 8, 0x3000, third);
+    Assert::AreEqual(false, task3.valid());
+    Assert::AreEqual(true, task3.done());
+    Assert::AreEqual((size_t)2, loopback.master().waiting());
+
+    Assert::AreEqual(true, loopback.run());
+    Assert::AreEqual(true, task1.done());
+    Assert::AreEqual(true, task2.done());
+    Assert::AreEqual(true, first.written && second.written);
+    Assert::AreEqual(true, first.finished && second.finished);
+    Assert::AreEqual((size_t)3, first.count);
+    Assert::AreEqual((uint16_t)0x1000, first.first);
+    Assert::AreEqual((uint16_t)0x1002, first.last);
+    Assert::AreEqual((size_t)3, second.count);
+    Assert::AreEqual((uint16_t)0x2000, second.first);
+    Assert::AreEqual((uint16_t)0x2002, second.last);
+    Assert::AreEqual((uint16_t)0x1001, loopback.reg(5));
+    Assert::AreEqual((uint16_t)0x2001, loopback.reg(21));
+    Assert::AreEqual((uint16_t)(3 * 0x0101), loopback.reg(3)); // untouched
+    Assert::AreEqual(false, third.written);
+
+    // the frame holds at least the buffer of the request it waits on, and fits in a block
+    Assert::IsTrue(pool.largest() >= MODBUS_DATA_BUFFER_SIZE, "frame smaller than a request");
+    Assert::IsTrue(pool.largest() <= pool.block_size(), "frame larger than a block");
+
+    // the blocks are returned when the tasks are destroyed
+    task1 = CModbusTask();
+    task2 = CModbusTask();
+    Assert::AreEqual((size_t)2, pool.available());
+}
+
+TEST_METHOD(CoroutineTests, TestInvalidRequest)
+{
+    CLoopback loopback;
+    Assert::AreEqual(true, loopback.open());
+    static char memory[block_size + (size_t)CModbusFramePool::alignment];
+    CModbusFramePool pool(memory, sizeof(memory), block_size);
+
+    // the request is never sent, and the coroutine runs to the end without suspending
+    uint8_t status = 0xff;
+    CModbusTask task = invalid_request(pool, loopback.master(), status);
+    Assert::AreEqual(true, task.valid());
+    Assert::AreEqual(true, task.done());
+    Assert::AreEqual((int)modbus_transaction_status::idle, (int)status);
+    Assert::AreEqual((size_t)0, loopback.master().waiting());
+}
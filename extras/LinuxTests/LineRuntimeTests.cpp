@@ -0,0 +1,187 @@
+#include "UnitTest.h"
+#include "../../ModbusLineRuntime.h"
+#include "../../ModbusPosixTimeProvider.h"
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+using namespace UnitTests;
+using namespace ModbusPotato;
+
+namespace
+{
+    // returns the monotonic time in milliseconds
+    double now_ms()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+    }
+
+    void sleep_ms(unsigned long ms)
+    {
+        struct timespec delay;
+        delay.tv_sec = ms / 1000;
+        delay.tv_nsec = (long)(ms % 1000) * 1000000;
+        nanosleep(&delay, NULL);
+    }
+
+    // a framer which treats each byte read from a pipe as a frame
+    class CPipeFramer : public IFramer
+    {
+    public:
+        CPipeFramer()
+            :   m_handler()
+            ,   m_buffer()
+        {
+            m_fds[0] = m_fds[1] = -1;
+            if (pipe(m_fds) == 0)
+                fcntl(m_fds[0], F_SETFL, O_NONBLOCK);
+        }
+        ~CPipeFramer()
+        {
+            close(m_fds[0]);
+            close(m_fds[1]);
+        }
+        int read_fd() const { return m_fds[0]; }
+        void put(int count)
+        {
+            uint8_t data[64] = {};
+            while (count > 0)
+            {
+                ssize_t ec = write(m_fds[1], data, count < 64 ? count : 64);
+                if (ec <= 0)
+                    break;
+                count -= (int)ec;
+            }
+        }
+        virtual void set_handler(IFrameHandler* handler) { m_handler = handler; }
+        virtual uint8_t station_address() const { return 0; }
+        virtual void set_station_address(uint8_t) {}
+        virtual unsigned long poll()
+        {
+            while (read(m_fds[0], &m_buffer, 1) == 1)
+            {
+                if (m_handler)
+                    m_handler->frame_ready(this);
+            }
+            return 0;
+        }
+        virtual bool begin_send() { return false; }
+        virtual void send() {}
+        virtual void finished() {}
+        virtual bool frame_ready() const { return false; }
+        virtual uint8_t frame_address() const { return 0; }
+        virtual void set_frame_address(uint8_t) {}
+        virtual uint8_t* buffer() { return &m_buffer; }
+        virtual size_t buffer_len() const { return 1; }
+        virtual void set_buffer_len(size_t) {}
+        virtual size_t buffer_max() const { return 1; }
+    private:
+        IFrameHandler* m_handler;
+        int m_fds[2];
+        uint8_t m_buffer;
+    };
+}
+
+TEST_METHOD(LineRuntimeTests, TestWorkerWakesOnInput)
+{
+    // one line, with an idle period far longer than the test
+    CModbusPosixTimeProvider timer;
+    CPipeFramer framer;
+    CModbusLine line(&framer, NULL, framer.read_fd());
+    CModbusLineRuntime runtime(&timer);
+    runtime.set_idle_period(5000000);
+    runtime.set_rebalance(0, 0);
+    Assert::AreEqual(true, runtime.add_worker(-1));
+    Assert::AreEqual(true, runtime.add_line(&line));
+    Assert::AreEqual(true, runtime.start());
+
+    // let the worker go to sleep, then check that input wakes it up
+    sleep_ms(50);
+    double start = now_ms();
+    framer.put(1);
+    while (!line.frames() && now_ms() - start < 2000)
+        sleep_ms(1);
+    double elapsed = now_ms() - start;
+    runtime.stop();
+    Assert::AreEqual(1ul, line.frames());
+    Assert::IsTrue(elapsed < 500, "the worker slept through the input");
+}
+
+TEST_METHOD(LineRuntimeTests, TestBusyLineIsMovedToItsOwnWorker)
+{
+    CModbusPosixTimeProvider timer;
+    CPipeFramer framers[4];
+    CModbusLine lines[4] =
+    {
+        CModbusLine(&framers[0], NULL, framers[0].read_fd()),
+        CModbusLine(&framers[1], NULL, framers[1].read_fd()),
+        CModbusLine(&framers[2], NULL, framers[2].read_fd()),
+        CModbusLine(&framers[3], NULL, framers[3].read_fd()),
+    };
+    CModbusLineRuntime runtime(&timer);
+    runtime.set_rebalance(20, 0); // measure often, and rebalance every time
+    Assert::AreEqual(true, runtime.add_worker(-1));
+    Assert::AreEqual(true, runtime.add_worker(-1));
+    for (size_t i = 0; i < 4; ++i)
+        Assert::AreEqual(true, runtime.add_line(&lines[i]));
+    Assert::AreEqual(true, runtime.start());
+
+    // keep the first line busy while the supervisor measures the rates
+    double start = now_ms();
+    while (now_ms() - start < 300)
+    {
+        framers[0].put(32);
+        sleep_ms(1);
+    }
+    runtime.stop();
+
+    // the busy line has a worker to itself, and the others share the other one
+    Assert::IsTrue(lines[0].frame_rate() > 0, "the frame rate was not measured");
+    int busy_worker = lines[0].worker();
+    for (size_t i = 1; i < 4; ++i)
+        Assert::AreEqual(1 - busy_worker, lines[i].worker());
+}
+
+TEST_METHOD(LineRuntimeTests, TestRebalanceWhileSupervisorRuns)
+{
+    CModbusPosixTimeProvider timer;
+    CPipeFramer framers[4];
+    CModbusLine lines[4] =
+    {
+        CModbusLine(&framers[0], NULL, framers[0].read_fd()),
+        CModbusLine(&framers[1], NULL, framers[1].read_fd()),
+        CModbusLine(&framers[2], NULL, framers[2].read_fd()),
+        CModbusLine(&framers[3], NULL, framers[3].read_fd()),
+    };
+    CModbusLineRuntime runtime(&timer);
+    runtime.set_rebalance(1, 0);
+    Assert::AreEqual(true, runtime.add_worker(-1));
+    Assert::AreEqual(true, runtime.add_worker(-1));
+    for (size_t i = 0; i < 4; ++i)
+        Assert::AreEqual(true, runtime.add_line(&lines[i]));
+    Assert::AreEqual(true, runtime.start());
+
+    // rebalance from the application while the supervisor does the same, with traffic on every line
+    double start = now_ms();
+    while (now_ms() - start < 200)
+    {
+        for (size_t i = 0; i < 4; ++i)
+            framers[i].put(1);
+        runtime.rebalance();
+    }
+    runtime.stop();
+
+    // every frame was counted once, and the idle lines are spread evenly
+    unsigned long frames = 0;
+    int owned[2] = {};
+    for (size_t i = 0; i < 4; ++i)
+    {
+        frames += lines[i].frames();
+        Assert::IsTrue(lines[i].worker() == 0 || lines[i].worker() == 1, "line has no worker");
+        owned[lines[i].worker()]++;
+    }
+    Assert::IsTrue(frames > 0, "no frames were received");
+    Assert::AreEqual(2, owned[0]);
+    Assert::AreEqual(2, owned[1]);
+}
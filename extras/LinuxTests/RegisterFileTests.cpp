@@ -0,0 +1,116 @@
+#include "UnitTest.h"
+#include "TempDir.h"
+#include "../../ModbusRegisterFile.h"
+#include <fcntl.h>
+#include <unistd.h>
+using namespace UnitTests;
+using namespace ModbusPotato;
+
+namespace
+{
+    enum { header_size = 64 }; // offset of the registers in the file
+
+    // reads a register straight from the file, bypassing the mapping
+    uint16_t read_register(const std::string& path, size_t index)
+    {
+        uint16_t value = 0xffff;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            if (pread(fd, &value, sizeof(value), header_size + index * sizeof(value)) != (ssize_t)sizeof(value))
+                value = 0xffff;
+            close(fd);
+        }
+        return value;
+    }
+}
+
+TEST_METHOD(RegisterFileTests, TestCreateAndReopen)
+{
+    CTempDir dir;
+    std::string path = dir.file("registers");
+
+    // a new file is created filled with zeros
+    {
+        CModbusRegisterFile file;
+        Assert::AreEqual(true, file.open(path.c_str(), 100));
+        Assert::AreEqual(true, file.created());
+        Assert::AreEqual((size_t)100, file.count());
+        for (size_t i = 0; i < 100; ++i)
+            Assert::AreEqual((uint16_t)0, file.registers()[i]);
+        file.registers()[0] = 0x1234;
+        file.registers()[99] = 0xabcd;
+    }
+
+    // and the values are mapped again when it is reopened
+    CModbusRegisterFile file;
+    Assert::AreEqual(true, file.open(path.c_str(), 100));
+    Assert::AreEqual(false, file.created());
+    Assert::AreEqual((uint16_t)0x1234, file.registers()[0]);
+    Assert::AreEqual((uint16_t)0xabcd, file.registers()[99]);
+
+    // the temporary file used to create it is gone
+    Assert::AreEqual(-1, access((path + ".tmp").c_str(), F_OK));
+}
+
+TEST_METHOD(RegisterFileTests, TestRejectsMismatchedFile)
+{
+    CTempDir dir;
+    std::string path = dir.file("registers");
+    CModbusRegisterFile file;
+    Assert::AreEqual(true, file.open(path.c_str(), 100));
+    file.close();
+    Assert::IsTrue(file.registers() == NULL, "the registers are still mapped");
+
+    // a different number of registers is rejected, and the file is left alone
+    Assert::AreEqual(false, file.open(path.c_str(), 50));
+    Assert::IsTrue(file.registers() == NULL, "a mismatched file was mapped");
+    Assert::AreEqual(true, file.open(path.c_str(), 100));
+    file.close();
+
+    // as is a damaged header
+    int fd = open(path.c_str(), O_WRONLY);
+    Assert::IsTrue(fd >= 0, "can't open the file");
+    uint8_t garbage = 0x55;
+    Assert::AreEqual((ssize_t)1, pwrite(fd, &garbage, 1, 4));
+    close(fd);
+    Assert::AreEqual(false, file.open(path.c_str(), 100));
+
+    // and an empty count, or one too large to address
+    Assert::AreEqual(false, file.open(dir.file("empty").c_str(), 0));
+    Assert::AreEqual(false, file.open(dir.file("large").c_str(), 0x10000));
+}
+
+TEST_METHOD(RegisterFileTests, TestSyncWrittenRegisters)
+{
+    CTempDir dir;
+    std::string path = dir.file("registers");
+    CModbusRegisterFile file;
+    Assert::AreEqual(true, file.open(path.c_str(), 4096));
+    CModbusSlaveHandlerHolding handler(file.registers(), file.count());
+    file.attach(&handler);
+    file.set_sync_interval(0);
+
+    // a write from the master lands in the file, and sync() flushes it
+    const uint16_t values[] = { 1, 2, 3 };
+    Assert::AreEqual((int)modbus_exception_code::ok, (int)handler.write_multiple_registers(3000, 3, values));
+    Assert::AreEqual((uint16_t)2, file.registers()[3001]);
+    file.poll();
+    Assert::AreEqual(true, file.sync());
+    for (size_t i = 0; i < 3; ++i)
+        Assert::AreEqual(values[i], read_register(path, 3000 + i));
+
+    // with nothing written since, sync() has nothing to do
+    Assert::AreEqual(true, file.sync());
+
+    // writes on either side of the first page widen the flushed range
+    Assert::AreEqual((int)modbus_exception_code::ok, (int)handler.write_multiple_registers(0, 1, values));
+    Assert::AreEqual((int)modbus_exception_code::ok, (int)handler.write_multiple_registers(4095, 1, values + 2));
+    Assert::AreEqual(true, file.sync());
+    Assert::AreEqual((uint16_t)1, read_register(path, 0));
+    Assert::AreEqual((uint16_t)3, read_register(path, 4095));
+
+    // there is nothing to flush once the file is closed
+    file.close();
+    Assert::AreEqual(false, file.sync());
+}
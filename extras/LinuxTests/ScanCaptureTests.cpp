@@ -0,0 +1,162 @@
+#include "UnitTest.h"
+#include "TempDir.h"
+#include "../../ModbusScanCapture.h"
+#include <string>
+using namespace UnitTests;
+using namespace ModbusPotato;
+
+namespace
+{
+    // a block of one uint16 register followed by a float32
+    struct CScan
+    {
+        CScan()
+            :   decoder(points, 2)
+        {
+            set_point(points[0], 0, modbus_point_type::uint16, 0);
+            set_point(points[1], 1, modbus_point_type::float32, 4);
+            decoder.compile();
+        }
+
+        // fills in an unscaled point in big-endian word order
+        static void set_point(CModbusPoint& point, uint16_t offset, uint8_t type, size_t output)
+        {
+            point.offset = offset;
+            point.type = type;
+            point.order = modbus_word_order::abcd;
+            point.scale = 0;
+            point.output = output;
+            point.kernel = NULL;
+            point.run = 0;
+        }
+
+        // builds the registers for a row, where the float is 1.5 times the counter
+        void build(uint16_t counter)
+        {
+            union { float f; uint32_t u; } value;
+            value.f = counter * 1.5f;
+            data[0] = (uint8_t)(counter >> 8);
+            data[1] = (uint8_t)counter;
+            data[2] = (uint8_t)(value.u >> 24);
+            data[3] = (uint8_t)(value.u >> 16);
+            data[4] = (uint8_t)(value.u >> 8);
+            data[5] = (uint8_t)value.u;
+        }
+        CModbusPoint points[2];
+        CModbusDecoder decoder;
+        uint8_t data[6];
+    };
+}
+
+TEST_METHOD(ScanCaptureTests, TestSegmentRollover)
+{
+    CTempDir dir;
+    CScan scan;
+    CModbusScanCapture capture(&scan.decoder);
+    std::string prefix = dir.file("meters");
+    Assert::AreEqual(true, capture.open(prefix.c_str(), 4));
+
+    // ten rows fill two segments of four and start a third
+    for (uint16_t i = 0; i < 10; ++i)
+    {
+        scan.build(i);
+        Assert::AreEqual(true, capture.append(scan.data, sizeof(scan.data), 1000000 + i * 100));
+    }
+    Assert::AreEqual(2u, capture.segment());
+    Assert::AreEqual(2u, capture.rows());
+
+    // the second segment holds rows 4 to 7, with times relative to its first row
+    CModbusCaptureReader reader;
+    Assert::AreEqual(true, reader.open((prefix + ".000001").c_str()));
+    Assert::AreEqual(4u, reader.rows());
+    Assert::AreEqual(1u, reader.header()->segment);
+    Assert::AreEqual((uint16_t)2, reader.header()->columns);
+    Assert::AreEqual((uint64_t)1000400, reader.header()->base_time);
+    Assert::AreEqual((uint64_t)1000700, reader.time(3));
+    Assert::AreEqual((uint8_t)modbus_point_type::uint16, reader.column_type(0));
+    Assert::AreEqual((uint8_t)modbus_point_type::float32, reader.column_type(1));
+    const uint16_t* counters = (const uint16_t*)reader.column(0);
+    const float* values = (const float*)reader.column(1);
+    for (uint32_t row = 0; row < 4; ++row)
+    {
+        Assert::AreEqual((uint16_t)(4 + row), counters[row]);
+        Assert::AreEqual((4 + row) * 1.5f, values[row]);
+    }
+
+    // a new capture continues after the last segment
+    capture.close();
+    CModbusScanCapture next(&scan.decoder);
+    Assert::AreEqual(true, next.open(prefix.c_str(), 4));
+    Assert::AreEqual(3u, next.segment());
+}
+
+TEST_METHOD(ScanCaptureTests, TestReaderCatchesUp)
+{
+    CTempDir dir;
+    CScan scan;
+    CModbusScanCapture capture(&scan.decoder);
+    std::string prefix = dir.file("meters");
+    Assert::AreEqual(true, capture.open(prefix.c_str(), 100));
+
+    // the reader can map the segment before anything is appended
+    CModbusCaptureReader reader;
+    Assert::AreEqual(true, reader.open((prefix + ".000000").c_str()));
+    Assert::AreEqual(0u, reader.rows());
+
+    // and sees each row as soon as it is appended
+    const uint16_t* counters = (const uint16_t*)reader.column(0);
+    for (uint16_t i = 0; i < 10; ++i)
+    {
+        scan.build(i);
+        Assert::AreEqual(true, capture.append(scan.data, sizeof(scan.data), 5000 + i));
+        Assert::AreEqual((uint32_t)i + 1, reader.rows());
+        Assert::AreEqual(i, counters[i]);
+        Assert::AreEqual((uint64_t)5000 + i, reader.time(i));
+    }
+}
+
+TEST_METHOD(ScanCaptureTests, TestClosedFlag)
+{
+    CTempDir dir;
+    CScan scan;
+    CModbusScanCapture capture(&scan.decoder);
+    std::string prefix = dir.file("meters");
+    Assert::AreEqual(true, capture.open(prefix.c_str(), 2));
+    CModbusCaptureReader first;
+    Assert::AreEqual(true, first.open((prefix + ".000000").c_str()));
+
+    // the segment is closed once the writer moves on to the next one
+    for (uint16_t i = 0; i < 2; ++i)
+    {
+        scan.build(i);
+        Assert::AreEqual(true, capture.append(scan.data, sizeof(scan.data), i));
+    }
+    Assert::AreEqual(false, first.closed());
+    scan.build(2);
+    Assert::AreEqual(true, capture.append(scan.data, sizeof(scan.data), 2));
+    Assert::AreEqual(true, first.closed());
+    Assert::AreEqual(2u, first.rows());
+
+    // and the last one when the capture is closed
+    CModbusCaptureReader second;
+    Assert::AreEqual(true, second.open((prefix + ".000001").c_str()));
+    Assert::AreEqual(false, second.closed());
+    capture.close();
+    Assert::AreEqual(true, second.closed());
+    Assert::AreEqual(1u, second.rows());
+}
+
+TEST_METHOD(ScanCaptureTests, TestPrefixLength)
+{
+    CTempDir dir;
+    CScan scan;
+    CModbusScanCapture capture(&scan.decoder);
+
+    // the prefix must leave room for a dot and a segment number of up to 10 digits
+    std::string longest = dir.file("");
+    longest.append(CModbusScanCapture::max_path - CModbusScanCapture::max_suffix - 1 - longest.size(), 'm');
+    std::string too_long = longest + "m";
+    Assert::AreEqual(false, capture.open(too_long.c_str(), 4));
+    Assert::AreEqual(true, capture.open(longest.c_str(), 4));
+    Assert::AreEqual(0u, capture.segment());
+}
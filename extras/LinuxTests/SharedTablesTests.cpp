@@ -0,0 +1,154 @@
+#include "UnitTest.h"
+#include "../../ModbusSharedTables.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+using namespace UnitTests;
+using namespace ModbusPotato;
+
+namespace
+{
+    // a segment name unique to the process, removed at the end of the test
+    class CSegmentName
+    {
+    public:
+        CSegmentName(const char* test)
+        {
+            snprintf(m_name, sizeof(m_name), "/modbus-tests-%d-%s", (int)getpid(), test);
+            CModbusSharedTables::remove(m_name);
+        }
+        ~CSegmentName()
+        {
+            CModbusSharedTables::remove(m_name);
+        }
+        const char* c_str() const { return m_name; }
+    private:
+        char m_name[64];
+    };
+
+    enum { torn_count = 40 }; // registers written at once by the torn read test, across several blocks
+
+    struct CTornWriter
+    {
+        CModbusSharedTables* tables;
+        volatile int stop;
+    };
+
+    // keeps writing the same value to every register of the range, one higher each time
+    void* torn_writer(void* arg)
+    {
+        CTornWriter* writer = (CTornWriter*)arg;
+        uint16_t values[torn_count];
+        for (uint16_t value = 1; !load_acquire(writer->stop); ++value)
+        {
+            for (size_t i = 0; i < torn_count; ++i)
+                values[i] = value;
+            writer->tables->write_registers(CModbusSharedTables::holding_registers, 2, torn_count, values);
+        }
+        return NULL;
+    }
+
+    // returns the monotonic time in milliseconds
+    double now_ms()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+    }
+}
+
+TEST_METHOD(SharedTablesTests, TestCreateAndOpen)
+{
+    CSegmentName name("open");
+    CModbusSharedTables slave, control;
+    Assert::AreEqual(false, control.open(name.c_str()));
+    Assert::AreEqual(true, slave.create(name.c_str(), 10, 20, 100, 50));
+    Assert::AreEqual((size_t)20, slave.count(CModbusSharedTables::discrete_inputs));
+
+    // another mapping sees the layout and the values written through the first
+    Assert::AreEqual(true, control.open(name.c_str()));
+    Assert::AreEqual((size_t)10, control.count(CModbusSharedTables::coils));
+    Assert::AreEqual((size_t)100, control.count(CModbusSharedTables::holding_registers));
+    Assert::AreEqual((size_t)50, control.count(CModbusSharedTables::input_registers));
+    const uint16_t values[] = { 0x1234, 0x5678 };
+    Assert::AreEqual(true, control.write_registers(CModbusSharedTables::input_registers, 48, 2, values));
+    uint16_t result[2] = {};
+    Assert::AreEqual(true, slave.read_registers(CModbusSharedTables::input_registers, 48, 2, result));
+    Assert::AreEqual(values[0], result[0]);
+    Assert::AreEqual(values[1], result[1]);
+
+    // creating it again keeps the values, as long as the layout matches
+    slave.close();
+    Assert::AreEqual((size_t)0, slave.count(CModbusSharedTables::coils));
+    Assert::AreEqual(false, slave.create(name.c_str(), 10, 20, 100, 51));
+    Assert::AreEqual(false, slave.create(name.c_str(), 10, 20, 100, 50, 32));
+    Assert::AreEqual(true, slave.create(name.c_str(), 10, 20, 100, 50));
+    Assert::AreEqual(true, slave.read_registers(CModbusSharedTables::input_registers, 49, 1, result));
+    Assert::AreEqual(values[1], result[0]);
+}
+
+TEST_METHOD(SharedTablesTests, TestRanges)
+{
+    CSegmentName name("ranges");
+    CModbusSharedTables tables;
+    Assert::AreEqual(true, tables.create(name.c_str(), 16, 0, 8, 8, 4));
+
+    // the bits are packed starting with the least significant bit
+    const uint8_t bits[] = { 0xa5, 0x03 };
+    Assert::AreEqual(true, tables.write_bits(CModbusSharedTables::coils, 3, 10, bits));
+    uint8_t result[2] = {};
+    Assert::AreEqual(true, tables.read_bits(CModbusSharedTables::coils, 3, 10, result));
+    Assert::AreEqual((uint8_t)0xa5, result[0]);
+    Assert::AreEqual((uint8_t)0x03, result[1]);
+    Assert::AreEqual(true, tables.read_bits(CModbusSharedTables::coils, 0, 8, result));
+    Assert::AreEqual((uint8_t)0x28, result[0]);
+
+    // ranges outside a table, empty ranges, and the wrong kind of table are refused
+    uint16_t registers[9] = {};
+    Assert::AreEqual(false, tables.read_registers(CModbusSharedTables::holding_registers, 0, 9, registers));
+    Assert::AreEqual(false, tables.read_registers(CModbusSharedTables::holding_registers, 8, 1, registers));
+    Assert::AreEqual(false, tables.read_registers(CModbusSharedTables::holding_registers, 0, 0, registers));
+    Assert::AreEqual(false, tables.read_registers(CModbusSharedTables::coils, 0, 1, registers));
+    Assert::AreEqual(false, tables.read_bits(CModbusSharedTables::discrete_inputs, 0, 1, result));
+    Assert::AreEqual(false, tables.write_bits(CModbusSharedTables::input_registers, 0, 1, bits));
+
+    // the slave handler maps the tables to the function codes
+    CModbusSlaveHandlerShared handler(&tables);
+    const uint16_t values[] = { 7, 8 };
+    Assert::AreEqual((int)modbus_exception_code::ok, (int)handler.write_multiple_registers(6, 2, values));
+    Assert::AreEqual((int)modbus_exception_code::ok, (int)handler.read_holding_registers(7, 1, registers));
+    Assert::AreEqual((uint16_t)8, registers[0]);
+    Assert::AreEqual((int)modbus_exception_code::illegal_data_address, (int)handler.read_holding_registers(7, 2, registers));
+    Assert::AreEqual((int)modbus_exception_code::illegal_data_address, (int)handler.read_discrete_inputs(0, 1, result));
+}
+
+TEST_METHOD(SharedTablesTests, TestReadsAreNeverTorn)
+{
+    // a writer thread rewrites a range of ten blocks while the test reads it through another mapping
+    CSegmentName name("torn");
+    CModbusSharedTables slave, control;
+    Assert::AreEqual(true, slave.create(name.c_str(), 0, 0, 64, 0, 4));
+    Assert::AreEqual(true, control.open(name.c_str()));
+    CTornWriter writer = { &control, 0 };
+    pthread_t thread;
+    Assert::AreEqual(0, pthread_create(&thread, NULL, torn_writer, &writer));
+
+    // every read sees one complete write
+    uint16_t values[torn_count], last = 0;
+    unsigned long changes = 0;
+    bool torn = false;
+    double start = now_ms();
+    while (now_ms() - start < 200 && !torn)
+    {
+        slave.read_registers(CModbusSharedTables::holding_registers, 2, torn_count, values);
+        for (size_t i = 1; i < torn_count; ++i)
+            torn |= values[i] != values[0];
+        changes += values[0] != last;
+        last = values[0];
+    }
+    store_release(writer.stop, 1);
+    pthread_join(thread, NULL);
+    Assert::IsTrue(!torn, "a read returned parts of two writes");
+    Assert::IsTrue(changes > 1, "the reads never overlapped the writes");
+}
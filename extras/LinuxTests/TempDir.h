@@ -0,0 +1,33 @@
+// A temporary directory for the tests which create files.
+//
+#ifndef __ModbusPotato_TempDir_h__
+#define __ModbusPotato_TempDir_h__
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+namespace UnitTests
+{
+    /// <summary>
+    /// Creates a temporary directory, which is removed with its files at the end of the test.
+    /// </summary>
+    class CTempDir
+    {
+    public:
+        CTempDir()
+        {
+            char path[] = "/tmp/modbus-tests-XXXXXX";
+            if (mkdtemp(path))
+                m_path = path;
+        }
+        ~CTempDir()
+        {
+            std::string command = "rm -rf '" + m_path + "'";
+            if (!m_path.empty() && system(command.c_str()) != 0)
+                perror("rm");
+        }
+        std::string file(const char* name) const { return m_path + "/" + name; }
+    private:
+        std::string m_path;
+    };
+}
+#endif
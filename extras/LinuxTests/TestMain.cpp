@@ -0,0 +1,42 @@
+// Runs the registered test methods, or those whose names contain one of
+// the arguments, and returns the number which failed.
+//
+#include "UnitTest.h"
+#include <stdio.h>
+#include <string.h>
+using namespace UnitTests;
+
+int main(int argc, char* argv[])
+{
+    // the list is in reverse order of registration, so reverse it back
+    CTestCase* tests = NULL;
+    while (CTestCase* test = CTestCase::head())
+    {
+        CTestCase::head() = test->next;
+        test->next = tests;
+        tests = test;
+    }
+
+    int run = 0, failed = 0;
+    for (CTestCase* test = tests; test; test = test->next)
+    {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc && !selected; ++i)
+            selected = strstr(test->name, argv[i]) != NULL;
+        if (!selected)
+            continue;
+        run++;
+        try
+        {
+            test->method();
+            printf("passed  %s\n", test->name);
+        }
+        catch (const CAssertFailed& e)
+        {
+            failed++;
+            printf("FAILED  %s: %s\n", test->name, e.message.c_str());
+        }
+    }
+    printf("%d of %d tests passed\n", run - failed, run);
+    return failed;
+}
@@ -0,0 +1,227 @@
+#include "UnitTest.h"
+#include "../../ModbusUDP.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+using namespace UnitTests;
+using namespace ModbusPotato;
+
+namespace
+{
+    // a raw socket on the loopback interface, standing in for a remote device or client
+    class CPeer
+    {
+    public:
+        CPeer()
+            :   m_fd(socket(AF_INET, SOCK_DGRAM, 0))
+        {
+            struct sockaddr_in local;
+            memset(&local, 0, sizeof(local));
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(m_fd, (struct sockaddr*)&local, sizeof(local));
+        }
+        ~CPeer()
+        {
+            close(m_fd);
+        }
+        uint16_t port() const
+        {
+            struct sockaddr_in local;
+            socklen_t len = sizeof(local);
+            getsockname(m_fd, (struct sockaddr*)&local, &len);
+            return ntohs(local.sin_port);
+        }
+
+        // sends a frame with an MBAP header to the given local port
+        void send(uint16_t port, uint16_t id, uint8_t unit, const uint8_t* pdu, size_t len)
+        {
+            uint8_t datagram[CModbusUDPDatagram::header_length + CModbusUDPDatagram::max_pdu];
+            datagram[0] = (uint8_t)(id >> 8);
+            datagram[1] = (uint8_t)id;
+            datagram[2] = datagram[3] = 0;
+            datagram[4] = (uint8_t)((len + 1) >> 8);
+            datagram[5] = (uint8_t)(len + 1);
+            datagram[6] = unit;
+            memcpy(datagram + CModbusUDPDatagram::header_length, pdu, len);
+            struct sockaddr_in to;
+            memset(&to, 0, sizeof(to));
+            to.sin_family = AF_INET;
+            to.sin_port = htons(port);
+            to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            sendto(m_fd, datagram, CModbusUDPDatagram::header_length + len, 0, (struct sockaddr*)&to, sizeof(to));
+        }
+
+        // receives a datagram, or returns false if none arrives within a second
+        bool receive(std::vector<uint8_t>& datagram)
+        {
+            struct pollfd pfd = { m_fd, POLLIN, 0 };
+            if (::poll(&pfd, 1, 1000) != 1)
+                return false;
+            uint8_t data[1024];
+            ssize_t len = recv(m_fd, data, sizeof(data), 0);
+            if (len < 0)
+                return false;
+            datagram.assign(data, data + len);
+            return true;
+        }
+    private:
+        int m_fd;
+    };
+
+    // records the function code and unit of each frame, and releases it
+    class CRecordingHandler : public IFrameHandler
+    {
+    public:
+        virtual void frame_ready(IFramer* framer)
+        {
+            functions.push_back(framer->buffer()[0]);
+            units.push_back(framer->frame_address());
+            framer->finished();
+        }
+        std::vector<uint8_t> functions, units;
+    };
+
+    // answers each frame by echoing its PDU back
+    class CEchoHandler : public IFrameHandler
+    {
+    public:
+        virtual void frame_ready(IFramer* framer)
+        {
+            if (!framer->begin_send())
+                return;
+            framer->send();
+        }
+    };
+
+    // waits up to a millisecond for the socket to be readable, and polls the framer
+    void poll_socket(CModbusUDP& framer)
+    {
+        struct pollfd pfd = { framer.fd(), POLLIN, 0 };
+        ::poll(&pfd, 1, 1);
+        framer.poll();
+    }
+}
+
+TEST_METHOD(UdpTests, TestRequestRouting)
+{
+    CPeer first, second;
+    CModbusUDPDatagram slots[4];
+    CModbusUDP framer;
+    framer.set_slots(slots, 4);
+    Assert::AreEqual(true, framer.open("127.0.0.1", 0));
+    CModbusUDPRoute routes[3];
+    Assert::AreEqual(true, framer.add_route(&routes[0], 1, "127.0.0.1", first.port()));
+    Assert::AreEqual(true, framer.add_route(&routes[1], 2, "127.0.0.1", second.port()));
+    Assert::AreEqual(false, framer.add_route(&routes[2], 3, "localhost", second.port())); // only numeric addresses
+
+    // each request goes to the route for its unit, with the next transaction id
+    static const uint8_t request[] = { 0x03, 0x00, 0x00, 0x00, 0x01 };
+    for (uint8_t unit = 2; unit >= 1; --unit)
+    {
+        Assert::AreEqual(true, framer.begin_send());
+        memcpy(framer.buffer(), request, sizeof(request));
+        framer.set_buffer_len(sizeof(request));
+        framer.set_frame_address(unit);
+        framer.send();
+    }
+    std::vector<uint8_t> datagram;
+    Assert::AreEqual(true, second.receive(datagram));
+    Assert::AreEqual((size_t)12, datagram.size());
+    Assert::AreEqual((uint8_t)1, datagram[1]); // transaction id
+    Assert::AreEqual((uint8_t)6, datagram[5]); // length
+    Assert::AreEqual((uint8_t)2, datagram[6]); // unit
+    Assert::AreEqual((uint8_t)0x03, datagram[7]);
+    Assert::AreEqual(true, first.receive(datagram));
+    Assert::AreEqual((uint8_t)2, datagram[1]);
+    Assert::AreEqual((uint8_t)1, datagram[6]);
+
+    // a unit without a route is dropped, and the framer is ready for the next request
+    Assert::AreEqual(true, framer.begin_send());
+    memcpy(framer.buffer(), request, sizeof(request));
+    framer.set_buffer_len(sizeof(request));
+    framer.set_frame_address(9);
+    framer.send();
+    Assert::AreEqual(1u, framer.statistics()->dumps);
+    Assert::AreEqual(2u, framer.statistics()->tx_frames);
+    Assert::AreEqual(true, framer.begin_send());
+    framer.finished();
+}
+
+TEST_METHOD(UdpTests, TestResponseMatching)
+{
+    CPeer device;
+    CModbusUDPDatagram slots[8];
+    CModbusUDP framer;
+    CRecordingHandler handler;
+    framer.set_handler(&handler);
+    framer.set_slots(slots, 8);
+    Assert::AreEqual(true, framer.open("127.0.0.1", 0));
+    CModbusUDPRoute route;
+    Assert::AreEqual(true, framer.add_route(&route, 1, "127.0.0.1", device.port()));
+
+    // send ten requests, so the transaction id is 10
+    static const uint8_t request[] = { 0x03, 0x00, 0x00, 0x00, 0x01 };
+    std::vector<uint8_t> datagram;
+    for (int i = 0; i < 10; ++i)
+    {
+        Assert::AreEqual(true, framer.begin_send());
+        memcpy(framer.buffer(), request, sizeof(request));
+        framer.set_buffer_len(sizeof(request));
+        framer.set_frame_address(1);
+        framer.send();
+        Assert::AreEqual(true, device.receive(datagram));
+    }
+    Assert::AreEqual((uint8_t)10, datagram[1]);
+
+    // responses to the last request and to a recent retry are accepted, while stale or unknown ids are not
+    static const uint8_t latest[] = { 0x03, 0x02, 0x00, 0x0a };
+    static const uint8_t retry[] = { 0x04, 0x02, 0x00, 0x03 };
+    static const uint8_t stale[] = { 0x05, 0x02, 0x00, 0x02 };
+    static const uint8_t future[] = { 0x06, 0x02, 0x00, 0x0b };
+    device.send(framer.port(), 2, 1, stale, sizeof(stale));
+    device.send(framer.port(), 11, 1, future, sizeof(future));
+    device.send(framer.port(), 3, 1, retry, sizeof(retry));
+    device.send(framer.port(), 10, 1, latest, sizeof(latest));
+    for (int i = 0; i < 1000 && handler.functions.size() < 2; ++i)
+        poll_socket(framer);
+    Assert::AreEqual((size_t)2, handler.functions.size());
+    Assert::AreEqual((uint8_t)0x04, handler.functions[0]);
+    Assert::AreEqual((uint8_t)0x03, handler.functions[1]);
+    Assert::AreEqual(2u, framer.statistics()->dumps);
+    Assert::AreEqual(2u, framer.statistics()->rx_frames);
+}
+
+TEST_METHOD(UdpTests, TestResponsesReturnToTheirPeers)
+{
+    CPeer first, second;
+    CModbusUDPDatagram slots[8];
+    CModbusUDP framer;
+    CEchoHandler handler;
+    framer.set_handler(&handler);
+    framer.set_station_address(1);
+    framer.set_slots(slots, 8);
+    Assert::AreEqual(true, framer.open("127.0.0.1", 0));
+
+    // two clients send requests with their own ids, and one is for another station
+    static const uint8_t request[] = { 0x03, 0x00, 0x00, 0x00, 0x01 };
+    first.send(framer.port(), 0x1234, 1, request, sizeof(request));
+    second.send(framer.port(), 0x0042, 2, request, sizeof(request));
+    second.send(framer.port(), 0x5678, 1, request, sizeof(request));
+    for (int i = 0; i < 1000 && framer.statistics()->tx_frames < 2; ++i)
+        poll_socket(framer);
+
+    // each response goes back to the peer of its request, with the same id
+    std::vector<uint8_t> datagram;
+    Assert::AreEqual(true, first.receive(datagram));
+    Assert::AreEqual((uint8_t)0x12, datagram[0]);
+    Assert::AreEqual((uint8_t)0x34, datagram[1]);
+    Assert::AreEqual(true, second.receive(datagram));
+    Assert::AreEqual((uint8_t)0x56, datagram[0]);
+    Assert::AreEqual((uint8_t)0x78, datagram[1]);
+    Assert::AreEqual((uint8_t)0x03, datagram[7]);
+    Assert::AreEqual(2u, framer.statistics()->rx_frames);
+}
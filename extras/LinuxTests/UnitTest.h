@@ -0,0 +1,81 @@
+// A small stand-in for the Visual Studio unit test framework, for the
+// parts of the library which only build on Linux.
+//
+// Test methods are declared with TEST_METHOD(class, method) and use the
+// same Assert::AreEqual() and Assert::IsTrue() calls as the tests in
+// "Project Files/VS.net/Unit Tests".  A failed assertion ends the test
+// method, and the runner reports it with the expected and actual values.
+//
+#ifndef __ModbusPotato_UnitTest_h__
+#define __ModbusPotato_UnitTest_h__
+#include <stdint.h>
+#include <sstream>
+#include <string>
+namespace UnitTests
+{
+    /// <summary>
+    /// Thrown by a failed assertion and caught by the test runner.
+    /// </summary>
+    struct CAssertFailed
+    {
+        CAssertFailed(const std::string& message) : message(message) {}
+        std::string message;
+    };
+
+    /// <summary>
+    /// A registered test method, linked into a list by its constructor.
+    /// </summary>
+    struct CTestCase
+    {
+        CTestCase(const char* name, void (*method)())
+            :   name(name)
+            ,   method(method)
+            ,   next(head())
+        {
+            head() = this;
+        }
+        static CTestCase*& head()
+        {
+            static CTestCase* s_head;
+            return s_head;
+        }
+        const char* name;
+        void (*method)();
+        CTestCase* next;
+    };
+
+    namespace Assert
+    {
+        // print small integers as numbers rather than characters
+        template <class T> inline void print(std::ostringstream& out, const T& value) { out << value; }
+        inline void print(std::ostringstream& out, uint8_t value) { out << (unsigned)value; }
+        inline void print(std::ostringstream& out, int8_t value) { out << (int)value; }
+        inline void print(std::ostringstream& out, bool value) { out << (value ? "true" : "false"); }
+
+        template <class T, class U> void AreEqual(const T& expected, const U& actual, const char* message = "")
+        {
+            if (expected == actual)
+                return;
+            std::ostringstream out;
+            out << "expected <";
+            print(out, expected);
+            out << "> but was <";
+            print(out, actual);
+            out << "> " << message;
+            throw CAssertFailed(out.str());
+        }
+
+        inline void IsTrue(bool condition, const char* message = "")
+        {
+            if (!condition)
+                throw CAssertFailed(std::string("assertion failed ") + message);
+        }
+    }
+}
+
+// declares and registers a test method
+#define TEST_METHOD(class_name, method) \
+    static void class_name##_##method(); \
+    static UnitTests::CTestCase class_name##_##method##_case(#class_name "." #method, &class_name##_##method); \
+    static void class_name##_##method()
+#endif
@@ -1,10 +1,13 @@
 #include "stdafx.h"
 #include "../../../../ModbusRTU.h"
 #include "../../../../ModbusASCII.h"
+#include "../../../../ModbusAutoDetect.h"
+#include "../../../../ModbusRTUOverTCP.h"
 #include <stdexcept>
 #include <vector>
 #include <tuple>
 #include <string>
+#include <cstring>
 #undef min
 
 using namespace System;
@@ -30,10 +33,12 @@ namespace UnitTests
             ,   m_tx_status()
             ,   m_rx_on_count()
             ,   m_tx_on_count()
+            ,   m_read_count()
         {
         }
         virtual int read(uint8_t* buffer, size_t buffer_size)
         {
+            m_read_count++;
             if (m_pos >= m_items.size())
                 return 0;
 
@@ -93,6 +98,7 @@ namespace UnitTests
         std::string write_data;
         bool m_rx_status, m_tx_status;
         int m_rx_on_count, m_tx_on_count;
+        int m_read_count;
     private:
         system_tick_t m_time, m_last_write;
         size_t m_pos, m_col;
@@ -119,6 +125,26 @@ namespace UnitTests
             Assert::AreEqual(0, stream.m_tx_on_count);
         };
 
+        [TestMethod]
+        void TestRTUExplicitDelays()
+        {
+            CDummyStream stream;
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTU rtu(&stream, &stream, buffer, _countof(buffer));
+
+            // the fixed delays above 19200 baud round down to the 2 tick minimum with a 1ms timer
+            rtu.setup(115200);
+            Assert::AreEqual(2ul, rtu.poll());
+
+            // explicit delays replace the calculated ones
+            rtu.set_delays(10000, 4000);
+            Assert::AreEqual(10ul, rtu.poll());
+
+            // slow baud rates are unaffected by the fast timing mode
+            rtu.setup(1200, true);
+            Assert::AreEqual(32ul, rtu.poll());
+        };
+
         [TestMethod]
         void TestReceiveRTUFrame()
         {
@@ -186,6 +212,170 @@ namespace UnitTests
             Assert::AreEqual(0, stream.m_tx_on_count);
         };
 
+        [TestMethod]
+        void TestReceiveASCIIChecksumError()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // incoming datagram with a bad LRC at 5ms
+            uint8_t frame1[] = ":1103006B00037F\r\n";
+            items.push_back(std::tr1::make_tuple(5, std::string(frame1, frame1 + _countof(frame1) - 1)));
+
+            // parse the frames
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusASCII framer(&stream, &stream, buffer, _countof(buffer));
+
+            while (stream.ticks() < 10)
+            {
+                framer.poll();
+                stream.increment(1);
+            }
+
+            // check the result
+            Assert::AreEqual(false, framer.frame_ready());
+            Assert::AreEqual(0u, framer.statistics()->rx_frames);
+            Assert::AreEqual(1u, framer.statistics()->checksum_errors);
+            Assert::AreEqual(17u, framer.statistics()->rx_bytes);
+        };
+
+        [TestMethod]
+        void TestRTUStatistics()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // incoming datagram with a bad CRC at 5ms
+            uint8_t frame1[] = { 2, 7, 0x41, 0x13 };
+            items.push_back(std::tr1::make_tuple(5, std::string(frame1, frame1 + _countof(frame1))));
+
+            // valid datagram at 15ms
+            uint8_t frame2[] = { 2, 7, 0x41, 0x12 };
+            items.push_back(std::tr1::make_tuple(15, std::string(frame2, frame2 + _countof(frame2))));
+
+            // parse the frames
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTU rtu(&stream, &stream, buffer, _countof(buffer));
+            rtu.setup(9600);
+
+            while (stream.ticks() < 25)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+
+            // check the counters
+            CModbusStatistics stats;
+            rtu.statistics()->snapshot(stats);
+            Assert::AreEqual(true, rtu.frame_ready());
+            Assert::AreEqual(1u, stats.rx_frames);
+            Assert::AreEqual(1u, stats.checksum_errors);
+            Assert::AreEqual(8u, stats.rx_bytes);
+            Assert::AreEqual(0u, stats.tx_frames);
+
+            // send an exception response
+            Assert::AreEqual(true, rtu.begin_send());
+            rtu.buffer()[0] = 0x87;
+            rtu.buffer()[1] = 0x01;
+            rtu.set_buffer_len(2);
+            rtu.send();
+            while (stream.ticks() < 40)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            rtu.statistics()->snapshot(stats);
+            Assert::AreEqual(1u, stats.tx_frames);
+            Assert::AreEqual(5u, stats.tx_bytes);
+            Assert::AreEqual(1u, stats.exceptions);
+        };
+
+        [TestMethod]
+        void TestRTUFlightRecorder()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // incoming datagram at 5ms
+            uint8_t frame1[] = { 2, 7, 0x41, 0x12 };
+            items.push_back(std::tr1::make_tuple(5, std::string(frame1, frame1 + _countof(frame1))));
+
+            // parse the frames while recording the transitions
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTU rtu(&stream, &stream, buffer, _countof(buffer));
+            rtu.setup(9600);
+            CModbusFlightRecord records[16];
+            CModbusFlightRecorder recorder(records, _countof(records));
+            rtu.set_flight_recorder(&recorder);
+
+            while (stream.ticks() < 15)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+
+            // check the transitions
+            Assert::AreEqual(true, rtu.frame_ready());
+            Assert::AreEqual((size_t)3, recorder.count());
+            Assert::AreEqual(0, strcmp("dump", CModbusRTU::state_name(recorder.at(0).old_state)));
+            Assert::AreEqual(0, strcmp("idle", CModbusRTU::state_name(recorder.at(1).old_state)));
+            Assert::AreEqual(0, strcmp("receive", CModbusRTU::state_name(recorder.at(2).old_state)));
+            Assert::AreEqual(0, strcmp("frame_ready", CModbusRTU::state_name(recorder.at(2).new_state)));
+            Assert::AreEqual((uint16_t)1, recorder.at(2).length);
+            Assert::AreEqual((system_tick_t)5, recorder.at(1).ticks);
+
+            // hold the frame, then answer it; the transitions made outside of poll() carry the time they were made
+            while (stream.ticks() < 25)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(true, rtu.begin_send());
+            while (stream.ticks() < 40)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            rtu.send();
+            Assert::AreEqual((size_t)5, recorder.count());
+            Assert::AreEqual(true, recorder.at(2).ticks < 15);
+            Assert::AreEqual(0, strcmp("queue", CModbusRTU::state_name(recorder.at(3).new_state)));
+            Assert::AreEqual((system_tick_t)25, recorder.at(3).ticks);
+            Assert::AreEqual(0, strcmp("tx_addr", CModbusRTU::state_name(recorder.at(4).new_state)));
+            Assert::AreEqual((system_tick_t)40, recorder.at(4).ticks);
+        };
+
+        [TestMethod]
+        void TestRTUFlightRecorderFinished()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // incoming datagram at 5ms
+            uint8_t frame1[] = { 2, 7, 0x41, 0x12 };
+            items.push_back(std::tr1::make_tuple(5, std::string(frame1, frame1 + _countof(frame1))));
+
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTU rtu(&stream, &stream, buffer, _countof(buffer));
+            rtu.setup(9600);
+            CModbusFlightRecord records[16];
+            CModbusFlightRecorder recorder(records, _countof(records));
+            rtu.set_flight_recorder(&recorder);
+
+            // hold the frame, then release it without answering
+            while (stream.ticks() < 30)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(true, rtu.frame_ready());
+            rtu.finished();
+            Assert::AreEqual((size_t)4, recorder.count());
+            Assert::AreEqual(0, strcmp("frame_ready", CModbusRTU::state_name(recorder.at(3).old_state)));
+            Assert::AreEqual(0, strcmp("idle", CModbusRTU::state_name(recorder.at(3).new_state)));
+            Assert::AreEqual((system_tick_t)30, recorder.at(3).ticks);
+        };
+
         [TestMethod]
         void TestReceiveInputOverflow()
         {
@@ -257,6 +447,201 @@ namespace UnitTests
             Assert::AreEqual(1, stream.m_tx_on_count);
         }
 
+        [TestMethod]
+        void TestRTUTransmitDeadline()
+        {
+            CDummyStream stream;
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTU rtu(&stream, &stream, buffer, _countof(buffer));
+            rtu.setup(9600);
+
+            // the initial dump ends T3.5 after construction
+            system_tick_t deadline;
+            Assert::AreEqual(true, rtu.deadline(deadline));
+            Assert::AreEqual((system_tick_t)4, deadline);
+
+            // no deadline while idle
+            while (stream.ticks() < 5)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(false, rtu.deadline(deadline));
+
+            // the earliest transmit instant is T3.5 plus the rounding counts after the last bus activity
+            Assert::AreEqual(true, rtu.begin_send());
+            rtu.set_frame_address(2);
+            rtu.buffer()[0] = 7;
+            rtu.set_buffer_len(1);
+            rtu.send();
+            Assert::AreEqual(true, rtu.deadline(deadline));
+            Assert::AreEqual((system_tick_t)6, deadline);
+
+            // once the delay has passed, the framer waits on the stream rather than a timer
+            while (stream.ticks() < 6)
+                stream.increment(1);
+            Assert::AreEqual(false, rtu.deadline(deadline));
+            rtu.poll();
+            Assert::AreEqual(false, rtu.deadline(deadline));
+        }
+
+        [TestMethod]
+        void TestRTUPrecomputedChecksum()
+        {
+            CDummyStream stream;
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTU rtu(&stream, &stream, buffer, _countof(buffer));
+            rtu.setup(9600);
+
+            // the checksum can only be given while the buffer is locked
+            Assert::AreEqual(false, rtu.set_checksum(0x1234));
+            while (stream.ticks() < 5)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+
+            // send a frame with a given checksum, which is sent as is
+            Assert::AreEqual(true, rtu.begin_send());
+            rtu.set_frame_address(2);
+            rtu.buffer()[0] = 7;
+            rtu.set_buffer_len(1);
+            Assert::AreEqual(true, rtu.set_checksum(0x1234));
+            rtu.send();
+            while (stream.ticks() < 15)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual((size_t)4, stream.write_data.size());
+            Assert::AreEqual((uint8_t)0x34, (uint8_t)stream.write_data[2]); // CRC L
+            Assert::AreEqual((uint8_t)0x12, (uint8_t)stream.write_data[3]); // CRC H
+
+            // the next frame has its checksum calculated again
+            stream.write_data.clear();
+            Assert::AreEqual(true, rtu.begin_send());
+            rtu.set_frame_address(2);
+            rtu.buffer()[0] = 7;
+            rtu.set_buffer_len(1);
+            rtu.send();
+            while (stream.ticks() < 25)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual((size_t)4, stream.write_data.size());
+            Assert::AreEqual((uint8_t)0x41, (uint8_t)stream.write_data[2]); // CRC L
+            Assert::AreEqual((uint8_t)0x12, (uint8_t)stream.write_data[3]); // CRC H
+        }
+
+        [TestMethod]
+        void TestRTUPredictedFrameEnd()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // a read exception status request at 5ms, and a user defined function code at 20ms
+            uint8_t frame1[] = { 2, 7, 0x41, 0x12 };
+            items.push_back(std::tr1::make_tuple(5, std::string(frame1, frame1 + _countof(frame1))));
+            uint8_t frame2[] = { 2, 0x41, 0xc0, 0xe0 };
+            items.push_back(std::tr1::make_tuple(20, std::string(frame2, frame2 + _countof(frame2))));
+
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTU rtu(&stream, &stream, buffer, _countof(buffer));
+            rtu.setup(9600);
+            rtu.set_station_address(2);
+            rtu.set_predict_length(true);
+
+            // the known function code is ready as soon as the CRC arrives, without waiting for T3.5
+            while (stream.ticks() <= 5)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(true, rtu.frame_ready());
+            Assert::AreEqual((size_t)1, rtu.buffer_len());
+            Assert::AreEqual((byte)7, rtu.buffer()[0]);
+
+            // the response still waits T3.5 plus rounding, measured from the last character of the request
+            Assert::AreEqual(true, rtu.begin_send());
+            rtu.buffer()[1] = 0;
+            rtu.set_buffer_len(2);
+            rtu.send();
+            while (stream.write_data.empty() && stream.ticks() < 19)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual((system_tick_t)12, stream.ticks()); // written at 11ms
+
+            // the unknown function code falls back to T3.5
+            while (stream.ticks() <= 23)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(false, rtu.frame_ready());
+            while (stream.ticks() <= 25)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(true, rtu.frame_ready());
+            Assert::AreEqual((byte)0x41, rtu.buffer()[0]);
+        }
+
+        [TestMethod]
+        void TestRTUReceivePool()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // two frames back to back, the second arriving while the first is still held
+            uint8_t frame1[] = { 2, 7, 0x41, 0x12 };
+            uint8_t frame2[] = { 2, 8, 0x01, 0x16 };
+            items.push_back(std::tr1::make_tuple(5, std::string(frame1, frame1 + _countof(frame1))));
+            items.push_back(std::tr1::make_tuple(10, std::string(frame2, frame2 + _countof(frame2))));
+
+            // parse the frames with one extra buffer
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE], pool[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTU rtu(&stream, &stream, buffer, _countof(buffer));
+            rtu.setup(9600);
+            rtu.set_receive_pool(pool, 1);
+
+            while (stream.ticks() < 20)
+            {
+                rtu.poll();
+                stream.increment(1);
+            }
+
+            // the first frame is held by the application
+            Assert::AreEqual(true, rtu.frame_ready());
+            Assert::AreEqual((byte)7, rtu.buffer()[0]);
+            uint8_t* first = rtu.buffer();
+
+            // the second frame was received in the background and is handed over without a copy
+            rtu.finished();
+            rtu.poll();
+            Assert::AreEqual(true, rtu.frame_ready());
+            Assert::AreEqual((byte)2, rtu.frame_address());
+            Assert::AreEqual(1u, rtu.buffer_len());
+            Assert::AreEqual((byte)8, rtu.buffer()[0]);
+            Assert::AreEqual(false, first == rtu.buffer());
+            Assert::AreEqual(2u, rtu.statistics()->rx_frames);
+            Assert::AreEqual(0u, rtu.statistics()->collisions);
+
+            // nothing else is queued
+            rtu.finished();
+            rtu.poll();
+            Assert::AreEqual(false, rtu.frame_ready());
+
+            // the background receiver is polled once per pass while the application builds a response
+            Assert::AreEqual(true, rtu.begin_send());
+            stream.m_read_count = 0;
+            rtu.poll();
+            Assert::AreEqual(1, stream.m_read_count);
+        }
+
         [TestMethod]
         void TestASCIITransmitFrame()
         {
@@ -297,5 +682,269 @@ namespace UnitTests
             Assert::AreEqual(0, stream.m_rx_on_count);
             Assert::AreEqual(1, stream.m_tx_on_count);
         }
+
+        [TestMethod]
+        void TestAutoDetectMixedFrames()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // an RTU frame at 5ms, an ASCII frame at 40ms, and an RTU frame to station 58 (':') at 90ms
+            uint8_t frame1[] = { 2, 7, 0x41, 0x12 };
+            items.push_back(std::tr1::make_tuple(5, std::string(frame1, frame1 + _countof(frame1))));
+            uint8_t frame2[] = ":1103006B00037E\r\n";
+            items.push_back(std::tr1::make_tuple(40, std::string(frame2, frame2 + _countof(frame2) - 1)));
+            uint8_t frame3[] = { ':', 3, 0x53, 0x11 };
+            items.push_back(std::tr1::make_tuple(90, std::string(frame3, frame3 + _countof(frame3))));
+
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusAutoDetect framer(&stream, &stream, buffer, _countof(buffer));
+            framer.rtu()->setup(9600);
+
+            // the RTU frame is received and echoed back as RTU
+            while (stream.ticks() < 10)
+            {
+                framer.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(true, framer.frame_ready());
+            Assert::AreEqual((int)CModbusAutoDetect::mode_rtu, (int)framer.mode());
+            Assert::AreEqual((byte)2, framer.frame_address());
+            Assert::AreEqual((size_t)1, framer.buffer_len());
+            Assert::AreEqual(true, framer.begin_send());
+            framer.send();
+            while (stream.ticks() < 35)
+            {
+                framer.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(true, std::string(frame1, frame1 + _countof(frame1)) == stream.write_data);
+
+            // the ASCII frame is received and echoed back as ASCII
+            stream.write_data.clear();
+            while (stream.ticks() < 50)
+            {
+                framer.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(true, framer.frame_ready());
+            Assert::AreEqual((int)CModbusAutoDetect::mode_ascii, (int)framer.mode());
+            Assert::AreEqual((byte)17, framer.frame_address());
+            Assert::AreEqual((size_t)5, framer.buffer_len());
+            Assert::AreEqual(true, framer.begin_send());
+            framer.send();
+            while (stream.ticks() < 85)
+            {
+                framer.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(gcnew System::String(":1103006B00037E\r\n"), gcnew System::String(stream.write_data.c_str()));
+
+            // a ':' followed by a binary function code is still RTU
+            while (stream.ticks() < 100)
+            {
+                framer.poll();
+                stream.increment(1);
+            }
+            Assert::AreEqual(true, framer.frame_ready());
+            Assert::AreEqual((int)CModbusAutoDetect::mode_rtu, (int)framer.mode());
+            Assert::AreEqual((byte)':', framer.frame_address());
+            Assert::AreEqual((byte)3, framer.buffer()[0]);
+
+            // the counters cover both modes and don't change with the mode
+            Assert::AreEqual((uint32_t)3, framer.statistics()->rx_frames);
+            Assert::AreEqual((uint32_t)2, framer.statistics()->tx_frames);
+            Assert::AreEqual((uint32_t)0, framer.rtu()->statistics()->rx_frames);
+            Assert::AreEqual((uint32_t)0, framer.ascii()->statistics()->rx_frames);
+        }
+
+        [TestMethod]
+        void TestRTUOverTCPPipelinedFrames()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // four requests in one segment, the third for another station
+            uint8_t segment[] = {
+                0x01, 0x03, 0x00, 0x00, 0x00, 0x0a, 0xc5, 0xcd,
+                0x01, 0x10, 0x00, 0x01, 0x00, 0x02, 0x04, 0x00, 0x0a, 0x01, 0x02, 0x92, 0x30,
+                0x02, 0x03, 0x00, 0x00, 0x00, 0x01, 0x84, 0x39,
+                0x01, 0x06, 0x00, 0x01, 0x00, 0x03, 0x98, 0x0b,
+            };
+            items.push_back(std::tr1::make_tuple(1, std::string(segment, segment + _countof(segment))));
+
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTUOverTCP framer(&stream, &stream, buffer, _countof(buffer));
+            framer.set_station_address(1);
+
+            // the first frame is ready without waiting for any silence, and the rest wait in the stream
+            stream.increment(1);
+            Assert::AreEqual(0ul, framer.poll());
+            Assert::AreEqual(true, framer.frame_ready());
+            Assert::AreEqual((byte)1, framer.frame_address());
+            Assert::AreEqual((size_t)5, framer.buffer_len());
+            Assert::AreEqual((byte)0x03, framer.buffer()[0]);
+
+            // answer it, which also receives the next frame
+            Assert::AreEqual(true, framer.begin_send());
+            uint8_t response[] = { 0x03, 0x04, 0x00, 0x01, 0x00, 0x02 };
+            std::copy(response, response + _countof(response), framer.buffer());
+            framer.set_buffer_len(_countof(response));
+            framer.send();
+            while (stream.ticks() < 10 && !framer.frame_ready())
+            {
+                stream.increment(1);
+                framer.poll();
+            }
+            uint8_t expected[] = { 0x01, 0x03, 0x04, 0x00, 0x01, 0x00, 0x02, 0x2a, 0x32 };
+            Assert::AreEqual(true, std::string(expected, expected + _countof(expected)) == stream.write_data);
+
+            // the write multiple registers request is sized by its byte count
+            Assert::AreEqual(true, framer.frame_ready());
+            Assert::AreEqual((size_t)10, framer.buffer_len());
+            Assert::AreEqual((byte)0x10, framer.buffer()[0]);
+            Assert::AreEqual((byte)0x02, framer.buffer()[9]);
+
+            // the frame for station 2 is skipped
+            framer.finished();
+            framer.poll();
+            Assert::AreEqual(true, framer.frame_ready());
+            Assert::AreEqual((size_t)5, framer.buffer_len());
+            Assert::AreEqual((byte)0x06, framer.buffer()[0]);
+            framer.finished();
+            framer.poll();
+            Assert::AreEqual(false, framer.frame_ready());
+            Assert::AreEqual(3u, framer.statistics()->rx_frames);
+            Assert::AreEqual(0u, framer.statistics()->checksum_errors);
+        }
+
+        [TestMethod]
+        void TestRTUOverTCPResponses()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // a read response, an exception response, then a frame with a bad CRC
+            uint8_t segment[] = {
+                0x01, 0x03, 0x04, 0x00, 0x01, 0x00, 0x02, 0x2a, 0x32,
+                0x01, 0x83, 0x02, 0xc0, 0xf1,
+                0x01, 0x06, 0x00, 0x01, 0x00, 0x03, 0x98, 0x0c, 0x01,
+            };
+            items.push_back(std::tr1::make_tuple(1, std::string(segment, segment + _countof(segment))));
+
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTUOverTCP framer(&stream, &stream, buffer, _countof(buffer));
+
+            // as a master, the response layout is matched by its CRC
+            stream.increment(1);
+            framer.poll();
+            Assert::AreEqual(true, framer.frame_ready());
+            Assert::AreEqual((size_t)6, framer.buffer_len());
+            Assert::AreEqual((byte)0x02, framer.buffer()[5]);
+            framer.finished();
+            framer.poll();
+            Assert::AreEqual(true, framer.frame_ready());
+            Assert::AreEqual((size_t)2, framer.buffer_len());
+            Assert::AreEqual((byte)0x83, framer.buffer()[0]);
+
+            // the bad frame is dumped along with anything after it
+            framer.finished();
+            framer.poll();
+            Assert::AreEqual(false, framer.frame_ready());
+            Assert::AreEqual(1u, framer.statistics()->checksum_errors);
+            Assert::AreEqual(1u, framer.statistics()->exceptions);
+            Assert::AreEqual(0, stream.read(NULL, (size_t)-1));
+        }
+
+        [TestMethod]
+        void TestRTUOverTCPTruncatedFrame()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // the first half of a request, then a complete one after the connection stalls
+            uint8_t truncated[] = { 0x01, 0x03, 0x00, 0x00 };
+            uint8_t request[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0a, 0xc5, 0xcd };
+            items.push_back(std::tr1::make_tuple(1, std::string(truncated, truncated + _countof(truncated))));
+            items.push_back(std::tr1::make_tuple(1500, std::string(request, request + _countof(request))));
+
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTUOverTCP framer(&stream, &stream, buffer, _countof(buffer));
+            framer.set_station_address(1);
+            framer.set_timeout(500);
+
+            // the framer waits for the rest of the frame until the timeout
+            stream.increment(1);
+            Assert::AreEqual(500ul, framer.poll());
+            stream.increment(200);
+            Assert::AreEqual(300ul, framer.poll());
+            Assert::AreEqual(true, stream.m_rx_status);
+
+            // then drops it and goes back to idle
+            stream.increment(300);
+            Assert::AreEqual(0ul, framer.poll());
+            Assert::AreEqual(false, stream.m_rx_status);
+            Assert::AreEqual(1u, framer.statistics()->t1p5_breaks);
+
+            // so the next request is received on its own
+            stream.increment(1000);
+            Assert::AreEqual(0ul, framer.poll());
+            Assert::AreEqual(true, framer.frame_ready());
+            Assert::AreEqual((size_t)5, framer.buffer_len());
+            Assert::AreEqual((byte)0x0a, framer.buffer()[4]);
+            Assert::AreEqual(1u, framer.statistics()->rx_frames);
+            Assert::AreEqual(0u, framer.statistics()->checksum_errors);
+        }
+
+        [TestMethod]
+        void TestRTUOverTCPUnknownLength()
+        {
+            std::vector<std::tr1::tuple<system_tick_t /*start*/, std::string /*data*/> > items;
+
+            // a user defined function code, a diagnostics echo, a read request and a short user defined frame, in one segment
+            uint8_t segment[] = {
+                0x01, 0x41, 0x10, 0x20, 0x30, 0x40, 0x50, 0xff, 0x21,
+                0x01, 0x08, 0x00, 0x00, 0x12, 0x34, 0x56, 0x78, 0x73, 0x33,
+                0x01, 0x03, 0x00, 0x00, 0x00, 0x0a, 0xc5, 0xcd,
+                0x01, 0x64, 0xaa, 0x8a, 0xbf,
+            };
+            items.push_back(std::tr1::make_tuple(1, std::string(segment, segment + _countof(segment))));
+
+            CDummyStream stream(items);
+            uint8_t buffer[MODBUS_DATA_BUFFER_SIZE];
+            CModbusRTUOverTCP framer(&stream, &stream, buffer, _countof(buffer));
+            framer.set_station_address(1);
+
+            // each frame ends where its CRC matches, leaving the next one in the stream
+            static const size_t lengths[] = { 6, 7, 5, 2 };
+            static const uint8_t functions[] = { 0x41, 0x08, 0x03, 0x64 };
+            stream.increment(1);
+            for (size_t i = 0; i < _countof(lengths); ++i)
+            {
+                framer.poll();
+                Assert::AreEqual(true, framer.frame_ready());
+                Assert::AreEqual(lengths[i], framer.buffer_len());
+                Assert::AreEqual(functions[i], framer.buffer()[0]);
+                framer.finished();
+            }
+            Assert::AreEqual(0ul, framer.poll());
+            Assert::AreEqual(false, framer.frame_ready());
+            Assert::AreEqual(4u, framer.statistics()->rx_frames);
+            Assert::AreEqual(0u, framer.statistics()->checksum_errors);
+            Assert::AreEqual(0u, framer.statistics()->dumps);
+        }
+
+        [TestMethod]
+        void TestRTUDiagnosticsLength()
+        {
+            // diagnostics has one data word, except for the return query data echo
+            uint8_t restart[] = { 0x08, 0x00, 0x01, 0xff, 0x00 };
+            uint8_t echo[] = { 0x08, 0x00, 0x00, 0x12, 0x34, 0x56, 0x78 };
+            Assert::AreEqual((size_t)3, CModbusRTU::frame_length(restart, 1, false));
+            Assert::AreEqual((size_t)5, CModbusRTU::frame_length(restart, 3, false));
+            Assert::AreEqual((size_t)5, CModbusRTU::frame_length(restart, 3, true));
+            Assert::AreEqual((size_t)0, CModbusRTU::frame_length(echo, 3, false));
+            Assert::AreEqual((size_t)0, CModbusRTU::frame_length(echo, _countof(echo), true));
+        }
     };
 }
@@ -0,0 +1,501 @@
+#include "stdafx.h"
+#include "../../../../ModbusMaster.h"
+#include "../../../../ModbusWriteBatch.h"
+#include "../../../../ModbusDecoder.h"
+#include <algorithm>
+#include <cstddef>
+
+using namespace System;
+using namespace System::Text;
+using namespace System::Collections::Generic;
+using namespace Microsoft::VisualStudio::TestTools::UnitTesting;
+using namespace ModbusPotato;
+
+namespace UnitTests
+{
+#pragma region Dummy Classes
+    class CMasterFramerDummy : public IFramer, public ITimeProvider
+    {
+    public:
+        CMasterFramerDummy()
+            :   handler()
+            ,   sent()
+            ,   busy()
+            ,   busy_until()
+            ,   max_len(MODBUS_DATA_BUFFER_SIZE)
+            ,   m_time()
+            ,   m_frame_address()
+            ,   m_buffer_len()
+        {
+        }
+        virtual void set_handler(IFrameHandler* handler) { this->handler = handler; }
+        virtual uint8_t station_address() const { return 0; }
+        virtual void set_station_address(uint8_t address) { }
+        virtual unsigned long poll() { return 0; }
+        virtual bool begin_send() { return !busy; }
+        virtual void send() { sent++; }
+        virtual void finished() { }
+        virtual bool frame_ready() const { return true; }
+        virtual uint8_t frame_address() const { return m_frame_address; }
+        virtual void set_frame_address(uint8_t address) { m_frame_address = address; }
+        virtual uint8_t* buffer() { return m_buffer; }
+        virtual size_t buffer_len() const { return m_buffer_len; }
+        virtual void set_buffer_len(size_t len) { m_buffer_len = len; }
+        virtual size_t buffer_max() const { return max_len; }
+        virtual bool deadline(system_tick_t& ticks) const { ticks = busy_until; return busy && busy_until; }
+        virtual system_tick_t ticks() const { return m_time; }
+        virtual unsigned long microseconds_per_tick() const { return 1000; }
+        void increment(system_tick_t value) { m_time += value; }
+
+        // delivers a response from the given slave to the handler
+        void respond(uint8_t address, const uint8_t* data, size_t len)
+        {
+            m_frame_address = address;
+            std::copy(data, data + len, m_buffer);
+            m_buffer_len = len;
+            handler->frame_ready(this);
+        }
+        IFrameHandler* handler;
+        int sent;
+        bool busy;
+        system_tick_t busy_until; // deadline reported while busy, or 0 for none
+        size_t max_len;
+    private:
+        system_tick_t m_time;
+        uint8_t m_frame_address;
+        size_t m_buffer_len;
+        uint8_t m_buffer[MODBUS_DATA_BUFFER_SIZE];
+    };
+
+    class CMasterHandler : public IMasterHandler
+    {
+    public:
+        CMasterHandler()
+            :   calls()
+            ,   last_status()
+        {
+        }
+        virtual void transaction_complete(CModbusMaster* master, CModbusTransaction* transaction)
+        {
+            calls++;
+            last_status = transaction->status;
+        }
+        int calls;
+        uint8_t last_status;
+    };
+    struct CMeterReading
+    {
+        float voltage[3];
+        int32_t power;
+        uint32_t energy;
+        double frequency;
+        double temperature;
+    };
+#pragma endregion
+
+    [TestClass]
+    public ref class MasterTests
+    {
+    public: 
+
+        [TestMethod]
+        void TestMasterReadHoldingRegisters()
+        {
+            CMasterFramerDummy framer;
+            CModbusMaster master(&framer, &framer);
+            CMasterHandler handler;
+
+            // read one holding register from slave 17
+            uint8_t data[8] = { 0x03, 0x00, 0x6B, 0x00, 0x01 };
+            CModbusTransaction transaction(&handler, data, _countof(data));
+            transaction.address = 17;
+            transaction.len = 5;
+            Assert::AreEqual(true, master.submit(&transaction));
+            Assert::AreEqual(false, master.submit(&transaction));
+            Assert::AreEqual(1000ul, master.poll());
+
+            // check the request
+            Assert::AreEqual(1, framer.sent);
+            Assert::AreEqual((byte)17, framer.frame_address());
+            Assert::AreEqual(5u, framer.buffer_len());
+            Assert::AreEqual((byte)0x6B, framer.buffer()[2]);
+
+            // responses from other slaves are ignored
+            uint8_t response[] = { 0x03, 0x02, 0x02, 0x2B };
+            framer.respond(16, response, _countof(response));
+            Assert::AreEqual(0, handler.calls);
+
+            // the response replaces the request
+            framer.respond(17, response, _countof(response));
+            Assert::AreEqual(1, handler.calls);
+            Assert::AreEqual((byte)modbus_transaction_status::ok, handler.last_status);
+            Assert::AreEqual(4u, transaction.len);
+            Assert::AreEqual((byte)0x2B, data[3]);
+            Assert::AreEqual(false, master.busy());
+        }
+
+        [TestMethod]
+        void TestMasterWaitsForBusyFramer()
+        {
+            CMasterFramerDummy framer;
+            CModbusMaster master(&framer, &framer);
+            CMasterHandler handler;
+            uint8_t data[8] = { 0x03, 0x00, 0x6B, 0x00, 0x01 };
+            CModbusTransaction transaction(&handler, data, _countof(data));
+            transaction.address = 17;
+            transaction.len = 5;
+            Assert::AreEqual(true, master.submit(&transaction));
+
+            // the framer is receiving and waiting on the stream
+            framer.busy = true;
+            Assert::AreEqual(0ul, master.poll());
+            Assert::AreEqual(0, framer.sent);
+
+            // the framer is waiting for the end of a frame
+            framer.busy_until = 4;
+            Assert::AreEqual(4ul, master.poll());
+            framer.increment(3);
+            Assert::AreEqual(1ul, master.poll());
+            Assert::AreEqual(0, framer.sent);
+
+            // the request goes out once the framer is free
+            framer.increment(1);
+            framer.busy = false;
+            Assert::AreEqual(1000ul, master.poll());
+            Assert::AreEqual(1, framer.sent);
+        }
+
+        [TestMethod]
+        void TestMasterRetryBackoff()
+        {
+            CMasterFramerDummy framer;
+            CModbusMaster master(&framer, &framer);
+            CMasterHandler handler;
+            master.set_timeout(100000);
+            master.set_retries(2);
+            master.set_backoff(10000, 15000);
+
+            uint8_t data[8] = { 0x03, 0x00, 0x00, 0x00, 0x01 };
+            CModbusTransaction transaction(&handler, data, _countof(data));
+            transaction.address = 1;
+            transaction.len = 5;
+            master.submit(&transaction);
+
+            // the first retry waits for the backoff time, and the second for double that up to the maximum
+            Assert::AreEqual(100ul, master.poll());
+            framer.increment(100);
+            Assert::AreEqual(10ul, master.poll());
+            framer.increment(10);
+            Assert::AreEqual(100ul, master.poll());
+            Assert::AreEqual(2, framer.sent);
+            framer.increment(100);
+            Assert::AreEqual(15ul, master.poll());
+            framer.increment(15);
+            Assert::AreEqual(100ul, master.poll());
+            Assert::AreEqual(3, framer.sent);
+
+            // give up after the last retry
+            framer.increment(100);
+            Assert::AreEqual(0ul, master.poll());
+            Assert::AreEqual(1, handler.calls);
+            Assert::AreEqual((byte)modbus_transaction_status::timeout, handler.last_status);
+            Assert::AreEqual((byte)3, transaction.attempts);
+        }
+
+        [TestMethod]
+        void TestMasterOfflineSlave()
+        {
+            CMasterFramerDummy framer;
+            CModbusMaster master(&framer, &framer);
+            CMasterHandler handler;
+            CModbusSlaveHealth health[4];
+            master.set_timeout(100000);
+            master.set_retries(0);
+            master.set_offline_threshold(2);
+            master.set_probe_interval(1000000);
+            master.set_health_table(health, _countof(health));
+            Assert::IsTrue(master.health(4) == NULL);
+
+            uint8_t data[8];
+            CModbusTransaction transaction(&handler, data, _countof(data));
+            transaction.address = 3;
+            for (int i = 0; i < 2; ++i)
+            {
+                data[0] = 0x03;
+                transaction.len = 5;
+                master.submit(&transaction);
+                master.poll();
+                framer.increment(100);
+                master.poll();
+            }
+
+            // the slave is offline after two consecutive timeouts
+            const CModbusSlaveHealth* status = master.health(3);
+            Assert::AreEqual((byte)CModbusSlaveHealth::offline, status->state);
+            Assert::AreEqual((byte)2, status->failures);
+            Assert::AreEqual(2u, status->timeouts);
+
+            // requests are skipped until the probe interval has elapsed
+            master.submit(&transaction);
+            Assert::AreEqual(0ul, master.poll());
+            Assert::AreEqual((byte)modbus_transaction_status::skipped, handler.last_status);
+            Assert::AreEqual(1u, status->skipped);
+            Assert::AreEqual(2, framer.sent);
+
+            // the probe brings the slave back online when it answers
+            framer.increment(1000);
+            master.submit(&transaction);
+            master.poll();
+            Assert::AreEqual(3, framer.sent);
+            uint8_t response[] = { 0x03, 0x02, 0x00, 0x01 };
+            framer.respond(3, response, _countof(response));
+            Assert::AreEqual((byte)modbus_transaction_status::ok, handler.last_status);
+            Assert::AreEqual((byte)CModbusSlaveHealth::online, status->state);
+            Assert::AreEqual((byte)0, status->failures);
+            Assert::AreEqual(3u, status->transactions);
+            Assert::AreEqual(1u, status->responses);
+        }
+
+        [TestMethod]
+        void TestMasterAdaptiveTimeout()
+        {
+            CMasterFramerDummy framer;
+            CModbusMaster master(&framer, &framer);
+            CMasterHandler handler;
+            CModbusSlaveHealth health[2];
+            master.set_timeout(100000);
+            master.set_retries(0);
+            master.set_adaptive_timeout(5000, 100000);
+            master.set_health_table(health, _countof(health));
+
+            uint8_t data[8];
+            CModbusTransaction transaction(&handler, data, _countof(data));
+            transaction.address = 1;
+            uint8_t response[] = { 0x03, 0x02, 0x00, 0x01 };
+
+            // the fixed timeout is used until the first response
+            data[0] = 0x03;
+            transaction.len = 5;
+            master.submit(&transaction);
+            Assert::AreEqual(100ul, master.poll());
+            framer.increment(10);
+            framer.respond(1, response, _countof(response));
+
+            // SRTT = 10 and RTTVAR = 5, so the timeout is 10 + 4 * 5
+            const CModbusSlaveHealth* status = master.health(1);
+            Assert::AreEqual((system_tick_t)30, status->rto);
+            data[0] = 0x03;
+            transaction.len = 5;
+            master.submit(&transaction);
+            Assert::AreEqual(30ul, master.poll());
+            framer.increment(10);
+            framer.respond(1, response, _countof(response));
+
+            // the variance shrinks with a steady round trip time
+            Assert::AreEqual((system_tick_t)80, status->srtt);
+            Assert::AreEqual((system_tick_t)15, status->rttvar);
+            Assert::AreEqual((system_tick_t)25, status->rto);
+
+            // the timeout doubles when there is no response
+            data[0] = 0x03;
+            transaction.len = 5;
+            master.submit(&transaction);
+            Assert::AreEqual(25ul, master.poll());
+            framer.increment(25);
+            master.poll();
+            Assert::AreEqual((byte)modbus_transaction_status::timeout, handler.last_status);
+            Assert::AreEqual((system_tick_t)50, status->rto);
+        }
+
+        [TestMethod]
+        void TestMasterBroadcast()
+        {
+            CMasterFramerDummy framer;
+            CModbusMaster master(&framer, &framer);
+            CMasterHandler handler;
+            master.set_turnaround_delay(100000);
+
+            // broadcasts complete after the turnaround delay without a response
+            uint8_t data[8] = { 0x06, 0x00, 0x01, 0x00, 0x03 };
+            CModbusTransaction transaction(&handler, data, _countof(data));
+            transaction.len = 5;
+            master.submit(&transaction);
+            Assert::AreEqual(100ul, master.poll());
+            Assert::AreEqual(1, framer.sent);
+            Assert::AreEqual((byte)0, framer.frame_address());
+            framer.increment(100);
+            Assert::AreEqual(0ul, master.poll());
+            Assert::AreEqual((byte)modbus_transaction_status::ok, handler.last_status);
+        }
+
+        [TestMethod]
+        void TestMasterWriteBatch()
+        {
+            CMasterFramerDummy framer;
+            CModbusMaster master(&framer, &framer);
+            CModbusWriteBatch batch(&master);
+            master.set_turnaround_delay(100000);
+            static const uint8_t fleet[] = { 1, 2, 3, 4 };
+            batch.set_fleet(fleet, _countof(fleet));
+
+            // every slave gets a mode register, and all but slave 4 the same value
+            uint16_t mode = 5, other_mode = 7, limits[] = { 100, 200 };
+            CModbusSetpoint mode1(1, 10, 1, &mode), mode2(2, 10, 1, &mode), mode3(3, 10, 1, &mode), mode4(4, 10, 1, &other_mode);
+
+            // only two slaves get new limits
+            CModbusSetpoint limits1(1, 20, 2, limits), limits2(2, 20, 2, limits);
+            CModbusSetpoint* setpoints[] = { &mode1, &mode2, &mode3, &mode4, &limits1, &limits2 };
+            for (size_t i = 0; i < _countof(setpoints); ++i)
+                Assert::AreEqual(true, batch.add(setpoints[i]));
+            Assert::AreEqual(true, batch.start());
+            Assert::AreEqual(false, batch.add(&mode1));
+
+            // the common mode is broadcast with function 0x06
+            Assert::AreEqual(100ul, master.poll());
+            Assert::AreEqual((byte)0, framer.frame_address());
+            Assert::AreEqual(5u, framer.buffer_len());
+            Assert::AreEqual((byte)0x06, framer.buffer()[0]);
+            Assert::AreEqual((byte)5, framer.buffer()[4]);
+            framer.increment(100);
+            master.poll();
+
+            // the rest are unicast, and answered with an echo of the request
+            uint8_t expected[][3] = { { 4, 0x06, 5 }, { 1, 0x10, 10 }, { 2, 0x10, 10 } };
+            for (size_t i = 0; i < _countof(expected); ++i)
+            {
+                Assert::AreEqual(expected[i][0], framer.frame_address());
+                Assert::AreEqual(expected[i][1], framer.buffer()[0]);
+                Assert::AreEqual((size_t)expected[i][2], framer.buffer_len());
+                uint8_t response[5];
+                std::copy(framer.buffer(), framer.buffer() + 5, response);
+                framer.respond(framer.frame_address(), response, _countof(response));
+                master.poll();
+            }
+
+            // check the results
+            Assert::AreEqual(false, batch.busy());
+            Assert::AreEqual(1u, batch.broadcast_frames());
+            Assert::AreEqual(3u, batch.unicast_frames());
+            Assert::AreEqual(4, framer.sent);
+            for (size_t i = 0; i < _countof(setpoints); ++i)
+                Assert::AreEqual((byte)modbus_transaction_status::ok, setpoints[i]->status);
+            Assert::AreEqual(true, mode3.broadcast);
+            Assert::AreEqual(false, mode4.broadcast);
+        }
+
+        [TestMethod]
+        void TestMasterWriteBatchFailures()
+        {
+            CMasterFramerDummy framer;
+            CModbusMaster master(&framer, &framer);
+            CModbusWriteBatch batch(&master);
+            master.set_turnaround_delay(100000);
+            master.set_retries(0);
+            framer.max_len = 64;
+            static const uint8_t fleet[] = { 1, 2, 3 };
+            batch.set_fleet(fleet, _countof(fleet));
+
+            // slave 3 has its own mode, and slave 1 a block of registers too long for the framer
+            uint16_t mode = 5, other_mode = 7, block[40] = {};
+            CModbusSetpoint mode1(1, 10, 1, &mode), mode2(2, 10, 1, &mode), mode3(3, 10, 1, &other_mode);
+            CModbusSetpoint block1(1, 100, _countof(block), block);
+            CModbusSetpoint* setpoints[] = { &mode1, &mode2, &mode3, &block1 };
+            for (size_t i = 0; i < _countof(setpoints); ++i)
+                Assert::AreEqual(true, batch.add(setpoints[i]));
+            Assert::AreEqual(true, batch.start());
+
+            // the common mode is broadcast, which slave 3 acts on as well
+            Assert::AreEqual(100ul, master.poll());
+            Assert::AreEqual((byte)0, framer.frame_address());
+            Assert::AreEqual(true, mode3.overwritten);
+            framer.increment(100);
+            master.poll();
+
+            // slave 3 does not answer its own write
+            Assert::AreEqual((byte)3, framer.frame_address());
+            framer.increment(1000);
+            master.poll();
+
+            // the block was not accepted by the master, and the batch finished anyway
+            Assert::AreEqual(false, batch.busy());
+            Assert::AreEqual(2, framer.sent);
+            Assert::AreEqual(1u, batch.broadcast_frames());
+            Assert::AreEqual(1u, batch.unicast_frames());
+            Assert::AreEqual((byte)modbus_transaction_status::ok, mode1.status);
+            Assert::AreEqual(false, mode1.overwritten);
+            Assert::AreEqual((byte)modbus_transaction_status::timeout, mode3.status);
+            Assert::AreEqual(true, mode3.overwritten);
+            Assert::AreEqual((byte)modbus_transaction_status::rejected, block1.status);
+            Assert::AreEqual(false, block1.overwritten);
+        }
+
+        [TestMethod]
+        void TestMasterDecoder()
+        {
+            // compile a schema with a run of three floats and the other word orders
+            CModbusPoint points[] =
+            {
+                { 0, modbus_point_type::float32, modbus_word_order::abcd, 0, offsetof(CMeterReading, voltage[0]) },
+                { 2, modbus_point_type::float32, modbus_word_order::abcd, 0, offsetof(CMeterReading, voltage[1]) },
+                { 4, modbus_point_type::float32, modbus_word_order::abcd, 0, offsetof(CMeterReading, voltage[2]) },
+                { 6, modbus_point_type::int32, modbus_word_order::cdab, 0, offsetof(CMeterReading, power) },
+                { 8, modbus_point_type::uint32, modbus_word_order::badc, 0, offsetof(CMeterReading, energy) },
+                { 10, modbus_point_type::float64, modbus_word_order::dcba, 0, offsetof(CMeterReading, frequency) },
+                { 14, modbus_point_type::int16, modbus_word_order::abcd, 0.1, offsetof(CMeterReading, temperature) },
+            };
+            CModbusDecoder decoder(points, _countof(points));
+            Assert::AreEqual(true, decoder.compile());
+            Assert::AreEqual((size_t)15, decoder.registers());
+            Assert::AreEqual((uint16_t)3, points[0].run);
+            Assert::AreEqual((uint16_t)1, points[3].run);
+
+            // a response to a read of 15 holding registers
+            uint8_t data[2 + 15 * 2] =
+            {
+                0x03, 30,
+                0x43, 0x66, 0x00, 0x00, // 230.0
+                0x43, 0x67, 0x00, 0x00, // 231.0
+                0x43, 0x68, 0x00, 0x00, // 232.0
+                0xFF, 0xFE, 0xFF, 0xFF, // -2 in CDAB
+                0x22, 0x11, 0x44, 0x33, // 0x11223344 in BADC
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x49, 0x40, // 50.0 in DCBA
+                0xFF, 0x06, // -25.0 scaled by 0.1
+            };
+            CModbusTransaction transaction(NULL, data, sizeof(data));
+            transaction.len = sizeof(data);
+            transaction.status = modbus_transaction_status::ok;
+
+            // decode it
+            CMeterReading reading;
+            Assert::AreEqual(true, decoder.decode_response(&transaction, &reading));
+            Assert::AreEqual(230.0f, reading.voltage[0]);
+            Assert::AreEqual(231.0f, reading.voltage[1]);
+            Assert::AreEqual(232.0f, reading.voltage[2]);
+            Assert::AreEqual((int32_t)-2, reading.power);
+            Assert::AreEqual((uint32_t)0x11223344, reading.energy);
+            Assert::AreEqual(50.0, reading.frequency);
+            Assert::AreEqual(true, reading.temperature > -25.01 && reading.temperature < -24.99);
+
+            // a short response is rejected
+            transaction.len -= 2;
+            data[1] -= 2;
+            Assert::AreEqual(false, decoder.decode_response(&transaction, &reading));
+
+            // decode two blocks into one array per point
+            int32_t power[2];
+            float voltage[3][2];
+            double frequency[2], temperature[2];
+            uint32_t energy[2];
+            void* columns[] = { voltage[0], voltage[1], voltage[2], power, energy, frequency, temperature };
+            uint8_t blocks[2][30];
+            std::copy(data + 2, data + 32, blocks[0]);
+            std::copy(data + 2, data + 32, blocks[1]);
+            blocks[1][14] = 0x00;
+            blocks[1][15] = 0x07;
+            Assert::AreEqual(true, decoder.decode_columns(blocks[0], sizeof(blocks[0]), 2, columns));
+            Assert::AreEqual((int32_t)-2, power[0]);
+            Assert::AreEqual((int32_t)0x0007FFFE, power[1]);
+            Assert::AreEqual(232.0f, voltage[2][1]);
+        }
+    };
+}
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "../../../../ModbusSlave.h"
 #include "../../../../ModbusSlaveHandlerBase.h"
+#include "../../../../ModbusSlaveHandlerHolding.h"
 #include <algorithm>
 #pragma comment(lib, "Ws2_32.lib")
 
@@ -38,6 +39,8 @@ namespace UnitTests
         virtual size_t buffer_len() const { return m_buffer_len; }
         virtual void set_buffer_len(size_t len) { m_buffer_len = len; }
         virtual size_t buffer_max() const { return _countof(m_buffer); }
+        virtual CModbusStatistics* statistics() { return &stats; }
+        CModbusStatistics stats;
         bool was_sent;
         bool was_finished;
     private:
@@ -109,6 +112,82 @@ namespace UnitTests
         }
     };
 
+    class CChangeHandler : public IRegisterChangeHandler
+    {
+    public:
+        CChangeHandler()
+            :   calls()
+            ,   last_address()
+            ,   last_count()
+        {
+        }
+        virtual void registers_changed(uint16_t address, uint16_t count)
+        {
+            calls++;
+            last_address = address;
+            last_count = count;
+        }
+        int calls;
+        uint16_t last_address, last_count;
+    };
+
+    class CDeferredHandler : public CModbusSlaveHandlerBase
+    {
+    public:
+        CDeferredHandler()
+            :   last_result()
+            ,   last_count()
+        {
+        }
+        uint16_t* last_result;
+        uint16_t last_count;
+        virtual modbus_exception_code::modbus_exception_code read_holding_registers(uint16_t address, uint16_t count, uint16_t* result)
+        {
+            last_result = result;
+            last_count = count;
+            return modbus_exception_code::pending;
+        }
+    };
+
+    class CCompletingHandler : public CModbusSlaveHandlerBase
+    {
+    public:
+        CCompletingHandler()
+            :   slave()
+        {
+        }
+        CModbusSlave* slave;
+        virtual modbus_exception_code::modbus_exception_code read_holding_registers(uint16_t address, uint16_t count, uint16_t* result)
+        {
+            // complete the request before returning, as another thread may do
+            for (uint16_t i = 0; i < count; ++i)
+                result[i] = (uint16_t)(address + i);
+            slave->complete(modbus_exception_code::ok);
+            return modbus_exception_code::pending;
+        }
+    };
+
+    class CReverseFunction : public IModbusFunction
+    {
+    public:
+        CReverseFunction()
+            :   calls()
+        {
+        }
+        int calls;
+        virtual modbus_exception_code::modbus_exception_code execute(CModbusSlave* slave, IFramer* framer)
+        {
+            // answer with the request data in reverse order
+            calls++;
+            uint8_t* buffer = framer->buffer();
+            size_t len = framer->buffer_len();
+            if (len < 2)
+                return modbus_exception_code::illegal_data_value;
+            std::reverse(buffer + 1, buffer + len);
+            return modbus_exception_code::ok;
+        }
+    };
+
 #pragma endregion
 
 	[TestClass]
@@ -337,6 +416,96 @@ namespace UnitTests
             Assert::AreEqual((uint8_t)0x03, framer.buffer()[4]); // value L
         }
 
+        // FC08
+        [TestMethod]
+		void TestSlaveFC08Diagnostics()
+		{
+            // create the slave object
+            CSlaveHandler handler;
+            CModbusSlave slave(&handler);
+
+            // return query data echoes the request
+            CFramerDummy framer;
+            framer.set_frame_address(0x11);
+            uint8_t echo[] = { 0x08, 0x00, 0x00, 0xA5, 0x37 };
+            std::copy(echo, echo + _countof(echo), framer.buffer());
+            framer.set_buffer_len(_countof(echo));
+            slave.frame_ready(&framer);
+            Assert::AreEqual(true, framer.was_sent);
+            Assert::AreEqual((size_t)_countof(echo), framer.buffer_len());
+            Assert::AreEqual(true, std::equal(echo, echo + _countof(echo), framer.buffer()));
+
+            // return the bus communication error count from the framer
+            framer.stats.checksum_errors = 0x0102;
+            uint8_t crc_errors[] = { 0x08, 0x00, 0x0C, 0x00, 0x00 };
+            std::copy(crc_errors, crc_errors + _countof(crc_errors), framer.buffer());
+            framer.set_buffer_len(_countof(crc_errors));
+            slave.frame_ready(&framer);
+            Assert::AreEqual((size_t)5, framer.buffer_len());
+            Assert::AreEqual((uint8_t)0x08, framer.buffer()[0]);
+            Assert::AreEqual((uint8_t)0x0C, framer.buffer()[2]); // sub-function L
+            Assert::AreEqual((uint8_t)0x01, framer.buffer()[3]); // count H
+            Assert::AreEqual((uint8_t)0x02, framer.buffer()[4]); // count L
+
+            // return the slave message count
+            uint8_t messages[] = { 0x08, 0x00, 0x0E, 0x00, 0x00 };
+            std::copy(messages, messages + _countof(messages), framer.buffer());
+            framer.set_buffer_len(_countof(messages));
+            slave.frame_ready(&framer);
+            Assert::AreEqual((uint8_t)0x00, framer.buffer()[3]);
+            Assert::AreEqual((uint8_t)0x03, framer.buffer()[4]);
+
+            // clear the counters
+            uint8_t clear[] = { 0x08, 0x00, 0x0A, 0x00, 0x00 };
+            std::copy(clear, clear + _countof(clear), framer.buffer());
+            framer.set_buffer_len(_countof(clear));
+            slave.frame_ready(&framer);
+            Assert::AreEqual(true, std::equal(clear, clear + _countof(clear), framer.buffer()));
+            Assert::AreEqual(0u, framer.stats.checksum_errors);
+
+            // unsupported sub-functions return an exception
+            uint8_t listen_only[] = { 0x08, 0x00, 0x04, 0x00, 0x00 };
+            std::copy(listen_only, listen_only + _countof(listen_only), framer.buffer());
+            framer.set_buffer_len(_countof(listen_only));
+            slave.frame_ready(&framer);
+            Assert::AreEqual((size_t)2, framer.buffer_len());
+            Assert::AreEqual((uint8_t)0x88, framer.buffer()[0]);
+            Assert::AreEqual((uint8_t)0x01, framer.buffer()[1]);
+        }
+
+        // FC11
+        [TestMethod]
+		void TestSlaveFC11GetCommEventCounter()
+		{
+            // create the slave object
+            CSlaveHandler handler;
+            CModbusSlave slave(&handler);
+
+            // complete two requests, one of which fails
+            CFramerDummy framer;
+            framer.set_frame_address(0x11);
+            uint8_t write[] = { 0x06, 0x00, 0x01, 0x00, 0x03 };
+            std::copy(write, write + _countof(write), framer.buffer());
+            framer.set_buffer_len(_countof(write));
+            slave.frame_ready(&framer);
+            uint8_t invalid[] = { 0x06, 0x00 };
+            std::copy(invalid, invalid + _countof(invalid), framer.buffer());
+            framer.set_buffer_len(_countof(invalid));
+            slave.frame_ready(&framer);
+
+            // read the event counter
+            uint8_t data[] = { 0x0B };
+            std::copy(data, data + _countof(data), framer.buffer());
+            framer.set_buffer_len(_countof(data));
+            slave.frame_ready(&framer);
+
+            // check the result
+            Assert::AreEqual(true, framer.was_sent);
+            uint8_t response[] = { 0x0B, 0x00, 0x00, 0x00, 0x01 };
+            Assert::AreEqual((size_t)_countof(response), framer.buffer_len());
+            Assert::AreEqual(true, std::equal(response, response + _countof(response), framer.buffer()));
+        }
+
         // FC15
         [TestMethod]
 		void TestSlaveFC15ForceMultipleCoils()
@@ -403,5 +572,319 @@ namespace UnitTests
             Assert::AreEqual((uint8_t)0x00, framer.buffer()[3]); // count H
             Assert::AreEqual((uint8_t)0x02, framer.buffer()[4]); // count L
 		}
+
+        [TestMethod]
+		void TestHoldingDirtyTracking()
+		{
+            // create the holding register handler with a dirty bitmap
+            uint16_t registers[40] = {};
+            uint8_t bitmap[(_countof(registers) + 7) / 8];
+            CModbusSlaveHandlerHolding handler(registers, _countof(registers));
+            handler.set_dirty_bitmap(bitmap);
+            Assert::AreEqual(false, handler.dirty());
+
+            // write some registers
+            uint16_t values[20] = {};
+            Assert::AreEqual((int)modbus_exception_code::ok, (int)handler.write_multiple_registers(3, 2, values));
+            Assert::AreEqual((int)modbus_exception_code::ok, (int)handler.write_multiple_registers(12, 20, values));
+            Assert::AreEqual((int)modbus_exception_code::ok, (int)handler.write_single_register(39, 1));
+            Assert::AreEqual(true, handler.dirty());
+
+            // drain the changes
+            uint16_t address, count;
+            Assert::AreEqual(true, handler.next_change(address, count));
+            Assert::AreEqual((uint16_t)3, address);
+            Assert::AreEqual((uint16_t)2, count);
+            Assert::AreEqual(true, handler.next_change(address, count));
+            Assert::AreEqual((uint16_t)12, address);
+            Assert::AreEqual((uint16_t)20, count);
+            Assert::AreEqual(true, handler.next_change(address, count));
+            Assert::AreEqual((uint16_t)39, address);
+            Assert::AreEqual((uint16_t)1, count);
+            Assert::AreEqual(false, handler.next_change(address, count));
+            Assert::AreEqual(false, handler.dirty());
+        }
+
+        [TestMethod]
+		void TestHoldingSubscription()
+		{
+            // subscribe to registers 10 through 14
+            uint16_t registers[40] = {};
+            CModbusSlaveHandlerHolding handler(registers, _countof(registers));
+            CChangeHandler changes;
+            CModbusRegisterSubscription subscription(&changes, 10, 5);
+            handler.subscribe(&subscription);
+
+            // a write outside of the range is not reported
+            uint16_t values[20] = {};
+            handler.write_multiple_registers(0, 10, values);
+            Assert::AreEqual(0, changes.calls);
+
+            // an overlapping write is clipped to the subscription
+            handler.write_multiple_registers(12, 20, values);
+            Assert::AreEqual(1, changes.calls);
+            Assert::AreEqual((uint16_t)12, changes.last_address);
+            Assert::AreEqual((uint16_t)3, changes.last_count);
+
+            // nothing is reported after unsubscribing
+            handler.unsubscribe(&subscription);
+            handler.write_multiple_registers(10, 5, values);
+            Assert::AreEqual(1, changes.calls);
+        }
+
+        [TestMethod]
+		void TestSlaveResponseCache()
+		{
+            // create the slave object with a cached range
+            CSlaveHandler handler;
+            CModbusSlave slave(&handler);
+            CModbusResponseCache cache;
+            uint8_t storage[3 * 2 + 2];
+            CModbusCachedResponse entry(0x6B, 3, storage);
+            cache.add(&entry);
+            slave.set_response_cache(&cache);
+
+            // the first read calls the handler and fills the cache
+            CFramerDummy framer;
+            framer.set_frame_address(0x11);
+            uint8_t data[] = { 0x03, 0x00, 0x6B, 0x00, 0x03 };
+            std::copy(data, data + _countof(data), framer.buffer());
+            framer.set_buffer_len(_countof(data));
+            slave.frame_ready(&framer);
+            uint8_t response[] = { 0x03, 0x06, 0xAE, 0x41, 0x56, 0x52, 0x43, 0x40 };
+            Assert::AreEqual((size_t)_countof(response), framer.buffer_len());
+            Assert::AreEqual(true, std::equal(response, response + _countof(response), framer.buffer()));
+            Assert::AreEqual((uint16_t)3, handler.last_count);
+            Assert::AreEqual(true, entry.valid);
+            Assert::AreEqual((uint32_t)1, cache.misses);
+
+            // the second read is answered from the cache
+            handler.last_count = 0;
+            framer.was_sent = false;
+            std::copy(data, data + _countof(data), framer.buffer());
+            framer.set_buffer_len(_countof(data));
+            slave.frame_ready(&framer);
+            Assert::AreEqual(true, framer.was_sent);
+            Assert::AreEqual((size_t)_countof(response), framer.buffer_len());
+            Assert::AreEqual(true, std::equal(response, response + _countof(response), framer.buffer()));
+            Assert::AreEqual((uint16_t)0, handler.last_count);
+            Assert::AreEqual((uint32_t)1, cache.hits);
+
+            // a write which overlaps the end of the range is applied to the cache
+            uint8_t write[] = { 0x10, 0x00, 0x6C, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78 };
+            std::copy(write, write + _countof(write), framer.buffer());
+            framer.set_buffer_len(_countof(write));
+            slave.frame_ready(&framer);
+            uint8_t updated[] = { 0x03, 0x06, 0xAE, 0x41, 0x12, 0x34, 0x56, 0x78 };
+            Assert::AreEqual(true, std::equal(updated, updated + _countof(updated), storage));
+
+            // the patched checksum matches one calculated from scratch
+            uint8_t check_storage[_countof(storage)];
+            CModbusCachedResponse check(0x6B, 3, check_storage);
+            cache.store(&check, 0x11, updated);
+            Assert::AreEqual(check.checksum, entry.checksum);
+
+            // a single register write is also applied
+            uint8_t single[] = { 0x06, 0x00, 0x6B, 0xBE, 0xEF };
+            std::copy(single, single + _countof(single), framer.buffer());
+            framer.set_buffer_len(_countof(single));
+            slave.frame_ready(&framer);
+            updated[2] = 0xBE;
+            updated[3] = 0xEF;
+            cache.store(&check, 0x11, updated);
+            Assert::AreEqual((uint8_t)0xBE, storage[2]);
+            Assert::AreEqual(check.checksum, entry.checksum);
+        }
+
+        [TestMethod]
+		void TestSlaveResponseCacheBypass()
+		{
+            // create the slave object with a cached range
+            CSlaveHandler handler;
+            CModbusSlave slave(&handler);
+            CModbusResponseCache cache;
+            uint8_t storage[3 * 2 + 2];
+            CModbusCachedResponse entry(0x6B, 3, storage);
+            cache.add(&entry);
+            slave.set_response_cache(&cache);
+
+            // fill the cache
+            CFramerDummy framer;
+            framer.set_frame_address(0x11);
+            uint8_t data[] = { 0x03, 0x00, 0x6B, 0x00, 0x03 };
+            std::copy(data, data + _countof(data), framer.buffer());
+            framer.set_buffer_len(_countof(data));
+            slave.frame_ready(&framer);
+            Assert::AreEqual(true, entry.valid);
+
+            // replacing a write function invalidates the cache, and reads go to the handler
+            IModbusFunction* write_single = slave.function(0x06);
+            CReverseFunction writer;
+            slave.set_function(0x06, &writer);
+            Assert::AreEqual(false, entry.valid);
+            handler.last_count = 0;
+            std::copy(data, data + _countof(data), framer.buffer());
+            framer.set_buffer_len(_countof(data));
+            slave.frame_ready(&framer);
+            Assert::AreEqual((uint16_t)3, handler.last_count);
+            Assert::AreEqual(false, entry.valid);
+            Assert::AreEqual((uint32_t)0, cache.hits);
+
+            // once it is restored, the cache is used again
+            slave.set_function(0x06, write_single);
+            for (int i = 0; i < 2; ++i)
+            {
+                std::copy(data, data + _countof(data), framer.buffer());
+                framer.set_buffer_len(_countof(data));
+                slave.frame_ready(&framer);
+            }
+            Assert::AreEqual(true, entry.valid);
+            Assert::AreEqual((uint32_t)1, cache.hits);
+        }
+
+        [TestMethod]
+		void TestSlaveDeferredResponse()
+		{
+            // create the slave object
+            CDeferredHandler handler;
+            CModbusSlave slave(&handler);
+
+            // initialize with a test packet
+            CFramerDummy framer;
+            framer.set_frame_address(0x11);
+            uint8_t data[] = { 0x03, 0x00, 0x6B, 0x00, 0x03 };
+            std::copy(data, data + _countof(data), framer.buffer());
+            framer.set_buffer_len(_countof(data));
+
+            // the handler defers the response
+            slave.frame_ready(&framer);
+            Assert::AreEqual(false, framer.was_sent);
+            Assert::AreEqual(true, slave.pending());
+
+            // nothing is sent until the request is completed
+            slave.poll_queue(&framer);
+            Assert::AreEqual(false, framer.was_sent);
+
+            // fill in the result and complete the request
+            static const uint16_t values[] = { 0xAE41, 0x5652, 0x4340 };
+            std::copy(values, values + _countof(values), handler.last_result);
+            slave.complete(modbus_exception_code::ok);
+            slave.poll_queue(&framer);
+
+            // check the result
+            Assert::AreEqual(true, framer.was_sent);
+            Assert::AreEqual(false, slave.pending());
+            uint8_t response[] = { 0x03, 0x06, 0xAE, 0x41, 0x56, 0x52, 0x43, 0x40 };
+            Assert::AreEqual((size_t)_countof(response), framer.buffer_len());
+            Assert::AreEqual(true, std::equal(response, response + _countof(response), framer.buffer()));
+        }
+
+        [TestMethod]
+		void TestSlaveDeferredException()
+		{
+            // create the slave object
+            CDeferredHandler handler;
+            CModbusSlave slave(&handler);
+
+            // initialize with a test packet
+            CFramerDummy framer;
+            framer.set_frame_address(0x11);
+            uint8_t data[] = { 0x03, 0x00, 0x6B, 0x00, 0x03 };
+            std::copy(data, data + _countof(data), framer.buffer());
+            framer.set_buffer_len(_countof(data));
+
+            // defer and then fail the request
+            slave.frame_ready(&framer);
+            slave.complete(modbus_exception_code::server_device_failure);
+            slave.poll_queue(&framer);
+
+            // check the result
+            Assert::AreEqual(true, framer.was_sent);
+            Assert::AreEqual((size_t)2, framer.buffer_len());
+            Assert::AreEqual((uint8_t)0x83, framer.buffer()[0]);
+            Assert::AreEqual((uint8_t)0x04, framer.buffer()[1]);
+        }
+
+        [TestMethod]
+		void TestSlaveCompletedBeforeDeferred()
+		{
+            // create the slave object
+            CCompletingHandler handler;
+            CModbusSlave slave(&handler);
+            handler.slave = &slave;
+
+            // initialize with a test packet
+            CFramerDummy framer;
+            framer.set_frame_address(0x11);
+            uint8_t data[] = { 0x03, 0x00, 0x6B, 0x00, 0x02 };
+            std::copy(data, data + _countof(data), framer.buffer());
+            framer.set_buffer_len(_countof(data));
+
+            // the completion is not lost, and the response is sent from poll_queue()
+            slave.frame_ready(&framer);
+            Assert::AreEqual(false, framer.was_sent);
+            slave.poll_queue(&framer);
+            Assert::AreEqual(true, framer.was_sent);
+            Assert::AreEqual(false, slave.pending());
+            uint8_t response[] = { 0x03, 0x04, 0x00, 0x6B, 0x00, 0x6C };
+            Assert::AreEqual((size_t)_countof(response), framer.buffer_len());
+            Assert::AreEqual(true, std::equal(response, response + _countof(response), framer.buffer()));
+        }
+
+        [TestMethod]
+		void TestSlaveCustomFunction()
+		{
+            // create the slave object and install a user defined function code
+            CSlaveHandler handler;
+            CModbusSlave slave(&handler);
+            CReverseFunction reverse;
+            Assert::AreEqual(true, slave.set_function(0x41, &reverse));
+            Assert::AreEqual(false, slave.set_function(0x00, &reverse));
+            Assert::AreEqual(false, slave.set_function(0xC1, &reverse));
+
+            // the custom function builds the response in place
+            CFramerDummy framer;
+            framer.set_frame_address(0x11);
+            uint8_t data[] = { 0x41, 0x01, 0x02, 0x03 };
+            std::copy(data, data + _countof(data), framer.buffer());
+            framer.set_buffer_len(_countof(data));
+            slave.frame_ready(&framer);
+            Assert::AreEqual(true, framer.was_sent);
+            Assert::AreEqual(1, reverse.calls);
+            uint8_t response[] = { 0x41, 0x03, 0x02, 0x01 };
+            Assert::AreEqual((size_t)_countof(response), framer.buffer_len());
+            Assert::AreEqual(true, std::equal(response, response + _countof(response), framer.buffer()));
+
+            // an exception from the custom function
+            CFramerDummy short_framer;
+            short_framer.set_frame_address(0x11);
+            short_framer.buffer()[0] = 0x41;
+            short_framer.set_buffer_len(1);
+            slave.frame_ready(&short_framer);
+            Assert::AreEqual((size_t)2, short_framer.buffer_len());
+            Assert::AreEqual((uint8_t)0xC1, short_framer.buffer()[0]);
+            Assert::AreEqual((uint8_t)0x03, short_framer.buffer()[1]);
+
+            // a standard function can be removed and restored
+            IModbusFunction* read_holding = slave.function(0x03);
+            Assert::AreEqual(true, read_holding != NULL);
+            slave.set_function(0x03, NULL);
+            CFramerDummy read_framer;
+            read_framer.set_frame_address(0x11);
+            uint8_t read[] = { 0x03, 0x00, 0x6B, 0x00, 0x03 };
+            std::copy(read, read + _countof(read), read_framer.buffer());
+            read_framer.set_buffer_len(_countof(read));
+            slave.frame_ready(&read_framer);
+            Assert::AreEqual((size_t)2, read_framer.buffer_len());
+            Assert::AreEqual((uint8_t)0x83, read_framer.buffer()[0]);
+            Assert::AreEqual((uint8_t)0x01, read_framer.buffer()[1]);
+            slave.set_function(0x03, read_holding);
+            std::copy(read, read + _countof(read), read_framer.buffer());
+            read_framer.set_buffer_len(_countof(read));
+            slave.frame_ready(&read_framer);
+            Assert::AreEqual((size_t)8, read_framer.buffer_len());
+            Assert::AreEqual((uint8_t)0x03, read_framer.buffer()[0]);
+            Assert::AreEqual((uint16_t)0x6B, handler.last_address);
+        }
     };
 }